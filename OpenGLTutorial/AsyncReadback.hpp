@@ -0,0 +1,352 @@
+#pragma once
+
+#include "glad/glad.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "CpuImageFilters.hpp"
+#include "ThreadPool.hpp"
+#include "stb_image_proxy.hpp"
+
+// What the pixels are, which decides how they're read and how they end up as an 8 bit image.
+enum class ReadbackKind {
+    // Anything with color in it, fixed or float, clamped to 0..1.
+    Color,
+    // Color with alpha kept, four bytes a pixel are easier on SIMD code than three.
+    Rgba,
+    // Unit vectors (GBufferLayout::wide), shown as n * 0.5 + 0.5.
+    Normals,
+    // Two channel octahedral normals (GBufferLayout::compact), unpacked and shown the same way.
+    OctahedralNormals,
+    // A depth or depth-stencil texture, stretched over the range of whatever isn't the far plane. Nearer is brighter.
+    Depth
+};
+
+// 8 bit, top row first, the way image files want it.
+struct ReadbackImage {
+    int width = 0, height = 0, channels = 0;
+    std::vector<unsigned char> pixels;
+    // AsyncReadback::frame() when it was requested.
+    uint64_t frame = 0;
+
+    bool writePng(const std::filesystem::path& path) const {
+        return stbi_write_png(path.string().c_str(), width, height, channels, pixels.data(), width * channels) != 0;
+    }
+};
+
+struct ReadbackStats {
+    size_t requested = 0;
+    size_t completed = 0;
+    // No free slot when asked, the request never happened.
+    size_t rejected = 0;
+    // Mapping failed or the callback threw.
+    size_t failed = 0;
+    size_t pending = 0;
+    // Spent on the render thread in requests and update() over the last frame, and the worst frame so far.
+    float renderThreadMilliseconds = 0.f;
+    float maxRenderThreadMilliseconds = 0.f;
+    // Conversion plus callback (PNG encoding, usually) of the last one done, on the pool.
+    float workerMilliseconds = 0.f;
+    // Frames between a request and its buffer getting mapped.
+    uint64_t latencyFrames = 0;
+};
+
+// Gets pixels off the GPU without waiting for it. A request copies into one of a ring of pixel pack buffers and drops
+// a fence behind the copy; update() polls the fences once a frame and maps whatever landed, so the render thread never
+// blocks on the GPU catching up. Converting out of the mapping and the callback both run on the pool, the buffer is
+// unmapped and reused an update() after the conversion is done with it.
+// Requests with every slot busy are rejected rather than queued, a screenshot can be asked for again.
+class AsyncReadback {
+    enum class SlotState {
+        Free,
+        // Copy queued, waiting on the fence.
+        Reading,
+        // Mapped and in the hands of a worker until released.
+        Mapped
+    };
+
+    struct Request {
+        int width = 0, height = 0;
+        ReadbackKind kind = ReadbackKind::Color;
+        uint64_t frame = 0;
+        std::function<void(ReadbackImage&&)> done;
+    };
+
+    struct Slot {
+        unsigned int buffer = 0;
+        size_t capacity = 0;
+        GLsync fence = nullptr;
+        SlotState state = SlotState::Free;
+        std::atomic<bool> released { false };
+        Request request;
+    };
+
+    ThreadPool& _pool;
+    std::vector<std::unique_ptr<Slot>> _slots;
+    std::vector<std::future<void>> _jobs;
+    unsigned int _framebuffer;
+    uint64_t _frame = 0;
+    float _frameMilliseconds = 0.f;
+    ReadbackStats _stats;
+    // Written by the workers.
+    std::atomic<size_t> _completed { 0 };
+    std::atomic<size_t> _failed { 0 };
+    std::atomic<float> _workerMilliseconds { 0.f };
+public:
+    // Slots bound how many readbacks are in flight at once, each keeps a buffer as big as the largest it took.
+    AsyncReadback(size_t slots = 8, ThreadPool& pool = ThreadPool::shared())
+    : _pool(pool)
+    {
+        glGenFramebuffers(1, &_framebuffer);
+        for (size_t i=0; i<std::max<size_t>(slots, 1); ++i) {
+            auto slot = std::make_unique<Slot>();
+            glGenBuffers(1, &slot->buffer);
+            _slots.push_back(std::move(slot));
+        }
+    }
+
+    ~AsyncReadback() {
+        finish();
+        for (auto& slot : _slots) glDeleteBuffers(1, &slot->buffer);
+        glDeleteFramebuffers(1, &_framebuffer);
+    }
+
+    AsyncReadback(const AsyncReadback& other) = delete;
+    AsyncReadback& operator=(const AsyncReadback& other) = delete;
+
+    // The lower left width x height of a texture's base level. done() gets called on the pool, or right away with an
+    // empty image if the buffer couldn't be mapped.
+    bool readTexture(unsigned int texture, int width, int height, ReadbackKind kind, std::function<void(ReadbackImage&&)> done) {
+        const auto start = std::chrono::steady_clock::now();
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, _framebuffer);
+        if (kind == ReadbackKind::Depth) {
+            glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0);
+            glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, texture, 0);
+            glReadBuffer(GL_NONE);
+        } else {
+            glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, 0, 0);
+            glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+            glReadBuffer(GL_COLOR_ATTACHMENT0);
+        }
+        const bool queued = read(width, height, kind, std::move(done));
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        _frameMilliseconds += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return queued;
+    }
+
+    // Back buffer of the default framebuffer, as drawn so far this frame.
+    bool readScreen(int width, int height, ReadbackKind kind, std::function<void(ReadbackImage&&)> done) {
+        const auto start = std::chrono::steady_clock::now();
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        glReadBuffer(GL_BACK);
+        const bool queued = read(width, height, kind, std::move(done));
+        _frameMilliseconds += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return queued;
+    }
+
+    // Once per frame. Never waits on the GPU.
+    void update() {
+        const auto start = std::chrono::steady_clock::now();
+        _frame++;
+        collect(false);
+        _frameMilliseconds += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        _stats.renderThreadMilliseconds = _frameMilliseconds;
+        _stats.maxRenderThreadMilliseconds = std::max(_stats.maxRenderThreadMilliseconds, _frameMilliseconds);
+        _frameMilliseconds = 0.f;
+    }
+
+    // Waits for everything in flight, callbacks included.
+    void finish() {
+        while (std::any_of(_slots.begin(), _slots.end(), [](const auto& slot) { return slot->state != SlotState::Free; }) || !_jobs.empty()) {
+            collect(true);
+            for (auto& job : _jobs) job.wait();
+        }
+    }
+
+    uint64_t frame() const { return _frame; }
+
+    const ReadbackStats& stats() {
+        _stats.completed = _completed.load();
+        _stats.failed = _failed.load();
+        _stats.workerMilliseconds = _workerMilliseconds.load();
+        _stats.pending = static_cast<size_t>(std::count_if(_slots.begin(), _slots.end(), [](const auto& slot) { return slot->state != SlotState::Free; }));
+        return _stats;
+    }
+
+private:
+    static int bytesPerPixel(ReadbackKind kind) {
+        switch (kind) {
+        case ReadbackKind::Normals:
+        case ReadbackKind::OctahedralNormals:
+            return 4 * sizeof(float);
+        case ReadbackKind::Depth:
+            return sizeof(float);
+        default:
+            return 4;
+        }
+    }
+
+    // Read framebuffer and read buffer already set.
+    bool read(int width, int height, ReadbackKind kind, std::function<void(ReadbackImage&&)> done) {
+        _stats.requested++;
+        const auto found = std::find_if(_slots.begin(), _slots.end(), [](const auto& slot) { return slot->state == SlotState::Free; });
+        if (found == _slots.end() || width <= 0 || height <= 0) {
+            _stats.rejected++;
+            return false;
+        }
+        auto& slot = **found;
+
+        const size_t bytes = static_cast<size_t>(width) * height * bytesPerPixel(kind);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        if (slot.capacity < bytes) {
+            glBufferData(GL_PIXEL_PACK_BUFFER, static_cast<GLsizeiptr>(bytes), nullptr, GL_STREAM_READ);
+            slot.capacity = bytes;
+        }
+        switch (kind) {
+        case ReadbackKind::Normals:
+        case ReadbackKind::OctahedralNormals:
+            glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, nullptr);
+            break;
+        case ReadbackKind::Depth:
+            glReadPixels(0, 0, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+            break;
+        default:
+            glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot.state = SlotState::Reading;
+        slot.request = Request { width, height, kind, _frame, std::move(done) };
+        return true;
+    }
+
+    void collect(bool wait) {
+        for (auto& pointer : _slots) {
+            auto& slot = *pointer;
+            if (slot.state == SlotState::Mapped && slot.released.load(std::memory_order_acquire)) {
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                slot.state = SlotState::Free;
+            }
+        }
+        _jobs.erase(std::remove_if(_jobs.begin(), _jobs.end(), [](auto& job) {
+            return job.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }), _jobs.end());
+
+        for (auto& pointer : _slots) {
+            auto& slot = *pointer;
+            if (slot.state != SlotState::Reading) continue;
+            const auto status = wait
+                ? glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, std::numeric_limits<GLuint64>::max())
+                : glClientWaitSync(slot.fence, 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) continue;
+            glDeleteSync(slot.fence);
+            slot.fence = nullptr;
+            _stats.latencyFrames = _frame - slot.request.frame;
+
+            const size_t bytes = static_cast<size_t>(slot.request.width) * slot.request.height * bytesPerPixel(slot.request.kind);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+            const void* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, static_cast<GLsizeiptr>(bytes), GL_MAP_READ_BIT);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            if (!data) {
+                _failed++;
+                slot.state = SlotState::Free;
+                if (slot.request.done) slot.request.done(ReadbackImage { 0, 0, 0, {}, slot.request.frame });
+                slot.request = {};
+                continue;
+            }
+            slot.state = SlotState::Mapped;
+            slot.released.store(false, std::memory_order_relaxed);
+            _jobs.push_back(_pool.submit([this, &slot, data, request = std::move(slot.request)]() mutable {
+                const auto start = std::chrono::steady_clock::now();
+                auto image = convert(request, data);
+                slot.released.store(true, std::memory_order_release);
+                try {
+                    if (request.done) request.done(std::move(image));
+                    _completed++;
+                } catch (...) {
+                    _failed++;
+                }
+                _workerMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+            }));
+        }
+    }
+
+    // GL rows go bottom up, image rows top down.
+    static ReadbackImage convert(const Request& request, const void* data) {
+        const int width = request.width, height = request.height;
+        const int channels = request.kind == ReadbackKind::Rgba ? 4 : 3;
+        ReadbackImage image { width, height, channels, std::vector<unsigned char>(static_cast<size_t>(width) * height * channels), request.frame };
+        const auto toByte = [](float value) { return static_cast<unsigned char>(std::clamp(value, 0.f, 1.f) * 255.f + 0.5f); };
+        const auto destination = [&](int y) { return image.pixels.data() + static_cast<size_t>(height - 1 - y) * width * channels; };
+
+        switch (request.kind) {
+        case ReadbackKind::Rgba:
+            for (int y=0; y<height; ++y) {
+                std::memcpy(destination(y), static_cast<const unsigned char*>(data) + static_cast<size_t>(y) * width * 4, static_cast<size_t>(width) * 4);
+            }
+            break;
+        case ReadbackKind::Color:
+            for (int y=0; y<height; ++y) {
+                const auto* source = static_cast<const unsigned char*>(data) + static_cast<size_t>(y) * width * 4;
+                auto* target = destination(y);
+                for (int x=0; x<width; ++x) {
+                    target[x * 3] = source[x * 4];
+                    target[x * 3 + 1] = source[x * 4 + 1];
+                    target[x * 3 + 2] = source[x * 4 + 2];
+                }
+            }
+            break;
+        case ReadbackKind::Normals:
+        case ReadbackKind::OctahedralNormals: {
+            const auto* floats = static_cast<const float*>(data);
+            const auto normals = request.kind == ReadbackKind::Normals
+                ? NormalPlanes::fromInterleaved(floats, width, height, 4)
+                : NormalPlanes::fromOctahedral(floats, width, height, 4);
+            for (int y=0; y<height; ++y) {
+                auto* target = destination(y);
+                for (int x=0; x<width; ++x) {
+                    target[x * 3] = toByte(normals.x.row(y)[x] * 0.5f + 0.5f);
+                    target[x * 3 + 1] = toByte(normals.y.row(y)[x] * 0.5f + 0.5f);
+                    target[x * 3 + 2] = toByte(normals.z.row(y)[x] * 0.5f + 0.5f);
+                }
+            }
+            break;
+        }
+        case ReadbackKind::Depth: {
+            // Raw depth bunches up right next to 1, spread over what's actually there it shows some shape.
+            const auto* depth = static_cast<const float*>(data);
+            const size_t pixels = static_cast<size_t>(width) * height;
+            float nearest = 1.f, farthest = 0.f;
+            for (size_t i=0; i<pixels; ++i) {
+                if (depth[i] >= 1.f) continue;
+                nearest = std::min(nearest, depth[i]);
+                farthest = std::max(farthest, depth[i]);
+            }
+            const float range = std::max(farthest - nearest, 1e-6f);
+            for (int y=0; y<height; ++y) {
+                const float* source = depth + static_cast<size_t>(y) * width;
+                auto* target = destination(y);
+                for (int x=0; x<width; ++x) {
+                    const unsigned char value = source[x] >= 1.f ? 0 : toByte(1.f - (source[x] - nearest) / range);
+                    target[x * 3] = target[x * 3 + 1] = target[x * 3 + 2] = value;
+                }
+            }
+            break;
+        }
+        }
+        return image;
+    }
+};
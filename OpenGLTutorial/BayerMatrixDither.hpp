@@ -3,31 +3,28 @@
 #include "glad/glad.h"
 #include "glm/glm.hpp"
 
-#include "VertexData.hpp"
-#include "ShaderProgram.hpp"
+#include <chrono>
+
+#include "PostProcessGraph.hpp"
+#include "PaletteLut.hpp"
 
 class BayerMatrixDither {
-    constexpr static auto processedTextureName = std::string_view("imageTexture");
     constexpr static auto matrixTextureName = std::string_view("bayerMatrixTexture");
     constexpr static auto matrixVerticalScaleName = std::string_view("matrixVerticalScale");
     constexpr static auto matrixHorizontalScaleName = std::string_view("matrixHorizontalScale");
+    constexpr static auto paletteLutName = std::string_view("paletteLut");
+    constexpr static auto paletteLutSizeName = std::string_view("paletteLutSize");
+    constexpr static auto paletteSpreadName = std::string_view("paletteSpread");
     
     unsigned int _matrixTexture;
-    VertexDataBase _vertexData;
-    ShaderProgram _shaderProgram;
+    unsigned int _paletteLut = 0;
+    int _paletteLutSize = 0;
+    float _paletteSpacing = 0.f;
+    float _paletteStrength = 1.f;
+    float _paletteLutMilliseconds = 0.f;
+    int _width = 4, _height = 4;
 public:
     BayerMatrixDither() {
-        auto indicesVector = std::vector<unsigned int>(indices, indices + 6);
-        _vertexData = VertexData<Layout::Sequential, Vec3>(indicesVector, 4, reinterpret_cast<const float*>(quadCoords));
-
-        const auto vertexShaderCode = Utils::readFile(SHADERS_SOURCE_DIR "/BayerDither/" "BayerDither.vert.glsl");
-	    const auto fragmentShaderCode = Utils::readFile(SHADERS_SOURCE_DIR "/BayerDither/" "BayerDither.frag.glsl");
-
-        _shaderProgram = ShaderProgram(
-            Shader<ShaderType::Vertex>(vertexShaderCode.c_str()),
-            Shader<ShaderType::Fragment>(fragmentShaderCode.c_str())
-        );
-
         glGenTextures(1, &_matrixTexture);
         glBindTexture(GL_TEXTURE_2D, _matrixTexture);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -38,26 +35,88 @@ public:
         glBindTexture(GL_TEXTURE_2D, 0);
     }
 
-    void draw(unsigned int texture) {
-        _shaderProgram.use();
+    ~BayerMatrixDither() {
+        glDeleteTextures(1, &_matrixTexture);
+        if (_paletteLut) glDeleteTextures(1, &_paletteLut);
+    }
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture);
-        _shaderProgram.set(processedTextureName, 0);
+    BayerMatrixDither(const BayerMatrixDither& other) = delete;
+    BayerMatrixDither& operator=(const BayerMatrixDither& other) = delete;
+
+    // Per-pixel, so it rides along in the draw of whatever produced the input.
+    PostProcessPass pass(std::string input, std::string output) const {
+        return PostProcessPass {
+            .name = "Bayer dither",
+            .stagePath = "PostProcess/BayerDither.glsl",
+            .stage = PostProcessStage::PerPixel,
+            .input = std::move(input),
+            .output = std::move(output),
+            .bind = [this](PostProcessBinding& binding) {
+                binding.texture(matrixTextureName, _matrixTexture);
+                binding.program.set(matrixVerticalScaleName, static_cast<float>(_height) / 4.f);
+                binding.program.set(matrixHorizontalScaleName, static_cast<float>(_width) / 4.f);
+            }
+        };
+    }
 
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, _matrixTexture);
-        _shaderProgram.set(matrixTextureName, 1);
+    // Same threshold matrix, but pushing color towards the neighbouring palette entries instead of gray towards black
+    // or white. Needs setPalette() first.
+    PostProcessPass palettePass(std::string input, std::string output) const {
+        auto pass = this->pass(std::move(input), std::move(output));
+        pass.name = "Palette dither";
+        pass.defines = { "PALETTE" };
+        pass.bind = [this](PostProcessBinding& binding) {
+            binding.texture(matrixTextureName, _matrixTexture);
+            binding.program.set(matrixVerticalScaleName, static_cast<float>(_height) / 4.f);
+            binding.program.set(matrixHorizontalScaleName, static_cast<float>(_width) / 4.f);
+            binding.texture(paletteLutName, _paletteLut, GL_TEXTURE_3D);
+            binding.program.set(paletteLutSizeName, static_cast<float>(_paletteLutSize));
+            binding.program.set(paletteSpreadName, _paletteStrength * _paletteSpacing);
+        };
+        return pass;
+    }
 
-        glActiveTexture(GL_TEXTURE0);
-        auto vertexBinding = VertexDataBase::ScopedBinding(_vertexData);
-        glDrawElements(GL_TRIANGLES, _vertexData.vertexCount(), GL_UNSIGNED_INT, 0);
+    // Builds the lookup on the pool and uploads it, lutSize^3 cells. The texels hold the palette color itself (index in
+    // alpha), so the shader is done after one fetch.
+    void setPalette(const std::vector<glm::vec3>& colors, int lutSize = 32) {
+        const auto start = std::chrono::steady_clock::now();
+        const auto indices = PaletteLut::build(colors, lutSize);
+        std::vector<unsigned char> texels(indices.size() * 4);
+        for (size_t i=0; i<indices.size(); ++i) {
+            const auto color = glm::round(glm::clamp(colors[indices[i]], 0.f, 1.f) * 255.f);
+            texels[i * 4] = static_cast<unsigned char>(color.r);
+            texels[i * 4 + 1] = static_cast<unsigned char>(color.g);
+            texels[i * 4 + 2] = static_cast<unsigned char>(color.b);
+            texels[i * 4 + 3] = indices[i];
+        }
+        _paletteLutMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        if (!_paletteLut) {
+            glGenTextures(1, &_paletteLut);
+            glBindTexture(GL_TEXTURE_3D, _paletteLut);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+            // Blending neighbouring cells would mix palette colors into ones that aren't in it.
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        }
+        _paletteLutSize = std::max(lutSize, 2);
+        glBindTexture(GL_TEXTURE_3D, _paletteLut);
+        glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA8, _paletteLutSize, _paletteLutSize, _paletteLutSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels.data());
+        glBindTexture(GL_TEXTURE_3D, 0);
+        _paletteSpacing = PaletteLut::spacing(colors);
     }
 
+    // Scales how far the matrix pushes a pixel, 1 is about the distance between neighbouring palette colors.
+    void setPaletteStrength(float strength) { _paletteStrength = strength; }
+    // CPU build plus texel packing of the last setPalette(), the upload isn't in it.
+    float paletteLutMilliseconds() const { return _paletteLutMilliseconds; }
+    int paletteLutSize() const { return _paletteLutSize; }
+
     void setMatrixDensity(int width, int height) {
-        _shaderProgram.use();
-        _shaderProgram.set(matrixVerticalScaleName, static_cast<float>(height) / 4.f);
-        _shaderProgram.set(matrixHorizontalScaleName, static_cast<float>(width) / 4.f);
+        _width = width;
+        _height = height;
     }
 
     constexpr static inline glm::vec3 bayer_2_2[4] = {
@@ -72,15 +131,4 @@ public:
         glm::vec3(float(15)/float(16)), glm::vec3(float(7)/float(16)),  glm::vec3(float(13)/float(16)), glm::vec3(float(5)/float(16)),
     };
 
-    constexpr static inline glm::vec3 quadCoords[4] = {
-        {-1.f, -1.f, 0.f},
-        {1.f, -1.f, 0.f},
-        {1.f, 1.f, 0.f},
-        {-1.f, 1.f, 0.f}
-    };
-
-    constexpr static inline unsigned int indices[6] = {
-        0, 1, 2, 2, 0, 3
-    };
-
-};
\ No newline at end of file
+};
@@ -0,0 +1,563 @@
+#pragma once
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "ThreadPool.hpp"
+
+// Ray/segment queries against triangle meshes. No GL in here, the baker tools use it too.
+
+struct Ray {
+    glm::vec3 origin;
+    glm::vec3 direction;
+    float tMax = std::numeric_limits<float>::max();
+
+    static Ray segment(const glm::vec3& from, const glm::vec3& to) {
+        return Ray { from, to - from, 1.f };
+    }
+};
+
+struct RayHit {
+    constexpr static unsigned int none = std::numeric_limits<unsigned int>::max();
+
+    unsigned int mesh = none;
+    unsigned int triangle = none;
+    // In units of Ray::direction, so the real distance only for normalized directions.
+    float distance = std::numeric_limits<float>::max();
+    float u = 0.f, v = 0.f;
+
+    bool hit() const { return triangle != none; }
+};
+
+struct Aabb {
+    glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 max = glm::vec3(std::numeric_limits<float>::lowest());
+
+    void grow(const glm::vec3& point) {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void grow(const Aabb& other) {
+        min = glm::min(min, other.min);
+        max = glm::max(max, other.max);
+    }
+
+    bool empty() const { return min.x > max.x; }
+
+    glm::vec3 center() const { return 0.5f * (min + max); }
+
+    float area() const {
+        if (empty()) return 0.f;
+        const glm::vec3 extent = max - min;
+        return 2.f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    }
+};
+
+// Interior nodes keep their left child right after themselves, leftOrFirst points to the right one.
+// Leaves (count > 0) own primitives [leftOrFirst, leftOrFirst + count).
+struct BvhNode {
+    glm::vec3 boundsMin;
+    unsigned int leftOrFirst;
+    glm::vec3 boundsMax;
+    unsigned int count;
+
+    bool isLeaf() const { return count > 0; }
+};
+
+namespace BvhDetail {
+
+// Distance to the box along the ray or +inf when missed.
+inline float intersectBox(const glm::vec3& boundsMin, const glm::vec3& boundsMax, const glm::vec3& origin, const glm::vec3& inverseDirection, const float tMax) {
+    const glm::vec3 t0 = (boundsMin - origin) * inverseDirection;
+    const glm::vec3 t1 = (boundsMax - origin) * inverseDirection;
+    const glm::vec3 tSmall = glm::min(t0, t1);
+    const glm::vec3 tBig = glm::max(t0, t1);
+    const float tEnter = std::max(std::max(tSmall.x, tSmall.y), std::max(tSmall.z, 0.f));
+    const float tExit = std::min(std::min(tBig.x, tBig.y), std::min(tBig.z, tMax));
+    return tEnter <= tExit ? tEnter : std::numeric_limits<float>::infinity();
+}
+
+inline glm::vec3 safeInverse(const glm::vec3& direction) {
+    constexpr float huge = 1e30f;
+    return glm::vec3(
+        direction.x != 0.f ? 1.f / direction.x : huge,
+        direction.y != 0.f ? 1.f / direction.y : huge,
+        direction.z != 0.f ? 1.f / direction.z : huge
+    );
+}
+
+// Deepest a node gets, past it ranges stay leaves whatever their size. Traversal stacks are sized from it: one entry a
+// level for the ordered descent, one more for pushing both children.
+constexpr unsigned int maxDepth = 64;
+constexpr size_t traversalStackSize = maxDepth + 1;
+
+// Binned SAH builder working on primitive bounds only, shared by the triangle and the instance BVH.
+class SahBuilder {
+    constexpr static int binCount = 16;
+    constexpr static unsigned int maxLeafSize = 8;
+    constexpr static size_t parallelThreshold = 4096;
+    constexpr static float traversalCost = 1.f;
+    constexpr static float intersectionCost = 1.f;
+
+    struct TreeNode {
+        Aabb bounds;
+        unsigned int first = 0, count = 0;
+        std::unique_ptr<TreeNode> left, right;
+    };
+
+    const std::vector<Aabb>& _bounds;
+    std::vector<glm::vec3> _centroids;
+    std::vector<unsigned int>& _order;
+    ThreadPool& _pool;
+public:
+    SahBuilder(const std::vector<Aabb>& bounds, std::vector<unsigned int>& order, ThreadPool& pool)
+    : _bounds(bounds), _order(order), _pool(pool) {}
+
+    std::vector<BvhNode> build() {
+        const size_t count = _bounds.size();
+        _order.resize(count);
+        _centroids.resize(count);
+        for (size_t i=0; i<count; ++i) {
+            _order[i] = static_cast<unsigned int>(i);
+            _centroids[i] = _bounds[i].center();
+        }
+
+        std::vector<BvhNode> nodes;
+        if (count == 0) return nodes;
+
+        TreeNode root;
+        root.first = 0;
+        root.count = static_cast<unsigned int>(count);
+        subdivide(root, 0);
+
+        nodes.reserve(2 * count);
+        flatten(root, nodes);
+        return nodes;
+    }
+
+private:
+    struct Bin {
+        Aabb bounds;
+        unsigned int count = 0;
+    };
+
+    Aabb rangeBounds(unsigned int first, unsigned int count, Aabb& centroidBounds) const {
+        Aabb bounds;
+        for (unsigned int i=first; i<first + count; ++i) {
+            bounds.grow(_bounds[_order[i]]);
+            centroidBounds.grow(_centroids[_order[i]]);
+        }
+        return bounds;
+    }
+
+    void fillBins(unsigned int first, unsigned int count, int axis, float minCentroid, float binScale, std::array<Bin, binCount>& bins) {
+        const auto binOf = [&](unsigned int primitive) {
+            return std::min(binCount - 1, static_cast<int>((_centroids[primitive][axis] - minCentroid) * binScale));
+        };
+
+        if (count < parallelThreshold) {
+            for (unsigned int i=first; i<first + count; ++i) {
+                auto& bin = bins[binOf(_order[i])];
+                bin.count++;
+                bin.bounds.grow(_bounds[_order[i]]);
+            }
+            return;
+        }
+
+        std::mutex mergeMutex;
+        _pool.parallelFor(first, first + count, parallelThreshold, [&](size_t begin, size_t end) {
+            std::array<Bin, binCount> local {};
+            for (size_t i=begin; i<end; ++i) {
+                auto& bin = local[binOf(_order[i])];
+                bin.count++;
+                bin.bounds.grow(_bounds[_order[i]]);
+            }
+            std::lock_guard lock(mergeMutex);
+            for (int b=0; b<binCount; ++b) {
+                bins[b].count += local[b].count;
+                bins[b].bounds.grow(local[b].bounds);
+            }
+        });
+    }
+
+    void subdivide(TreeNode& node, unsigned int depth) {
+        Aabb centroidBounds;
+        node.bounds = rangeBounds(node.first, node.count, centroidBounds);
+        if (node.count <= 2 || depth >= maxDepth) return;
+
+        float bestCost = std::numeric_limits<float>::max();
+        int bestAxis = -1, bestSplit = -1;
+        for (int axis=0; axis<3; ++axis) {
+            const float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+            if (extent <= 0.f) continue;
+
+            const float binScale = binCount / extent;
+            std::array<Bin, binCount> bins {};
+            fillBins(node.first, node.count, axis, centroidBounds.min[axis], binScale, bins);
+
+            // Sweep from both sides to get the cost of every plane between bins.
+            std::array<float, binCount - 1> leftArea {}, rightArea {};
+            std::array<unsigned int, binCount - 1> leftCount {}, rightCount {};
+            Aabb leftBox, rightBox;
+            unsigned int leftSum = 0, rightSum = 0;
+            for (int i=0; i<binCount - 1; ++i) {
+                leftSum += bins[i].count;
+                leftCount[i] = leftSum;
+                leftBox.grow(bins[i].bounds);
+                leftArea[i] = leftBox.area();
+
+                rightSum += bins[binCount - 1 - i].count;
+                rightCount[binCount - 2 - i] = rightSum;
+                rightBox.grow(bins[binCount - 1 - i].bounds);
+                rightArea[binCount - 2 - i] = rightBox.area();
+            }
+            for (int i=0; i<binCount - 1; ++i) {
+                if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+                const float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = i;
+                }
+            }
+        }
+
+        const float parentArea = node.bounds.area();
+        const float leafCost = intersectionCost * node.count;
+        const float splitCost = parentArea > 0.f
+            ? traversalCost + intersectionCost * bestCost / parentArea
+            : std::numeric_limits<float>::max();
+        if (bestAxis < 0 || (splitCost >= leafCost && node.count <= maxLeafSize)) return;
+
+        const float minCentroid = centroidBounds.min[bestAxis];
+        const float binScale = binCount / (centroidBounds.max[bestAxis] - minCentroid);
+        const auto middle = std::partition(_order.begin() + node.first, _order.begin() + node.first + node.count, [&](unsigned int primitive) {
+            const int bin = std::min(binCount - 1, static_cast<int>((_centroids[primitive][bestAxis] - minCentroid) * binScale));
+            return bin <= bestSplit;
+        });
+        const auto leftCount = static_cast<unsigned int>(middle - (_order.begin() + node.first));
+        if (leftCount == 0 || leftCount == node.count) return;
+
+        node.left = std::make_unique<TreeNode>();
+        node.right = std::make_unique<TreeNode>();
+        node.left->first = node.first;
+        node.left->count = leftCount;
+        node.right->first = node.first + leftCount;
+        node.right->count = node.count - leftCount;
+
+        if (node.count >= parallelThreshold) {
+            _pool.parallelFor(0, 2, 1, [&](size_t begin, size_t) {
+                subdivide(begin == 0 ? *node.left : *node.right, depth + 1);
+            });
+        } else {
+            subdivide(*node.left, depth + 1);
+            subdivide(*node.right, depth + 1);
+        }
+    }
+
+    void flatten(const TreeNode& node, std::vector<BvhNode>& nodes) const {
+        const auto index = nodes.size();
+        nodes.push_back(BvhNode { node.bounds.min, node.first, node.bounds.max, node.count });
+        if (!node.left) return;
+
+        nodes[index].count = 0;
+        flatten(*node.left, nodes);
+        nodes[index].leftOrFirst = static_cast<unsigned int>(nodes.size());
+        flatten(*node.right, nodes);
+    }
+};
+
+}
+
+// Bottom level: triangles of a single mesh, in object space.
+class TriangleBvh {
+    // Pre-baked for Moller-Trumbore.
+    struct Triangle {
+        glm::vec3 v0, edge1, edge2;
+        unsigned int index;
+    };
+
+    std::vector<BvhNode> _nodes;
+    std::vector<Triangle> _triangles;
+public:
+    TriangleBvh() = default;
+
+    TriangleBvh(const std::vector<glm::vec3>& positions, const std::vector<unsigned int>& indices, ThreadPool& pool = ThreadPool::shared()) {
+        const size_t triangleCount = indices.size() / 3;
+        std::vector<Aabb> bounds(triangleCount);
+        for (size_t t=0; t<triangleCount; ++t) {
+            for (int k=0; k<3; ++k) {
+                bounds[t].grow(positions[indices[3*t + k]]);
+            }
+        }
+
+        std::vector<unsigned int> order;
+        _nodes = BvhDetail::SahBuilder(bounds, order, pool).build();
+
+        _triangles.resize(triangleCount);
+        for (size_t i=0; i<triangleCount; ++i) {
+            const auto t = order[i];
+            const auto& a = positions[indices[3*t + 0]];
+            const auto& b = positions[indices[3*t + 1]];
+            const auto& c = positions[indices[3*t + 2]];
+            _triangles[i] = Triangle { a, b - a, c - a, t };
+        }
+    }
+
+    bool empty() const { return _nodes.empty(); }
+    size_t triangleCount() const { return _triangles.size(); }
+    size_t nodeCount() const { return _nodes.size(); }
+
+    Aabb bounds() const {
+        if (_nodes.empty()) return {};
+        return Aabb { _nodes[0].boundsMin, _nodes[0].boundsMax };
+    }
+
+    // Closest hit closer than hit.distance. Fills triangle, distance and barycentrics, leaves hit.mesh alone.
+    bool intersect(const Ray& ray, RayHit& hit) const {
+        return traverse<false>(ray, hit);
+    }
+
+    // Any hit - enough for shadow and line-of-sight rays.
+    bool occluded(const Ray& ray) const {
+        RayHit hit;
+        hit.distance = ray.tMax;
+        return traverse<true>(ray, hit);
+    }
+
+private:
+    template<bool AnyHit>
+    bool traverse(const Ray& ray, RayHit& hit) const {
+        if (_nodes.empty()) return false;
+
+        const glm::vec3 inverseDirection = BvhDetail::safeInverse(ray.direction);
+        float tMax = std::min(ray.tMax, hit.distance);
+        bool found = false;
+
+        // Holds the far child of every node above the current one, never more than the builder's depth.
+        std::array<unsigned int, BvhDetail::traversalStackSize> stack;
+        int stackSize = 0;
+        unsigned int nodeIndex = 0;
+        if (BvhDetail::intersectBox(_nodes[0].boundsMin, _nodes[0].boundsMax, ray.origin, inverseDirection, tMax) == std::numeric_limits<float>::infinity()) {
+            return false;
+        }
+
+        while (true) {
+            const auto& node = _nodes[nodeIndex];
+            if (node.isLeaf()) {
+                for (unsigned int i=node.leftOrFirst; i<node.leftOrFirst + node.count; ++i) {
+                    float t, u, v;
+                    if (intersectTriangle(_triangles[i], ray, tMax, t, u, v)) {
+                        tMax = t;
+                        hit.distance = t;
+                        hit.triangle = _triangles[i].index;
+                        hit.u = u;
+                        hit.v = v;
+                        found = true;
+                        if constexpr (AnyHit) return true;
+                    }
+                }
+            } else {
+                unsigned int near = nodeIndex + 1;
+                unsigned int far = node.leftOrFirst;
+                float tNear = BvhDetail::intersectBox(_nodes[near].boundsMin, _nodes[near].boundsMax, ray.origin, inverseDirection, tMax);
+                float tFar = BvhDetail::intersectBox(_nodes[far].boundsMin, _nodes[far].boundsMax, ray.origin, inverseDirection, tMax);
+                if (tFar < tNear) {
+                    std::swap(near, far);
+                    std::swap(tNear, tFar);
+                }
+                if (tNear != std::numeric_limits<float>::infinity()) {
+                    if (tFar != std::numeric_limits<float>::infinity()) stack[stackSize++] = far;
+                    nodeIndex = near;
+                    continue;
+                }
+            }
+            if (stackSize == 0) break;
+            nodeIndex = stack[--stackSize];
+        }
+        return found;
+    }
+
+    static bool intersectTriangle(const Triangle& triangle, const Ray& ray, const float tMax, float& t, float& u, float& v) {
+        constexpr float epsilon = 1e-9f;
+        const glm::vec3 p = glm::cross(ray.direction, triangle.edge2);
+        const float determinant = glm::dot(triangle.edge1, p);
+        if (std::abs(determinant) < epsilon) return false;
+
+        const float inverseDeterminant = 1.f / determinant;
+        const glm::vec3 s = ray.origin - triangle.v0;
+        u = glm::dot(s, p) * inverseDeterminant;
+        if (u < 0.f || u > 1.f) return false;
+
+        const glm::vec3 q = glm::cross(s, triangle.edge1);
+        v = glm::dot(ray.direction, q) * inverseDeterminant;
+        if (v < 0.f || u + v > 1.f) return false;
+
+        t = glm::dot(triangle.edge2, q) * inverseDeterminant;
+        return t > 0.f && t < tMax;
+    }
+};
+
+struct BvhInstance {
+    const TriangleBvh* bvh;
+    glm::mat4 transform = glm::mat4(1.f);
+    // Reported back as RayHit::mesh.
+    unsigned int id = 0;
+};
+
+// Top level: instances of triangle BVHs placed in the world.
+class SceneBvh {
+    struct Instance {
+        const TriangleBvh* bvh;
+        glm::mat4 worldToObject;
+        unsigned int id;
+    };
+
+    std::vector<BvhNode> _nodes;
+    std::vector<Instance> _instances;
+public:
+    SceneBvh() = default;
+
+    explicit SceneBvh(const std::vector<BvhInstance>& instances, ThreadPool& pool = ThreadPool::shared()) {
+        std::vector<Aabb> bounds;
+        std::vector<Instance> unordered;
+        for (const auto& instance : instances) {
+            if (!instance.bvh || instance.bvh->empty()) continue;
+            bounds.push_back(transformBounds(instance.bvh->bounds(), instance.transform));
+            unordered.push_back(Instance { instance.bvh, glm::inverse(instance.transform), instance.id });
+        }
+
+        std::vector<unsigned int> order;
+        _nodes = BvhDetail::SahBuilder(bounds, order, pool).build();
+        for (const auto index : order) {
+            _instances.push_back(unordered[index]);
+        }
+    }
+
+    size_t instanceCount() const { return _instances.size(); }
+
+    RayHit intersect(const Ray& ray) const {
+        RayHit hit;
+        hit.distance = ray.tMax;
+        traverse<false>(ray, hit);
+        if (!hit.hit()) hit.distance = std::numeric_limits<float>::max();
+        return hit;
+    }
+
+    // True if anything blocks the ray before tMax, e.g. Ray::segment(a, b) for line of sight.
+    bool occluded(const Ray& ray) const {
+        RayHit hit;
+        hit.distance = ray.tMax;
+        return traverse<true>(ray, hit);
+    }
+
+private:
+    static Aabb transformBounds(const Aabb& box, const glm::mat4& transform) {
+        Aabb result;
+        for (int corner=0; corner<8; ++corner) {
+            const glm::vec3 point(
+                corner & 1 ? box.max.x : box.min.x,
+                corner & 2 ? box.max.y : box.min.y,
+                corner & 4 ? box.max.z : box.min.z
+            );
+            result.grow(glm::vec3(transform * glm::vec4(point, 1.f)));
+        }
+        return result;
+    }
+
+    template<bool AnyHit>
+    bool traverse(const Ray& ray, RayHit& hit) const {
+        if (_nodes.empty()) return false;
+
+        const glm::vec3 inverseDirection = BvhDetail::safeInverse(ray.direction);
+        bool found = false;
+        // Siblings of the nodes above plus both children of the one popped, see BvhDetail::maxDepth.
+        std::array<unsigned int, BvhDetail::traversalStackSize> stack;
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        while (stackSize > 0) {
+            const auto& node = _nodes[stack[--stackSize]];
+            if (BvhDetail::intersectBox(node.boundsMin, node.boundsMax, ray.origin, inverseDirection, hit.distance) == std::numeric_limits<float>::infinity()) {
+                continue;
+            }
+
+            if (!node.isLeaf()) {
+                stack[stackSize++] = node.leftOrFirst;
+                stack[stackSize++] = static_cast<unsigned int>(&node - _nodes.data()) + 1;
+                continue;
+            }
+
+            for (unsigned int i=node.leftOrFirst; i<node.leftOrFirst + node.count; ++i) {
+                const auto& instance = _instances[i];
+                // Direction is not renormalized, so t stays the same in both spaces.
+                Ray local {
+                    glm::vec3(instance.worldToObject * glm::vec4(ray.origin, 1.f)),
+                    glm::mat3(instance.worldToObject) * ray.direction,
+                    hit.distance
+                };
+                if constexpr (AnyHit) {
+                    if (instance.bvh->occluded(local)) return true;
+                } else if (instance.bvh->intersect(local, hit)) {
+                    hit.mesh = instance.id;
+                    found = true;
+                }
+            }
+        }
+        return found;
+    }
+};
+
+struct RayThroughput {
+    double singleThreadRaysPerSecond;
+    double raysPerSecondPerCore;
+    unsigned int threads;
+    float hitFraction;
+};
+
+// Random rays from a point, closest hit. Measures one thread and then all of the pool.
+inline RayThroughput benchmarkRayThroughput(const SceneBvh& scene, const glm::vec3& origin, const size_t rayCount, ThreadPool& pool = ThreadPool::shared()) {
+    std::mt19937 random(1234);
+    std::normal_distribution<float> gaussian;
+    std::vector<Ray> rays(rayCount);
+    for (auto& ray : rays) {
+        glm::vec3 direction(gaussian(random), gaussian(random), gaussian(random));
+        ray = Ray { origin, glm::normalize(direction + glm::vec3(1e-6f)), 1000.f };
+    }
+
+    using Clock = std::chrono::steady_clock;
+    size_t hits = 0;
+    auto start = Clock::now();
+    for (const auto& ray : rays) {
+        hits += scene.intersect(ray).hit();
+    }
+    const double singleSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::atomic<size_t> parallelHits { 0 };
+    start = Clock::now();
+    pool.parallelFor(0, rays.size(), 1024, [&](size_t begin, size_t end) {
+        size_t localHits = 0;
+        for (size_t i=begin; i<end; ++i) {
+            localHits += scene.intersect(rays[i]).hit();
+        }
+        parallelHits += localHits;
+    });
+    const double parallelSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+    // Calling thread helps, hence +1.
+    const auto threads = static_cast<unsigned int>(pool.size() + 1);
+
+    return RayThroughput {
+        rayCount / std::max(singleSeconds, 1e-9),
+        rayCount / std::max(parallelSeconds, 1e-9) / threads,
+        threads,
+        static_cast<float>(hits + parallelHits) / static_cast<float>(2 * std::max<size_t>(rayCount, 1))
+    };
+}
@@ -13,6 +13,8 @@ class Camera {
 
     float _fov = 45.f;
     float _aspectRatio = 1.f/2.f;
+    float _nearPlane = 0.1f;
+    float _farPlane = 100.f;
 
 public:
     void updatePosition(const float front, const float left, const float up) {
@@ -53,7 +55,15 @@ public:
     }
 
     glm::mat4 getProjectionTransform() const {
-        return glm::perspective(glm::radians(_fov), _aspectRatio, 0.1f, 100.f);
+        return glm::perspective(glm::radians(_fov), _aspectRatio, _nearPlane, _farPlane);
+    }
+
+    float getNearPlane() const {
+        return _nearPlane;
+    }
+
+    float getFarPlane() const {
+        return _farPlane;
     }
 
     glm::vec3 getPosition() const {
@@ -0,0 +1,508 @@
+#pragma once
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ShaderProgram.hpp"
+#include "ShaderSource.hpp"
+#include "RenderTargetPool.hpp"
+#include "PostProcessGraph.hpp"
+
+// Square, odd sized. Row 0 is the bottom row like in a texture, weights[(y + r) * size + (x + r)] multiplies the texel
+// at offset (x, y).
+struct ConvolutionKernel {
+    int size;
+    std::vector<float> weights;
+
+    int radius() const { return size / 2; }
+    float at(int x, int y) const { return weights[(y + radius()) * size + x + radius()]; }
+
+    // Sigma defaults to a third of the radius, the tails past that are noise anyway.
+    static ConvolutionKernel gaussian(int size, float sigma = 0.f) {
+        const int radius = size / 2;
+        if (sigma <= 0.f) sigma = std::max(radius / 3.f, 0.5f);
+        ConvolutionKernel kernel { size, std::vector<float>(static_cast<size_t>(size) * size) };
+        float sum = 0.f;
+        for (int y=-radius; y<=radius; ++y) {
+            for (int x=-radius; x<=radius; ++x) {
+                const float weight = std::exp(-(x * x + y * y) / (2.f * sigma * sigma));
+                kernel.weights[(y + radius) * size + x + radius] = weight;
+                sum += weight;
+            }
+        }
+        for (auto& weight : kernel.weights) weight /= sum;
+        return kernel;
+    }
+
+    // Bokeh-ish box with round corners, the usual kernel that doesn't separate.
+    static ConvolutionKernel disk(int size) {
+        const int radius = size / 2;
+        ConvolutionKernel kernel { size, std::vector<float>(static_cast<size_t>(size) * size) };
+        float sum = 0.f;
+        for (int y=-radius; y<=radius; ++y) {
+            for (int x=-radius; x<=radius; ++x) {
+                const float weight = x * x + y * y <= radius * radius + radius ? 1.f : 0.f;
+                kernel.weights[(y + radius) * size + x + radius] = weight;
+                sum += weight;
+            }
+        }
+        for (auto& weight : kernel.weights) weight /= sum;
+        return kernel;
+    }
+};
+
+struct ConvolutionSeparation {
+    bool separable = false;
+    // |K - vertical * horizontal^T| / |K|, Frobenius.
+    float residual = 1.f;
+    std::vector<float> horizontal;
+    std::vector<float> vertical;
+};
+
+// Rank test through the largest singular pair. Power iteration on K^T K gives it without a full SVD; K is separable
+// exactly when that one pair reconstructs it, i.e. the remaining singular values are all zero.
+inline ConvolutionSeparation separateKernel(const ConvolutionKernel& kernel, float tolerance = 1e-4f) {
+    const int n = kernel.size;
+    const auto k = [&](int row, int column) { return kernel.weights[row * n + column]; };
+    ConvolutionSeparation result;
+
+    float norm = 0.f;
+    for (const float weight : kernel.weights) norm += weight * weight;
+    norm = std::sqrt(norm);
+    if (norm == 0.f) return result;
+
+    // Uneven start so it's never orthogonal to an antisymmetric kernel like Prewitt's.
+    std::vector<float> v(n), kv(n), ktkv(n);
+    for (int i=0; i<n; ++i) v[i] = 1.f + 0.1f * i;
+    float sigma = 0.f;
+    for (int iteration=0; iteration<100; ++iteration) {
+        for (int row=0; row<n; ++row) {
+            kv[row] = 0.f;
+            for (int column=0; column<n; ++column) kv[row] += k(row, column) * v[column];
+        }
+        for (int column=0; column<n; ++column) {
+            ktkv[column] = 0.f;
+            for (int row=0; row<n; ++row) ktkv[column] += k(row, column) * kv[row];
+        }
+        float length = 0.f;
+        for (const float value : ktkv) length += value * value;
+        length = std::sqrt(length);
+        if (length == 0.f) return result;
+        float change = 0.f;
+        for (int i=0; i<n; ++i) {
+            const float next = ktkv[i] / length;
+            change = std::max(change, std::abs(next - v[i]));
+            v[i] = next;
+        }
+        sigma = std::sqrt(length);
+        if (change < 1e-7f) break;
+    }
+
+    // K v = sigma u, split sigma evenly between the two factors.
+    result.horizontal.resize(n);
+    result.vertical.resize(n);
+    float kvLength = 0.f;
+    for (int row=0; row<n; ++row) {
+        kv[row] = 0.f;
+        for (int column=0; column<n; ++column) kv[row] += k(row, column) * v[column];
+        kvLength += kv[row] * kv[row];
+    }
+    sigma = std::sqrt(kvLength);
+    for (int i=0; i<n; ++i) {
+        result.horizontal[i] = v[i] * std::sqrt(sigma);
+        result.vertical[i] = kv[i] / sigma * std::sqrt(sigma);
+    }
+
+    float error = 0.f;
+    for (int row=0; row<n; ++row) {
+        for (int column=0; column<n; ++column) {
+            const float difference = k(row, column) - result.vertical[row] * result.horizontal[column];
+            error += difference * difference;
+        }
+    }
+    result.residual = std::sqrt(error) / norm;
+    result.separable = result.residual < tolerance;
+    return result;
+}
+
+// One texture read, weighted per output channel. Offsets are in texels and may be fractional after tap sharing.
+struct ConvolutionTap {
+    glm::vec2 offset;
+    glm::vec4 weights;
+};
+
+enum class ConvolutionPath {
+    // Separable when that reads fewer texels, counting the intermediate as a few reads.
+    Auto,
+    Direct,
+    Separable,
+};
+
+struct ConvolutionSettings {
+    ConvolutionPath path = ConvolutionPath::Auto;
+    // Merges neighbouring same-sign taps into one linear fetch between them, roughly halving a Gaussian.
+    bool bilinear = true;
+    // Body of vec4 convolutionRead(vec2 uv), what the first pass reads per tap. Plain texture() when empty. Anything
+    // nonlinear in here rules out tap sharing on that pass.
+    std::string fetch;
+    // Uniform declarations the fetch reads, set through the first pass's bind.
+    std::string fetchUniforms;
+    GLenum intermediateFormat = GL_RGBA16F;
+};
+
+// Applies a bank of up to four kernels. A single kernel filters all four channels; with more, kernel i filters the
+// red channel of the input into output channel i (gradient pairs and the like), which keeps a bank in one set of
+// passes. Weights are baked into the generated shaders as constants, no uniforms or kernel textures.
+class Convolution {
+    constexpr static int intermediateCost = 4;
+    constexpr static auto outputImageName = std::string_view("outputImage");
+
+    std::vector<ConvolutionKernel> _bank;
+    ConvolutionSettings _settings;
+    bool _separable = false;
+    std::vector<ConvolutionTap> _direct;
+    std::vector<ConvolutionTap> _horizontal;
+    std::vector<ConvolutionTap> _vertical;
+    // Compute path, built on first dispatch. Direct, or horizontal then vertical.
+    std::unique_ptr<ShaderProgram> _computePrograms[2];
+public:
+    Convolution(std::vector<ConvolutionKernel> bank, ConvolutionSettings settings = {})
+    : _bank(std::move(bank)), _settings(std::move(settings))
+    {
+        if (_bank.empty() || _bank.size() > 4) throw std::runtime_error("Convolution takes one to four kernels");
+        const int size = _bank.front().size;
+        if (size % 2 == 0) throw std::runtime_error("Convolution kernels have to be odd sized");
+
+        std::vector<ConvolutionSeparation> separations;
+        bool allSeparable = true;
+        for (const auto& kernel : _bank) {
+            if (kernel.size != size) throw std::runtime_error("Convolution kernels in one bank have to match in size");
+            separations.push_back(separateKernel(kernel));
+            allSeparable = allSeparable && separations.back().separable;
+        }
+
+        const int radius = size / 2;
+        for (int y=-radius; y<=radius; ++y) {
+            for (int x=-radius; x<=radius; ++x) {
+                addTap(_direct, glm::vec2(x, y), bankWeights([&](size_t kernel) { return _bank[kernel].at(x, y); }));
+            }
+        }
+
+        if (allSeparable) {
+            for (int i=-radius; i<=radius; ++i) {
+                addTap(_horizontal, glm::vec2(i, 0), bankWeights([&](size_t kernel) { return separations[kernel].horizontal[i + radius]; }));
+                addTap(_vertical, glm::vec2(0, i), bankWeights([&](size_t kernel) { return separations[kernel].vertical[i + radius]; }));
+            }
+            if (_settings.bilinear && _bank.size() == 1) {
+                if (_settings.fetch.empty()) _horizontal = shareTaps(_horizontal);
+                _vertical = shareTaps(_vertical);
+            }
+        }
+
+        switch (_settings.path) {
+            case ConvolutionPath::Auto:
+                _separable = allSeparable && _horizontal.size() + _vertical.size() + intermediateCost < _direct.size();
+                break;
+            case ConvolutionPath::Separable:
+                _separable = allSeparable;
+                break;
+            case ConvolutionPath::Direct:
+                _separable = false;
+                break;
+        }
+    }
+
+    bool separable() const { return _separable; }
+
+    // Texture reads per output pixel over all passes.
+    size_t taps() const { return _separable ? _horizontal.size() + _vertical.size() : _direct.size(); }
+
+    // Both passes sample a neighbourhood, so they always start a draw each; per-pixel work on the result still fuses
+    // into the last one.
+    std::vector<PostProcessPass> passes(const std::string& input, const std::string& output, GLenum format = GL_RGBA16F) const {
+        if (!_separable) {
+            return { PostProcessPass {
+                .name = "Convolution " + sizeName(),
+                .stageSource = fragmentStage(_direct, true),
+                .stage = PostProcessStage::Source,
+                .input = input,
+                .output = output,
+                .format = format,
+            } };
+        }
+        const auto intermediate = output + ".horizontal";
+        return {
+            PostProcessPass {
+                .name = "Convolution " + sizeName() + " horizontal",
+                .stageSource = fragmentStage(_horizontal, true),
+                .stage = PostProcessStage::Source,
+                .input = input,
+                .linearInput = sharesTaps(_horizontal),
+                .output = intermediate,
+                .format = _settings.intermediateFormat,
+            },
+            PostProcessPass {
+                .name = "Convolution " + sizeName() + " vertical",
+                .stageSource = fragmentStage(_vertical, false),
+                .stage = PostProcessStage::Source,
+                .input = intermediate,
+                .linearInput = sharesTaps(_vertical),
+                .output = output,
+                .format = format,
+            },
+        };
+    }
+
+    // GL 4.3 compute shaders are optional on our 3.3 context, check before dispatching.
+    static bool computeSupported() { return GLAD_GL_VERSION_4_3; }
+
+    // Tiled compute path: each work group pulls its tile plus the kernel's apron into shared memory once and every tap
+    // reads from there. Output has to be GL_RGBA16F, it's written through an image unit. Edges clamp like the
+    // fragment path does.
+    void dispatch(RenderTargetPool& pool, unsigned int input, unsigned int output, unsigned int width, unsigned int height) {
+        if (!_separable) {
+            dispatchPass(0, _direct, true, input, output, width, height);
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+            return;
+        }
+        RenderTargetPool::ScopedTarget intermediate(pool, RenderTargetDesc { width, height, GL_RGBA16F });
+        dispatchPass(0, integerTaps(_horizontal, 0), true, input, intermediate, width, height);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        dispatchPass(1, integerTaps(_vertical, 1), false, intermediate, output, width, height);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+    }
+
+private:
+    std::string sizeName() const {
+        return std::to_string(_bank.front().size) + "x" + std::to_string(_bank.front().size);
+    }
+
+    // A lone kernel weighs every channel the same, a bank one kernel per channel.
+    template<class Weight>
+    glm::vec4 bankWeights(Weight&& weight) const {
+        if (_bank.size() == 1) return glm::vec4(weight(0));
+        glm::vec4 weights(0.f);
+        for (size_t kernel=0; kernel<_bank.size(); ++kernel) weights[kernel] = weight(kernel);
+        return weights;
+    }
+
+    static void addTap(std::vector<ConvolutionTap>& taps, glm::vec2 offset, glm::vec4 weights) {
+        if (weights == glm::vec4(0.f)) return;
+        taps.push_back(ConvolutionTap { offset, weights });
+    }
+
+    // Two neighbours a and b with weights of one sign read as one linear fetch at a + wb / (wa + wb), weighted wa + wb.
+    // Only valid for a single kernel, a bank would need the same split in every channel.
+    static std::vector<ConvolutionTap> shareTaps(const std::vector<ConvolutionTap>& taps) {
+        std::vector<ConvolutionTap> shared;
+        for (size_t i=0; i<taps.size(); ++i) {
+            const auto& a = taps[i];
+            if (i + 1 < taps.size()) {
+                const auto& b = taps[i + 1];
+                const auto step = b.offset - a.offset;
+                const bool adjacent = std::abs(step.x) + std::abs(step.y) == 1.f;
+                if (adjacent && (a.weights.x > 0.f) == (b.weights.x > 0.f)) {
+                    const float weight = a.weights.x + b.weights.x;
+                    shared.push_back(ConvolutionTap { a.offset + step * (b.weights.x / weight), glm::vec4(weight) });
+                    i++;
+                    continue;
+                }
+            }
+            shared.push_back(a);
+        }
+        return shared;
+    }
+
+    static bool sharesTaps(const std::vector<ConvolutionTap>& taps) {
+        return std::any_of(taps.begin(), taps.end(), [](const ConvolutionTap& tap) {
+            return tap.offset != glm::floor(tap.offset);
+        });
+    }
+
+    // Shared memory holds whole texels, so the compute path undoes the sharing.
+    std::vector<ConvolutionTap> integerTaps(const std::vector<ConvolutionTap>& taps, int axis) const {
+        if (!sharesTaps(taps)) return taps;
+        std::vector<ConvolutionTap> result;
+        const int radius = _bank.front().radius();
+        const auto separation = separateKernel(_bank.front());
+        for (int i=-radius; i<=radius; ++i) {
+            glm::vec2 offset(0.f);
+            offset[axis] = static_cast<float>(i);
+            addTap(result, offset, glm::vec4(axis == 0 ? separation.horizontal[i + radius] : separation.vertical[i + radius]));
+        }
+        return result;
+    }
+
+    static std::string number(float value) {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.9g", value);
+        return text;
+    }
+
+    static std::string tapArrays(const std::vector<ConvolutionTap>& taps, bool integer) {
+        // Zero length arrays don't exist, an all zero kernel still reads once.
+        const auto used = taps.empty() ? std::vector<ConvolutionTap> { ConvolutionTap { glm::vec2(0.f), glm::vec4(0.f) } } : taps;
+        const auto count = std::to_string(used.size());
+        const auto offsetType = std::string(integer ? "ivec2" : "vec2");
+        std::string offsets = "const " + offsetType + " convolutionOffsets[" + count + "] = " + offsetType + "[](";
+        std::string weights = "const vec4 convolutionWeights[" + count + "] = vec4[](";
+        for (size_t i=0; i<used.size(); ++i) {
+            const auto separator = i + 1 < used.size() ? ", " : "";
+            if (integer) {
+                offsets += "ivec2(" + std::to_string(static_cast<int>(used[i].offset.x)) + ", " + std::to_string(static_cast<int>(used[i].offset.y)) + ")" + separator;
+            } else {
+                offsets += "vec2(" + number(used[i].offset.x) + ", " + number(used[i].offset.y) + ")" + separator;
+            }
+            weights += "vec4(" + number(used[i].weights.x) + ", " + number(used[i].weights.y) + ", " + number(used[i].weights.z) + ", " + number(used[i].weights.w) + ")" + separator;
+        }
+        return "const int convolutionTapCount = " + count + ";\n" + offsets + ");\n" + weights + ");\n";
+    }
+
+    // The first pass of a bank spreads the input's red channel over all outputs, later ones go channel to channel.
+    std::string fetchFunction(bool firstPass) const {
+        const auto body = firstPass && !_settings.fetch.empty() ? _settings.fetch : "return texture(imageTexture, uv);";
+        const auto swizzle = firstPass && _bank.size() > 1 ? ".rrrr" : "";
+        const auto uniforms = firstPass ? _settings.fetchUniforms : "";
+        return uniforms + "vec4 convolutionRead(vec2 uv) {\n" + body + "\n}\nvec4 convolutionFetch(vec2 uv) {\n    return convolutionRead(uv)" + swizzle + ";\n}\n";
+    }
+
+    std::string fragmentStage(const std::vector<ConvolutionTap>& taps, bool firstPass) const {
+        return tapArrays(taps, false) + fetchFunction(firstPass) +
+            "vec4 Source(vec2 uv) {\n"
+            "    vec2 texel = 1.f / vec2(textureSize(imageTexture, 0));\n"
+            // Past the graph's viewport is stale, clamp there like the sampler clamps at the edge.
+            "    vec2 last = viewportScale - 0.5f * texel;\n"
+            "    vec4 color = vec4(0.f);\n"
+            "    for (int i=0; i<convolutionTapCount; ++i) {\n"
+            "        color += convolutionWeights[i] * convolutionFetch(min(uv + convolutionOffsets[i] * texel, last));\n"
+            "    }\n"
+            "    return color;\n"
+            "}\n";
+    }
+
+    std::string computeSource(const std::vector<ConvolutionTap>& taps, bool firstPass, glm::ivec2 group, glm::ivec2 apron) const {
+        const auto vec = [](glm::ivec2 v) { return "ivec2(" + std::to_string(v.x) + ", " + std::to_string(v.y) + ")"; };
+        return "#version 430 core\n"
+            "layout(local_size_x = " + std::to_string(group.x) + ", local_size_y = " + std::to_string(group.y) + ") in;\n"
+            "uniform sampler2D imageTexture;\n"
+            "layout(rgba16f) writeonly uniform image2D outputImage;\n"
+            "const ivec2 groupSize = " + vec(group) + ";\n"
+            "const ivec2 apron = " + vec(apron) + ";\n"
+            "const ivec2 tileSize = groupSize + 2 * apron;\n"
+            "shared vec4 tile[tileSize.x * tileSize.y];\n" +
+            tapArrays(taps, true) + fetchFunction(firstPass) +
+            "void main() {\n"
+            "    ivec2 size = textureSize(imageTexture, 0);\n"
+            "    ivec2 origin = ivec2(gl_WorkGroupID.xy) * groupSize - apron;\n"
+            "    for (int i=int(gl_LocalInvocationIndex); i<tileSize.x * tileSize.y; i+=groupSize.x * groupSize.y) {\n"
+            "        ivec2 texel = clamp(origin + ivec2(i % tileSize.x, i / tileSize.x), ivec2(0), size - 1);\n"
+            "        tile[i] = convolutionFetch((vec2(texel) + 0.5f) / vec2(size));\n"
+            "    }\n"
+            "    barrier();\n"
+            "    ivec2 local = ivec2(gl_LocalInvocationID.xy) + apron;\n"
+            "    vec4 color = vec4(0.f);\n"
+            "    for (int i=0; i<convolutionTapCount; ++i) {\n"
+            "        ivec2 p = local + convolutionOffsets[i];\n"
+            "        color += convolutionWeights[i] * tile[p.y * tileSize.x + p.x];\n"
+            "    }\n"
+            "    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);\n"
+            "    if (all(lessThan(pixel, size))) imageStore(outputImage, pixel, color);\n"
+            "}\n";
+    }
+
+    void dispatchPass(int index, const std::vector<ConvolutionTap>& taps, bool firstPass, unsigned int input, unsigned int output, unsigned int width, unsigned int height) {
+        glm::ivec2 apron(0);
+        for (const auto& tap : taps) apron = glm::max(apron, glm::ivec2(glm::abs(tap.offset)));
+        // 1D passes get long thin groups along the kernel. 2D tiles stay under the 32 KB of shared memory GL promises.
+        glm::ivec2 group(16, 16);
+        if (apron.y == 0) group = glm::ivec2(64, 4);
+        else if (apron.x == 0) group = glm::ivec2(4, 64);
+        else if ((16 + 2 * apron.x) * (16 + 2 * apron.y) * 16 > 32768) group = glm::ivec2(8, 8);
+
+        if (!_computePrograms[index]) {
+            const auto source = ShaderSource::parse("Convolution/generated", computeSource(taps, firstPass, group, apron));
+            _computePrograms[index] = std::make_unique<ShaderProgram>(Shader<ShaderType::Compute>(source.text));
+        }
+        auto& program = *_computePrograms[index];
+        program.use();
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, input);
+        program.set(std::string_view("imageTexture"), 0);
+        glBindImageTexture(0, output, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        program.set(outputImageName, 0);
+        glDispatchCompute((width + group.x - 1) / group.x, (height + group.y - 1) / group.y, 1);
+    }
+};
+
+struct ConvolutionTiming {
+    int size;
+    size_t directTaps;
+    size_t separableTaps;
+    size_t sharedTaps;
+    float directMilliseconds;
+    float separableMilliseconds;
+    float sharedMilliseconds;
+    // Negative without GL 4.3.
+    float computeMilliseconds;
+};
+
+// Gaussian of the given size over a width x height RGBA16F target, each path run a few times back to back. GPU time
+// from timestamps, which unlike GL_TIME_ELAPSED don't clash with the graph's own per-draw timers. Stalls, so only
+// from a button.
+inline ConvolutionTiming benchmarkConvolution(int size, unsigned int width, unsigned int height, RenderTargetPool& pool) {
+    constexpr int runs = 8;
+    const auto kernel = ConvolutionKernel::gaussian(size);
+    RenderTargetPool::ScopedTarget image(pool, RenderTargetDesc { width, height, GL_RGBA16F });
+
+    unsigned int queries[2];
+    glGenQueries(2, queries);
+    const auto time = [&](auto&& run) {
+        run();
+        glQueryCounter(queries[0], GL_TIMESTAMP);
+        for (int i=0; i<runs; ++i) run();
+        glQueryCounter(queries[1], GL_TIMESTAMP);
+        GLuint64 start = 0, end = 0;
+        glGetQueryObjectui64v(queries[0], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(queries[1], GL_QUERY_RESULT, &end);
+        return static_cast<float>(end - start) / 1'000'000.f / runs;
+    };
+
+    const auto timeGraph = [&](const Convolution& convolution) {
+        PostProcessGraph graph(pool, width, height);
+        graph.setInput("image", image);
+        for (auto& pass : convolution.passes("image", "blurred")) graph.addPass(std::move(pass));
+        graph.compile();
+        ShaderCompiler::shared().finishAll();
+        return time([&]() { graph.execute(width, height); });
+    };
+
+    const Convolution direct({ kernel }, ConvolutionSettings { .path = ConvolutionPath::Direct });
+    const Convolution separable({ kernel }, ConvolutionSettings { .path = ConvolutionPath::Separable, .bilinear = false });
+    const Convolution shared({ kernel }, ConvolutionSettings { .path = ConvolutionPath::Separable });
+
+    ConvolutionTiming timing {};
+    timing.size = size;
+    timing.directTaps = direct.taps();
+    timing.separableTaps = separable.taps();
+    timing.sharedTaps = shared.taps();
+    timing.directMilliseconds = timeGraph(direct);
+    timing.separableMilliseconds = timeGraph(separable);
+    timing.sharedMilliseconds = timeGraph(shared);
+    timing.computeMilliseconds = -1.f;
+    if (Convolution::computeSupported()) {
+        Convolution compute({ kernel }, ConvolutionSettings { .path = ConvolutionPath::Separable });
+        RenderTargetPool::ScopedTarget output(pool, RenderTargetDesc { width, height, GL_RGBA16F });
+        timing.computeMilliseconds = time([&]() { compute.dispatch(pool, image, output, width, height); });
+    }
+
+    glDeleteQueries(2, queries);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return timing;
+}
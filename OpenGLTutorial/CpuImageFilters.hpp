@@ -0,0 +1,690 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Kernels are compiled per instruction set with target attributes and picked at runtime, so a default build still
+// gets AVX2 where the CPU has it. MSVC takes the intrinsics without any flags. No FMA in the targets: GCC would fuse
+// the mul/add pairs and the SIMD paths have to round exactly like the scalar ones.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CPU_IMAGE_FILTERS_X86 1
+#define CPU_IMAGE_FILTERS_TARGET(isa) __attribute__((target(isa)))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#define CPU_IMAGE_FILTERS_X86 1
+#define CPU_IMAGE_FILTERS_TARGET(isa)
+#endif
+
+#include "ThreadPool.hpp"
+
+// CPU twins of the post-process stages in Shaders/PostProcess, for places without a GPU and for checking the GLSL.
+// No GL in here on purpose.
+
+enum class ImageFilterIsa {
+    Scalar,
+    Sse4,
+    Avx2,
+};
+
+inline const char* imageFilterIsaName(ImageFilterIsa isa) {
+    switch (isa) {
+        case ImageFilterIsa::Sse4: return "SSE4.1";
+        case ImageFilterIsa::Avx2: return "AVX2";
+        default: return "scalar";
+    }
+}
+
+inline bool imageFilterIsaSupported(ImageFilterIsa isa) {
+    if (isa == ImageFilterIsa::Scalar) return true;
+#if defined(CPU_IMAGE_FILTERS_X86) && defined(__GNUC__)
+    if (isa == ImageFilterIsa::Sse4) return __builtin_cpu_supports("sse4.1");
+    return __builtin_cpu_supports("avx2");
+#elif defined(CPU_IMAGE_FILTERS_X86)
+    int info[4];
+    __cpuid(info, 1);
+    const bool sse4 = info[2] & (1 << 19);
+    if (isa == ImageFilterIsa::Sse4) return sse4;
+    // OS has to save the YMM registers too.
+    const bool osAvx = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+    __cpuidex(info, 7, 0);
+    return sse4 && osAvx && (info[1] & (1 << 5));
+#else
+    return false;
+#endif
+}
+
+inline ImageFilterIsa bestImageFilterIsa() {
+    if (imageFilterIsaSupported(ImageFilterIsa::Avx2)) return ImageFilterIsa::Avx2;
+    if (imageFilterIsaSupported(ImageFilterIsa::Sse4)) return ImageFilterIsa::Sse4;
+    return ImageFilterIsa::Scalar;
+}
+
+// One float channel. Row 0 is the bottom row like in a GL texture or readback; stb_image rows need flipping.
+struct ImagePlane {
+    int width = 0;
+    int height = 0;
+    std::vector<float> values;
+
+    ImagePlane() = default;
+    ImagePlane(int width, int height, float fill = 0.f) : width(width), height(height), values(static_cast<size_t>(width) * height, fill) {}
+
+    float* row(int y) { return values.data() + static_cast<size_t>(y) * width; }
+    const float* row(int y) const { return values.data() + static_cast<size_t>(y) * width; }
+    // Edges clamp like the pool's GL_CLAMP_TO_EDGE targets.
+    float at(int x, int y) const { return row(std::clamp(y, 0, height - 1))[std::clamp(x, 0, width - 1)]; }
+};
+
+struct ColorPlanes {
+    ImagePlane r, g, b;
+
+    int width() const { return r.width; }
+    int height() const { return r.height; }
+
+    // stb_image output or an 8 bit readback, 1 to 4 channels. stb rows run top to bottom, pass flipRows for those.
+    static ColorPlanes fromInterleaved(const unsigned char* data, int width, int height, int channels, bool flipRows = false) {
+        ColorPlanes planes { ImagePlane(width, height), ImagePlane(width, height), ImagePlane(width, height) };
+        for (int y=0; y<height; ++y) {
+            const auto* source = data + static_cast<size_t>(flipRows ? height - 1 - y : y) * width * channels;
+            for (int x=0; x<width; ++x) {
+                const auto* texel = source + static_cast<size_t>(x) * channels;
+                planes.r.row(y)[x] = texel[0] / 255.f;
+                planes.g.row(y)[x] = texel[channels >= 3 ? 1 : 0] / 255.f;
+                planes.b.row(y)[x] = texel[channels >= 3 ? 2 : 0] / 255.f;
+            }
+        }
+        return planes;
+    }
+};
+
+struct NormalPlanes {
+    ImagePlane x, y, z;
+
+    int width() const { return x.width; }
+    int height() const { return x.height; }
+
+    // GL_RGB / GL_FLOAT readback of the wide G-buffer.
+    static NormalPlanes fromInterleaved(const float* data, int width, int height, int channels = 3) {
+        NormalPlanes planes { ImagePlane(width, height), ImagePlane(width, height), ImagePlane(width, height) };
+        for (size_t i=0; i<planes.x.values.size(); ++i) {
+            planes.x.values[i] = data[i * channels];
+            planes.y.values[i] = data[i * channels + 1];
+            planes.z.values[i] = data[i * channels + 2];
+        }
+        return planes;
+    }
+
+    // GL_RG / GL_FLOAT readback of the compact G-buffer, decoded like OctahedralDecode() in Common/Octahedral.glsl.
+    static NormalPlanes fromOctahedral(const float* data, int width, int height, int channels = 2) {
+        NormalPlanes planes { ImagePlane(width, height), ImagePlane(width, height), ImagePlane(width, height) };
+        for (size_t i=0; i<planes.x.values.size(); ++i) {
+            float px = data[i * channels], py = data[i * channels + 1];
+            if (px == 0.f && py == 0.f) continue;
+            float nz = 1.f - std::abs(px) - std::abs(py);
+            if (nz < 0.f) {
+                const float fx = (1.f - std::abs(py)) * (px >= 0.f ? 1.f : -1.f);
+                const float fy = (1.f - std::abs(px)) * (py >= 0.f ? 1.f : -1.f);
+                px = fx;
+                py = fy;
+            }
+            const float length = std::sqrt(px * px + py * py + nz * nz);
+            planes.x.values[i] = px / length;
+            planes.y.values[i] = py / length;
+            planes.z.values[i] = nz / length;
+        }
+        return planes;
+    }
+};
+
+enum class ErrorDiffusionKernel {
+    FloydSteinberg,
+    Atkinson,
+    JarvisJudiceNinke,
+};
+
+inline const char* errorDiffusionKernelName(ErrorDiffusionKernel kernel) {
+    switch (kernel) {
+        case ErrorDiffusionKernel::Atkinson: return "Atkinson";
+        case ErrorDiffusionKernel::JarvisJudiceNinke: return "Jarvis-Judice-Ninke";
+        default: return "Floyd-Steinberg";
+    }
+}
+
+// Share of the error pushed dx to the right and dy rows further down the scan.
+struct ErrorDiffusionTap {
+    int dx, dy;
+    float weight;
+};
+
+inline std::vector<ErrorDiffusionTap> errorDiffusionTaps(ErrorDiffusionKernel kernel) {
+    switch (kernel) {
+        case ErrorDiffusionKernel::Atkinson: return {
+            { 1, 0, 1.f/8.f }, { 2, 0, 1.f/8.f },
+            { -1, 1, 1.f/8.f }, { 0, 1, 1.f/8.f }, { 1, 1, 1.f/8.f },
+            { 0, 2, 1.f/8.f },
+        };
+        case ErrorDiffusionKernel::JarvisJudiceNinke: return {
+            { 1, 0, 7.f/48.f }, { 2, 0, 5.f/48.f },
+            { -2, 1, 3.f/48.f }, { -1, 1, 5.f/48.f }, { 0, 1, 7.f/48.f }, { 1, 1, 5.f/48.f }, { 2, 1, 3.f/48.f },
+            { -2, 2, 1.f/48.f }, { -1, 2, 3.f/48.f }, { 0, 2, 5.f/48.f }, { 1, 2, 3.f/48.f }, { 2, 2, 1.f/48.f },
+        };
+        default: return {
+            { 1, 0, 7.f/16.f },
+            { -1, 1, 3.f/16.f }, { 0, 1, 5.f/16.f }, { 1, 1, 1.f/16.f },
+        };
+    }
+}
+
+// How many pixels a row has to stay behind the one above it in the wavefront. A row reads its own pixel once every
+// row above has pushed its error there, and two rows writing into the same row further down must never touch the
+// same pixel at once. Floyd-Steinberg and Atkinson get away with 2, Jarvis needs 5. Rows more than one apart are only
+// held apart transitively, which loses a pixel per row in between.
+inline int errorDiffusionLag(const std::vector<ErrorDiffusionTap>& taps) {
+    int rows = 0;
+    for (const auto& tap : taps) rows = std::max(rows, tap.dy);
+    const auto minDx = [&](int dy) {
+        int value = 0;
+        for (const auto& tap : taps) if (tap.dy == dy) value = std::min(value, tap.dx);
+        return value;
+    };
+    const auto maxDx = [&](int dy) {
+        int value = 0;
+        for (const auto& tap : taps) if (tap.dy == dy) value = std::max(value, tap.dx);
+        return value;
+    };
+    for (int lag=1;; ++lag) {
+        bool enough = true;
+        for (int dy=1; dy<=rows; ++dy) {
+            for (int distance=1; distance<=dy; ++distance) {
+                const int gap = distance * lag - (distance - 1);
+                const int lower = dy - distance;
+                // Same row errors stay in registers, so with lower == 0 it's only the read that has to wait.
+                const int needed = lower == 0 ? 1 - minDx(dy) : 1 + maxDx(lower) - minDx(dy);
+                enough &= gap >= needed;
+            }
+        }
+        if (enough) return lag;
+    }
+}
+
+struct CpuImageFilterSettings {
+    ImageFilterIsa isa = bestImageFilterIsa();
+    ThreadPool* pool = &ThreadPool::shared();
+    // Rows per tile handed to a thread, whole rows so the SIMD loops run long.
+    int tileRows = 32;
+};
+
+// Same math as the GLSL stages at the pixelated resolution, outputs as they'd land in an 8 bit target (clamped).
+// Rows are split into tiles over the pool; within a row the interior runs 4 (SSE4.1) or 8 (AVX2) pixels at a time
+// and the clamped border columns go through the scalar code.
+class CpuImageFilters {
+public:
+    // PostProcess/BayerDither.glsl, matrix density = image size so texel x, y reads matrix[y % 4][x % 4].
+    static void bayerDither(const ColorPlanes& image, ImagePlane& output, const CpuImageFilterSettings& settings = {}) {
+        output = ImagePlane(image.width(), image.height());
+        run(settings, image.height(), [&](int begin, int end, ImageFilterIsa isa) {
+#ifdef CPU_IMAGE_FILTERS_X86
+            if (isa == ImageFilterIsa::Avx2) return bayerDitherAvx2(image, output, begin, end);
+            if (isa == ImageFilterIsa::Sse4) return bayerDitherSse4(image, output, begin, end);
+#endif
+            for (int y=begin; y<end; ++y) {
+                for (int x=0; x<image.width(); ++x) output.row(y)[x] = bayerDitherPixel(image, x, y);
+            }
+        });
+    }
+
+    // Prewitt pair over linearized depth, the "Depth edges" output (PrewittFilter + PostProcess/PrewittEdges.glsl).
+    // Near/far are the camera's, the same PrewittFilter::setDepthRange() got.
+    static void depthEdges(const ImagePlane& depth, ImagePlane& output, float nearPlane, float farPlane, const CpuImageFilterSettings& settings = {}) {
+        const DepthRange range { 2.f * nearPlane, farPlane + nearPlane, farPlane - nearPlane };
+        ImagePlane linear(depth.width, depth.height);
+        run(settings, depth.height, [&](int begin, int end, ImageFilterIsa isa) {
+#ifdef CPU_IMAGE_FILTERS_X86
+            if (isa == ImageFilterIsa::Avx2) return linearizeDepthAvx2(depth, linear, begin, end, range);
+            if (isa == ImageFilterIsa::Sse4) return linearizeDepthSse4(depth, linear, begin, end, range);
+#endif
+            for (int y=begin; y<end; ++y) {
+                for (int x=0; x<depth.width; ++x) linear.row(y)[x] = linearDepth(depth.row(y)[x], range);
+            }
+        });
+
+        output = ImagePlane(depth.width, depth.height);
+        run(settings, depth.height, [&](int begin, int end, ImageFilterIsa isa) {
+            for (int y=begin; y<end; ++y) {
+                int first = 0, last = depth.width;
+#ifdef CPU_IMAGE_FILTERS_X86
+                // Interior only, the loads reach one texel left and right.
+                if (isa == ImageFilterIsa::Avx2) std::tie(first, last) = depthEdgesRowAvx2(linear, output, y);
+                if (isa == ImageFilterIsa::Sse4) std::tie(first, last) = depthEdgesRowSse4(linear, output, y);
+#endif
+                for (int x=0; x<first; ++x) output.row(y)[x] = depthEdgesPixel(linear, x, y);
+                for (int x=last; x<depth.width; ++x) output.row(y)[x] = depthEdgesPixel(linear, x, y);
+                if (first == 0 && last == depth.width) {
+                    for (int x=0; x<depth.width; ++x) output.row(y)[x] = depthEdgesPixel(linear, x, y);
+                }
+            }
+        });
+    }
+
+    // PostProcess/NormalEdges.glsl. Zero normals stay zero and outline against everything.
+    static void normalEdges(const NormalPlanes& normals, ImagePlane& output, const CpuImageFilterSettings& settings = {}) {
+        output = ImagePlane(normals.width(), normals.height());
+        run(settings, normals.height(), [&](int begin, int end, ImageFilterIsa isa) {
+            for (int y=begin; y<end; ++y) {
+                int first = 0, last = normals.width();
+#ifdef CPU_IMAGE_FILTERS_X86
+                if (isa == ImageFilterIsa::Avx2) std::tie(first, last) = normalEdgesRowAvx2(normals, output, y);
+                if (isa == ImageFilterIsa::Sse4) std::tie(first, last) = normalEdgesRowSse4(normals, output, y);
+#endif
+                for (int x=0; x<first; ++x) output.row(y)[x] = normalEdgesPixel(normals, x, y);
+                for (int x=last; x<normals.width(); ++x) output.row(y)[x] = normalEdgesPixel(normals, x, y);
+                if (first == 0 && last == normals.width()) {
+                    for (int x=0; x<normals.width(); ++x) output.row(y)[x] = normalEdgesPixel(normals, x, y);
+                }
+            }
+        });
+    }
+
+    // One bit error diffusion of a gray image, scanned top row first. Serial within a row, so rather than SIMD it
+    // spreads over threads as a diagonal wavefront: rows go to whichever thread is free and each one trails the row
+    // above by errorDiffusionLag() pixels. threads = 0 takes the whole pool. Returns how many threads got rows, a
+    // busy pool may leave some of the requested ones without any.
+    static size_t errorDiffusion(const ImagePlane& gray, ImagePlane& output, ErrorDiffusionKernel kernel, const CpuImageFilterSettings& settings = {},
+        size_t threads = 0) {
+        const int width = gray.width, height = gray.height;
+        const auto taps = errorDiffusionTaps(kernel);
+        const int lag = errorDiffusionLag(taps);
+        output = ImagePlane(width, height);
+        ImagePlane errors(width, height);
+        // Pixels done per scan row, published every few pixels.
+        const auto progress = std::make_unique<std::atomic<int>[]>(height);
+        for (int i=0; i<height; ++i) progress[i].store(0, std::memory_order_relaxed);
+        std::atomic<int> nextRow = 0;
+        std::atomic<size_t> used = 0;
+
+        const auto rows = [&](size_t, size_t) {
+            int scan = nextRow++;
+            if (scan < height) used++;
+            for (; scan < height; scan = nextRow++) {
+                const int y = height - 1 - scan;
+                const auto* source = gray.row(y);
+                auto* error = errors.row(y);
+                auto* target = output.row(y);
+                float ahead[3] = {};
+                int seen = scan == 0 ? width : 0;
+                for (int x=0; x<width; ++x) {
+                    const int needed = std::min(x + lag, width);
+                    while (seen < needed) {
+                        seen = progress[scan - 1].load(std::memory_order_acquire);
+                        if (seen < needed) std::this_thread::yield();
+                    }
+
+                    const float value = source[x] + error[x] + ahead[0];
+                    const float quantized = value >= 0.5f ? 1.f : 0.f;
+                    const float residual = value - quantized;
+                    target[x] = quantized;
+                    ahead[0] = ahead[1];
+                    ahead[1] = ahead[2];
+                    ahead[2] = 0.f;
+                    for (const auto& tap : taps) {
+                        const int tx = x + tap.dx;
+                        if (tx < 0 || tx >= width) continue;
+                        if (tap.dy == 0) ahead[tap.dx - 1] += residual * tap.weight;
+                        else if (y - tap.dy >= 0) errors.row(y - tap.dy)[tx] += residual * tap.weight;
+                    }
+                    if ((x & 7) == 7) progress[scan].store(x + 1, std::memory_order_release);
+                }
+                progress[scan].store(width, std::memory_order_release);
+            }
+        };
+
+        const size_t available = settings.pool ? settings.pool->size() + 1 : 1;
+        const size_t workers = std::clamp<size_t>(threads ? threads : available, 1, std::min<size_t>(available, std::max(height, 1)));
+        if (workers == 1) rows(0, 1);
+        else settings.pool->parallelFor(0, workers, 1, rows);
+        return used;
+    }
+
+    // Gray to RGBA8, for stbi_write_png and friends.
+    static std::vector<unsigned char> toRgba8(const ImagePlane& plane, bool flipRows = false) {
+        std::vector<unsigned char> pixels(plane.values.size() * 4);
+        for (int y=0; y<plane.height; ++y) {
+            auto* target = pixels.data() + static_cast<size_t>(flipRows ? plane.height - 1 - y : y) * plane.width * 4;
+            for (int x=0; x<plane.width; ++x) {
+                const auto value = static_cast<unsigned char>(std::clamp(plane.row(y)[x], 0.f, 1.f) * 255.f + 0.5f);
+                target[x * 4] = target[x * 4 + 1] = target[x * 4 + 2] = value;
+                target[x * 4 + 3] = 255;
+            }
+        }
+        return pixels;
+    }
+
+    constexpr static float bayerMatrix[16] = {
+        0.f/16.f,  8.f/16.f,  2.f/16.f,  10.f/16.f,
+        12.f/16.f, 4.f/16.f,  14.f/16.f, 6.f/16.f,
+        3.f/16.f,  11.f/16.f, 1.f/16.f,  9.f/16.f,
+        15.f/16.f, 7.f/16.f,  13.f/16.f, 5.f/16.f,
+    };
+
+private:
+    template<class Rows>
+    static void run(const CpuImageFilterSettings& settings, int height, Rows&& rows) {
+        const auto isa = imageFilterIsaSupported(settings.isa) ? settings.isa : ImageFilterIsa::Scalar;
+        const auto tile = static_cast<size_t>(std::max(settings.tileRows, 1));
+        if (!settings.pool) {
+            rows(0, height, isa);
+            return;
+        }
+        settings.pool->parallelFor(0, height, tile, [&](size_t begin, size_t end) {
+            rows(static_cast<int>(begin), static_cast<int>(end), isa);
+        });
+    }
+
+    // GLSL's round() may go either way on .5, this is the even one like _mm_round_ps.
+    static float bayerDitherPixel(const ColorPlanes& image, int x, int y) {
+        const float gray = 0.21f * image.r.row(y)[x] + 0.72f * image.g.row(y)[x] + 0.07f * image.b.row(y)[x];
+        return std::nearbyint(gray + 0.9f * (bayerMatrix[(y % 4) * 4 + x % 4] - 0.45f));
+    }
+
+    // 2 near, far + near and far - near, the terms of PrewittFilter::linearDepthFetch.
+    struct DepthRange {
+        float numerator, sum, difference;
+    };
+
+    static float linearDepth(float depth, const DepthRange& range) {
+        return range.numerator / (range.sum - depth * range.difference);
+    }
+
+    static float edgeOutput(float horizontal, float vertical) {
+        constexpr float sqrt3 = 1.7320508f;
+        const float edges = (sqrt3 * std::abs(horizontal) >= 0.015f ? 1.f : 0.f) + (sqrt3 * std::abs(vertical) >= 0.015f ? 1.f : 0.f);
+        return std::clamp(1.f - edges, 0.f, 1.f);
+    }
+
+    static float depthEdgesPixel(const ImagePlane& linear, int x, int y) {
+        float horizontal = 0.f, vertical = 0.f;
+        for (int i=-1; i<=1; ++i) {
+            horizontal += linear.at(x + i, y - 1) - linear.at(x + i, y + 1);
+            vertical += linear.at(x + 1, y + i) - linear.at(x - 1, y + i);
+        }
+        return edgeOutput(horizontal, vertical);
+    }
+
+    static float normalEdgesPixel(const NormalPlanes& n, int x, int y) {
+        const auto dot = [&](int ax, int ay, int bx, int by) {
+            return std::abs(n.x.at(ax, ay) * n.x.at(bx, by) + n.y.at(ax, ay) * n.y.at(bx, by) + n.z.at(ax, ay) * n.z.at(bx, by));
+        };
+        const float horizontal = 3.f - dot(x - 1, y + 1, x + 1, y + 1) - dot(x - 1, y, x + 1, y) - dot(x - 1, y - 1, x + 1, y - 1);
+        const float vertical = 3.f - dot(x - 1, y + 1, x - 1, y - 1) - dot(x, y + 1, x, y - 1) - dot(x + 1, y + 1, x + 1, y - 1);
+        return std::abs(horizontal + vertical) >= 0.4f ? 0.f : 1.f;
+    }
+
+#ifdef CPU_IMAGE_FILTERS_X86
+    CPU_IMAGE_FILTERS_TARGET("sse4.1")
+    static void bayerDitherSse4(const ColorPlanes& image, ImagePlane& output, int begin, int end) {
+        const int width = image.width();
+        for (int y=begin; y<end; ++y) {
+            // Four wide lines up with the matrix row exactly.
+            const auto* matrix = bayerMatrix + (y % 4) * 4;
+            const __m128 threshold = _mm_mul_ps(_mm_set1_ps(0.9f), _mm_sub_ps(_mm_loadu_ps(matrix), _mm_set1_ps(0.45f)));
+            int x = 0;
+            for (; x + 4 <= width; x += 4) {
+                __m128 gray = _mm_mul_ps(_mm_set1_ps(0.21f), _mm_loadu_ps(image.r.row(y) + x));
+                gray = _mm_add_ps(gray, _mm_mul_ps(_mm_set1_ps(0.72f), _mm_loadu_ps(image.g.row(y) + x)));
+                gray = _mm_add_ps(gray, _mm_mul_ps(_mm_set1_ps(0.07f), _mm_loadu_ps(image.b.row(y) + x)));
+                _mm_storeu_ps(output.row(y) + x, _mm_round_ps(_mm_add_ps(gray, threshold), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+            }
+            for (; x<width; ++x) output.row(y)[x] = bayerDitherPixel(image, x, y);
+        }
+    }
+
+    CPU_IMAGE_FILTERS_TARGET("avx2")
+    static void bayerDitherAvx2(const ColorPlanes& image, ImagePlane& output, int begin, int end) {
+        const int width = image.width();
+        for (int y=begin; y<end; ++y) {
+            const auto* matrix = bayerMatrix + (y % 4) * 4;
+            const __m128 row = _mm_loadu_ps(matrix);
+            const __m256 threshold = _mm256_mul_ps(_mm256_set1_ps(0.9f), _mm256_sub_ps(_mm256_set_m128(row, row), _mm256_set1_ps(0.45f)));
+            int x = 0;
+            for (; x + 8 <= width; x += 8) {
+                // Separate mul and add rather than FMA, keeps the sums bit-identical to the scalar path.
+                __m256 gray = _mm256_mul_ps(_mm256_set1_ps(0.21f), _mm256_loadu_ps(image.r.row(y) + x));
+                gray = _mm256_add_ps(gray, _mm256_mul_ps(_mm256_set1_ps(0.72f), _mm256_loadu_ps(image.g.row(y) + x)));
+                gray = _mm256_add_ps(gray, _mm256_mul_ps(_mm256_set1_ps(0.07f), _mm256_loadu_ps(image.b.row(y) + x)));
+                _mm256_storeu_ps(output.row(y) + x, _mm256_round_ps(_mm256_add_ps(gray, threshold), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+            }
+            for (; x<width; ++x) output.row(y)[x] = bayerDitherPixel(image, x, y);
+        }
+    }
+
+    CPU_IMAGE_FILTERS_TARGET("sse4.1")
+    static void linearizeDepthSse4(const ImagePlane& depth, ImagePlane& linear, int begin, int end, const DepthRange& range) {
+        for (int y=begin; y<end; ++y) {
+            int x = 0;
+            for (; x + 4 <= depth.width; x += 4) {
+                const __m128 denominator = _mm_sub_ps(_mm_set1_ps(range.sum), _mm_mul_ps(_mm_loadu_ps(depth.row(y) + x), _mm_set1_ps(range.difference)));
+                _mm_storeu_ps(linear.row(y) + x, _mm_div_ps(_mm_set1_ps(range.numerator), denominator));
+            }
+            for (; x<depth.width; ++x) linear.row(y)[x] = linearDepth(depth.row(y)[x], range);
+        }
+    }
+
+    CPU_IMAGE_FILTERS_TARGET("avx2")
+    static void linearizeDepthAvx2(const ImagePlane& depth, ImagePlane& linear, int begin, int end, const DepthRange& range) {
+        for (int y=begin; y<end; ++y) {
+            int x = 0;
+            for (; x + 8 <= depth.width; x += 8) {
+                const __m256 denominator = _mm256_sub_ps(_mm256_set1_ps(range.sum), _mm256_mul_ps(_mm256_loadu_ps(depth.row(y) + x), _mm256_set1_ps(range.difference)));
+                _mm256_storeu_ps(linear.row(y) + x, _mm256_div_ps(_mm256_set1_ps(range.numerator), denominator));
+            }
+            for (; x<depth.width; ++x) linear.row(y)[x] = linearDepth(depth.row(y)[x], range);
+        }
+    }
+
+    // Returns the [first, last) columns it covered, the caller does the rest in scalar.
+    CPU_IMAGE_FILTERS_TARGET("sse4.1")
+    static std::pair<int, int> depthEdgesRowSse4(const ImagePlane& linear, ImagePlane& output, int y) {
+        const auto* below = linear.row(std::max(y - 1, 0));
+        const auto* center = linear.row(y);
+        const auto* above = linear.row(std::min(y + 1, linear.height - 1));
+        const __m128 sqrt3 = _mm_set1_ps(1.7320508f);
+        const __m128 threshold = _mm_set1_ps(0.015f);
+        const __m128 signMask = _mm_set1_ps(-0.f);
+        const __m128 one = _mm_set1_ps(1.f);
+        int x = 1;
+        for (; x + 4 <= linear.width - 1; x += 4) {
+            // Differences first and summed in the scalar order, so rounding matches depthEdgesPixel exactly.
+            __m128 horizontal = _mm_sub_ps(_mm_loadu_ps(below + x - 1), _mm_loadu_ps(above + x - 1));
+            horizontal = _mm_add_ps(horizontal, _mm_sub_ps(_mm_loadu_ps(below + x), _mm_loadu_ps(above + x)));
+            horizontal = _mm_add_ps(horizontal, _mm_sub_ps(_mm_loadu_ps(below + x + 1), _mm_loadu_ps(above + x + 1)));
+            __m128 vertical = _mm_sub_ps(_mm_loadu_ps(below + x + 1), _mm_loadu_ps(below + x - 1));
+            vertical = _mm_add_ps(vertical, _mm_sub_ps(_mm_loadu_ps(center + x + 1), _mm_loadu_ps(center + x - 1)));
+            vertical = _mm_add_ps(vertical, _mm_sub_ps(_mm_loadu_ps(above + x + 1), _mm_loadu_ps(above + x - 1)));
+            const __m128 edgeX = _mm_and_ps(_mm_cmpge_ps(_mm_mul_ps(sqrt3, _mm_andnot_ps(signMask, horizontal)), threshold), one);
+            const __m128 edgeY = _mm_and_ps(_mm_cmpge_ps(_mm_mul_ps(sqrt3, _mm_andnot_ps(signMask, vertical)), threshold), one);
+            _mm_storeu_ps(output.row(y) + x, _mm_max_ps(_mm_sub_ps(one, _mm_add_ps(edgeX, edgeY)), _mm_setzero_ps()));
+        }
+        return { 1, x };
+    }
+
+    CPU_IMAGE_FILTERS_TARGET("avx2")
+    static std::pair<int, int> depthEdgesRowAvx2(const ImagePlane& linear, ImagePlane& output, int y) {
+        const auto* below = linear.row(std::max(y - 1, 0));
+        const auto* center = linear.row(y);
+        const auto* above = linear.row(std::min(y + 1, linear.height - 1));
+        const __m256 sqrt3 = _mm256_set1_ps(1.7320508f);
+        const __m256 threshold = _mm256_set1_ps(0.015f);
+        const __m256 signMask = _mm256_set1_ps(-0.f);
+        const __m256 one = _mm256_set1_ps(1.f);
+        int x = 1;
+        for (; x + 8 <= linear.width - 1; x += 8) {
+            __m256 horizontal = _mm256_sub_ps(_mm256_loadu_ps(below + x - 1), _mm256_loadu_ps(above + x - 1));
+            horizontal = _mm256_add_ps(horizontal, _mm256_sub_ps(_mm256_loadu_ps(below + x), _mm256_loadu_ps(above + x)));
+            horizontal = _mm256_add_ps(horizontal, _mm256_sub_ps(_mm256_loadu_ps(below + x + 1), _mm256_loadu_ps(above + x + 1)));
+            __m256 vertical = _mm256_sub_ps(_mm256_loadu_ps(below + x + 1), _mm256_loadu_ps(below + x - 1));
+            vertical = _mm256_add_ps(vertical, _mm256_sub_ps(_mm256_loadu_ps(center + x + 1), _mm256_loadu_ps(center + x - 1)));
+            vertical = _mm256_add_ps(vertical, _mm256_sub_ps(_mm256_loadu_ps(above + x + 1), _mm256_loadu_ps(above + x - 1)));
+            const __m256 edgeX = _mm256_and_ps(_mm256_cmp_ps(_mm256_mul_ps(sqrt3, _mm256_andnot_ps(signMask, horizontal)), threshold, _CMP_GE_OQ), one);
+            const __m256 edgeY = _mm256_and_ps(_mm256_cmp_ps(_mm256_mul_ps(sqrt3, _mm256_andnot_ps(signMask, vertical)), threshold, _CMP_GE_OQ), one);
+            _mm256_storeu_ps(output.row(y) + x, _mm256_max_ps(_mm256_sub_ps(one, _mm256_add_ps(edgeX, edgeY)), _mm256_setzero_ps()));
+        }
+        return { 1, x };
+    }
+
+    // Lambdas don't pick up the target attribute, so the normal taps go through these instead.
+    struct NormalsSse4 { __m128 x, y, z; };
+    struct NormalsAvx2 { __m256 x, y, z; };
+
+    CPU_IMAGE_FILTERS_TARGET("sse4.1")
+    static NormalsSse4 loadNormalsSse4(const NormalPlanes& n, int y, int x) {
+        return { _mm_loadu_ps(n.x.row(y) + x), _mm_loadu_ps(n.y.row(y) + x), _mm_loadu_ps(n.z.row(y) + x) };
+    }
+
+    CPU_IMAGE_FILTERS_TARGET("sse4.1")
+    static __m128 absDotSse4(const NormalsSse4& a, const NormalsSse4& b) {
+        const __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a.x, b.x), _mm_mul_ps(a.y, b.y)), _mm_mul_ps(a.z, b.z));
+        return _mm_andnot_ps(_mm_set1_ps(-0.f), dot);
+    }
+
+    CPU_IMAGE_FILTERS_TARGET("avx2")
+    static NormalsAvx2 loadNormalsAvx2(const NormalPlanes& n, int y, int x) {
+        return { _mm256_loadu_ps(n.x.row(y) + x), _mm256_loadu_ps(n.y.row(y) + x), _mm256_loadu_ps(n.z.row(y) + x) };
+    }
+
+    CPU_IMAGE_FILTERS_TARGET("avx2")
+    static __m256 absDotAvx2(const NormalsAvx2& a, const NormalsAvx2& b) {
+        const __m256 dot = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a.x, b.x), _mm256_mul_ps(a.y, b.y)), _mm256_mul_ps(a.z, b.z));
+        return _mm256_andnot_ps(_mm256_set1_ps(-0.f), dot);
+    }
+
+    CPU_IMAGE_FILTERS_TARGET("sse4.1")
+    static std::pair<int, int> normalEdgesRowSse4(const NormalPlanes& n, ImagePlane& output, int y) {
+        const int below = std::max(y - 1, 0), above = std::min(y + 1, n.height() - 1);
+        const __m128 three = _mm_set1_ps(3.f);
+        int x = 1;
+        for (; x + 4 <= n.width() - 1; x += 4) {
+            const auto topLeft = loadNormalsSse4(n, above, x - 1), topMid = loadNormalsSse4(n, above, x), topRight = loadNormalsSse4(n, above, x + 1);
+            const auto bottomLeft = loadNormalsSse4(n, below, x - 1), bottomMid = loadNormalsSse4(n, below, x), bottomRight = loadNormalsSse4(n, below, x + 1);
+            const auto centerLeft = loadNormalsSse4(n, y, x - 1), centerRight = loadNormalsSse4(n, y, x + 1);
+            const __m128 horizontal = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(three, absDotSse4(topLeft, topRight)), absDotSse4(centerLeft, centerRight)), absDotSse4(bottomLeft, bottomRight));
+            const __m128 vertical = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(three, absDotSse4(topLeft, bottomLeft)), absDotSse4(topMid, bottomMid)), absDotSse4(topRight, bottomRight));
+            const __m128 edge = _mm_cmpge_ps(_mm_andnot_ps(_mm_set1_ps(-0.f), _mm_add_ps(horizontal, vertical)), _mm_set1_ps(0.4f));
+            _mm_storeu_ps(output.row(y) + x, _mm_andnot_ps(edge, _mm_set1_ps(1.f)));
+        }
+        return { 1, x };
+    }
+
+    CPU_IMAGE_FILTERS_TARGET("avx2")
+    static std::pair<int, int> normalEdgesRowAvx2(const NormalPlanes& n, ImagePlane& output, int y) {
+        const int below = std::max(y - 1, 0), above = std::min(y + 1, n.height() - 1);
+        const __m256 three = _mm256_set1_ps(3.f);
+        int x = 1;
+        for (; x + 8 <= n.width() - 1; x += 8) {
+            const auto topLeft = loadNormalsAvx2(n, above, x - 1), topMid = loadNormalsAvx2(n, above, x), topRight = loadNormalsAvx2(n, above, x + 1);
+            const auto bottomLeft = loadNormalsAvx2(n, below, x - 1), bottomMid = loadNormalsAvx2(n, below, x), bottomRight = loadNormalsAvx2(n, below, x + 1);
+            const auto centerLeft = loadNormalsAvx2(n, y, x - 1), centerRight = loadNormalsAvx2(n, y, x + 1);
+            const __m256 horizontal = _mm256_sub_ps(_mm256_sub_ps(_mm256_sub_ps(three, absDotAvx2(topLeft, topRight)), absDotAvx2(centerLeft, centerRight)), absDotAvx2(bottomLeft, bottomRight));
+            const __m256 vertical = _mm256_sub_ps(_mm256_sub_ps(_mm256_sub_ps(three, absDotAvx2(topLeft, bottomLeft)), absDotAvx2(topMid, bottomMid)), absDotAvx2(topRight, bottomRight));
+            const __m256 edge = _mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.f), _mm256_add_ps(horizontal, vertical)), _mm256_set1_ps(0.4f), _CMP_GE_OQ);
+            _mm256_storeu_ps(output.row(y) + x, _mm256_andnot_ps(edge, _mm256_set1_ps(1.f)));
+        }
+        return { 1, x };
+    }
+#endif
+};
+
+struct ImageFilterThroughput {
+    const char* filter;
+    ImageFilterIsa isa;
+    size_t threads;
+    float megapixelsPerSecond;
+};
+
+// Random inputs at width x height, every filter on every instruction set the CPU has on one thread, then the best
+// one on the whole pool. Depth edges linearize with the given camera planes.
+inline std::vector<ImageFilterThroughput> benchmarkCpuImageFilters(int width, int height, float nearPlane, float farPlane, ThreadPool& pool = ThreadPool::shared()) {
+    std::mt19937 random(11);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    std::normal_distribution<float> gaussian;
+    ColorPlanes color { ImagePlane(width, height), ImagePlane(width, height), ImagePlane(width, height) };
+    ImagePlane depth(width, height);
+    NormalPlanes normals { ImagePlane(width, height), ImagePlane(width, height), ImagePlane(width, height) };
+    for (size_t i=0; i<depth.values.size(); ++i) {
+        color.r.values[i] = unit(random);
+        color.g.values[i] = unit(random);
+        color.b.values[i] = unit(random);
+        depth.values[i] = 0.9f + 0.1f * unit(random);
+        const float x = gaussian(random), y = gaussian(random), z = gaussian(random);
+        const float length = std::max(std::sqrt(x * x + y * y + z * z), 1e-6f);
+        normals.x.values[i] = x / length;
+        normals.y.values[i] = y / length;
+        normals.z.values[i] = z / length;
+    }
+
+    constexpr int runs = 5;
+    ImagePlane output;
+    std::vector<ImageFilterThroughput> results;
+    const auto measure = [&](const char* name, const CpuImageFilterSettings& settings, auto&& filter) {
+        filter(settings);
+        const auto start = std::chrono::steady_clock::now();
+        for (int run=0; run<runs; ++run) filter(settings);
+        const float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count() / runs;
+        const size_t threads = settings.pool ? settings.pool->size() + 1 : 1;
+        results.push_back(ImageFilterThroughput { name, settings.isa, threads, static_cast<float>(width) * height / 1e6f / seconds });
+    };
+    const auto measureAll = [&](const CpuImageFilterSettings& settings) {
+        measure("Bayer dither", settings, [&](const CpuImageFilterSettings& s) { CpuImageFilters::bayerDither(color, output, s); });
+        measure("Depth edges", settings, [&](const CpuImageFilterSettings& s) { CpuImageFilters::depthEdges(depth, output, nearPlane, farPlane, s); });
+        measure("Normal edges", settings, [&](const CpuImageFilterSettings& s) { CpuImageFilters::normalEdges(normals, output, s); });
+    };
+
+    for (const auto isa : { ImageFilterIsa::Scalar, ImageFilterIsa::Sse4, ImageFilterIsa::Avx2 }) {
+        if (!imageFilterIsaSupported(isa)) continue;
+        measureAll(CpuImageFilterSettings { .isa = isa, .pool = nullptr });
+    }
+    measureAll(CpuImageFilterSettings { .isa = bestImageFilterIsa(), .pool = &pool });
+    return results;
+}
+
+struct ErrorDiffusionTiming {
+    ErrorDiffusionKernel kernel;
+    size_t threads;
+    float milliseconds;
+};
+
+// A random gray frame at width x height through every kernel, on 1, 2, 4... threads up to the whole pool.
+inline std::vector<ErrorDiffusionTiming> benchmarkErrorDiffusion(int width, int height, ThreadPool& pool = ThreadPool::shared()) {
+    std::mt19937 random(7);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    ImagePlane gray(width, height);
+    for (auto& value : gray.values) value = unit(random);
+
+    std::vector<size_t> threadCounts;
+    for (size_t threads=1; threads<pool.size() + 1; threads*=2) threadCounts.push_back(threads);
+    threadCounts.push_back(pool.size() + 1);
+
+    constexpr int runs = 5;
+    ImagePlane output;
+    std::vector<ErrorDiffusionTiming> results;
+    for (const auto kernel : { ErrorDiffusionKernel::FloydSteinberg, ErrorDiffusionKernel::Atkinson, ErrorDiffusionKernel::JarvisJudiceNinke }) {
+        for (const auto threads : threadCounts) {
+            const CpuImageFilterSettings settings { .pool = &pool };
+            CpuImageFilters::errorDiffusion(gray, output, kernel, settings, threads);
+            const auto start = std::chrono::steady_clock::now();
+            for (int run=0; run<runs; ++run) CpuImageFilters::errorDiffusion(gray, output, kernel, settings, threads);
+            const float milliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+            results.push_back(ErrorDiffusionTiming { kernel, threads, milliseconds });
+        }
+    }
+    return results;
+}
@@ -2,15 +2,27 @@
 
 #include <glad/glad.h>
 
+#include <algorithm>
+#include <cstddef>
 #include <type_traits>
 
+#include "RenderTargetPool.hpp"
+
 struct FramebufferBase {
     unsigned int _framebufferId;
+    // What gets rendered: the lower left corner of attachments allocated at _allocatedWidth x _allocatedHeight.
     unsigned int _width, _height;
-    FramebufferBase(unsigned int width, unsigned int height) : _width(width), _height(height) {
+    unsigned int _allocatedWidth, _allocatedHeight;
+    FramebufferBase(unsigned int width, unsigned int height) : _width(width), _height(height), _allocatedWidth(width), _allocatedHeight(height) {
         glGenFramebuffers(1, &_framebufferId);
     }
 
+    // Shrinks the viewport without touching the attachments, up to the allocated size.
+    void setRenderSize(unsigned int width, unsigned int height) {
+        _width = std::clamp(width, 1u, _allocatedWidth);
+        _height = std::clamp(height, 1u, _allocatedHeight);
+    }
+
     ~FramebufferBase() {
         glDeleteFramebuffers(1, &_framebufferId);
     }
@@ -28,62 +40,140 @@ struct FramebufferBase {
     };
 };
 
-// Hardcoded everything!
+// What each G-buffer target holds and in which sized format.
+// Wide keeps world space position around; compact rebuilds it from depth and packs normals octahedrally into two channels.
+struct GBufferLayout {
+    bool storePosition;
+    bool octahedralNormals;
+    GLenum positionFormat;
+    GLenum albedoFormat;
+    GLenum normalsFormat;
+    GLenum depthStencilFormat = GL_DEPTH24_STENCIL8;
+    // Per-object screen motion, for TemporalReuse.
+    GLenum motionFormat = GL_RG16F;
+
+    static GBufferLayout wide() {
+        return { true, false, GL_RGB16F, GL_RGBA8, GL_RGB8_SNORM };
+    }
+
+    static GBufferLayout compact() {
+        return { false, true, GL_NONE, GL_RGBA8, GL_RG16_SNORM };
+    }
+
+    unsigned int bytesPerPixel() const {
+        return (storePosition ? renderTargetFormatBytes(positionFormat) : 0) + renderTargetFormatBytes(albedoFormat) + renderTargetFormatBytes(normalsFormat)
+            + renderTargetFormatBytes(depthStencilFormat) + renderTargetFormatBytes(motionFormat);
+    }
+
+    // Rough per-frame traffic of a deferred frame: geometry writes every target once, resolve reads albedo and normals,
+    // shading reads position (or depth) plus albedo and normals once more. Overlapping light volumes only make it worse.
+    size_t frameTrafficBytes(size_t pixels) const {
+        const size_t positionRead = storePosition ? renderTargetFormatBytes(positionFormat) : renderTargetFormatBytes(depthStencilFormat);
+        const size_t materialRead = renderTargetFormatBytes(albedoFormat) + renderTargetFormatBytes(normalsFormat);
+        return pixels * (bytesPerPixel() + materialRead + positionRead + materialRead);
+    }
+};
+
+// G-buffer attachments come from the pool, so resizing hands the old ones back instead of leaking them.
 class DeferredFramebuffer : public FramebufferBase {
 
-    unsigned int _positionTextureOutput;
-    unsigned int _albedoTextureOutput;
-    unsigned int _normalsTextureOutput;
-    unsigned int _zBufferTextureOutput;
-public:
-    DeferredFramebuffer(unsigned int width, unsigned int height) : FramebufferBase(width, height) {
+    RenderTargetPool& _pool;
+    GBufferLayout _layout;
+    unsigned int _positionTextureOutput = 0;
+    unsigned int _albedoTextureOutput = 0;
+    unsigned int _normalsTextureOutput = 0;
+    unsigned int _zBufferTextureOutput = 0;
+    unsigned int _motionTextureOutput = 0;
+
+    void acquireTargets() {
         ScopedBinding binding(*this);
-        glGenTextures(1, &_positionTextureOutput);
-        glBindTexture(GL_TEXTURE_2D, _positionTextureOutput);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, _width, _height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _positionTextureOutput, 0);
-
-        glGenTextures(1, &_albedoTextureOutput);
-        glBindTexture(GL_TEXTURE_2D, _albedoTextureOutput);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, _width, _height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        // World space, lighting needs it unclamped.
+        if (_layout.storePosition) {
+            _positionTextureOutput = _pool.acquire({ _allocatedWidth, _allocatedHeight, _layout.positionFormat });
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _positionTextureOutput, 0);
+        }
+        _albedoTextureOutput = _pool.acquire({ _allocatedWidth, _allocatedHeight, _layout.albedoFormat });
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, _albedoTextureOutput, 0);
-
-        glGenTextures(1, &_normalsTextureOutput);
-        glBindTexture(GL_TEXTURE_2D, _normalsTextureOutput);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8_SNORM, _width, _height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        _normalsTextureOutput = _pool.acquire({ _allocatedWidth, _allocatedHeight, _layout.normalsFormat });
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, _normalsTextureOutput, 0);
+        _motionTextureOutput = _pool.acquire({ _allocatedWidth, _allocatedHeight, _layout.motionFormat });
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_2D, _motionTextureOutput, 0);
+        // Stencil is for the light volumes, depth doubles as the position source in the compact layout.
+        _zBufferTextureOutput = _pool.acquire({ _allocatedWidth, _allocatedHeight, _layout.depthStencilFormat });
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, _zBufferTextureOutput, 0);
 
-        glGenTextures(1, &_zBufferTextureOutput);
-        glBindTexture(GL_TEXTURE_2D, _zBufferTextureOutput);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, _width, _height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, _zBufferTextureOutput, 0);
+        // Locations stay put so phong.frag doesn't care which layout it writes to.
+        unsigned int attachments[4] = { _layout.storePosition ? GL_COLOR_ATTACHMENT0 : static_cast<unsigned int>(GL_NONE), GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3 };
+        glDrawBuffers(4, attachments);
+    }
 
-        unsigned int attachments[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
-        glDrawBuffers(3, attachments);
-        glBindTexture(GL_TEXTURE_2D, 0);
+    void releaseTargets() {
+        for (auto* texture : { &_positionTextureOutput, &_albedoTextureOutput, &_normalsTextureOutput, &_zBufferTextureOutput, &_motionTextureOutput }) {
+            if (*texture) _pool.release(*texture);
+            *texture = 0;
+        }
+    }
+public:
+    DeferredFramebuffer(RenderTargetPool& pool, unsigned int width, unsigned int height, GBufferLayout layout = GBufferLayout::compact())
+    : FramebufferBase(width, height), _pool(pool), _layout(layout) {
+        acquireTargets();
     }
 
     ~DeferredFramebuffer() {
-        unsigned int texturesAsArray[] = { _positionTextureOutput, _albedoTextureOutput, _normalsTextureOutput, _zBufferTextureOutput };
-        glDeleteTextures(sizeof(texturesAsArray), texturesAsArray);
+        releaseTargets();
     }
 
+    // Free when the size didn't change, fine to call every frame. Reallocates, renders at the full new size until
+    // setRenderSize() says otherwise.
+    void resize(unsigned int width, unsigned int height) {
+        if (width == _allocatedWidth && height == _allocatedHeight) return;
+        releaseTargets();
+        _width = _allocatedWidth = width;
+        _height = _allocatedHeight = height;
+        acquireTargets();
+    }
+
+    const GBufferLayout& layout() const { return _layout; }
+    // 0 in the compact layout, reconstruct from getZBufferTexture() instead.
     unsigned int getPositionTexture() const { return _positionTextureOutput; }
     unsigned int getAlbedoTexture() const { return _albedoTextureOutput; }
     unsigned int getNormalsTexture() const { return _normalsTextureOutput; }
     unsigned int getZBufferTexture() const { return _zBufferTextureOutput; }
-};
\ No newline at end of file
+    unsigned int getMotionTexture() const { return _motionTextureOutput; }
+};
+
+// Where the lights add up. The depth/stencil a light volume pass tests against is a transient pool target
+// attached only for that pass (see attachDepthStencil), the G-buffer depth stays free to be sampled while shading.
+class LightingFramebuffer : public FramebufferBase {
+    RenderTargetPool& _pool;
+    unsigned int _colorTextureOutput = 0;
+
+    void acquireTargets() {
+        ScopedBinding binding(*this);
+        _colorTextureOutput = _pool.acquire({ _allocatedWidth, _allocatedHeight, GL_RGBA16F });
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _colorTextureOutput, 0);
+    }
+public:
+    LightingFramebuffer(RenderTargetPool& pool, unsigned int width, unsigned int height) : FramebufferBase(width, height), _pool(pool) {
+        acquireTargets();
+    }
+
+    ~LightingFramebuffer() {
+        _pool.release(_colorTextureOutput);
+    }
+
+    void resize(unsigned int width, unsigned int height) {
+        if (width == _allocatedWidth && height == _allocatedHeight) return;
+        _pool.release(_colorTextureOutput);
+        _width = _allocatedWidth = width;
+        _height = _allocatedHeight = height;
+        acquireTargets();
+    }
+
+    // Expects this framebuffer to be bound. 0 detaches.
+    void attachDepthStencil(unsigned int depthStencilTexture) {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, depthStencilTexture, 0);
+    }
+
+    unsigned int getColorTexture() const { return _colorTextureOutput; }
+};
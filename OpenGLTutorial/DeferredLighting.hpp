@@ -0,0 +1,619 @@
+#pragma once
+
+#include "glad/glad.h"
+#include "glm/glm.hpp"
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include "VertexData.hpp"
+#include "ShaderProgram.hpp"
+#include "ShaderCompiler.hpp"
+#include "Utils.hpp"
+#include "Frustum.hpp"
+#include "GpuQuery.hpp"
+#include "DeferredFramebuffer.hpp"
+#include "LightClusters.hpp"
+#include "ShaderPermutations.hpp"
+#include "Lights.hpp"
+#include "ShadowMaps.hpp"
+#include "SphericalHarmonics.hpp"
+#include "Lightmap.hpp"
+#include "TemporalReuse.hpp"
+
+#ifndef SHADERS_SOURCE_DIR
+#define SHADERS_SOURCE_DIR "INCORRECT SOURCE DIR"
+#endif
+
+enum class LightingTechnique : uint8_t {
+    LightVolumes,
+    Clustered
+};
+
+struct DeferredLightingStats {
+    size_t lightsDrawn = 0;
+    size_t lightsCulled = 0;
+    size_t lightsShadowed = 0;
+    float resolveMilliseconds = 0.f;
+    float lightVolumesMilliseconds = 0.f;
+    float clusterAssignMilliseconds = 0.f;
+    float clusteredShadingMilliseconds = 0.f;
+    float bakedLightingMilliseconds = 0.f;
+    LightClusterStats clusters;
+    TemporalReuseStats temporal;
+
+    // GPU time of everything render() draws.
+    float totalMilliseconds() const {
+        return resolveMilliseconds + lightVolumesMilliseconds + clusteredShadingMilliseconds + bakedLightingMilliseconds
+            + temporal.reprojectMilliseconds + temporal.historyMilliseconds;
+    }
+};
+
+// Lights the G-buffer, two ways:
+// - LightVolumes: one light at a time. Each light is a sphere (point) or cone (spot) around its attenuation
+//   range, so it only shades the pixels it can reach. The stencil variant additionally rejects pixels in
+//   front of the volume, not just behind it.
+// - Clustered: lights are binned into froxels on the CPU and a single fullscreen pass loops over
+//   only the lights of each pixel's cluster. Lists go up as texture buffers.
+// Lights with a shadow map always go the volume way, the clustered pass leaves them out.
+// With temporal reuse on, pixels whose lighting carries over from last frame are skipped by all of it, see
+// TemporalReuse.
+class DeferredLighting {
+    constexpr static auto gPositionName = std::string_view("gPosition");
+    constexpr static auto gAlbedoName = std::string_view("gAlbedo");
+    constexpr static auto gNormalName = std::string_view("gNormal");
+    constexpr static auto gDepthName = std::string_view("gDepth");
+    constexpr static auto inverseProjectionName = std::string_view("inverseProjection");
+    constexpr static auto inverseViewName = std::string_view("inverseView");
+    constexpr static auto ambientName = std::string_view("ambient");
+    constexpr static auto skyAmbientStrengthName = std::string_view("skyAmbientStrength");
+    constexpr static auto skyIrradianceName = std::string_view("SkyIrradiance");
+    constexpr static auto imageTextureName = std::string_view("imageTexture");
+    constexpr static auto modelName = std::string_view("model");
+    constexpr static auto viewName = std::string_view("view");
+    constexpr static auto projectionName = std::string_view("projection");
+    constexpr static auto viewPosName = std::string_view("viewPos");
+    constexpr static auto shininessName = std::string_view("shininess");
+    constexpr static auto lightsName = std::string_view("lights");
+    constexpr static auto clustersName = std::string_view("clusters");
+    constexpr static auto lightIndicesName = std::string_view("lightIndices");
+    constexpr static auto nearPlaneName = std::string_view("nearPlane");
+    constexpr static auto farPlaneName = std::string_view("farPlane");
+    constexpr static auto screenWidthName = std::string_view("screenWidth");
+    constexpr static auto screenHeightName = std::string_view("screenHeight");
+    constexpr static auto shadowMapName = std::string_view("shadowMap");
+    constexpr static auto shadowCubeName = std::string_view("shadowCube");
+    constexpr static auto lightSpaceName = std::string_view("lightSpace");
+    constexpr static auto shadowFarName = std::string_view("shadowFar");
+    constexpr static auto temporalHistoryName = std::string_view("temporalHistory");
+    constexpr static auto viewportSizeName = std::string_view("viewportSize");
+    constexpr static auto viewportScaleName = std::string_view("viewportScale");
+    // vec4s per light in the lights buffer, matches Clustered.frag.glsl.
+    constexpr static int lightStride = 5;
+
+    constexpr static int sphereSegments = 12;
+    constexpr static int sphereRings = 8;
+    constexpr static int coneSegments = 16;
+
+    VertexDataBase _quad;
+    VertexDataBase _sphere;
+    VertexDataBase _cone;
+    // Variants by G-buffer layout (and light type for the volumes).
+    ShaderPermutations _resolvePermutations;
+    ShaderPermutations _volumePermutations;
+    ShaderPermutations _clusteredPermutations;
+    ShaderProgram* _volumePointProgram = nullptr;
+    ShaderProgram* _volumeSpotProgram = nullptr;
+    ShaderProgram* _volumeShadowedPointProgram = nullptr;
+    ShaderProgram* _volumeShadowedSpotProgram = nullptr;
+    // Only set during render().
+    const ShadowMaps* _shadows = nullptr;
+    Lightmap* _lightmap = nullptr;
+    ShaderProgram _stencilProgram;
+    ShaderProgram _presentProgram;
+    RenderTargetPool& _pool;
+    LightingFramebuffer _framebuffer;
+    TemporalReuse _temporalReuse;
+    bool _temporalReuseEnabled = false;
+    // Only set during render(), whether this frame got a reprojection to reuse.
+    bool _reusing = false;
+
+    LightClusterGrid _clusters;
+    std::vector<ClusterLight> _clusterLights;
+    std::vector<glm::vec4> _packedLights;
+    // Buffer + the texture viewing it, for lights, cluster ranges and light indices.
+    std::array<unsigned int, 3> _textureBuffers {};
+    std::array<unsigned int, 3> _bufferTextures {};
+
+    GpuTimer _resolveTimer;
+    GpuTimer _lightVolumesTimer;
+    GpuTimer _clusteredTimer;
+    GpuTimer _bakedLightingTimer;
+    DeferredLightingStats _stats;
+
+    LightingTechnique _technique = LightingTechnique::LightVolumes;
+    bool _stencilCulling = true;
+    glm::vec3 _ambient = glm::vec3(0.02f);
+    bool _skyAmbient = false;
+    float _skyAmbientStrength = 1.f;
+    float _shininess = 32.f;
+public:
+    DeferredLighting(RenderTargetPool& pool, unsigned int width, unsigned int height)
+    : _resolvePermutations("DeferredLighting/Fullscreen.vert.glsl", "DeferredLighting/Resolve.frag.glsl", bindGBufferUnits),
+      _volumePermutations("DeferredLighting/LightVolume.vert.glsl", "DeferredLighting/LightVolume.frag.glsl", bindGBufferUnits),
+      _clusteredPermutations("DeferredLighting/Fullscreen.vert.glsl", "DeferredLighting/Clustered.frag.glsl", [](ShaderProgram& program) {
+          bindGBufferUnits(program);
+          program.set(lightsName, 3);
+          program.set(clustersName, 4);
+          program.set(lightIndicesName, 5);
+      }),
+      _pool(pool),
+      _framebuffer(pool, width, height),
+      _temporalReuse(pool, bindGBufferUnits)
+    {
+        auto indicesVector = std::vector<unsigned int>(quadIndices, quadIndices + 6);
+        _quad = VertexData<Layout::Sequential, Vec3>(indicesVector, 4, reinterpret_cast<const float*>(quadCoords));
+        _sphere = buildSphere();
+        _cone = buildCone();
+
+        ShaderCompiler::shared().compile(_presentProgram, "DeferredLighting/Fullscreen.vert.glsl", "DeferredLighting/Present.frag.glsl");
+        // Stencil marking writes no color, the depth-only shaders do just that.
+        ShaderCompiler::shared().compile(_stencilProgram, "depth.vert.glsl", "depth.frag.glsl");
+        _resolvePermutations.warmAll();
+        _volumePermutations.warmAll();
+        _clusteredPermutations.warmAll();
+
+        const GLenum bufferFormats[] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+        glGenBuffers(3, _textureBuffers.data());
+        glGenTextures(3, _bufferTextures.data());
+        for (int i=0; i<3; ++i) {
+            glBindBuffer(GL_TEXTURE_BUFFER, _textureBuffers[i]);
+            glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_STREAM_DRAW);
+            glBindTexture(GL_TEXTURE_BUFFER, _bufferTextures[i]);
+            glTexBuffer(GL_TEXTURE_BUFFER, bufferFormats[i], _textureBuffers[i]);
+        }
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    ~DeferredLighting() {
+        glDeleteTextures(3, _bufferTextures.data());
+        glDeleteBuffers(3, _textureBuffers.data());
+    }
+
+    // Has to follow the G-buffer size, the shaders address it by gl_FragCoord. The render size follows it on its own
+    // in render().
+    void resize(unsigned int width, unsigned int height) {
+        _framebuffer.resize(width, height);
+    }
+
+    void setTechnique(LightingTechnique technique) { _technique = technique; }
+    void setStencilCulling(bool enabled) { _stencilCulling = enabled; }
+    void setAmbient(const glm::vec3& ambient) { _ambient = ambient; }
+    // Ambient from the Skybox's SH irradiance block instead of the flat color.
+    void setSkyAmbient(bool enabled, float strength = 1.f) {
+        _skyAmbient = enabled;
+        _skyAmbientStrength = strength;
+    }
+    void setShininess(float shininess) { _shininess = shininess; }
+    // Baked static lights, added right after the resolve. nullptr turns it off.
+    void setLightmap(Lightmap* lightmap) { _lightmap = lightmap; }
+    // Turning it off drops the history, turning it back on starts shading everything for a frame.
+    void setTemporalReuse(bool enabled) { _temporalReuseEnabled = enabled; }
+    TemporalReuse& temporalReuse() { return _temporalReuse; }
+
+    const DeferredLightingStats& stats() const { return _stats; }
+    size_t shaderVariants() const {
+        return _resolvePermutations.stats().variants + _volumePermutations.stats().variants + _clusteredPermutations.stats().variants;
+    }
+    unsigned int getLitTexture() const { return _framebuffer.getColorTexture(); }
+
+    // Expects the G-buffer to be filled. Works with either GBufferLayout. Shadow maps have to be rendered already.
+    void render(const DeferredFramebuffer& gBuffer, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& viewPos,
+                const std::vector<PointLight>& pointLights, const std::vector<SpotLight>& spotLights, const ShadowMaps* shadows = nullptr) {
+        _shadows = shadows;
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, gBuffer.getPositionTexture());
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, gBuffer.getAlbedoTexture());
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, gBuffer.getNormalsTexture());
+        glActiveTexture(GL_TEXTURE6);
+        glBindTexture(GL_TEXTURE_2D, gBuffer.getZBufferTexture());
+        glActiveTexture(GL_TEXTURE0);
+
+        if (_temporalReuseEnabled) _reusing = _temporalReuse.reproject(gBuffer, view, projection) != 0;
+        else _temporalReuse.reset();
+        _framebuffer.setRenderSize(gBuffer._width, gBuffer._height);
+        FramebufferBase::ScopedBinding binding(_framebuffer);
+
+        // Feature bits follow each shader's own declaration order, so the mask is built per permutation set.
+        const auto& layout = gBuffer.layout();
+        const auto variant = [&](ShaderPermutations& permutations, std::initializer_list<std::string_view> features) -> ShaderProgram& {
+            uint32_t mask = permutations.mask(features) | gBufferFeatures(permutations, layout);
+            if (_reusing) mask |= permutations.feature("TEMPORAL_REUSE");
+            return permutations.get(mask);
+        };
+        auto& resolveProgram = _skyAmbient ? variant(_resolvePermutations, { "SKY_AMBIENT" }) : variant(_resolvePermutations, {});
+        auto& clusteredProgram = variant(_clusteredPermutations, {});
+        _volumePointProgram = &variant(_volumePermutations, {});
+        _volumeSpotProgram = &variant(_volumePermutations, { "SPOT_LIGHT" });
+        _volumeShadowedPointProgram = &variant(_volumePermutations, { "SHADOW" });
+        _volumeShadowedSpotProgram = &variant(_volumePermutations, { "SHADOW", "SPOT_LIGHT" });
+
+        const glm::mat4 inverseProjection = glm::inverse(projection);
+        const glm::mat4 inverseView = glm::inverse(view);
+        for (auto* program : { _volumePointProgram, _volumeSpotProgram, _volumeShadowedPointProgram, _volumeShadowedSpotProgram, &clusteredProgram }) {
+            program->use();
+            program->set(inverseProjectionName, inverseProjection);
+            program->set(inverseViewName, inverseView);
+            program->set(viewportSizeName, glm::vec2(gBuffer._width, gBuffer._height));
+        }
+
+        glDepthMask(GL_FALSE);
+        {
+            GpuTimer::ScopedQuery timer(_resolveTimer);
+            glDisable(GL_DEPTH_TEST);
+            resolveProgram.use();
+            resolveProgram.set(ambientName, _ambient);
+            if (_skyAmbient) resolveProgram.set(skyAmbientStrengthName, _skyAmbientStrength);
+            auto vertexBinding = VertexDataBase::ScopedBinding(_quad);
+            glDrawElements(GL_TRIANGLES, _quad.vertexCount(), GL_UNSIGNED_INT, 0);
+        }
+
+        if (_lightmap) renderBakedLighting(gBuffer, view, projection);
+
+        _stats.lightsDrawn = 0;
+        _stats.lightsCulled = 0;
+        _stats.lightsShadowed = 0;
+        if (_technique == LightingTechnique::Clustered) {
+            renderClustered(clusteredProgram, gBuffer, view, projection, viewPos, pointLights, spotLights);
+            if (shadows) renderLightVolumes(gBuffer, view, projection, viewPos, pointLights, spotLights, true);
+        } else {
+            renderLightVolumes(gBuffer, view, projection, viewPos, pointLights, spotLights);
+        }
+        _shadows = nullptr;
+
+        if (_temporalReuseEnabled) _temporalReuse.store(gBuffer, _framebuffer.getColorTexture(), view, projection);
+        _stats.temporal = _temporalReuseEnabled ? _temporalReuse.stats() : TemporalReuseStats {};
+        _reusing = false;
+
+        glEnable(GL_DEPTH_TEST);
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+
+        _stats.resolveMilliseconds = _resolveTimer.milliseconds();
+        _stats.lightVolumesMilliseconds = _lightVolumesTimer.milliseconds();
+        _stats.clusteredShadingMilliseconds = _clusteredTimer.milliseconds();
+        _stats.bakedLightingMilliseconds = _lightmap ? _bakedLightingTimer.milliseconds() : 0.f;
+    }
+
+    // Lit result to whatever framebuffer is bound.
+    void present() {
+        _presentProgram.use();
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, _framebuffer.getColorTexture());
+        _presentProgram.set(imageTextureName, 0);
+        _presentProgram.set(viewportScaleName, glm::vec2(_framebuffer._width, _framebuffer._height) / glm::vec2(_framebuffer._allocatedWidth, _framebuffer._allocatedHeight));
+
+        auto vertexBinding = VertexDataBase::ScopedBinding(_quad);
+        glDrawElements(GL_TRIANGLES, _quad.vertexCount(), GL_UNSIGNED_INT, 0);
+    }
+
+private:
+    // Lightmapped geometry drawn again over the lit buffer, depth tested against a copy of the G-buffer depth so
+    // only the surfaces the G-buffer actually kept get their baked light.
+    void renderBakedLighting(const DeferredFramebuffer& gBuffer, const glm::mat4& view, const glm::mat4& projection) {
+        GpuTimer::ScopedQuery timer(_bakedLightingTimer);
+        RenderTargetPool::ScopedTarget depthStencil(_pool, { _framebuffer._allocatedWidth, _framebuffer._allocatedHeight, GL_DEPTH24_STENCIL8 });
+        _framebuffer.attachDepthStencil(depthStencil);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, gBuffer._framebufferId);
+        glBlitFramebuffer(0, 0, gBuffer._width, gBuffer._height, 0, 0, _framebuffer._width, _framebuffer._height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, _framebuffer._framebufferId);
+
+        glEnable(GL_DEPTH_TEST);
+        glDepthFunc(GL_LEQUAL);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        _lightmap->draw(view, projection, _reusing);
+        glDisable(GL_BLEND);
+        glDisable(GL_DEPTH_TEST);
+        glDepthFunc(GL_LESS);
+        _framebuffer.attachDepthStencil(0);
+    }
+
+    void renderLightVolumes(const DeferredFramebuffer& gBuffer, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& viewPos,
+                            const std::vector<PointLight>& pointLights, const std::vector<SpotLight>& spotLights, bool shadowedOnly = false) {
+        GpuTimer::ScopedQuery timer(_lightVolumesTimer);
+
+        // Volumes are depth tested against the scene, but the G-buffer depth is being sampled, so test against a copy.
+        // Only lives for this pass, the pool hands the same texture back every frame.
+        RenderTargetPool::ScopedTarget depthStencil(_pool, { _framebuffer._allocatedWidth, _framebuffer._allocatedHeight, GL_DEPTH24_STENCIL8 });
+        _framebuffer.attachDepthStencil(depthStencil);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, gBuffer._framebufferId);
+        glBlitFramebuffer(0, 0, gBuffer._width, gBuffer._height, 0, 0, _framebuffer._width, _framebuffer._height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, _framebuffer._framebufferId);
+        const Frustum frustum(projection * view);
+
+        _stencilProgram.use();
+        _stencilProgram.set(viewName, view);
+        _stencilProgram.set(projectionName, projection);
+        for (auto* program : { _volumePointProgram, _volumeSpotProgram, _volumeShadowedPointProgram, _volumeShadowedSpotProgram }) {
+            program->use();
+            program->set(viewName, view);
+            program->set(projectionName, projection);
+            program->set(viewPosName, viewPos);
+            program->set(shininessName, _shininess);
+        }
+
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        glEnable(GL_CULL_FACE);
+        if (_stencilCulling) {
+            glEnable(GL_STENCIL_TEST);
+            glClear(GL_STENCIL_BUFFER_BIT);
+        }
+
+        for (const auto& light : pointLights) {
+            if (shadowedOnly && !shadowed(light)) continue;
+            const float range = attenuationRange(light);
+            if (range <= 0.f || !frustum.intersectsSphere(light.position, range)) {
+                _stats.lightsCulled++;
+                continue;
+            }
+            const auto model = glm::scale(glm::translate(glm::mat4(1.f), light.position), glm::vec3(range * sphereCircumscribe()));
+            auto& program = shadowed(light) ? *_volumeShadowedPointProgram : *_volumePointProgram;
+            program.use();
+            setLight(program, light);
+            bindShadow(program, light);
+            drawVolume(program, _sphere, model);
+            _stats.lightsDrawn++;
+        }
+
+        for (const auto& light : spotLights) {
+            if (shadowedOnly && !shadowed(light)) continue;
+            const float range = attenuationRange(light);
+            if (range <= 0.f || !frustum.intersectsSphere(light.position, range)) {
+                _stats.lightsCulled++;
+                continue;
+            }
+            auto& program = shadowed(light) ? *_volumeShadowedSpotProgram : *_volumeSpotProgram;
+            program.use();
+            setLight(program, light);
+            program.set("light.direction", light.direction);
+            program.set("light.cutoffStart", light.cutoffStart);
+            program.set("light.cutoffEnd", light.cutoffEnd);
+            bindShadow(program, light);
+            drawVolume(program, _cone, coneTransform(light, range));
+            _stats.lightsDrawn++;
+        }
+
+        glDisable(GL_STENCIL_TEST);
+        glDisable(GL_CULL_FACE);
+        glCullFace(GL_BACK);
+        glDisable(GL_BLEND);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        _framebuffer.attachDepthStencil(0);
+    }
+
+    void renderClustered(ShaderProgram& program, const DeferredFramebuffer& gBuffer, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& viewPos,
+                         const std::vector<PointLight>& pointLights, const std::vector<SpotLight>& spotLights) {
+        // Straight out of a glm::perspective matrix.
+        const float nearPlane = projection[3][2] / (projection[2][2] - 1.f);
+        const float farPlane = projection[3][2] / (projection[2][2] + 1.f);
+
+        const auto assignStart = std::chrono::steady_clock::now();
+        _clusters.setProjection(projection, nearPlane, farPlane);
+        _clusterLights.clear();
+        _packedLights.clear();
+        const glm::mat3 viewRotation(view);
+        const auto pack = [&](const PointLight& light, const glm::vec3& direction, float cutoffStart, float cutoffEnd) {
+            _clusterLights.push_back(ClusterLight {
+                glm::vec3(view * glm::vec4(light.position, 1.f)),
+                attenuationRange(light),
+                viewRotation * direction,
+                glm::dot(direction, direction) > 0.f ? cutoffEnd : -1.f
+            });
+            _packedLights.insert(_packedLights.end(), {
+                glm::vec4(light.position, cutoffEnd),
+                glm::vec4(light.diffuse, light.constant),
+                glm::vec4(light.specular, light.linear),
+                glm::vec4(light.ambient, light.quadratic),
+                glm::vec4(direction, cutoffStart)
+            });
+        };
+        for (const auto& light : pointLights) {
+            if (!shadowed(light)) pack(light, glm::vec3(0.f), 1.f, -1.f);
+        }
+        for (const auto& light : spotLights) {
+            if (!shadowed(light)) pack(light, glm::normalize(light.direction), light.cutoffStart, light.cutoffEnd);
+        }
+        _clusters.assign(_clusterLights);
+        _stats.clusterAssignMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - assignStart).count();
+        _stats.clusters = _clusters.stats();
+        _stats.lightsDrawn = _clusterLights.size();
+
+        // Orphan and refill, a zero sized buffer isn't allowed so there's always something.
+        const auto upload = [&](int index, const void* data, size_t bytes) {
+            glBindBuffer(GL_TEXTURE_BUFFER, _textureBuffers[index]);
+            glBufferData(GL_TEXTURE_BUFFER, std::max<size_t>(bytes, 16), nullptr, GL_STREAM_DRAW);
+            if (bytes) glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes, data);
+        };
+        upload(0, _packedLights.data(), _packedLights.size() * sizeof(glm::vec4));
+        upload(1, _clusters.clusterRanges().data(), _clusters.clusterRanges().size() * sizeof(uint32_t));
+        upload(2, _clusters.lightIndices().data(), _clusters.lightIndices().size() * sizeof(uint32_t));
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+        GpuTimer::ScopedQuery timer(_clusteredTimer);
+        for (int i=0; i<3; ++i) {
+            glActiveTexture(GL_TEXTURE3 + i);
+            glBindTexture(GL_TEXTURE_BUFFER, _bufferTextures[i]);
+        }
+        glActiveTexture(GL_TEXTURE0);
+
+        program.use();
+        program.set(viewName, view);
+        program.set(viewPosName, viewPos);
+        program.set(shininessName, _shininess);
+        program.set(nearPlaneName, nearPlane);
+        program.set(farPlaneName, farPlane);
+        program.set(screenWidthName, static_cast<float>(gBuffer._width));
+        program.set(screenHeightName, static_cast<float>(gBuffer._height));
+
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        {
+            auto vertexBinding = VertexDataBase::ScopedBinding(_quad);
+            glDrawElements(GL_TRIANGLES, _quad.vertexCount(), GL_UNSIGNED_INT, 0);
+        }
+        glDisable(GL_BLEND);
+    }
+
+    bool shadowed(const PointLight& light) const {
+        return _shadows && light.shadowMap >= 0 && _shadows->texture(light.shadowMap) != 0;
+    }
+
+    // Unit 7, whichever sampler type the variant declares.
+    void bindShadow(ShaderProgram& program, const PointLight& light) {
+        if (!shadowed(light)) return;
+        _stats.lightsShadowed++;
+        glActiveTexture(GL_TEXTURE7);
+        if (_shadows->type(light.shadowMap) == ShadowType::Point) {
+            glBindTexture(GL_TEXTURE_CUBE_MAP, _shadows->texture(light.shadowMap));
+            program.set(shadowFarName, _shadows->farPlane(light.shadowMap));
+        } else {
+            glBindTexture(GL_TEXTURE_2D, _shadows->texture(light.shadowMap));
+            program.set(lightSpaceName, _shadows->lightSpace(light.shadowMap));
+        }
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    static void setLight(ShaderProgram& program, const PointLight& light) {
+        program.set("light.position", light.position);
+        program.set("light.ambient", light.ambient);
+        program.set("light.diffuse", light.diffuse);
+        program.set("light.specular", light.specular);
+        program.set("light.constant", light.constant);
+        program.set("light.linear", light.linear);
+        program.set("light.quadratic", light.quadratic);
+    }
+
+    void drawVolume(ShaderProgram& program, const VertexDataBase& volume, const glm::mat4& model) {
+        auto vertexBinding = VertexDataBase::ScopedPositionBinding(volume);
+        if (_stencilCulling) {
+            // Mark pixels whose surface lies between the volume's front and back faces.
+            _stencilProgram.use();
+            _stencilProgram.set(modelName, model);
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            glEnable(GL_DEPTH_TEST);
+            glDepthFunc(GL_LESS);
+            glDisable(GL_CULL_FACE);
+            glStencilFunc(GL_ALWAYS, 0, 0xFF);
+            glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+            glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+            glDrawElements(GL_TRIANGLES, volume.vertexCount(), GL_UNSIGNED_INT, 0);
+
+            // Shade the marked ones and zero them on the way, so the next light starts clean.
+            program.use();
+            program.set(modelName, model);
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            glDisable(GL_DEPTH_TEST);
+            glEnable(GL_CULL_FACE);
+            glCullFace(GL_FRONT);
+            glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
+            glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
+            glDrawElements(GL_TRIANGLES, volume.vertexCount(), GL_UNSIGNED_INT, 0);
+        } else {
+            // Back faces only, so it still works with the camera inside. Surfaces behind the volume fail depth.
+            program.set(modelName, model);
+            glEnable(GL_DEPTH_TEST);
+            glDepthFunc(GL_GEQUAL);
+            glCullFace(GL_FRONT);
+            glDrawElements(GL_TRIANGLES, volume.vertexCount(), GL_UNSIGNED_INT, 0);
+        }
+    }
+
+    static void bindGBufferUnits(ShaderProgram& program) {
+        program.set(gPositionName, 0);
+        program.set(gAlbedoName, 1);
+        program.set(gNormalName, 2);
+        program.set(gDepthName, 6);
+        program.set(shadowMapName, 7);
+        program.set(shadowCubeName, 7);
+        program.set(temporalHistoryName, TemporalReuse::historyUnit);
+        if (const auto block = glGetUniformBlockIndex(program, skyIrradianceName.data()); block != GL_INVALID_INDEX) {
+            glUniformBlockBinding(program, block, skyIrradianceBinding);
+        }
+    }
+
+    // Unit cone opens along -Z, rotate it onto the light direction and stretch to the range.
+    static glm::mat4 coneTransform(const SpotLight& light, const float range) {
+        const glm::vec3 direction = glm::normalize(light.direction);
+        const glm::vec3 up = std::abs(direction.y) > 0.99f ? glm::vec3(1.f, 0.f, 0.f) : glm::vec3(0.f, 1.f, 0.f);
+        const glm::mat4 orientation = glm::inverse(glm::lookAt(glm::vec3(0.f), direction, up));
+        const float cosine = std::clamp(light.cutoffEnd, 0.01f, 1.f);
+        const float radius = range * std::sqrt(1.f - cosine * cosine) / cosine;
+        return glm::translate(glm::mat4(1.f), light.position) * orientation * glm::scale(glm::mat4(1.f), glm::vec3(radius, radius, range));
+    }
+
+    // The tessellated sphere sits inside the real one, scale it up so it covers it.
+    constexpr static float sphereCircumscribe() {
+        return 1.f / (0.9659258f /* cos(pi/12) */ * 0.9807853f /* cos(pi/16) */);
+    }
+
+    static VertexDataBase buildSphere() {
+        static_assert(sphereSegments == 12 && sphereRings == 8, "sphereCircumscribe() assumes these");
+        std::vector<glm::vec3> positions;
+        std::vector<unsigned int> indices;
+        for (int ring=0; ring<=sphereRings; ++ring) {
+            const float phi = glm::pi<float>() * ring / sphereRings;
+            for (int segment=0; segment<sphereSegments; ++segment) {
+                const float theta = 2.f * glm::pi<float>() * segment / sphereSegments;
+                positions.emplace_back(std::sin(phi) * std::cos(theta), std::cos(phi), std::sin(phi) * std::sin(theta));
+            }
+        }
+        for (int ring=0; ring<sphereRings; ++ring) {
+            for (int segment=0; segment<sphereSegments; ++segment) {
+                const unsigned int a = ring * sphereSegments + segment;
+                const unsigned int b = ring * sphereSegments + (segment + 1) % sphereSegments;
+                const unsigned int c = a + sphereSegments, d = b + sphereSegments;
+                indices.insert(indices.end(), { a, b, c, b, d, c });
+            }
+        }
+        return VertexData<Layout::Sequential, Vec3>(indices, positions.size(), reinterpret_cast<const float*>(positions.data()));
+    }
+
+    static VertexDataBase buildCone() {
+        // Base polygon pushed out so its edges, not just corners, reach radius 1.
+        const float baseRadius = 1.f / std::cos(glm::pi<float>() / coneSegments);
+        std::vector<glm::vec3> positions { glm::vec3(0.f), glm::vec3(0.f, 0.f, -1.f) };
+        std::vector<unsigned int> indices;
+        for (int segment=0; segment<coneSegments; ++segment) {
+            const float theta = 2.f * glm::pi<float>() * segment / coneSegments;
+            positions.emplace_back(baseRadius * std::cos(theta), baseRadius * std::sin(theta), -1.f);
+        }
+        for (int segment=0; segment<coneSegments; ++segment) {
+            const unsigned int a = 2 + segment;
+            const unsigned int b = 2 + (segment + 1) % coneSegments;
+            indices.insert(indices.end(), { 0u, a, b, 1u, b, a });
+        }
+        return VertexData<Layout::Sequential, Vec3>(indices, positions.size(), reinterpret_cast<const float*>(positions.data()));
+    }
+
+    constexpr static inline glm::vec3 quadCoords[4] = {
+        {-1.f, -1.f, 0.f},
+        {1.f, -1.f, 0.f},
+        {1.f, 1.f, 0.f},
+        {-1.f, 1.f, 0.f}
+    };
+
+    constexpr static inline unsigned int quadIndices[6] = {
+        0, 1, 2, 2, 0, 3
+    };
+};
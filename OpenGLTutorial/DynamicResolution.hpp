@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+
+struct DynamicResolutionSettings {
+    // GPU time the scaled passes should fit in.
+    float targetMilliseconds = 6.f;
+    float minScale = 0.5f;
+    float maxScale = 1.f;
+    // Scale only takes multiples of this, so the size doesn't creep by a pixel every frame.
+    float step = 1.f / 16.f;
+    // Fraction of the target either side of it where nothing changes.
+    float deadband = 0.1f;
+    // Frames to leave a new scale alone, the timers come back a few frames late and would still report the old one.
+    int settleFrames = 8;
+    // Weight of the newest measurement in the running average.
+    float smoothing = 0.2f;
+};
+
+struct DynamicResolutionDecision {
+    uint64_t frame;
+    // Averaged GPU time that triggered it.
+    float milliseconds;
+    float fromScale, toScale;
+    const char* reason;
+};
+
+// Picks a render scale from the GPU time of whatever draws at that scale. Over budget it jumps straight to the scale
+// the time says would fit, taking the cost to go with the pixel count; under budget it creeps back up a step at a time
+// and only when the estimate says the step still fits, which is what keeps it from bouncing between two sizes.
+// Every change is kept in log() and printed, to tune the settings against a real load.
+class DynamicResolution {
+    constexpr static size_t logSize = 64;
+
+    DynamicResolutionSettings _settings;
+    float _scale;
+    float _averageMilliseconds = 0.f;
+    uint64_t _frame = 0;
+    uint64_t _lastChange = 0;
+    bool _print = true;
+    std::deque<DynamicResolutionDecision> _log;
+public:
+    DynamicResolution(DynamicResolutionSettings settings = {})
+    : _settings(clamped(settings)), _scale(_settings.maxScale)
+    {}
+
+    void setSettings(const DynamicResolutionSettings& settings) {
+        _settings = clamped(settings);
+        change(std::clamp(_scale, _settings.minScale, _settings.maxScale), "bounds changed");
+    }
+    const DynamicResolutionSettings& settings() const { return _settings; }
+
+    // Decisions go to stdout as well as to log().
+    void setPrint(bool print) { _print = print; }
+
+    // Once per frame with the latest GPU time of the scaled passes, returns the scale to render the next frame at.
+    float update(float gpuMilliseconds) {
+        _frame++;
+        // Timers not back yet.
+        if (gpuMilliseconds <= 0.f) return _scale;
+        _averageMilliseconds = _averageMilliseconds > 0.f ? _averageMilliseconds + _settings.smoothing * (gpuMilliseconds - _averageMilliseconds) : gpuMilliseconds;
+        if (_frame - _lastChange < static_cast<uint64_t>(_settings.settleFrames)) return _scale;
+
+        const float target = _settings.targetMilliseconds;
+        if (_averageMilliseconds > target * (1.f + _settings.deadband)) {
+            const float fits = _scale * std::sqrt(target / _averageMilliseconds);
+            change(std::max(std::floor(fits / _settings.step) * _settings.step, _settings.minScale), "over budget");
+        } else if (_averageMilliseconds < target * (1.f - _settings.deadband)) {
+            const float next = std::min(_scale + _settings.step, _settings.maxScale);
+            const float estimate = _averageMilliseconds * (next * next) / (_scale * _scale);
+            if (estimate <= target) change(next, "under budget");
+        }
+        return _scale;
+    }
+
+    float scale() const { return _scale; }
+    float averageMilliseconds() const { return _averageMilliseconds; }
+
+    // Of a full size, at least a pixel and never past it.
+    unsigned int scaled(unsigned int size) const {
+        return std::clamp(static_cast<unsigned int>(std::lround(size * _scale)), 1u, size);
+    }
+
+    // Oldest first.
+    const std::deque<DynamicResolutionDecision>& log() const { return _log; }
+
+    // Back to full size with nothing measured, for when the timings so far say nothing about what comes next.
+    void reset() {
+        change(_settings.maxScale, "reset");
+        _averageMilliseconds = 0.f;
+    }
+
+private:
+    static DynamicResolutionSettings clamped(DynamicResolutionSettings settings) {
+        settings.minScale = std::clamp(settings.minScale, settings.step, 1.f);
+        settings.maxScale = std::clamp(settings.maxScale, settings.minScale, 1.f);
+        return settings;
+    }
+
+    void change(float scale, const char* reason) {
+        if (scale == _scale) return;
+        const DynamicResolutionDecision decision { _frame, _averageMilliseconds, _scale, scale, reason };
+        if (_log.size() == logSize) _log.pop_front();
+        _log.push_back(decision);
+        if (_print) {
+            std::cout << "Dynamic resolution, frame " << decision.frame << ": " << std::fixed << std::setprecision(1)
+                << 100.f * decision.fromScale << "% -> " << 100.f * decision.toScale << "% at " << std::setprecision(2)
+                << decision.milliseconds << " ms against " << _settings.targetMilliseconds << " ms (" << reason << ")\n"
+                << std::defaultfloat;
+        }
+        // Whatever was measured so far was at the old scale.
+        if (_averageMilliseconds > 0.f) _averageMilliseconds *= (scale * scale) / (_scale * _scale);
+        _scale = scale;
+        _lastChange = _frame;
+    }
+};
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "glad/glad.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <future>
+#include <vector>
+
+#include "CpuImageFilters.hpp"
+#include "PostProcessGraph.hpp"
+#include "ThreadPool.hpp"
+
+struct ErrorDiffusionStats {
+    float ditherMilliseconds = 0.f;
+    size_t threads = 0;
+    // Frames between a readback being queued and its dither showing up on screen.
+    uint64_t latencyFrames = 0;
+    // Frames the readbacks were all still busy, and frames that came back while the CPU was behind.
+    size_t skippedReadbacks = 0;
+    size_t droppedReadbacks = 0;
+};
+
+// Real error diffusion, which a fragment shader can't do - every pixel depends on the ones before it. Each frame the
+// source gets read back into a pixel buffer without waiting on it, a finished readback goes to the pool for
+// CpuImageFilters::errorDiffusion and the result is uploaded once it's done. The picture trails the scene by a few
+// frames; until the first one comes back the pass shows its input as is.
+class ErrorDiffusionDither {
+    constexpr static auto diffusedTextureName = std::string_view("diffusedTexture");
+    constexpr static auto hasDiffusedName = std::string_view("hasDiffused");
+    constexpr static int latency = 3;
+
+    struct Readback {
+        unsigned int buffer = 0;
+        GLsync fence = nullptr;
+        uint64_t frame = 0;
+        int width = 0, height = 0;
+    };
+
+    ThreadPool& _pool;
+    std::array<Readback, latency> _readbacks {};
+    int _next = 0;
+    unsigned int _framebuffer;
+    unsigned int _texture;
+    int _width = 0, _height = 0;
+    ErrorDiffusionKernel _kernel = ErrorDiffusionKernel::FloydSteinberg;
+    size_t _threads = 0;
+    uint64_t _frame = 0;
+
+    // Touched by the job only while it runs.
+    std::future<void> _job;
+    ImagePlane _gray, _dithered;
+    std::vector<unsigned char> _upload;
+    int _jobWidth = 0, _jobHeight = 0;
+    uint64_t _jobFrame = 0;
+    float _jobMilliseconds = 0.f;
+    size_t _jobThreads = 0;
+    bool _hasResult = false;
+    ErrorDiffusionStats _stats;
+public:
+    ErrorDiffusionDither(int width, int height, ThreadPool& pool = ThreadPool::shared())
+    : _pool(pool)
+    {
+        glGenFramebuffers(1, &_framebuffer);
+        glGenTextures(1, &_texture);
+        glBindTexture(GL_TEXTURE_2D, _texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        for (auto& readback : _readbacks) glGenBuffers(1, &readback.buffer);
+        setSize(width, height);
+    }
+
+    ~ErrorDiffusionDither() {
+        if (_job.valid()) _job.wait();
+        for (auto& readback : _readbacks) {
+            if (readback.fence) glDeleteSync(readback.fence);
+            glDeleteBuffers(1, &readback.buffer);
+        }
+        glDeleteTextures(1, &_texture);
+        glDeleteFramebuffers(1, &_framebuffer);
+    }
+
+    ErrorDiffusionDither(const ErrorDiffusionDither& other) = delete;
+    ErrorDiffusionDither& operator=(const ErrorDiffusionDither& other) = delete;
+
+    // Draws the latest dithered frame, input is whatever update() is being fed.
+    PostProcessPass pass(std::string input, std::string output) const {
+        return PostProcessPass {
+            .name = "Error diffusion",
+            .stagePath = "PostProcess/ErrorDiffusion.glsl",
+            .stage = PostProcessStage::Source,
+            .input = std::move(input),
+            .output = std::move(output),
+            .bind = [this](PostProcessBinding& binding) {
+                binding.texture(diffusedTextureName, _texture);
+                binding.program.set(hasDiffusedName, _hasResult);
+            }
+        };
+    }
+
+    // Once per frame with the texture to dither, allocated at the size given to setSize(). Only its lower left
+    // width x height gets read, the same corner of the result is written.
+    void update(unsigned int source, int width, int height) {
+        _frame++;
+        if (_job.valid() && _job.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            _job.get();
+            glBindTexture(GL_TEXTURE_2D, _texture);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, _jobWidth, _jobHeight, GL_RED, GL_UNSIGNED_BYTE, _upload.data());
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            _hasResult = true;
+            _stats.ditherMilliseconds = _jobMilliseconds;
+            _stats.threads = _jobThreads;
+            _stats.latencyFrames = _frame - _jobFrame;
+        }
+        if (!_job.valid()) collect();
+        read(source, std::min(width, _width), std::min(height, _height));
+    }
+
+    // Free when the size didn't change.
+    void setSize(int width, int height) {
+        if (width == _width && height == _height) return;
+        if (_job.valid()) _job.wait();
+        _job = {};
+        for (auto& readback : _readbacks) {
+            if (readback.fence) glDeleteSync(readback.fence);
+            readback.fence = nullptr;
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+            glBufferData(GL_PIXEL_PACK_BUFFER, static_cast<GLsizeiptr>(width) * height * 4, nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glBindTexture(GL_TEXTURE_2D, _texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        _width = width;
+        _height = height;
+        _hasResult = false;
+    }
+
+    // Takes effect from the next frame that reaches the CPU.
+    void setKernel(ErrorDiffusionKernel kernel) { _kernel = kernel; }
+    ErrorDiffusionKernel kernel() const { return _kernel; }
+
+    // 0 for the whole pool.
+    void setThreads(size_t threads) { _threads = threads; }
+
+    const ErrorDiffusionStats& stats() const { return _stats; }
+
+private:
+    void read(unsigned int source, int width, int height) {
+        auto& readback = _readbacks[_next];
+        if (readback.fence) {
+            _stats.skippedReadbacks++;
+            return;
+        }
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, _framebuffer);
+        glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, source, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        readback.frame = _frame;
+        readback.width = width;
+        readback.height = height;
+        _next = (_next + 1) % latency;
+    }
+
+    // Newest readback that landed goes to the CPU, any older ones that landed alongside it are stale by now.
+    void collect() {
+        Readback* newest = nullptr;
+        for (int i=0; i<latency; ++i) {
+            auto& readback = _readbacks[(_next + i) % latency];
+            if (!readback.fence) continue;
+            const auto status = glClientWaitSync(readback.fence, 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) break;
+            if (newest) {
+                glDeleteSync(newest->fence);
+                newest->fence = nullptr;
+                _stats.droppedReadbacks++;
+            }
+            newest = &readback;
+        }
+        if (!newest) return;
+
+        _gray = ImagePlane(newest->width, newest->height);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, newest->buffer);
+        const auto* pixels = static_cast<const unsigned char*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, static_cast<GLsizeiptr>(newest->width) * newest->height * 4, GL_MAP_READ_BIT));
+        if (pixels) {
+            for (size_t i=0; i<_gray.values.size(); ++i) {
+                _gray.values[i] = (0.21f * pixels[i * 4] + 0.72f * pixels[i * 4 + 1] + 0.07f * pixels[i * 4 + 2]) / 255.f;
+            }
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glDeleteSync(newest->fence);
+        newest->fence = nullptr;
+
+        _jobFrame = newest->frame;
+        _jobWidth = newest->width;
+        _jobHeight = newest->height;
+        _job = _pool.submit([this, kernel = _kernel, threads = _threads] {
+            const auto start = std::chrono::steady_clock::now();
+            _jobThreads = CpuImageFilters::errorDiffusion(_gray, _dithered, kernel, CpuImageFilterSettings { .pool = &_pool }, threads);
+            _upload.resize(_dithered.values.size());
+            for (size_t i=0; i<_upload.size(); ++i) _upload[i] = _dithered.values[i] > 0.5f ? 255 : 0;
+            _jobMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        });
+    }
+};
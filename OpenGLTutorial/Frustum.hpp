@@ -0,0 +1,56 @@
+#pragma once
+#include <glm/glm.hpp>
+
+#include <array>
+
+// Planes pulled straight out of the view-projection matrix (Gribb & Hartmann).
+// Every plane normal points inside, so "in front" means "visible".
+class Frustum {
+    std::array<glm::vec4, 6> _planes {};
+public:
+    Frustum() = default;
+
+    explicit Frustum(const glm::mat4& viewProjection) {
+        const auto row = [&](int i) {
+            return glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+        };
+        _planes[0] = row(3) + row(0); // left
+        _planes[1] = row(3) - row(0); // right
+        _planes[2] = row(3) + row(1); // bottom
+        _planes[3] = row(3) - row(1); // top
+        _planes[4] = row(3) + row(2); // near
+        _planes[5] = row(3) - row(2); // far
+
+        for (auto& plane : _planes) {
+            plane /= glm::length(glm::vec3(plane));
+        }
+    }
+
+    bool intersectsSphere(const glm::vec3& center, const float radius) const {
+        for (const auto& plane : _planes) {
+            if (glm::dot(glm::vec3(plane), center) + plane.w < -radius) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool intersectsBox(const glm::vec3& boxMin, const glm::vec3& boxMax) const {
+        for (const auto& plane : _planes) {
+            // Only the corner furthest along the plane normal matters.
+            const glm::vec3 positive(
+                plane.x >= 0.f ? boxMax.x : boxMin.x,
+                plane.y >= 0.f ? boxMax.y : boxMin.y,
+                plane.z >= 0.f ? boxMax.z : boxMin.z
+            );
+            if (glm::dot(glm::vec3(plane), positive) + plane.w < 0.f) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const std::array<glm::vec4, 6>& planes() const {
+        return _planes;
+    }
+};
@@ -4,6 +4,7 @@
 #include <array>
 
 #include "ShaderProgram.hpp"
+#include "ShaderCompiler.hpp"
 #include "Utils.hpp"
 
 #ifndef SHADERS_SOURCE_DIR
@@ -70,12 +71,6 @@ private:
     }
 
     void prepareProgram() {
-        auto vertexShaderCode = Utils::readFile(SHADERS_SOURCE_DIR "/" "gizmo.vert.glsl");
-        auto fragmentShaderCode = Utils::readFile(SHADERS_SOURCE_DIR "/" "gizmo.frag.glsl");
-
-        program = ShaderProgram(
-            Shader<ShaderType::Vertex>(vertexShaderCode),
-            Shader<ShaderType::Fragment>(fragmentShaderCode)
-        );
+        ShaderCompiler::shared().compile(program, "gizmo.vert.glsl", "gizmo.frag.glsl");
     }
 };
\ No newline at end of file
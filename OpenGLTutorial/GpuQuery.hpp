@@ -0,0 +1,75 @@
+#pragma once
+#include <glad/glad.h>
+
+#include <array>
+#include <cstdint>
+
+// Ring of GL queries read back a few frames late, so asking for the result never stalls the pipeline.
+// Only one query per target can be active at a time - timers can't be nested.
+template<GLenum Target>
+class GpuQuery {
+    constexpr static int latency = 4;
+
+    std::array<unsigned int, latency> _queries {};
+    std::array<bool, latency> _pending {};
+    int _next = 0;
+    uint64_t _result = 0;
+public:
+    GpuQuery() {
+        glGenQueries(latency, _queries.data());
+    }
+
+    ~GpuQuery() {
+        glDeleteQueries(latency, _queries.data());
+    }
+
+    GpuQuery(const GpuQuery& other) = delete;
+    GpuQuery& operator=(const GpuQuery& other) = delete;
+
+    void begin() {
+        glBeginQuery(Target, _queries[_next]);
+    }
+
+    void end() {
+        glEndQuery(Target);
+        _pending[_next] = true;
+        _next = (_next + 1) % latency;
+        collect();
+    }
+
+    // Latest result which made it back from the GPU.
+    uint64_t result() const {
+        return _result;
+    }
+
+    float milliseconds() const requires (Target == GL_TIME_ELAPSED) {
+        return static_cast<float>(_result) / 1'000'000.f;
+    }
+
+    struct ScopedQuery {
+        GpuQuery& _query;
+        ScopedQuery(GpuQuery& query) : _query(query) { _query.begin(); }
+        ~ScopedQuery() { _query.end(); }
+    };
+
+private:
+    void collect() {
+        // _next now points at the oldest query.
+        for (int i=0; i<latency; ++i) {
+            const int index = (_next + i) % latency;
+            if (!_pending[index]) continue;
+
+            int available = 0;
+            glGetQueryObjectiv(_queries[index], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) break;
+
+            GLuint64 value = 0;
+            glGetQueryObjectui64v(_queries[index], GL_QUERY_RESULT, &value);
+            _result = value;
+            _pending[index] = false;
+        }
+    }
+};
+
+using GpuTimer = GpuQuery<GL_TIME_ELAPSED>;
+using SamplesPassedCounter = GpuQuery<GL_SAMPLES_PASSED>;
@@ -0,0 +1,281 @@
+#pragma once
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LIGHT_CLUSTERS_SSE 1
+#endif
+
+#include "ThreadPool.hpp"
+
+// Light as the cluster grid sees it, in view space. Point lights have cosOuter = -1 (a "cone" covering everything).
+struct ClusterLight {
+    glm::vec3 position;
+    float range;
+    glm::vec3 direction;
+    float cosOuter = -1.f;
+};
+
+struct LightClusterStats {
+    size_t lights = 0;
+    size_t indices = 0;
+    size_t maxLightsPerCluster = 0;
+    size_t occupiedClusters = 0;
+};
+
+// Froxel grid over the camera frustum: screen tiles in x/y, exponential slices in z.
+// Lights get assigned per slice in parallel, each slice tests a light against 4 clusters at a time.
+// Keep the dimensions in sync with Shaders/DeferredLighting/Clustered.frag.glsl.
+class LightClusterGrid {
+public:
+    constexpr static unsigned int tilesX = 16;
+    constexpr static unsigned int tilesY = 9;
+    constexpr static unsigned int slices = 24;
+    constexpr static unsigned int clustersPerSlice = tilesX * tilesY;
+    constexpr static unsigned int clusterCount = clustersPerSlice * slices;
+    static_assert(clustersPerSlice % 4 == 0, "SIMD path goes 4 clusters at a time");
+
+private:
+    // Structure of arrays, so 4 neighbouring clusters load as one register per component.
+    struct ClusterBounds {
+        std::vector<float> minX, minY, minZ, maxX, maxY, maxZ;
+        // Bounding spheres, for the cone test.
+        std::vector<float> centerX, centerY, centerZ, radius;
+    };
+
+    ClusterBounds _bounds;
+    std::array<float, slices + 1> _sliceDepths {};
+    glm::mat4 _projection { 0.f };
+    float _near = 0.f, _far = 0.f;
+
+    // Per cluster: first index into _lightIndices and how many follow.
+    std::vector<uint32_t> _clusterRanges;
+    std::vector<uint32_t> _lightIndices;
+    std::vector<std::vector<std::vector<uint32_t>>> _sliceLists;
+    LightClusterStats _stats;
+
+public:
+    LightClusterGrid()
+    : _clusterRanges(2 * clusterCount, 0),
+      _sliceLists(slices, std::vector<std::vector<uint32_t>>(clustersPerSlice))
+    {
+        for (auto* component : { &_bounds.minX, &_bounds.minY, &_bounds.minZ, &_bounds.maxX, &_bounds.maxY, &_bounds.maxZ,
+                                 &_bounds.centerX, &_bounds.centerY, &_bounds.centerZ, &_bounds.radius }) {
+            component->resize(clusterCount);
+        }
+    }
+
+    // Cheap to call every frame, only rebuilds when the projection actually changed.
+    void setProjection(const glm::mat4& projection, const float nearPlane, const float farPlane) {
+        if (projection == _projection && nearPlane == _near && farPlane == _far) return;
+        _projection = projection;
+        _near = nearPlane;
+        _far = farPlane;
+
+        for (unsigned int slice=0; slice<=slices; ++slice) {
+            _sliceDepths[slice] = sliceDepth(slice);
+        }
+
+        const glm::mat4 inverseProjection = glm::inverse(projection);
+        // Direction through an NDC point, scaled so z = -1.
+        const auto rayAt = [&](float ndcX, float ndcY) {
+            const glm::vec4 point = inverseProjection * glm::vec4(ndcX, ndcY, 1.f, 1.f);
+            const glm::vec3 view = glm::vec3(point) / point.w;
+            return view / -view.z;
+        };
+
+        for (unsigned int slice=0; slice<slices; ++slice) {
+            const float zNear = _sliceDepths[slice], zFar = _sliceDepths[slice + 1];
+            for (unsigned int y=0; y<tilesY; ++y) {
+                for (unsigned int x=0; x<tilesX; ++x) {
+                    const float x0 = 2.f * x / tilesX - 1.f, x1 = 2.f * (x + 1) / tilesX - 1.f;
+                    const float y0 = 2.f * y / tilesY - 1.f, y1 = 2.f * (y + 1) / tilesY - 1.f;
+
+                    glm::vec3 boxMin(std::numeric_limits<float>::max()), boxMax(std::numeric_limits<float>::lowest());
+                    for (const auto& ray : { rayAt(x0, y0), rayAt(x1, y0), rayAt(x0, y1), rayAt(x1, y1) }) {
+                        for (const float depth : { zNear, zFar }) {
+                            boxMin = glm::min(boxMin, ray * depth);
+                            boxMax = glm::max(boxMax, ray * depth);
+                        }
+                    }
+
+                    const unsigned int index = clusterIndex(x, y, slice);
+                    _bounds.minX[index] = boxMin.x; _bounds.minY[index] = boxMin.y; _bounds.minZ[index] = boxMin.z;
+                    _bounds.maxX[index] = boxMax.x; _bounds.maxY[index] = boxMax.y; _bounds.maxZ[index] = boxMax.z;
+                    const glm::vec3 center = 0.5f * (boxMin + boxMax);
+                    _bounds.centerX[index] = center.x; _bounds.centerY[index] = center.y; _bounds.centerZ[index] = center.z;
+                    _bounds.radius[index] = 0.5f * glm::length(boxMax - boxMin);
+                }
+            }
+        }
+    }
+
+    void assign(const std::vector<ClusterLight>& lights, ThreadPool& pool = ThreadPool::shared(), const bool simd = true) {
+        pool.parallelFor(0, slices, 1, [&](size_t begin, size_t end) {
+            for (size_t slice=begin; slice<end; ++slice) {
+                assignSlice(static_cast<unsigned int>(slice), lights, simd);
+            }
+        });
+
+        _lightIndices.clear();
+        _stats = LightClusterStats {};
+        _stats.lights = lights.size();
+        for (unsigned int slice=0; slice<slices; ++slice) {
+            for (unsigned int cluster=0; cluster<clustersPerSlice; ++cluster) {
+                const auto& list = _sliceLists[slice][cluster];
+                const unsigned int index = slice * clustersPerSlice + cluster;
+                _clusterRanges[2 * index] = static_cast<uint32_t>(_lightIndices.size());
+                _clusterRanges[2 * index + 1] = static_cast<uint32_t>(list.size());
+                _lightIndices.insert(_lightIndices.end(), list.begin(), list.end());
+                _stats.maxLightsPerCluster = std::max(_stats.maxLightsPerCluster, list.size());
+                _stats.occupiedClusters += !list.empty();
+            }
+        }
+        _stats.indices = _lightIndices.size();
+    }
+
+    const std::vector<uint32_t>& clusterRanges() const { return _clusterRanges; }
+    const std::vector<uint32_t>& lightIndices() const { return _lightIndices; }
+    const LightClusterStats& stats() const { return _stats; }
+
+    // Distance (positive) from the camera where a slice starts.
+    float sliceDepth(unsigned int slice) const {
+        return _near * std::pow(_far / _near, static_cast<float>(slice) / slices);
+    }
+
+    static unsigned int clusterIndex(unsigned int x, unsigned int y, unsigned int slice) {
+        return (slice * tilesY + y) * tilesX + x;
+    }
+
+private:
+    void assignSlice(const unsigned int slice, const std::vector<ClusterLight>& lights, const bool simd) {
+        auto& lists = _sliceLists[slice];
+        for (auto& list : lists) list.clear();
+
+        const float sliceNear = -_sliceDepths[slice], sliceFar = -_sliceDepths[slice + 1];
+        const unsigned int first = slice * clustersPerSlice;
+        for (uint32_t lightIndex=0; lightIndex<lights.size(); ++lightIndex) {
+            const auto& light = lights[lightIndex];
+            // Whole slice first, most lights miss most slices.
+            if (light.position.z - light.range > sliceNear || light.position.z + light.range < sliceFar) continue;
+
+            for (unsigned int cluster=0; cluster<clustersPerSlice; cluster+=4) {
+                const int mask = simd ? testFourSimd(light, first + cluster) : testFourScalar(light, first + cluster);
+                for (int lane=0; lane<4; ++lane) {
+                    if (mask & (1 << lane)) lists[cluster + lane].push_back(lightIndex);
+                }
+            }
+        }
+    }
+
+    // Sphere vs box, then for spot lights the cone vs the box's bounding sphere.
+    int testFourScalar(const ClusterLight& light, const unsigned int first) const {
+        int mask = 0;
+        for (int lane=0; lane<4; ++lane) {
+            const unsigned int i = first + lane;
+            const float dx = std::max(0.f, std::max(_bounds.minX[i] - light.position.x, light.position.x - _bounds.maxX[i]));
+            const float dy = std::max(0.f, std::max(_bounds.minY[i] - light.position.y, light.position.y - _bounds.maxY[i]));
+            const float dz = std::max(0.f, std::max(_bounds.minZ[i] - light.position.z, light.position.z - _bounds.maxZ[i]));
+            if (dx * dx + dy * dy + dz * dz > light.range * light.range) continue;
+
+            if (light.cosOuter > -1.f) {
+                const glm::vec3 v = glm::vec3(_bounds.centerX[i], _bounds.centerY[i], _bounds.centerZ[i]) - light.position;
+                const float along = glm::dot(v, light.direction);
+                const float across = std::sqrt(std::max(0.f, glm::dot(v, v) - along * along));
+                const float sinOuter = std::sqrt(1.f - light.cosOuter * light.cosOuter);
+                const float closest = light.cosOuter * across - along * sinOuter;
+                if (closest > _bounds.radius[i] || along < -_bounds.radius[i]) continue;
+            }
+            mask |= 1 << lane;
+        }
+        return mask;
+    }
+
+#ifdef LIGHT_CLUSTERS_SSE
+    int testFourSimd(const ClusterLight& light, const unsigned int first) const {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 px = _mm_set1_ps(light.position.x), py = _mm_set1_ps(light.position.y), pz = _mm_set1_ps(light.position.z);
+
+        const auto axisDistance = [&](const std::vector<float>& mins, const std::vector<float>& maxs, __m128 p) {
+            const __m128 below = _mm_sub_ps(_mm_loadu_ps(&mins[first]), p);
+            const __m128 above = _mm_sub_ps(p, _mm_loadu_ps(&maxs[first]));
+            return _mm_max_ps(zero, _mm_max_ps(below, above));
+        };
+        const __m128 dx = axisDistance(_bounds.minX, _bounds.maxX, px);
+        const __m128 dy = axisDistance(_bounds.minY, _bounds.maxY, py);
+        const __m128 dz = axisDistance(_bounds.minZ, _bounds.maxZ, pz);
+        const __m128 distanceSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        __m128 inside = _mm_cmple_ps(distanceSquared, _mm_set1_ps(light.range * light.range));
+
+        if (light.cosOuter > -1.f && _mm_movemask_ps(inside)) {
+            const __m128 vx = _mm_sub_ps(_mm_loadu_ps(&_bounds.centerX[first]), px);
+            const __m128 vy = _mm_sub_ps(_mm_loadu_ps(&_bounds.centerY[first]), py);
+            const __m128 vz = _mm_sub_ps(_mm_loadu_ps(&_bounds.centerZ[first]), pz);
+            const __m128 radius = _mm_loadu_ps(&_bounds.radius[first]);
+            const __m128 along = _mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(vx, _mm_set1_ps(light.direction.x)),
+                _mm_mul_ps(vy, _mm_set1_ps(light.direction.y))),
+                _mm_mul_ps(vz, _mm_set1_ps(light.direction.z)));
+            const __m128 lengthSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+            const __m128 across = _mm_sqrt_ps(_mm_max_ps(zero, _mm_sub_ps(lengthSquared, _mm_mul_ps(along, along))));
+            const float sinOuter = std::sqrt(1.f - light.cosOuter * light.cosOuter);
+            const __m128 closest = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(light.cosOuter), across), _mm_mul_ps(along, _mm_set1_ps(sinOuter)));
+            const __m128 inCone = _mm_and_ps(
+                _mm_cmple_ps(closest, radius),
+                _mm_cmpge_ps(along, _mm_sub_ps(zero, radius)));
+            inside = _mm_and_ps(inside, inCone);
+        }
+        return _mm_movemask_ps(inside);
+    }
+#else
+    int testFourSimd(const ClusterLight& light, const unsigned int first) const {
+        return testFourScalar(light, first);
+    }
+#endif
+};
+
+struct ClusterAssignmentTiming {
+    size_t lights;
+    float scalarMilliseconds;
+    float simdMilliseconds;
+    float averageLightsPerOccupiedCluster;
+};
+
+// Random lights spread through the view frustum, averaged over a few runs. On one core, the slices run inline.
+inline ClusterAssignmentTiming benchmarkClusterAssignment(LightClusterGrid& grid, const size_t lightCount, const float farPlane) {
+    ThreadPool serial(0);
+    std::mt19937 random(42);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    std::vector<ClusterLight> lights(lightCount);
+    for (auto& light : lights) {
+        const float depth = farPlane * 0.5f * unit(random);
+        light.position = glm::vec3((2.f * unit(random) - 1.f) * depth, (2.f * unit(random) - 1.f) * depth * 0.5f, -depth);
+        light.range = 0.5f + 3.f * unit(random);
+        light.direction = glm::vec3(0.f, 0.f, -1.f);
+        light.cosOuter = unit(random) < 0.25f ? 0.9f : -1.f;
+    }
+
+    constexpr int runs = 5;
+    const auto time = [&](bool simd) {
+        grid.assign(lights, serial, simd); // warm up the lists
+        const auto start = std::chrono::steady_clock::now();
+        for (int run=0; run<runs; ++run) {
+            grid.assign(lights, serial, simd);
+        }
+        return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+    };
+
+    ClusterAssignmentTiming timing { lightCount, time(false), time(true), 0.f };
+    const auto& stats = grid.stats();
+    timing.averageLightsPerOccupiedCluster = stats.occupiedClusters ? static_cast<float>(stats.indices) / stats.occupiedClusters : 0.f;
+    return timing;
+}
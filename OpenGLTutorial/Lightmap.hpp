@@ -0,0 +1,822 @@
+#pragma once
+
+#include <assimp/Importer.hpp>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Bvh.hpp"
+#include "Lights.hpp"
+#include "ShaderProgram.hpp"
+#include "ShaderCompiler.hpp"
+#include "TemporalReuse.hpp"
+#include "ThreadPool.hpp"
+#include "VertexData.hpp"
+#include "stb_image_proxy.hpp"
+
+// Lighting from lights that never move, baked offline. Every mesh gets a second UV set of flattened charts packed
+// into one atlas, every atlas texel traces direct light plus one diffuse bounce against the scene BVH.
+namespace LightmapFormat {
+
+constexpr char magic[8] = { 'L', 'O', 'G', 'L', 'L', 'M', 'A', 'P' };
+constexpr uint32_t version = 1;
+
+// Source mesh cut along chart seams, so vertices on a seam show up once per chart.
+struct ChartedMesh {
+    std::vector<glm::vec3> positions;
+    // Into the atlas, [0, 1].
+    std::vector<glm::vec2> uvs;
+    std::vector<uint32_t> indices;
+};
+
+struct LightmapData {
+    uint32_t width = 0, height = 0;
+    std::vector<ChartedMesh> meshes;
+    // Irradiance in the units the light volumes shade with, times albedo is what the surface reflects.
+    std::vector<glm::vec3> texels;
+};
+
+template<class T>
+void write(std::ostream& stream, const T& value) {
+    stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<class T>
+T read(std::istream& stream) {
+    T value {};
+    stream.read(reinterpret_cast<char*>(&value), sizeof(T));
+    return value;
+}
+
+inline void writeFile(const std::string& path, const LightmapData& data) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open lightmap file for writing");
+    }
+    write(file, magic);
+    write<uint32_t>(file, version);
+    write<uint32_t>(file, data.width);
+    write<uint32_t>(file, data.height);
+    write<uint32_t>(file, static_cast<uint32_t>(data.meshes.size()));
+    for (const auto& mesh : data.meshes) {
+        write<uint32_t>(file, static_cast<uint32_t>(mesh.positions.size()));
+        write<uint32_t>(file, static_cast<uint32_t>(mesh.indices.size()));
+        file.write(reinterpret_cast<const char*>(mesh.positions.data()), mesh.positions.size() * sizeof(glm::vec3));
+        file.write(reinterpret_cast<const char*>(mesh.uvs.data()), mesh.uvs.size() * sizeof(glm::vec2));
+        file.write(reinterpret_cast<const char*>(mesh.indices.data()), mesh.indices.size() * sizeof(uint32_t));
+    }
+    file.write(reinterpret_cast<const char*>(data.texels.data()), data.texels.size() * sizeof(glm::vec3));
+}
+
+inline LightmapData readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    char fileMagic[8] {};
+    file.read(fileMagic, sizeof(fileMagic));
+    if (!file.is_open() || !std::equal(std::begin(magic), std::end(magic), fileMagic) || read<uint32_t>(file) != version) {
+        throw std::runtime_error("Not a lightmap file: " + path);
+    }
+
+    LightmapData data;
+    data.width = read<uint32_t>(file);
+    data.height = read<uint32_t>(file);
+    data.meshes.resize(read<uint32_t>(file));
+    for (auto& mesh : data.meshes) {
+        mesh.positions.resize(read<uint32_t>(file));
+        mesh.uvs.resize(mesh.positions.size());
+        mesh.indices.resize(read<uint32_t>(file));
+        file.read(reinterpret_cast<char*>(mesh.positions.data()), mesh.positions.size() * sizeof(glm::vec3));
+        file.read(reinterpret_cast<char*>(mesh.uvs.data()), mesh.uvs.size() * sizeof(glm::vec2));
+        file.read(reinterpret_cast<char*>(mesh.indices.data()), mesh.indices.size() * sizeof(uint32_t));
+    }
+    data.texels.resize(static_cast<size_t>(data.width) * data.height);
+    file.read(reinterpret_cast<char*>(data.texels.data()), data.texels.size() * sizeof(glm::vec3));
+    if (!file) {
+        throw std::runtime_error("Truncated lightmap file: " + path);
+    }
+    return data;
+}
+
+}
+
+struct LightmapBakeSettings {
+    unsigned int resolution = 512;
+    // Upper bound, lowered until every chart fits into the atlas.
+    float texelsPerUnit = 16.f;
+    // Faces turned further than this from a chart's first face start a chart of their own.
+    float chartAngleDegrees = 30.f;
+    // Texels around every chart, so bilinear filtering never reaches into a neighbour.
+    unsigned int padding = 2;
+    unsigned int tileSize = 16;
+    unsigned int bounceSamples = 64;
+    // Radiance of rays that leave the scene.
+    glm::vec3 sky = glm::vec3(0.f);
+};
+
+struct LightmapBakeStats {
+    size_t meshes = 0;
+    size_t triangles = 0;
+    size_t charts = 0;
+    size_t texels = 0;
+    float atlasCoverage = 0.f;
+    float texelsPerUnit = 0.f;
+    size_t rays = 0;
+    size_t tiles = 0;
+    size_t tilesStolen = 0;
+    unsigned int threads = 0;
+    float chartMilliseconds = 0.f;
+    float traceMilliseconds = 0.f;
+    float filterMilliseconds = 0.f;
+    float totalMilliseconds = 0.f;
+
+    double raysPerSecond() const { return rays / std::max(traceMilliseconds / 1000.0, 1e-9); }
+};
+
+// Tiles are dealt out in contiguous runs, one deque per worker. Owners take from the front of their own, idle
+// workers steal from the back of someone else's, so neighbouring tiles mostly stay on one thread while the tiles
+// full of geometry still get spread out once the empty ones are done.
+class WorkStealingTiles {
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tiles;
+    };
+    std::vector<std::unique_ptr<Queue>> _queues;
+    std::atomic<size_t> _steals { 0 };
+public:
+    WorkStealingTiles(size_t tileCount, size_t workerCount) {
+        for (size_t i=0; i<workerCount; ++i) {
+            _queues.push_back(std::make_unique<Queue>());
+        }
+        for (size_t tile=0; tile<tileCount; ++tile) {
+            _queues[tile * workerCount / tileCount]->tiles.push_back(tile);
+        }
+    }
+
+    std::optional<size_t> next(size_t worker) {
+        {
+            auto& own = *_queues[worker];
+            std::lock_guard lock(own.mutex);
+            if (!own.tiles.empty()) {
+                const auto tile = own.tiles.front();
+                own.tiles.pop_front();
+                return tile;
+            }
+        }
+        for (size_t i=1; i<_queues.size(); ++i) {
+            auto& victim = *_queues[(worker + i) % _queues.size()];
+            std::lock_guard lock(victim.mutex);
+            if (victim.tiles.empty()) continue;
+            const auto tile = victim.tiles.back();
+            victim.tiles.pop_back();
+            _steals++;
+            return tile;
+        }
+        return std::nullopt;
+    }
+
+    size_t steals() const { return _steals; }
+
+    // worker(index) on every pool thread plus the calling one, returns once all of them ran out of tiles.
+    template<class Function>
+    static void run(ThreadPool& pool, size_t workerCount, Function&& worker) {
+        std::vector<std::future<void>> helpers;
+        for (size_t i=1; i<workerCount; ++i) {
+            helpers.push_back(pool.submit([&worker, i] { worker(i); }));
+        }
+        worker(0);
+        for (auto& helper : helpers) helper.get();
+    }
+};
+
+class LightmapBaker {
+    struct Chart {
+        size_t mesh;
+        std::vector<uint32_t> triangles;
+        glm::vec3 tangent, bitangent;
+        glm::vec2 min = glm::vec2(std::numeric_limits<float>::max());
+        glm::vec2 max = glm::vec2(std::numeric_limits<float>::lowest());
+        // Texels, padding included.
+        glm::ivec2 offset {}, size {};
+        // Where its triangles start in the charted mesh's index buffer.
+        size_t firstIndex = 0;
+    };
+
+    // What an atlas texel sits on. Texels no triangle covers keep chart -1 until dilation fills them.
+    struct Texel {
+        glm::vec3 position;
+        glm::vec3 normal;
+        glm::vec3 faceNormal;
+        int chart = -1;
+    };
+public:
+    struct SourceMesh {
+        std::vector<glm::vec3> positions;
+        std::vector<glm::vec3> normals;
+        std::vector<uint32_t> indices;
+        glm::vec3 albedo = glm::vec3(0.5f);
+    };
+
+    // Same import as Model, so the charts line up with what is drawn. The lights are baked in as they are.
+    static LightmapBakeStats bake(std::string_view sourcePath, const std::string& outputPath, const std::vector<PointLight>& pointLights,
+                                  const std::vector<SpotLight>& spotLights, const LightmapBakeSettings& settings = {}, ThreadPool& pool = ThreadPool::shared()) {
+        Assimp::Importer importer;
+        const aiScene *scene = importer.ReadFile(std::string(sourcePath), aiProcess_Triangulate | aiProcess_FlipUVs);
+        if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
+            throw std::runtime_error("Failed to load Model");
+        }
+        const std::string directory(sourcePath.substr(0, sourcePath.find_last_of('/')));
+
+        std::vector<const aiMesh*> sceneMeshes;
+        collectMeshes(scene->mRootNode, scene, sceneMeshes);
+        std::vector<SourceMesh> meshes;
+        for (const auto* mesh : sceneMeshes) {
+            meshes.push_back(loadMesh(mesh, scene, directory));
+        }
+
+        // A point light is a spot that never cuts off, same as in LightVolume.frag.glsl.
+        std::vector<SpotLight> lights(spotLights);
+        for (const auto& light : pointLights) {
+            SpotLight spot;
+            static_cast<PointLight&>(spot) = light;
+            spot.direction = glm::vec3(0.f, -1.f, 0.f);
+            spot.cutoffStart = -1.f;
+            spot.cutoffEnd = -2.f;
+            lights.push_back(spot);
+        }
+
+        LightmapBakeStats stats;
+        const auto data = bakeMeshes(meshes, lights, settings, pool, stats);
+        LightmapFormat::writeFile(outputPath, data);
+        return stats;
+    }
+
+    static LightmapFormat::LightmapData bakeMeshes(const std::vector<SourceMesh>& meshes, const std::vector<SpotLight>& lights, const LightmapBakeSettings& settings,
+                                                   ThreadPool& pool, LightmapBakeStats& stats) {
+        using Clock = std::chrono::steady_clock;
+        const auto start = Clock::now();
+        const auto millisecondsSince = [](Clock::time_point from) { return std::chrono::duration<float, std::milli>(Clock::now() - from).count(); };
+
+        std::vector<TriangleBvh> bvhs(meshes.size());
+        pool.parallelFor(0, meshes.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t i=begin; i<end; ++i) {
+                bvhs[i] = TriangleBvh(meshes[i].positions, meshes[i].indices, pool);
+            }
+        });
+        std::vector<BvhInstance> instances;
+        Aabb sceneBounds;
+        for (size_t i=0; i<meshes.size(); ++i) {
+            instances.push_back(BvhInstance { &bvhs[i], glm::mat4(1.f), static_cast<unsigned int>(i) });
+            if (!bvhs[i].empty()) sceneBounds.grow(bvhs[i].bounds());
+            stats.triangles += meshes[i].indices.size() / 3;
+        }
+        const SceneBvh scene(instances, pool);
+        // Rays start this far off the surface so they don't hit the triangle they left from.
+        const float bias = sceneBounds.empty() ? 1e-4f : std::max(1e-4f, 1e-4f * glm::length(sceneBounds.max - sceneBounds.min));
+
+        std::vector<Chart> charts;
+        for (size_t i=0; i<meshes.size(); ++i) {
+            buildCharts(meshes[i], i, glm::cos(glm::radians(settings.chartAngleDegrees)), charts);
+        }
+        const unsigned int resolution = settings.resolution;
+        stats.meshes = meshes.size();
+        stats.charts = charts.size();
+        stats.texelsPerUnit = pack(charts, settings);
+
+        LightmapFormat::LightmapData data;
+        data.width = data.height = resolution;
+        data.meshes = chartedMeshes(meshes, charts, stats.texelsPerUnit, settings.padding, resolution);
+
+        std::vector<Texel> texels(static_cast<size_t>(resolution) * resolution);
+        pool.parallelFor(0, charts.size(), 16, [&](size_t begin, size_t end) {
+            for (size_t i=begin; i<end; ++i) rasterize(meshes, data.meshes, charts, static_cast<int>(i), resolution, texels);
+        });
+        size_t chartArea = 0;
+        for (const auto& chart : charts) chartArea += static_cast<size_t>(chart.size.x) * chart.size.y;
+        stats.atlasCoverage = static_cast<float>(chartArea) / (static_cast<float>(resolution) * resolution);
+        stats.texels = std::count_if(texels.begin(), texels.end(), [](const Texel& texel) { return texel.chart >= 0; });
+        stats.chartMilliseconds = millisecondsSince(start);
+
+        // Direct and bounce light are kept apart, only the noisy bounce goes through the filter.
+        const auto traceStart = Clock::now();
+        std::vector<glm::vec3> direct(texels.size()), indirect(texels.size());
+        const unsigned int tilesPerRow = (resolution + settings.tileSize - 1) / settings.tileSize;
+        stats.tiles = static_cast<size_t>(tilesPerRow) * tilesPerRow;
+        stats.threads = static_cast<unsigned int>(pool.size() + 1);
+        WorkStealingTiles tiles(stats.tiles, stats.threads);
+        std::atomic<size_t> rays { 0 };
+        WorkStealingTiles::run(pool, stats.threads, [&](size_t worker) {
+            while (const auto tile = tiles.next(worker)) {
+                std::mt19937 random(static_cast<unsigned int>(*tile));
+                size_t tileRays = 0;
+                const unsigned int x0 = static_cast<unsigned int>(*tile % tilesPerRow) * settings.tileSize;
+                const unsigned int y0 = static_cast<unsigned int>(*tile / tilesPerRow) * settings.tileSize;
+                for (unsigned int y=y0; y<std::min(resolution, y0 + settings.tileSize); ++y) {
+                    for (unsigned int x=x0; x<std::min(resolution, x0 + settings.tileSize); ++x) {
+                        const size_t index = static_cast<size_t>(y) * resolution + x;
+                        const auto& texel = texels[index];
+                        if (texel.chart < 0) continue;
+                        const glm::vec3 origin = texel.position + bias * texel.faceNormal;
+                        direct[index] = directLight(scene, lights, origin, texel.normal, tileRays);
+                        indirect[index] = bounceLight(scene, meshes, lights, origin, texel.normal, settings, bias, random, tileRays);
+                    }
+                }
+                rays += tileRays;
+            }
+        });
+        stats.rays = rays;
+        stats.tilesStolen = tiles.steals();
+        stats.traceMilliseconds = millisecondsSince(traceStart);
+
+        const auto filterStart = Clock::now();
+        indirect = denoise(texels, indirect, resolution, 2.f / stats.texelsPerUnit, pool);
+        data.texels.resize(texels.size());
+        for (size_t i=0; i<texels.size(); ++i) data.texels[i] = direct[i] + indirect[i];
+        dilate(texels, data.texels, resolution, 2 * settings.padding + 2, pool);
+        stats.filterMilliseconds = millisecondsSince(filterStart);
+        stats.totalMilliseconds = millisecondsSince(start);
+        return data;
+    }
+
+private:
+    static void collectMeshes(const aiNode* node, const aiScene* scene, std::vector<const aiMesh*>& meshes) {
+        for (unsigned int i=0; i<node->mNumMeshes; ++i) {
+            meshes.push_back(scene->mMeshes[node->mMeshes[i]]);
+        }
+        for (unsigned int i=0; i<node->mNumChildren; ++i) {
+            collectMeshes(node->mChildren[i], scene, meshes);
+        }
+    }
+
+    static SourceMesh loadMesh(const aiMesh* mesh, const aiScene* scene, const std::string& directory) {
+        SourceMesh result;
+        for (unsigned int v=0; v<mesh->mNumVertices; ++v) {
+            result.positions.emplace_back(mesh->mVertices[v].x, mesh->mVertices[v].y, mesh->mVertices[v].z);
+        }
+        for (unsigned int f=0; f<mesh->mNumFaces; ++f) {
+            const auto& face = mesh->mFaces[f];
+            if (face.mNumIndices != 3) continue;
+            result.indices.insert(result.indices.end(), { face.mIndices[0], face.mIndices[1], face.mIndices[2] });
+        }
+
+        result.normals.assign(result.positions.size(), glm::vec3(0.f));
+        if (mesh->mNormals) {
+            for (unsigned int v=0; v<mesh->mNumVertices; ++v) {
+                result.normals[v] = glm::vec3(mesh->mNormals[v].x, mesh->mNormals[v].y, mesh->mNormals[v].z);
+            }
+        } else {
+            for (size_t i=0; i+2<result.indices.size(); i+=3) {
+                const glm::vec3 normal = faceNormal(result, i / 3);
+                for (int k=0; k<3; ++k) result.normals[result.indices[i + k]] += normal;
+            }
+        }
+        for (auto& normal : result.normals) {
+            const float length = glm::length(normal);
+            normal = length > 0.f ? normal / length : glm::vec3(0.f, 1.f, 0.f);
+        }
+
+        // Bounce light only needs the average color: material color times the mean of its diffuse map.
+        const aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
+        aiColor3D color { 1.f, 1.f, 1.f };
+        if (material->Get(AI_MATKEY_COLOR_DIFFUSE, color) != AI_SUCCESS) color = aiColor3D { 0.5f, 0.5f, 0.5f };
+        result.albedo = glm::vec3(color.r, color.g, color.b);
+        if (material->GetTextureCount(aiTextureType_DIFFUSE) > 0) {
+            aiString path;
+            material->GetTexture(aiTextureType_DIFFUSE, 0, &path);
+            result.albedo *= averageColor(directory + '/' + path.C_Str());
+        }
+        return result;
+    }
+
+    static glm::vec3 averageColor(const std::string& path) {
+        int width, height, channels;
+        unsigned char* pixels = stbi_load(path.c_str(), &width, &height, &channels, 3);
+        if (!pixels) return glm::vec3(0.5f);
+        glm::dvec3 sum(0.0);
+        const size_t count = static_cast<size_t>(width) * height;
+        for (size_t i=0; i<count; ++i) {
+            sum += glm::dvec3(pixels[3*i], pixels[3*i + 1], pixels[3*i + 2]);
+        }
+        stbi_image_free(pixels);
+        return glm::vec3(sum / (255.0 * std::max<size_t>(count, 1)));
+    }
+
+    static glm::vec3 faceNormal(const SourceMesh& mesh, size_t triangle) {
+        const auto& a = mesh.positions[mesh.indices[3*triangle + 0]];
+        const auto& b = mesh.positions[mesh.indices[3*triangle + 1]];
+        const auto& c = mesh.positions[mesh.indices[3*triangle + 2]];
+        return glm::cross(b - a, c - a);
+    }
+
+    // Flood fill over shared edges while faces stay within the angle of the chart's first face, then flatten the
+    // chart onto that face's plane. Positions are welded first, so UV seams of the source don't split charts.
+    static void buildCharts(const SourceMesh& mesh, size_t meshIndex, float cosineThreshold, std::vector<Chart>& charts) {
+        const size_t triangleCount = mesh.indices.size() / 3;
+        std::unordered_map<uint64_t, uint32_t> weldMap;
+        std::vector<uint32_t> welded(mesh.positions.size());
+        for (size_t v=0; v<mesh.positions.size(); ++v) {
+            const glm::ivec3 cell = glm::ivec3(glm::round(mesh.positions[v] * 1e4f)) + glm::ivec3(1 << 20);
+            const uint64_t key = (static_cast<uint64_t>(cell.x & 0x1FFFFF) << 42) | (static_cast<uint64_t>(cell.y & 0x1FFFFF) << 21) | static_cast<uint64_t>(cell.z & 0x1FFFFF);
+            welded[v] = weldMap.try_emplace(key, static_cast<uint32_t>(weldMap.size())).first->second;
+        }
+
+        std::unordered_map<uint64_t, std::vector<uint32_t>> edgeTriangles;
+        const auto edgeKey = [&](uint32_t a, uint32_t b) {
+            a = welded[a];
+            b = welded[b];
+            return (static_cast<uint64_t>(std::min(a, b)) << 32) | std::max(a, b);
+        };
+        std::vector<glm::vec3> normals(triangleCount);
+        for (size_t t=0; t<triangleCount; ++t) {
+            const float length = glm::length(faceNormal(mesh, t));
+            normals[t] = length > 1e-12f ? faceNormal(mesh, t) / length : glm::vec3(0.f);
+            for (int k=0; k<3; ++k) {
+                edgeTriangles[edgeKey(mesh.indices[3*t + k], mesh.indices[3*t + (k + 1) % 3])].push_back(static_cast<uint32_t>(t));
+            }
+        }
+
+        std::vector<bool> assigned(triangleCount, false);
+        for (size_t seed=0; seed<triangleCount; ++seed) {
+            if (assigned[seed]) continue;
+            // Slivers have no direction of their own and go wherever their neighbours go.
+            const glm::vec3 chartNormal = glm::length(normals[seed]) > 0.f ? normals[seed] : glm::vec3(0.f, 1.f, 0.f);
+            Chart chart;
+            chart.mesh = meshIndex;
+            const glm::vec3 helper = std::abs(chartNormal.y) < 0.99f ? glm::vec3(0.f, 1.f, 0.f) : glm::vec3(1.f, 0.f, 0.f);
+            chart.tangent = glm::normalize(glm::cross(helper, chartNormal));
+            chart.bitangent = glm::cross(chartNormal, chart.tangent);
+
+            std::vector<uint32_t> open { static_cast<uint32_t>(seed) };
+            assigned[seed] = true;
+            while (!open.empty()) {
+                const auto t = open.back();
+                open.pop_back();
+                chart.triangles.push_back(t);
+                for (int k=0; k<3; ++k) {
+                    for (const auto neighbour : edgeTriangles[edgeKey(mesh.indices[3*t + k], mesh.indices[3*t + (k + 1) % 3])]) {
+                        if (assigned[neighbour]) continue;
+                        const bool sliver = glm::length(normals[neighbour]) == 0.f;
+                        if (!sliver && glm::dot(normals[neighbour], chartNormal) < cosineThreshold) continue;
+                        assigned[neighbour] = true;
+                        open.push_back(neighbour);
+                    }
+                }
+            }
+
+            for (const auto t : chart.triangles) {
+                for (int k=0; k<3; ++k) {
+                    const auto& position = mesh.positions[mesh.indices[3*t + k]];
+                    const glm::vec2 projected(glm::dot(position, chart.tangent), glm::dot(position, chart.bitangent));
+                    chart.min = glm::min(chart.min, projected);
+                    chart.max = glm::max(chart.max, projected);
+                }
+            }
+            charts.push_back(std::move(chart));
+        }
+    }
+
+    static glm::ivec2 chartSize(const Chart& chart, float texelsPerUnit, unsigned int padding) {
+        // +1 so the far edge still has texel centers on it.
+        const glm::vec2 extent = (chart.max - chart.min) * texelsPerUnit;
+        return glm::ivec2(glm::ceil(extent)) + glm::ivec2(1 + 2 * static_cast<int>(padding));
+    }
+
+    // Shelf packing, tallest first. Starts from a density that would fill most of the atlas and backs off until
+    // everything fits. Returns the texels per world unit it settled on.
+    static float pack(std::vector<Chart>& charts, const LightmapBakeSettings& settings) {
+        const int resolution = static_cast<int>(settings.resolution);
+        double area = 0.0;
+        for (const auto& chart : charts) {
+            const glm::vec2 extent = chart.max - chart.min;
+            area += static_cast<double>(extent.x) * extent.y;
+        }
+        float texelsPerUnit = settings.texelsPerUnit;
+        if (area > 0.0) {
+            texelsPerUnit = std::min(texelsPerUnit, static_cast<float>(std::sqrt(0.7 * resolution * resolution / area)));
+        }
+
+        std::vector<size_t> order(charts.size());
+        for (size_t i=0; i<order.size(); ++i) order[i] = i;
+        while (texelsPerUnit > 1e-6f) {
+            for (auto& chart : charts) chart.size = chartSize(chart, texelsPerUnit, settings.padding);
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return charts[a].size.y > charts[b].size.y; });
+
+            glm::ivec2 cursor(0);
+            int shelfHeight = 0;
+            bool fits = true;
+            for (const auto i : order) {
+                auto& chart = charts[i];
+                if (cursor.x + chart.size.x > resolution) {
+                    cursor = glm::ivec2(0, cursor.y + shelfHeight);
+                    shelfHeight = 0;
+                }
+                if (cursor.x + chart.size.x > resolution || cursor.y + chart.size.y > resolution) {
+                    fits = false;
+                    break;
+                }
+                chart.offset = cursor;
+                cursor.x += chart.size.x;
+                shelfHeight = std::max(shelfHeight, chart.size.y);
+            }
+            if (fits) return texelsPerUnit;
+            texelsPerUnit *= 0.9f;
+        }
+        throw std::runtime_error("Lightmap charts don't fit the atlas");
+    }
+
+    static std::vector<LightmapFormat::ChartedMesh> chartedMeshes(const std::vector<SourceMesh>& meshes, std::vector<Chart>& charts,
+                                                                  float texelsPerUnit, unsigned int padding, unsigned int resolution) {
+        std::vector<LightmapFormat::ChartedMesh> result(meshes.size());
+        for (auto& chart : charts) {
+            const auto& mesh = meshes[chart.mesh];
+            auto& charted = result[chart.mesh];
+            chart.firstIndex = charted.indices.size();
+            std::unordered_map<uint32_t, uint32_t> remap;
+            for (const auto t : chart.triangles) {
+                for (int k=0; k<3; ++k) {
+                    const auto v = mesh.indices[3*t + k];
+                    auto [it, inserted] = remap.try_emplace(v, static_cast<uint32_t>(charted.positions.size()));
+                    if (inserted) {
+                        const auto& position = mesh.positions[v];
+                        const glm::vec2 projected(glm::dot(position, chart.tangent), glm::dot(position, chart.bitangent));
+                        const glm::vec2 texel = (projected - chart.min) * texelsPerUnit + glm::vec2(chart.offset) + glm::vec2(padding + 0.5f);
+                        charted.positions.push_back(position);
+                        charted.uvs.push_back(texel / static_cast<float>(resolution));
+                    }
+                    charted.indices.push_back(it->second);
+                }
+            }
+        }
+        return result;
+    }
+
+    // Texel centers inside a chart's triangles get the surface point under them. Charts never share texels, so
+    // every chart can go on its own thread.
+    static void rasterize(const std::vector<SourceMesh>& meshes, const std::vector<LightmapFormat::ChartedMesh>& charted, const std::vector<Chart>& charts,
+                          int chartIndex, unsigned int resolution, std::vector<Texel>& texels) {
+        const auto& chart = charts[chartIndex];
+        const auto& mesh = meshes[chart.mesh];
+        const auto& output = charted[chart.mesh];
+
+        for (size_t n=0; n<chart.triangles.size(); ++n) {
+            const auto t = chart.triangles[n];
+            glm::vec2 uv[3];
+            for (int k=0; k<3; ++k) uv[k] = output.uvs[output.indices[chart.firstIndex + 3*n + k]] * static_cast<float>(resolution);
+            const float area = (uv[1].x - uv[0].x) * (uv[2].y - uv[0].y) - (uv[2].x - uv[0].x) * (uv[1].y - uv[0].y);
+            if (std::abs(area) < 1e-12f) continue;
+
+            glm::vec3 geometric = faceNormal(mesh, t);
+            geometric = glm::length(geometric) > 0.f ? glm::normalize(geometric) : glm::vec3(0.f, 1.f, 0.f);
+            const glm::ivec2 lower = glm::max(glm::ivec2(glm::floor(glm::min(uv[0], glm::min(uv[1], uv[2])))), glm::ivec2(0));
+            const glm::ivec2 upper = glm::min(glm::ivec2(glm::ceil(glm::max(uv[0], glm::max(uv[1], uv[2])))), glm::ivec2(static_cast<int>(resolution) - 1));
+            for (int y=lower.y; y<=upper.y; ++y) {
+                for (int x=lower.x; x<=upper.x; ++x) {
+                    const glm::vec2 p(x + 0.5f, y + 0.5f);
+                    const float w0 = ((uv[1].x - p.x) * (uv[2].y - p.y) - (uv[2].x - p.x) * (uv[1].y - p.y)) / area;
+                    const float w1 = ((uv[2].x - p.x) * (uv[0].y - p.y) - (uv[0].x - p.x) * (uv[2].y - p.y)) / area;
+                    const float w2 = 1.f - w0 - w1;
+                    if (w0 < 0.f || w1 < 0.f || w2 < 0.f) continue;
+
+                    const auto i0 = mesh.indices[3*t], i1 = mesh.indices[3*t + 1], i2 = mesh.indices[3*t + 2];
+                    auto& texel = texels[static_cast<size_t>(y) * resolution + x];
+                    texel.position = w0 * mesh.positions[i0] + w1 * mesh.positions[i1] + w2 * mesh.positions[i2];
+                    texel.normal = glm::normalize(w0 * mesh.normals[i0] + w1 * mesh.normals[i1] + w2 * mesh.normals[i2] + 1e-6f * geometric);
+                    // Offsets go to whichever side the shading normal is on, meshes here aren't consistently wound.
+                    texel.faceNormal = glm::dot(geometric, texel.normal) < 0.f ? -geometric : geometric;
+                    texel.chart = chartIndex;
+                }
+            }
+        }
+    }
+
+    // Same terms as LightVolume.frag.glsl minus specular, with a shadow ray instead of the shadow map.
+    static glm::vec3 directLight(const SceneBvh& scene, const std::vector<SpotLight>& lights, const glm::vec3& origin, const glm::vec3& normal, size_t& rays) {
+        glm::vec3 irradiance(0.f);
+        for (const auto& light : lights) {
+            const glm::vec3 toLight = light.position - origin;
+            const float distance = glm::length(toLight);
+            if (distance <= 0.f) continue;
+            const float attenuation = 1.f / (light.constant + light.linear * distance + light.quadratic * distance * distance);
+            irradiance += attenuation * light.ambient;
+
+            const glm::vec3 lightDir = toLight / distance;
+            const float diffuse = glm::dot(normal, lightDir);
+            if (diffuse <= 0.f) continue;
+            const float theta = glm::dot(-lightDir, glm::normalize(light.direction));
+            const float cutoff = std::clamp((theta - light.cutoffEnd) / (light.cutoffStart - light.cutoffEnd), 0.f, 1.f);
+            if (cutoff <= 0.f) continue;
+
+            rays++;
+            if (scene.occluded(Ray::segment(origin, light.position))) continue;
+            irradiance += attenuation * cutoff * diffuse * light.diffuse;
+        }
+        return irradiance;
+    }
+
+    // Cosine weighted hemisphere samples. Whatever they hit reflects its albedo times its own direct light.
+    static glm::vec3 bounceLight(const SceneBvh& scene, const std::vector<SourceMesh>& meshes, const std::vector<SpotLight>& lights, const glm::vec3& origin,
+                                 const glm::vec3& normal, const LightmapBakeSettings& settings, float bias, std::mt19937& random, size_t& rays) {
+        if (settings.bounceSamples == 0) return glm::vec3(0.f);
+        std::uniform_real_distribution<float> unit(0.f, 1.f);
+        const glm::vec3 helper = std::abs(normal.y) < 0.99f ? glm::vec3(0.f, 1.f, 0.f) : glm::vec3(1.f, 0.f, 0.f);
+        const glm::vec3 tangent = glm::normalize(glm::cross(helper, normal));
+        const glm::vec3 bitangent = glm::cross(normal, tangent);
+
+        glm::vec3 sum(0.f);
+        for (unsigned int s=0; s<settings.bounceSamples; ++s) {
+            const float u = unit(random), angle = 6.2831853f * unit(random);
+            const float radius = std::sqrt(u);
+            const glm::vec3 direction = radius * std::cos(angle) * tangent + radius * std::sin(angle) * bitangent + std::sqrt(1.f - u) * normal;
+
+            rays++;
+            const RayHit hit = scene.intersect(Ray { origin, direction });
+            if (!hit.hit()) {
+                sum += settings.sky;
+                continue;
+            }
+            const auto& mesh = meshes[hit.mesh];
+            const auto i0 = mesh.indices[3*hit.triangle], i1 = mesh.indices[3*hit.triangle + 1], i2 = mesh.indices[3*hit.triangle + 2];
+            glm::vec3 geometric = faceNormal(mesh, hit.triangle);
+            if (glm::length(geometric) == 0.f) continue;
+            geometric = glm::normalize(geometric);
+            if (glm::dot(geometric, direction) > 0.f) geometric = -geometric;
+            glm::vec3 shading = glm::normalize((1.f - hit.u - hit.v) * mesh.normals[i0] + hit.u * mesh.normals[i1] + hit.v * mesh.normals[i2] + 1e-6f * geometric);
+            if (glm::dot(shading, geometric) < 0.f) shading = -shading;
+
+            const glm::vec3 position = origin + hit.distance * direction + bias * geometric;
+            sum += mesh.albedo * directLight(scene, lights, position, shading, rays);
+        }
+        return sum / static_cast<float>(settings.bounceSamples);
+    }
+
+    // Cross bilateral: neighbours of the same chart, weighted down by normal difference and world distance.
+    static std::vector<glm::vec3> denoise(const std::vector<Texel>& texels, const std::vector<glm::vec3>& light, unsigned int resolution, float worldRadius, ThreadPool& pool) {
+        constexpr int radius = 3;
+        std::vector<glm::vec3> result(light.size());
+        const float inverseDistance = 1.f / (2.f * worldRadius * worldRadius);
+        pool.parallelFor(0, resolution, 16, [&](size_t begin, size_t end) {
+            for (size_t y=begin; y<end; ++y) {
+                for (size_t x=0; x<resolution; ++x) {
+                    const size_t index = y * resolution + x;
+                    const auto& center = texels[index];
+                    if (center.chart < 0) continue;
+                    glm::vec3 sum(0.f);
+                    float weights = 0.f;
+                    for (int dy=-radius; dy<=radius; ++dy) {
+                        for (int dx=-radius; dx<=radius; ++dx) {
+                            const int sx = static_cast<int>(x) + dx, sy = static_cast<int>(y) + dy;
+                            if (sx < 0 || sy < 0 || sx >= static_cast<int>(resolution) || sy >= static_cast<int>(resolution)) continue;
+                            const size_t sample = static_cast<size_t>(sy) * resolution + sx;
+                            const auto& neighbour = texels[sample];
+                            if (neighbour.chart != center.chart) continue;
+                            const glm::vec3 offset = neighbour.position - center.position;
+                            const float facing = std::max(glm::dot(neighbour.normal, center.normal), 0.f);
+                            const float weight = std::pow(facing, 8.f) * std::exp(-glm::dot(offset, offset) * inverseDistance);
+                            sum += weight * light[sample];
+                            weights += weight;
+                        }
+                    }
+                    result[index] = weights > 0.f ? sum / weights : light[index];
+                }
+            }
+        });
+        return result;
+    }
+
+    // Grows every chart outwards a texel per pass with the average of the covered neighbours, so bilinear taps
+    // along chart borders and over uncovered slivers read something sensible instead of black.
+    static void dilate(const std::vector<Texel>& texels, std::vector<glm::vec3>& light, unsigned int resolution, unsigned int passes, ThreadPool& pool) {
+        std::vector<uint8_t> covered(texels.size());
+        for (size_t i=0; i<texels.size(); ++i) covered[i] = texels[i].chart >= 0;
+        for (unsigned int pass=0; pass<passes; ++pass) {
+            auto nextCovered = covered;
+            auto nextLight = light;
+            pool.parallelFor(0, resolution, 16, [&](size_t begin, size_t end) {
+                for (size_t y=begin; y<end; ++y) {
+                    for (size_t x=0; x<resolution; ++x) {
+                        const size_t index = y * resolution + x;
+                        if (covered[index]) continue;
+                        glm::vec3 sum(0.f);
+                        int count = 0;
+                        for (int dy=-1; dy<=1; ++dy) {
+                            for (int dx=-1; dx<=1; ++dx) {
+                                const int sx = static_cast<int>(x) + dx, sy = static_cast<int>(y) + dy;
+                                if (sx < 0 || sy < 0 || sx >= static_cast<int>(resolution) || sy >= static_cast<int>(resolution)) continue;
+                                const size_t sample = static_cast<size_t>(sy) * resolution + sx;
+                                if (!covered[sample]) continue;
+                                sum += light[sample];
+                                count++;
+                            }
+                        }
+                        if (count == 0) continue;
+                        nextLight[index] = sum / static_cast<float>(count);
+                        nextCovered[index] = 1;
+                    }
+                }
+            });
+            covered = std::move(nextCovered);
+            light = std::move(nextLight);
+        }
+    }
+};
+
+// Runtime side: the charted meshes with their lightmap UVs and the atlas as a texture. Drawn over the lit buffer
+// after the resolve, see DeferredLighting::setLightmap.
+class Lightmap {
+    constexpr static auto modelName = std::string_view("model");
+    constexpr static auto viewName = std::string_view("view");
+    constexpr static auto projectionName = std::string_view("projection");
+    constexpr static auto gAlbedoName = std::string_view("gAlbedo");
+    constexpr static auto lightmapName = std::string_view("lightmap");
+    constexpr static auto intensityName = std::string_view("intensity");
+    constexpr static auto temporalHistoryName = std::string_view("temporalHistory");
+    constexpr static auto temporalReuseName = std::string_view("temporalReuse");
+    // 0-7 are taken by the G-buffer, the light buffers and the shadow map.
+    constexpr static int lightmapUnit = 8;
+
+    unsigned int _texture = 0;
+    unsigned int _width = 0, _height = 0;
+    std::vector<VertexDataBase> _meshes;
+    ShaderProgram _program;
+    size_t _watch;
+    float _intensity = 1.f;
+public:
+    explicit Lightmap(const std::string& path) {
+        const auto data = LightmapFormat::readFile(path);
+        _width = data.width;
+        _height = data.height;
+
+        glGenTextures(1, &_texture);
+        glBindTexture(GL_TEXTURE_2D, _texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, _width, _height, 0, GL_RGB, GL_FLOAT, data.texels.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        for (const auto& mesh : data.meshes) {
+            if (mesh.indices.empty()) continue;
+            const std::vector<unsigned int> indices(mesh.indices.begin(), mesh.indices.end());
+            _meshes.push_back(VertexData<Layout::Sequential, Vec3, Vec2>(indices, mesh.positions.size(),
+                reinterpret_cast<const float*>(mesh.positions.data()), reinterpret_cast<const float*>(mesh.uvs.data())));
+        }
+
+        _watch = ShaderCompiler::shared().compile(_program, "Lightmap/Lightmap.vert.glsl", "Lightmap/Lightmap.frag.glsl", [](ShaderProgram& program) {
+            program.set(gAlbedoName, 1);
+            program.set(lightmapName, lightmapUnit);
+            program.set(temporalHistoryName, TemporalReuse::historyUnit);
+        });
+    }
+
+    ~Lightmap() {
+        // Rebaking replaces the whole Lightmap, a reload must not land in this one afterwards.
+        ShaderCompiler::shared().unwatch(_watch);
+        ShaderCompiler::shared().cancel(_program);
+        glDeleteTextures(1, &_texture);
+        for (auto& mesh : _meshes) mesh.release();
+    }
+
+    Lightmap(const Lightmap& other) = delete;
+    Lightmap& operator=(const Lightmap& other) = delete;
+
+    void setIntensity(float intensity) { _intensity = intensity; }
+    unsigned int width() const { return _width; }
+    unsigned int height() const { return _height; }
+
+    // Blending and depth state are the caller's, the G-buffer albedo is expected on unit 1. With TemporalReuse on its
+    // reprojection is on TemporalReuse::historyUnit and those pixels are skipped.
+    void draw(const glm::mat4& view, const glm::mat4& projection, bool temporalReuse = false) {
+        _program.use();
+        _program.set(temporalReuseName, temporalReuse);
+        _program.set(modelName, glm::mat4(1.f));
+        _program.set(viewName, view);
+        _program.set(projectionName, projection);
+        _program.set(intensityName, _intensity);
+        glActiveTexture(GL_TEXTURE0 + lightmapUnit);
+        glBindTexture(GL_TEXTURE_2D, _texture);
+        for (const auto& mesh : _meshes) {
+            VertexDataBase::ScopedBinding binding(mesh);
+            glDrawElements(GL_TRIANGLES, mesh.vertexCount(), GL_UNSIGNED_INT, 0);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glActiveTexture(GL_TEXTURE0);
+    }
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+struct PointLight {
+    glm::vec3 position;
+    glm::vec3 ambient;
+    glm::vec3 diffuse;
+    glm::vec3 specular;
+
+    float constant = 1.f;
+    float linear = 0.09f;
+    float quadratic = 0.032f;
+
+    // Slot from ShadowMaps::add, -1 for lights that don't cast shadows.
+    int shadowMap = -1;
+};
+
+struct SpotLight : PointLight {
+    glm::vec3 direction;
+    float cutoffStart;
+    float cutoffEnd;
+};
+
+// Distance at which the light drops below what an 8 bit channel can show.
+inline float attenuationRange(const PointLight& light, const float maxRange = 100.f) {
+    const glm::vec3 brightest = glm::max(light.ambient, glm::max(light.diffuse, light.specular));
+    const float intensity = std::max(brightest.x, std::max(brightest.y, brightest.z));
+    // constant + linear*d + quadratic*d^2 = intensity * 256
+    const float target = intensity * 256.f - light.constant;
+    if (target <= 0.f) return 0.f;
+    if (light.quadratic > 0.f) {
+        return std::min(maxRange, (-light.linear + std::sqrt(light.linear * light.linear + 4.f * light.quadratic * target)) / (2.f * light.quadratic));
+    }
+    if (light.linear > 0.f) {
+        return std::min(maxRange, target / light.linear);
+    }
+    return maxRange;
+}
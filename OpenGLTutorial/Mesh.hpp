@@ -4,11 +4,15 @@
 #include <string_view>
 #include <vector>
 #include <string>
+#include <algorithm>
 #include <array>
+#include <functional>
 
 #include "stb_image_proxy.hpp"
 #include "ShaderProgram.hpp"
+#include "ShaderPermutations.hpp"
 #include "VertexData.hpp"
+#include "Meshlet.hpp"
 
 enum class TextureType : uint8_t {
     Diffuse = 0,
@@ -48,6 +52,9 @@ struct Texture {
         glBindTexture(GL_TEXTURE_2D, 0);
     }
 
+    // Already uploaded by someone else (e.g. TextureStreamer).
+    Texture(unsigned int id, int width, int height, TextureType type) : id(id), width(width), height(height), type(type) {}
+
     operator unsigned int() {
         return id;
     }
@@ -74,13 +81,54 @@ class Mesh {
 
     VertexDataBase _vertexData;
     std::vector<Texture> _textures;
+    MeshletData _meshletData;
+    std::vector<bool> _visibleMeshlets;
+    std::vector<unsigned int> _visibleIndices;
 public:
     
-    Mesh(VertexDataBase vertexData, std::vector<Texture> textures)
+    Mesh(VertexDataBase vertexData, std::vector<Texture> textures, MeshletData meshletData = {})
     : _vertexData(vertexData),
-      _textures(std::move(textures))
+      _textures(std::move(textures)),
+      _meshletData(std::move(meshletData)),
+      _visibleMeshlets(_meshletData.meshlets.size(), true)
     {}
 
+    // Culls meshlets and rebuilds the index stream if the visible set changed since the last call.
+    // Meshes without meshlets are left alone.
+    MeshletStats updateVisibility(const MeshletCullingContext& context) {
+        MeshletStats stats;
+        if (_meshletData.meshlets.empty()) return stats;
+
+        const MeshletCuller culler(context);
+        bool changed = false;
+        for (size_t i=0; i<_meshletData.meshlets.size(); ++i) {
+            const auto& meshlet = _meshletData.meshlets[i];
+            const auto visibility = culler.classify(meshlet);
+            const bool visible = visibility == MeshletVisibility::Visible;
+
+            stats.meshlets++;
+            stats.triangles += meshlet.triangleCount;
+            if (visible) stats.visibleMeshlets++;
+            if (visibility == MeshletVisibility::OutsideFrustum) stats.frustumRejectedTriangles += meshlet.triangleCount;
+            if (visibility == MeshletVisibility::BackFacing) stats.coneRejectedTriangles += meshlet.triangleCount;
+
+            changed |= _visibleMeshlets[i] != visible;
+            _visibleMeshlets[i] = visible;
+        }
+
+        if (changed) {
+            _visibleIndices.clear();
+            for (size_t i=0; i<_meshletData.meshlets.size(); ++i) {
+                if (!_visibleMeshlets[i]) continue;
+                const auto& meshlet = _meshletData.meshlets[i];
+                const auto begin = _meshletData.indices.begin() + meshlet.indexOffset;
+                _visibleIndices.insert(_visibleIndices.end(), begin, begin + 3 * meshlet.triangleCount);
+            }
+            _vertexData.setIndices(_visibleIndices);
+        }
+        return stats;
+    }
+
     void Draw(ShaderProgram& shader) {
         std::array<int, static_cast<size_t>(TextureType::SIZE)> textureCounters{};
         
@@ -102,7 +150,62 @@ public:
         glBindTexture(GL_TEXTURE_2D, 0);
         glActiveTexture(GL_TEXTURE0);
 
+        if (_vertexData.vertexCount() == 0) return;
         VertexDataBase::ScopedBinding bind(_vertexData);
         glDrawElements(GL_TRIANGLES, _vertexData.vertexCount(), GL_UNSIGNED_INT, 0);
     }
-};
\ No newline at end of file
+
+    const std::vector<Texture>& textures() const {
+        return _textures;
+    }
+
+    bool hasTexture(TextureType type) const {
+        return std::any_of(_textures.begin(), _textures.end(), [type](const Texture& texture) { return texture.type == type; });
+    }
+
+    // Features phong.frag.glsl needs for the maps this mesh actually has.
+    uint32_t materialFeatures(const ShaderPermutations& permutations) const {
+        return hasTexture(TextureType::Specular) ? permutations.feature("SPECULAR_MAP") : 0;
+    }
+
+    // Before any meshlet culling.
+    size_t triangleCount() const {
+        return _meshletData.indices.empty() ? _vertexData.vertexCount() / 3 : _meshletData.indices.size() / 3;
+    }
+
+    // Frees the GPU buffers, textures are shared between meshes and stay.
+    void release() {
+        _vertexData.release();
+    }
+
+    // Position-only stream, no textures bound.
+    void DrawDepth() {
+        if (_vertexData.vertexCount() == 0) return;
+        VertexDataBase::ScopedPositionBinding bind(_vertexData);
+        glDrawElements(GL_TRIANGLES, _vertexData.vertexCount(), GL_UNSIGNED_INT, 0);
+    }
+};
+
+// Draws each mesh with the cheapest variant its textures allow. Programs only switch when the variant does,
+// bind sets up the per-frame uniforms of whichever variant just became current.
+class MeshVariantDrawer {
+    ShaderPermutations& _permutations;
+    uint32_t _features;
+    std::function<void(ShaderProgram&)> _bind;
+    ShaderProgram* _current = nullptr;
+    uint32_t _currentFeatures = 0;
+public:
+    MeshVariantDrawer(ShaderPermutations& permutations, uint32_t features, std::function<void(ShaderProgram&)> bind)
+    : _permutations(permutations), _features(features), _bind(std::move(bind)) {}
+
+    void operator()(Mesh& mesh) {
+        const uint32_t features = _features | mesh.materialFeatures(_permutations);
+        if (!_current || features != _currentFeatures) {
+            _current = &_permutations.get(features);
+            _currentFeatures = features;
+            _current->use();
+            _bind(*_current);
+        }
+        mesh.Draw(*_current);
+    }
+};
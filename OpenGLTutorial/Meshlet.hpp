@@ -0,0 +1,261 @@
+#pragma once
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cmath>
+#include <limits>
+
+#include "Frustum.hpp"
+
+// Small cluster of triangles that is culled as a whole.
+// Triangles of a meshlet are stored contiguously in MeshletData::indices.
+struct Meshlet {
+    unsigned int indexOffset;
+    unsigned int triangleCount;
+    unsigned int vertexCount;
+
+    glm::vec3 center;
+    float radius;
+
+    // Cone containing all triangle normals, coneCutoff is sin of its half-angle.
+    // 1.0 means the normals are too spread to ever reject the meshlet.
+    glm::vec3 coneAxis;
+    float coneCutoff;
+};
+
+struct MeshletData {
+    std::vector<Meshlet> meshlets;
+    std::vector<unsigned int> indices;
+};
+
+struct MeshletCullingContext {
+    Frustum frustum;
+    glm::vec3 cameraPosition;
+    glm::mat4 model = glm::mat4(1.f);
+    bool frustumCulling = true;
+    bool coneCulling = true;
+};
+
+struct MeshletStats {
+    size_t meshlets = 0;
+    size_t visibleMeshlets = 0;
+    size_t triangles = 0;
+    size_t frustumRejectedTriangles = 0;
+    size_t coneRejectedTriangles = 0;
+
+    float rejectedFraction() const {
+        if (triangles == 0) return 0.f;
+        return static_cast<float>(frustumRejectedTriangles + coneRejectedTriangles) / static_cast<float>(triangles);
+    }
+
+    MeshletStats& operator+=(const MeshletStats& other) {
+        meshlets += other.meshlets;
+        visibleMeshlets += other.visibleMeshlets;
+        triangles += other.triangles;
+        frustumRejectedTriangles += other.frustumRejectedTriangles;
+        coneRejectedTriangles += other.coneRejectedTriangles;
+        return *this;
+    }
+};
+
+enum class MeshletVisibility : uint8_t {
+    Visible,
+    OutsideFrustum,
+    BackFacing
+};
+
+// Culling context with the per-draw parts (normal matrix, scale) resolved once.
+class MeshletCuller {
+    const MeshletCullingContext& _context;
+    glm::mat3 _normalMatrix;
+    float _scale;
+public:
+    MeshletCuller(const MeshletCullingContext& context)
+    : _context(context),
+      _normalMatrix(glm::transpose(glm::inverse(glm::mat3(context.model))))
+    {
+        _scale = std::sqrt(std::max(
+            glm::dot(context.model[0], context.model[0]),
+            std::max(glm::dot(context.model[1], context.model[1]), glm::dot(context.model[2], context.model[2]))
+        ));
+    }
+
+    MeshletVisibility classify(const Meshlet& meshlet) const {
+        const glm::vec3 center = glm::vec3(_context.model * glm::vec4(meshlet.center, 1.f));
+        const float radius = meshlet.radius * _scale;
+
+        if (_context.frustumCulling && !_context.frustum.intersectsSphere(center, radius)) {
+            return MeshletVisibility::OutsideFrustum;
+        }
+
+        if (_context.coneCulling && meshlet.coneCutoff < 1.f) {
+            const glm::vec3 axis = glm::normalize(_normalMatrix * meshlet.coneAxis);
+            const glm::vec3 toCenter = center - _context.cameraPosition;
+            if (glm::dot(toCenter, axis) >= meshlet.coneCutoff * glm::length(toCenter) + radius) {
+                return MeshletVisibility::BackFacing;
+            }
+        }
+        return MeshletVisibility::Visible;
+    }
+};
+
+// Greedy clustering: grow a meshlet through shared vertices, preferring triangles which add the fewest new
+// vertices and then the ones facing the same way as the meshlet so far (tighter normal cones).
+class MeshletBuilder {
+public:
+    constexpr static size_t maxVertices = 64;
+    constexpr static size_t maxTriangles = 124;
+
+    static MeshletData build(const std::vector<glm::vec3>& positions, const std::vector<unsigned int>& indices) {
+        const size_t triangleCount = indices.size() / 3;
+        const size_t vertexCount = positions.size();
+
+        std::vector<glm::vec3> faceNormals(triangleCount);
+        for (size_t t=0; t<triangleCount; ++t) {
+            const auto& a = positions[indices[3*t + 0]];
+            const auto& b = positions[indices[3*t + 1]];
+            const auto& c = positions[indices[3*t + 2]];
+            const glm::vec3 normal = glm::cross(b - a, c - a);
+            const float area = glm::length(normal);
+            faceNormals[t] = area > 0.f ? normal / area : glm::vec3(0.f);
+        }
+
+        // Vertex -> triangles adjacency, compressed.
+        std::vector<unsigned int> adjacencyOffsets(vertexCount + 1, 0);
+        for (const auto index : indices) {
+            adjacencyOffsets[index + 1]++;
+        }
+        for (size_t v=0; v<vertexCount; ++v) {
+            adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+        }
+        std::vector<unsigned int> adjacency(indices.size());
+        {
+            std::vector<unsigned int> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+            for (size_t i=0; i<indices.size(); ++i) {
+                adjacency[fill[indices[i]]++] = static_cast<unsigned int>(i / 3);
+            }
+        }
+
+        MeshletData result;
+        result.indices.reserve(indices.size());
+
+        constexpr auto noMeshlet = std::numeric_limits<unsigned int>::max();
+        std::vector<unsigned int> vertexOwner(vertexCount, noMeshlet);
+        std::vector<bool> emitted(triangleCount, false);
+        std::vector<unsigned int> meshletVertices;
+        std::vector<unsigned int> meshletTriangles;
+        size_t seedCursor = 0;
+
+        while (true) {
+            while (seedCursor < triangleCount && emitted[seedCursor]) ++seedCursor;
+            if (seedCursor == triangleCount) break;
+
+            const auto meshletIndex = static_cast<unsigned int>(result.meshlets.size());
+            meshletVertices.clear();
+            meshletTriangles.clear();
+            glm::vec3 normalSum(0.f);
+
+            const auto newVertices = [&](unsigned int triangle) {
+                int count = 0;
+                for (int k=0; k<3; ++k) {
+                    count += vertexOwner[indices[3*triangle + k]] != meshletIndex;
+                }
+                return count;
+            };
+
+            const auto addTriangle = [&](unsigned int triangle) {
+                for (int k=0; k<3; ++k) {
+                    const auto vertex = indices[3*triangle + k];
+                    if (vertexOwner[vertex] != meshletIndex) {
+                        vertexOwner[vertex] = meshletIndex;
+                        meshletVertices.push_back(vertex);
+                    }
+                }
+                meshletTriangles.push_back(triangle);
+                emitted[triangle] = true;
+                normalSum += faceNormals[triangle];
+            };
+
+            addTriangle(static_cast<unsigned int>(seedCursor));
+
+            while (meshletTriangles.size() < maxTriangles) {
+                unsigned int best = noMeshlet;
+                int bestNewVertices = 4;
+                float bestAlignment = -2.f;
+                const float normalSumLength = glm::length(normalSum);
+                const glm::vec3 direction = normalSumLength > 0.f ? normalSum / normalSumLength : glm::vec3(0.f);
+
+                for (const auto vertex : meshletVertices) {
+                    for (auto a=adjacencyOffsets[vertex]; a<adjacencyOffsets[vertex + 1]; ++a) {
+                        const auto candidate = adjacency[a];
+                        if (emitted[candidate]) continue;
+
+                        const int added = newVertices(candidate);
+                        if (meshletVertices.size() + added > maxVertices) continue;
+
+                        const float alignment = glm::dot(direction, faceNormals[candidate]);
+                        if (added < bestNewVertices || (added == bestNewVertices && alignment > bestAlignment)) {
+                            best = candidate;
+                            bestNewVertices = added;
+                            bestAlignment = alignment;
+                        }
+                    }
+                }
+                if (best == noMeshlet) break;
+                addTriangle(best);
+            }
+
+            Meshlet meshlet {};
+            meshlet.indexOffset = static_cast<unsigned int>(result.indices.size());
+            meshlet.triangleCount = static_cast<unsigned int>(meshletTriangles.size());
+            meshlet.vertexCount = static_cast<unsigned int>(meshletVertices.size());
+            for (const auto triangle : meshletTriangles) {
+                result.indices.insert(result.indices.end(), indices.begin() + 3*triangle, indices.begin() + 3*triangle + 3);
+            }
+            computeBounds(meshlet, positions, meshletVertices, faceNormals, meshletTriangles);
+            result.meshlets.push_back(meshlet);
+        }
+
+        return result;
+    }
+
+private:
+    static void computeBounds(
+        Meshlet& meshlet,
+        const std::vector<glm::vec3>& positions,
+        const std::vector<unsigned int>& vertices,
+        const std::vector<glm::vec3>& faceNormals,
+        const std::vector<unsigned int>& triangles)
+    {
+        glm::vec3 boxMin(std::numeric_limits<float>::max());
+        glm::vec3 boxMax(std::numeric_limits<float>::lowest());
+        for (const auto vertex : vertices) {
+            boxMin = glm::min(boxMin, positions[vertex]);
+            boxMax = glm::max(boxMax, positions[vertex]);
+        }
+        meshlet.center = 0.5f * (boxMin + boxMax);
+        meshlet.radius = 0.f;
+        for (const auto vertex : vertices) {
+            meshlet.radius = std::max(meshlet.radius, glm::length(positions[vertex] - meshlet.center));
+        }
+
+        glm::vec3 axis(0.f);
+        for (const auto triangle : triangles) {
+            axis += faceNormals[triangle];
+        }
+        const float axisLength = glm::length(axis);
+        meshlet.coneAxis = axisLength > 0.f ? axis / axisLength : glm::vec3(0.f, 0.f, 1.f);
+        meshlet.coneCutoff = 1.f;
+        if (axisLength == 0.f) return;
+
+        float minDot = 1.f;
+        for (const auto triangle : triangles) {
+            if (faceNormals[triangle] == glm::vec3(0.f)) continue; // degenerate, never rasterized
+            minDot = std::min(minDot, glm::dot(meshlet.coneAxis, faceNormals[triangle]));
+        }
+        // Past ~85 degrees the cone is too wide to ever reject anything.
+        if (minDot > 0.1f) {
+            meshlet.coneCutoff = std::sqrt(1.f - minDot * minDot);
+        }
+    }
+};
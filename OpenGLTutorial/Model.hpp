@@ -6,14 +6,29 @@
 
 #include "Mesh.hpp"
 #include "ShaderProgram.hpp"
+#include "Bvh.hpp"
+#include "ThreadPool.hpp"
+#include "TextureStreaming.hpp"
 
 
 class Model {
+    struct MeshGeometry {
+        std::vector<glm::vec3> positions;
+        std::vector<unsigned int> indices;
+    };
+
     std::vector<Mesh> _meshes;
+    std::vector<TriangleBvh> _bvhs;
+    std::vector<MeshGeometry> _pendingGeometry;
+    std::vector<TexelDensity> _texelDensities;
     std::string _directory;
+    TextureStreamer* _textureStreamer = nullptr;
 public:
 
-    Model(std::string_view filepath) {
+    // With a streamer the textures are shared per file and only get the mips the camera asks for.
+    Model(std::string_view filepath, TextureStreamer* textureStreamer = nullptr)
+    : _textureStreamer(textureStreamer)
+    {
         loadModel(filepath);
     }
 
@@ -22,6 +37,45 @@ public:
             mesh.Draw(shader);
         }
     }
+
+    void Draw(MeshVariantDrawer& draw) {
+        for (auto& mesh : _meshes) {
+            draw(mesh);
+        }
+    }
+
+    void DrawDepth() {
+        for (auto& mesh : _meshes) {
+            mesh.DrawDepth();
+        }
+    }
+
+    const std::vector<Mesh>& meshes() const {
+        return _meshes;
+    }
+
+    // One per mesh, same order as they are drawn. Triangle indices match the mesh index buffer.
+    const std::vector<TriangleBvh>& bvhs() const {
+        return _bvhs;
+    }
+
+    // Tells the streamer how fine each texture needs to be for this frame.
+    void requestTextureMips(const MipRequestContext& context) const {
+        if (!_textureStreamer) return;
+        for (size_t i=0; i<_meshes.size(); ++i) {
+            for (const auto& texture : _meshes[i].textures()) {
+                _textureStreamer->request(texture.id, requiredMipLevel(_texelDensities[i], context, std::max(texture.width, texture.height)));
+            }
+        }
+    }
+
+    MeshletStats updateVisibility(const MeshletCullingContext& context) {
+        MeshletStats stats;
+        for (auto& mesh : _meshes) {
+            stats += mesh.updateVisibility(context);
+        }
+        return stats;
+    }
 private:
     void loadModel(std::string_view filepath) {
         Assimp::Importer importer;
@@ -32,6 +86,18 @@ private:
         }
         _directory = filepath.substr(0, filepath.find_last_of('/'));
         processNode(scene->mRootNode, scene);
+        buildBvhs();
+    }
+
+    void buildBvhs() {
+        auto& pool = ThreadPool::shared();
+        _bvhs.resize(_pendingGeometry.size());
+        pool.parallelFor(0, _pendingGeometry.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t i=begin; i<end; ++i) {
+                _bvhs[i] = TriangleBvh(_pendingGeometry[i].positions, _pendingGeometry[i].indices, pool);
+            }
+        });
+        _pendingGeometry.clear();
     }
 
     void processNode(aiNode *node, const aiScene *scene) {
@@ -50,13 +116,23 @@ private:
         std::vector<unsigned int> indices;
         for (int i=0; i<mesh->mNumFaces; ++i) {
             const auto& face = mesh->mFaces[i];
+            if (face.mNumIndices != 3) continue; // stray points/lines, we only draw triangles
             for (int j=0; j<face.mNumIndices; ++j) {
                 indices.push_back(face.mIndices[j]);
             }
         }
 
-        VertexDataBase vertexData;
         const size_t numberOfVertices = mesh->mNumVertices;
+        std::vector<glm::vec3> positions(numberOfVertices);
+        for (int i=0; i<numberOfVertices; ++i) {
+            positions[i] = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
+        }
+        // Triangles get reordered meshlet by meshlet, the stream uploaded here is the "everything visible" one.
+        auto meshletData = MeshletBuilder::build(positions, indices);
+        indices = meshletData.indices;
+        _pendingGeometry.push_back(MeshGeometry { positions, indices });
+
+        VertexDataBase vertexData;
         const float* vertices = reinterpret_cast<float*>(mesh->mVertices);
         const float* normals = reinterpret_cast<float*>(mesh->mNormals);
         bool hasUvs = mesh->mTextureCoords[0];
@@ -68,8 +144,10 @@ private:
                 convertedUVs[i].y = uvs[i].y;
             }
             vertexData = VertexData<Layout::Sequential, Vec3, Vec3, Vec2>(indices, numberOfVertices, vertices, normals, reinterpret_cast<float*>(convertedUVs.data()));
+            _texelDensities.push_back(TexelDensity::measure(positions, convertedUVs, indices));
         } else {
             vertexData = VertexData<Layout::Sequential, Vec3, Vec3>(indices, numberOfVertices, vertices, normals);
+            _texelDensities.emplace_back();
         } 
 
         std::vector<Texture> textures;
@@ -83,7 +161,7 @@ private:
             textures.insert(textures.end(), normalMaps.begin(), normalMaps.end());
         }
 
-        return Mesh(vertexData, std::move(textures));
+        return Mesh(vertexData, std::move(textures), std::move(meshletData));
     }
 
     std::vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type, TextureType typeName) {
@@ -91,7 +169,11 @@ private:
         for (int i=0; i<mat->GetTextureCount(type); ++i) {
             aiString str;
             mat->GetTexture(type, i, &str);
-            textures.emplace_back(_directory + '/' + str.C_Str(), typeName);
+            if (_textureStreamer) {
+                textures.push_back(_textureStreamer->load(_directory + '/' + str.C_Str(), typeName));
+            } else {
+                textures.emplace_back(_directory + '/' + str.C_Str(), typeName);
+            }
         }
         return textures;
     }
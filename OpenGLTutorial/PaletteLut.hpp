@@ -0,0 +1,171 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ThreadPool.hpp"
+
+struct Palette {
+    std::string name;
+    // sRGB, 0..1.
+    std::vector<glm::vec3> colors;
+
+    static glm::vec3 hex(uint32_t rgb) {
+        return glm::vec3((rgb >> 16) & 0xFF, (rgb >> 8) & 0xFF, rgb & 0xFF) / 255.f;
+    }
+
+    static std::vector<Palette> builtIn() {
+        std::vector<Palette> palettes;
+        palettes.push_back(Palette { "Game Boy", { hex(0x0F380F), hex(0x306230), hex(0x8BAC0F), hex(0x9BBC0F) } });
+        palettes.push_back(Palette { "CGA", { hex(0x000000), hex(0x55FFFF), hex(0xFF55FF), hex(0xFFFFFF) } });
+        palettes.push_back(Palette { "PICO-8", {
+            hex(0x000000), hex(0x1D2B53), hex(0x7E2553), hex(0x008751), hex(0xAB5236), hex(0x5F574F), hex(0xC2C3C7), hex(0xFFF1E8),
+            hex(0xFF004D), hex(0xFFA300), hex(0xFFEC27), hex(0x00E436), hex(0x29ADFF), hex(0x83769C), hex(0xFF77A8), hex(0xFFCCAA)
+        } });
+        // Six levels a channel plus the grays in between, as big as an 8 bit index goes.
+        Palette web { "Web safe + grays", {} };
+        for (int b=0; b<6; ++b) {
+            for (int g=0; g<6; ++g) {
+                for (int r=0; r<6; ++r) web.colors.push_back(glm::vec3(r, g, b) / 5.f);
+            }
+        }
+        for (int i=1; i<=40; ++i) web.colors.push_back(glm::vec3(i / 41.f));
+        palettes.push_back(std::move(web));
+        return palettes;
+    }
+};
+
+// Nearest palette color for every cell of an RGB grid, so quantizing a pixel is a single 3D texture fetch no matter
+// how many colors there are. Distances are measured in Oklab rather than RGB, which is what makes the nearest color
+// look like the nearest one.
+class PaletteLut {
+public:
+    static glm::vec3 srgbToOklab(const glm::vec3& srgb) {
+        const auto linear = [](float c) { return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f); };
+        return linearToOklab(glm::vec3(linear(srgb.r), linear(srgb.g), linear(srgb.b)));
+    }
+
+    // size^3 palette indices, red fastest then green then blue, the layout glTexImage3D takes. Cell i along an axis
+    // stands for i / (size - 1).
+    static std::vector<uint8_t> build(const std::vector<glm::vec3>& colors, int size, ThreadPool& pool = ThreadPool::shared()) {
+        if (colors.empty() || colors.size() > 256) throw std::runtime_error("Palettes take 1 to 256 colors");
+        size = std::max(size, 2);
+
+        // Sorted by lightness, the search walks out from the closest L both ways and stops a side once the L
+        // difference alone is worse than the best so far. Big palettes only ever look at a handful of colors.
+        struct Entry {
+            glm::vec3 lab;
+            uint8_t index;
+        };
+        std::vector<Entry> palette;
+        for (size_t i=0; i<colors.size(); ++i) palette.push_back(Entry { srgbToOklab(colors[i]), static_cast<uint8_t>(i) });
+        std::sort(palette.begin(), palette.end(), [](const Entry& a, const Entry& b) { return a.lab.x < b.lab.x; });
+        // Linearizing is per channel, so each axis only needs it once per level.
+        std::vector<float> levels(size);
+        for (int i=0; i<size; ++i) {
+            const float c = static_cast<float>(i) / static_cast<float>(size - 1);
+            levels[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+
+        std::vector<uint8_t> indices(static_cast<size_t>(size) * size * size);
+        pool.parallelFor(0, size, 1, [&](size_t begin, size_t end) {
+            for (size_t b=begin; b<end; ++b) {
+                for (int g=0; g<size; ++g) {
+                    uint8_t* row = indices.data() + (b * size + g) * size;
+                    for (int r=0; r<size; ++r) {
+                        const auto lab = linearToOklab(glm::vec3(levels[r], levels[g], levels[b]));
+                        const auto start = std::lower_bound(palette.begin(), palette.end(), lab.x, [](const Entry& entry, float l) { return entry.lab.x < l; }) - palette.begin();
+                        float best = std::numeric_limits<float>::max();
+                        const auto consider = [&](const Entry& entry) {
+                            const auto difference = lab - entry.lab;
+                            const float distance = glm::dot(difference, difference);
+                            if (distance < best) {
+                                best = distance;
+                                row[r] = entry.index;
+                            }
+                        };
+                        bool up = true, down = true;
+                        for (ptrdiff_t step=0; up || down; ++step) {
+                            const ptrdiff_t above = start + step, below = start - step - 1;
+                            if (up && above < static_cast<ptrdiff_t>(palette.size())) {
+                                const float l = palette[above].lab.x - lab.x;
+                                if (l * l >= best) up = false;
+                                else consider(palette[above]);
+                            } else {
+                                up = false;
+                            }
+                            if (down && below >= 0) {
+                                const float l = lab.x - palette[below].lab.x;
+                                if (l * l >= best) down = false;
+                                else consider(palette[below]);
+                            } else {
+                                down = false;
+                            }
+                        }
+                    }
+                }
+            }
+        });
+        return indices;
+    }
+
+    // Mean distance from each color to its closest neighbour, per RGB channel. About how far the ordered dither has to
+    // push a pixel for it to land on another color.
+    static float spacing(const std::vector<glm::vec3>& colors) {
+        if (colors.size() < 2) return 0.f;
+        float total = 0.f;
+        for (size_t i=0; i<colors.size(); ++i) {
+            float nearest = std::numeric_limits<float>::max();
+            for (size_t j=0; j<colors.size(); ++j) {
+                if (i != j) nearest = std::min(nearest, glm::length(colors[i] - colors[j]));
+            }
+            total += nearest;
+        }
+        return total / static_cast<float>(colors.size()) / std::sqrt(3.f);
+    }
+
+private:
+    static glm::vec3 linearToOklab(const glm::vec3& rgb) {
+        const float l = std::cbrt(0.4122214708f * rgb.r + 0.5363325363f * rgb.g + 0.0514459929f * rgb.b);
+        const float m = std::cbrt(0.2119034982f * rgb.r + 0.6806995451f * rgb.g + 0.1073969566f * rgb.b);
+        const float s = std::cbrt(0.0883024619f * rgb.r + 0.2817188376f * rgb.g + 0.6299787005f * rgb.b);
+        return glm::vec3(
+            0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s,
+            1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s,
+            0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s
+        );
+    }
+};
+
+struct PaletteLutTiming {
+    std::string palette;
+    size_t colors;
+    int lutSize;
+    size_t threads;
+    float milliseconds;
+};
+
+// Every built-in palette at the usual LUT sizes, on one thread and on the whole pool.
+inline std::vector<PaletteLutTiming> benchmarkPaletteLut(ThreadPool& pool = ThreadPool::shared()) {
+    std::vector<PaletteLutTiming> timings;
+    ThreadPool serial(0);
+    for (const auto& palette : Palette::builtIn()) {
+        for (const int size : { 32, 64 }) {
+            for (auto* threads : { &serial, &pool }) {
+                const auto start = std::chrono::steady_clock::now();
+                const auto indices = PaletteLut::build(palette.colors, size, *threads);
+                const float milliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+                timings.push_back(PaletteLutTiming { palette.name, palette.colors.size(), size, threads->size() + 1, milliseconds });
+            }
+        }
+    }
+    return timings;
+}
@@ -0,0 +1,401 @@
+#pragma once
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "ShaderProgram.hpp"
+#include "ShaderCompiler.hpp"
+#include "ShaderSource.hpp"
+#include "RenderTargetPool.hpp"
+#include "GpuQuery.hpp"
+
+// Core profile wants a VAO bound even when nothing is fetched, so this is just an empty one. Pair with
+// PostProcess/Fullscreen.vert.glsl.
+class FullscreenTriangle {
+    unsigned int _vertexArray;
+public:
+    FullscreenTriangle() {
+        glGenVertexArrays(1, &_vertexArray);
+    }
+
+    ~FullscreenTriangle() {
+        glDeleteVertexArrays(1, &_vertexArray);
+    }
+
+    FullscreenTriangle(const FullscreenTriangle& other) = delete;
+    FullscreenTriangle& operator=(const FullscreenTriangle& other) = delete;
+
+    // Needs a current context the first time.
+    static FullscreenTriangle& shared() {
+        static FullscreenTriangle triangle;
+        return triangle;
+    }
+
+    void draw() const {
+        glBindVertexArray(_vertexArray);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+    }
+};
+
+enum class PostProcessStage {
+    // vec4 Source(vec2 uv), free to sample imageTexture wherever it likes. Always starts a draw.
+    Source,
+    // vec4 Apply(vec4 color, vec2 uv), only sees its input at its own pixel, so it can run in the previous pass's draw.
+    PerPixel,
+};
+
+// Per-frame state of one pass, handed to its bind callback with the program it ended up in.
+struct PostProcessBinding {
+    ShaderProgram& program;
+    int nextUnit;
+
+    // Units are handed out in order, passes sharing a program can't step on each other's samplers.
+    void texture(std::string_view sampler, unsigned int texture, GLenum target = GL_TEXTURE_2D) {
+        glActiveTexture(GL_TEXTURE0 + nextUnit);
+        glBindTexture(target, texture);
+        program.set(sampler, nextUnit);
+        nextUnit++;
+        glActiveTexture(GL_TEXTURE0);
+    }
+};
+
+struct PostProcessPass {
+    std::string name;
+    // Relative to the shaders root, defines Source or Apply depending on the stage. Everything in it ends up in one
+    // program with the other stages of a fused draw, so helpers and uniforms are prefixed or shared on purpose.
+    std::string stagePath;
+    // Generated stage code, used instead of stagePath when set. Same rules, #include works too.
+    std::string stageSource;
+    PostProcessStage stage = PostProcessStage::Source;
+    // Read as imageTexture.
+    std::string input;
+    // Filters imageTexture bilinearly for this draw, the pool's targets are nearest otherwise.
+    bool linearInput = false;
+    // Further resources the stage samples itself, sampler name -> resource.
+    std::vector<std::pair<std::string, std::string>> extraInputs;
+    // PostProcessGraph::screen, a texture set with setInput() to render into, or a transient the graph allocates at
+    // its size.
+    std::string output;
+    GLenum format = GL_RGBA8;
+    std::vector<std::string> defines;
+    std::function<void(PostProcessBinding&)> bind;
+};
+
+struct PostProcessPassTiming {
+    std::string name;
+    size_t stages;
+    float milliseconds;
+};
+
+struct PostProcessStats {
+    size_t passes = 0;
+    size_t draws = 0;
+    // Transients declared between passes, and the textures they actually landed in last frame.
+    size_t intermediates = 0;
+    size_t targets = 0;
+    // Per frame, writes and reads of the intermediates fusion folded into registers.
+    size_t fusedBytes = 0;
+    std::vector<PostProcessPassTiming> timings;
+};
+
+// Fullscreen passes wired by resource name. Passes run in the order they were added and each one reads resources
+// that are either set from outside or written by an earlier pass. Transients come from the RenderTargetPool and go
+// back to it right after their last reader, so a chain ping-pongs between two textures and anything longer aliases
+// whatever is free. With fusion on, a PerPixel pass whose input nobody else reads is appended to the draw producing
+// it: one generated shader calls Source and each Apply in turn and the intermediate never touches memory.
+// With setViewport() only the lower left corner of every target gets drawn; uv stays in texture space, so it ends at
+// viewportScale instead of 1 and stages sampling around a pixel should clamp to that.
+class PostProcessGraph {
+    constexpr static auto imageTextureName = std::string_view("imageTexture");
+    constexpr static auto viewportScaleName = std::string_view("viewportScale");
+
+    struct Draw {
+        std::vector<size_t> passes;
+        ShaderProgram program;
+        std::vector<std::string> files;
+        std::string vertexSource, fragmentSource;
+        GpuTimer timer;
+        // Transients to hand back to the pool once this draw is done.
+        std::vector<std::string> lastUses;
+    };
+
+    RenderTargetPool& _pool;
+    unsigned int _framebuffer;
+    unsigned int _linearSampler;
+    unsigned int _width, _height;
+    unsigned int _viewportWidth, _viewportHeight;
+    bool _fusion = true;
+    std::vector<PostProcessPass> _passes;
+    std::vector<std::unique_ptr<Draw>> _draws;
+    std::unordered_map<std::string, unsigned int> _inputs;
+    size_t _watch;
+    PostProcessStats _stats;
+public:
+    constexpr static auto screen = std::string_view("screen");
+
+    PostProcessGraph(RenderTargetPool& pool, unsigned int width, unsigned int height)
+    : _pool(pool), _width(width), _height(height), _viewportWidth(width), _viewportHeight(height)
+    {
+        glGenFramebuffers(1, &_framebuffer);
+        glGenSamplers(1, &_linearSampler);
+        glSamplerParameteri(_linearSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glSamplerParameteri(_linearSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glSamplerParameteri(_linearSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glSamplerParameteri(_linearSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        _watch = ShaderCompiler::shared().watch({}, [this]() {
+            for (auto& draw : _draws) generate(*draw);
+            return files();
+        });
+    }
+
+    ~PostProcessGraph() {
+        dropDraws();
+        ShaderCompiler::shared().unwatch(_watch);
+        glDeleteFramebuffers(1, &_framebuffer);
+        glDeleteSamplers(1, &_linearSampler);
+    }
+
+    PostProcessGraph(const PostProcessGraph& other) = delete;
+    PostProcessGraph& operator=(const PostProcessGraph& other) = delete;
+
+    void addPass(PostProcessPass pass) {
+        _passes.push_back(std::move(pass));
+    }
+
+    void clear() {
+        _passes.clear();
+        dropDraws();
+    }
+
+    // External resources, looked up every frame so they can change under the graph.
+    void setInput(const std::string& name, unsigned int texture) {
+        _inputs[name] = texture;
+    }
+
+    // Size of the transients, the screen is drawn at whatever viewport execute() is given.
+    void setSize(unsigned int width, unsigned int height) {
+        _width = _viewportWidth = width;
+        _height = _viewportHeight = height;
+        countFusedBytes();
+    }
+
+    // Part of the size actually drawn, inputs are expected to hold their picture in the same corner. The screen still
+    // gets the whole of it, stretched.
+    void setViewport(unsigned int width, unsigned int height) {
+        _viewportWidth = std::clamp(width, 1u, _width);
+        _viewportHeight = std::clamp(height, 1u, _height);
+    }
+
+    void setFusion(bool fusion) {
+        if (_fusion == fusion) return;
+        _fusion = fusion;
+        if (!_draws.empty()) compile();
+    }
+
+    bool fusion() const { return _fusion; }
+
+    // After the passes change. Splits them into draws and submits the generated programs, which show up a few frames
+    // later like any other async compile.
+    void compile() {
+        validate();
+        dropDraws();
+        for (size_t i=0; i<_passes.size(); ++i) {
+            if (!_draws.empty() && fusesIntoPrevious(i)) {
+                _draws.back()->passes.push_back(i);
+                continue;
+            }
+            _draws.push_back(std::make_unique<Draw>());
+            _draws.back()->passes.push_back(i);
+        }
+
+        for (size_t i=0; i<_draws.size(); ++i) {
+            const auto& output = _passes[_draws[i]->passes.back()].output;
+            if (output != screen && !_inputs.contains(output)) _draws[std::max(lastReader(output), i)]->lastUses.push_back(output);
+            generate(*_draws[i]);
+        }
+        ShaderCompiler::shared().rewatch(_watch, files());
+
+        _stats.passes = _passes.size();
+        _stats.draws = _draws.size();
+        countFusedBytes();
+    }
+
+    void execute(int screenWidth, int screenHeight) {
+        std::unordered_map<std::string, unsigned int> transients;
+        std::vector<unsigned int> targets;
+        _stats.timings.clear();
+
+        for (auto& draw : _draws) {
+            const auto& last = _passes[draw->passes.back()];
+            const auto& first = _passes[draw->passes.front()];
+            const bool toScreen = last.output == screen;
+
+            std::string name;
+            for (const auto index : draw->passes) name += (name.empty() ? "" : " + ") + _passes[index].name;
+            _stats.timings.push_back(PostProcessPassTiming { name, draw->passes.size(), draw->timer.milliseconds() });
+            // Not linked yet, the transients still get allocated so the frame's bookkeeping stays the same.
+            if (toScreen) {
+                glBindFramebuffer(GL_FRAMEBUFFER, 0);
+                glViewport(0, 0, screenWidth, screenHeight);
+            } else {
+                // External outputs are drawn in place, at the graph's size like everything else.
+                const auto external = _inputs.find(last.output);
+                const auto texture = external != _inputs.end() ? external->second : _pool.acquire(RenderTargetDesc { _width, _height, last.format });
+                if (external == _inputs.end()) {
+                    transients[last.output] = texture;
+                    if (std::find(targets.begin(), targets.end(), texture) == targets.end()) targets.push_back(texture);
+                }
+                glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+                glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+                glViewport(0, 0, _viewportWidth, _viewportHeight);
+            }
+
+            if (draw->program != 0) {
+                GpuTimer::ScopedQuery timer(draw->timer);
+                draw->program.use();
+                PostProcessBinding binding { draw->program, 0 };
+                draw->program.set(viewportScaleName, glm::vec2(_viewportWidth, _viewportHeight) / glm::vec2(_width, _height));
+                binding.texture(imageTextureName, resolve(first.input, transients));
+                if (first.linearInput) glBindSampler(0, _linearSampler);
+                for (const auto index : draw->passes) {
+                    const auto& pass = _passes[index];
+                    for (const auto& [sampler, resource] : pass.extraInputs) binding.texture(sampler, resolve(resource, transients));
+                    if (pass.bind) pass.bind(binding);
+                }
+                FullscreenTriangle::shared().draw();
+                if (first.linearInput) glBindSampler(0, 0);
+            }
+
+            for (const auto& done : draw->lastUses) _pool.release(transients[done]);
+        }
+
+        _stats.targets = targets.size();
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    const PostProcessStats& stats() const { return _stats; }
+
+    // For a draw that isn't behaving, with #line numbers pointing into files.
+    const std::string& generatedSource(size_t draw) const { return _draws[draw]->fragmentSource; }
+
+private:
+    void validate() const {
+        std::vector<std::string> written;
+        for (const auto& pass : _passes) {
+            const auto check = [&](const std::string& resource) {
+                if (_inputs.contains(resource) || std::find(written.begin(), written.end(), resource) != written.end()) return;
+                throw std::runtime_error("Post-process pass " + pass.name + " reads " + resource + " before anything writes it");
+            };
+            check(pass.input);
+            for (const auto& extra : pass.extraInputs) check(extra.second);
+            if (pass.output != screen) written.push_back(pass.output);
+        }
+    }
+
+    // The compiler holds on to programs still linking, those have to land before their draw goes away.
+    void dropDraws() {
+        for (auto& draw : _draws) ShaderCompiler::shared().wait(draw->program);
+        _draws.clear();
+    }
+
+    bool fusesIntoPrevious(size_t index) const {
+        const auto& pass = _passes[index];
+        const auto& previous = _passes[index - 1];
+        if (!_fusion || pass.stage != PostProcessStage::PerPixel) return false;
+        if (previous.output == screen || _inputs.contains(previous.output) || pass.input != previous.output) return false;
+        size_t readers = 0;
+        for (const auto& other : _passes) {
+            readers += other.input == previous.output;
+            for (const auto& extra : other.extraInputs) readers += extra.second == previous.output;
+        }
+        return readers == 1;
+    }
+
+    // Whether a draw renders it out, rather than it living inside a fused shader.
+    bool producedBy(const std::string& resource) const {
+        for (const auto& draw : _draws) {
+            if (_passes[draw->passes.back()].output == resource) return true;
+        }
+        return false;
+    }
+
+    void countFusedBytes() {
+        _stats.intermediates = 0;
+        _stats.fusedBytes = 0;
+        for (const auto& pass : _passes) {
+            if (pass.output == screen || _inputs.contains(pass.output)) continue;
+            _stats.intermediates++;
+            if (!producedBy(pass.output)) {
+                // Written and read back within a single draw.
+                _stats.fusedBytes += 2 * RenderTargetDesc { _width, _height, pass.format }.bytes();
+            }
+        }
+    }
+
+    size_t lastReader(const std::string& resource) const {
+        size_t last = 0;
+        for (size_t i=0; i<_draws.size(); ++i) {
+            const auto& first = _passes[_draws[i]->passes.front()];
+            if (first.input == resource) last = i;
+            for (const auto index : _draws[i]->passes) {
+                for (const auto& extra : _passes[index].extraInputs) {
+                    if (extra.second == resource) last = i;
+                }
+            }
+        }
+        return last;
+    }
+
+    unsigned int resolve(const std::string& resource, const std::unordered_map<std::string, unsigned int>& transients) const {
+        if (const auto it = transients.find(resource); it != transients.end()) return it->second;
+        if (const auto it = _inputs.find(resource); it != _inputs.end()) return it->second;
+        return 0;
+    }
+
+    // Each stage file is pulled in with its entry point renamed, main() chains them.
+    void generate(Draw& draw) {
+        std::string text = "#version 330 core\nin vec2 FragPos;\nout vec4 FragColor;\nuniform sampler2D imageTexture;\nuniform vec2 viewportScale = vec2(1.f);\n";
+        std::vector<std::string> defines;
+        std::string body;
+        for (size_t i=0; i<draw.passes.size(); ++i) {
+            const auto& pass = _passes[draw.passes[i]];
+            const bool source = pass.stage == PostProcessStage::Source;
+            const auto entry = std::string(source ? "Source" : "Apply");
+            const auto renamed = entry + std::to_string(i);
+            const auto stage = pass.stageSource.empty() ? "#include \"" + pass.stagePath + "\"" : pass.stageSource;
+            text += "#define " + entry + " " + renamed + "\n" + stage + "\n#undef " + entry + "\n";
+
+            if (i == 0) {
+                body += source ? "    vec4 color = " + renamed + "(uv);\n" : "    vec4 color = " + renamed + "(texture(imageTexture, uv), uv);\n";
+            } else {
+                body += "    color = " + renamed + "(color, uv);\n";
+            }
+            for (const auto& define : pass.defines) {
+                if (std::find(defines.begin(), defines.end(), define) == defines.end()) defines.push_back(define);
+            }
+        }
+        text += "void main() {\n    vec2 uv = (FragPos + vec2(1.f))/2.f * viewportScale;\n" + body + "    FragColor = color;\n}\n";
+
+        const auto vertex = ShaderSource::load("PostProcess/Fullscreen.vert.glsl");
+        const auto fragment = ShaderSource::parse("PostProcess/generated", text);
+        draw.vertexSource = vertex.text;
+        draw.fragmentSource = fragment.withDefines(defines);
+        draw.files = vertex.files;
+        draw.files.insert(draw.files.end(), fragment.files.begin() + 1, fragment.files.end());
+        ShaderCompiler::shared().submit(draw.program, draw.vertexSource, draw.fragmentSource);
+    }
+
+    std::vector<std::string> files() const {
+        std::vector<std::string> result;
+        for (const auto& draw : _draws) result.insert(result.end(), draw->files.begin(), draw->files.end());
+        return result;
+    }
+};
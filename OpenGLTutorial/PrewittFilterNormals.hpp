@@ -3,60 +3,38 @@
 #include "glad/glad.h"
 #include "glm/glm.hpp"
 
-#include "VertexData.hpp"
-#include "ShaderProgram.hpp"
-#include "Utils.hpp"
-
-#ifndef SHADERS_SOURCE_DIR
-#define SHADERS_SOURCE_DIR "INCORRECT SOURCE DIR"
-#endif
+#include "PostProcessGraph.hpp"
 
 class PrewittFilterNormals {
-    constexpr static auto processedTextureName = std::string_view("imageTexture");
     constexpr static auto kernelVerticalScaleName = std::string_view("imageVerticalScale");
     constexpr static auto kernelHorizontalScaleName = std::string_view("imageHorizontalScale");
     
-    VertexDataBase _vertexData;
-    ShaderProgram _shaderProgram;
+    bool _octahedral = false;
+    int _width = 1, _height = 1;
 public:
-    PrewittFilterNormals() {
-        auto indicesVector = std::vector<unsigned int>(indices, indices + 6);
-        _vertexData = VertexData<Layout::Sequential, Vec3>(indicesVector, 4, reinterpret_cast<const float*>(quadCoords));
-
-        const auto vertexShaderCode = Utils::readFile(SHADERS_SOURCE_DIR "/" "PrewittFilter.vert.glsl");
-	    const auto fragmentShaderCode = Utils::readFile(SHADERS_SOURCE_DIR "/" "PrewittFilterNormals.frag.glsl");
-
-        _shaderProgram = ShaderProgram(
-            Shader<ShaderType::Vertex>(vertexShaderCode.c_str()),
-            Shader<ShaderType::Fragment>(fragmentShaderCode.c_str())
-        );
-    }
-
-    void draw(unsigned int texture) {
-        _shaderProgram.use();
-
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture);
-        _shaderProgram.set(processedTextureName, 0);
-
-        auto vertexBinding = VertexDataBase::ScopedBinding(_vertexData);
-        glDrawElements(GL_TRIANGLES, _vertexData.vertexCount(), GL_UNSIGNED_INT, 0);
+    // Samples a neighbourhood, always starts a draw of its own. Takes the normals layout current at the time.
+    PostProcessPass pass(std::string input, std::string output) const {
+        return PostProcessPass {
+            .name = "Normal edges",
+            .stagePath = "PostProcess/NormalEdges.glsl",
+            .stage = PostProcessStage::Source,
+            .input = std::move(input),
+            .output = std::move(output),
+            .defines = _octahedral ? std::vector<std::string> { "OCTAHEDRAL_NORMALS" } : std::vector<std::string> {},
+            .bind = [this](PostProcessBinding& binding) {
+                binding.program.set(kernelVerticalScaleName, static_cast<float>(_height));
+                binding.program.set(kernelHorizontalScaleName, static_cast<float>(_width));
+            }
+        };
     }
 
     void setMatrixDensity(int width, int height) {
-        _shaderProgram.use();
-        _shaderProgram.set(kernelVerticalScaleName, static_cast<float>(height));
-        _shaderProgram.set(kernelHorizontalScaleName, static_cast<float>(width));
+        _width = width;
+        _height = height;
     }
 
-    constexpr static inline glm::vec3 quadCoords[4] = {
-        {-1.f, -1.f, 0.f},
-        {1.f, -1.f, 0.f},
-        {1.f, 1.f, 0.f},
-        {-1.f, 1.f, 0.f}
-    };
-
-    constexpr static inline unsigned int indices[6] = {
-        0, 1, 2, 2, 0, 3
-    };
-};
\ No newline at end of file
+    // Compact G-buffer stores normals octahedrally in two channels.
+    void setOctahedralNormals(bool octahedral) {
+        _octahedral = octahedral;
+    }
+};
@@ -0,0 +1,264 @@
+#pragma once
+#include <glad/glad.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "ShaderProgram.hpp"
+
+#ifndef SHADER_CACHE_DIR
+#define SHADER_CACHE_DIR "INCORRECT CACHE DIR"
+#endif
+
+struct ProgramBinaryCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t stores = 0;
+    // Binaries the driver refused (driver update, corrupted file), deleted and rebuilt from source.
+    size_t invalidations = 0;
+    float milliseconds = 0.f;
+};
+
+// A build handed to the driver, see ProgramBinaryCache::begin.
+struct PendingProgram {
+    unsigned int program = 0;
+    // Both 0 when the program came from a stored binary.
+    unsigned int vertex = 0;
+    unsigned int fragment = 0;
+    uint64_t key = 0;
+    bool linked = false;
+};
+
+// Linked programs kept on disk between runs with glGetProgramBinary/glProgramBinary. A binary is only good for
+// the exact driver that produced it, so the key covers vendor/renderer/version on top of the full sources
+// (defines included). Anything going wrong falls back to compiling from source.
+class ProgramBinaryCache {
+    constexpr static char magic[8] = { 'L', 'O', 'G', 'L', 'P', 'B', 'I', 'N' };
+    constexpr static uint32_t version = 1;
+
+    std::filesystem::path _directory;
+    std::string _driver;
+    bool _supported = false;
+    bool _enabled = true;
+    ProgramBinaryCacheStats _stats;
+public:
+    ProgramBinaryCache(std::filesystem::path directory = SHADER_CACHE_DIR) : _directory(std::move(directory)) {
+        GLint formats = 0;
+        if (GLAD_GL_VERSION_4_1 || GLAD_GL_ARB_get_program_binary) {
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        }
+        _supported = formats > 0;
+
+        for (const GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+            const auto* value = reinterpret_cast<const char*>(glGetString(name));
+            _driver += value ? value : "";
+            _driver += '\n';
+        }
+
+        std::error_code error;
+        std::filesystem::create_directories(_directory, error);
+        if (error) _supported = false;
+    }
+
+    // Needs a current context the first time.
+    static ProgramBinaryCache& shared() {
+        static ProgramBinaryCache cache;
+        return cache;
+    }
+
+    ShaderProgram build(const std::string& vertexSource, const std::string& fragmentSource) {
+        auto pending = begin(vertexSource, fragmentSource);
+        return finish(pending);
+    }
+
+    // Hands the sources to the driver and returns without asking for any status, so with KHR_parallel_shader_compile
+    // the driver compiles in the background until finish() (see ShaderCompiler). Cache hits come back already linked.
+    PendingProgram begin(const std::string& vertexSource, const std::string& fragmentSource) {
+        const auto start = std::chrono::steady_clock::now();
+        PendingProgram pending;
+        pending.key = hash({ _driver, vertexSource, "\n--fragment--\n", fragmentSource });
+
+        if (unsigned int program = _enabled && _supported ? load(pending.key) : 0) {
+            _stats.hits++;
+            pending.program = program;
+            pending.linked = true;
+            _stats.milliseconds += elapsedMilliseconds(start);
+            return pending;
+        }
+        _stats.misses++;
+
+        pending.program = glCreateProgram();
+        pending.vertex = compile(GL_VERTEX_SHADER, vertexSource);
+        pending.fragment = compile(GL_FRAGMENT_SHADER, fragmentSource);
+        glAttachShader(pending.program, pending.vertex);
+        glAttachShader(pending.program, pending.fragment);
+        if (_supported) glProgramParameteri(pending.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(pending.program);
+        _stats.milliseconds += elapsedMilliseconds(start);
+        return pending;
+    }
+
+    // Waits for the driver if it isn't done yet. A failed link prints the logs and still hands the program back,
+    // pending.linked tells which one it was.
+    ShaderProgram finish(PendingProgram& pending) {
+        const auto start = std::chrono::steady_clock::now();
+        if (pending.vertex) {
+            GLint linked = GL_FALSE;
+            glGetProgramiv(pending.program, GL_LINK_STATUS, &linked);
+            pending.linked = linked;
+            if (!linked) {
+                char infoLog[512];
+                for (const auto shader : { pending.vertex, pending.fragment }) {
+                    GLint compiled = GL_FALSE;
+                    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+                    if (compiled) continue;
+                    glGetShaderInfoLog(shader, 512, NULL, infoLog);
+                    std::cout << "ERROR::SHADER::COMPILATION_FAILED\n" << infoLog << '\n';
+                }
+                glGetProgramInfoLog(pending.program, 512, NULL, infoLog);
+                std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << '\n';
+            } else if (_enabled && _supported) {
+                store(pending.key, pending.program);
+            }
+            releaseShaders(pending);
+        }
+        _stats.milliseconds += elapsedMilliseconds(start);
+        return ShaderProgram::adopt(std::exchange(pending.program, 0));
+    }
+
+    // Drops a build nobody wants anymore, e.g. superseded by a newer save of the same file.
+    void discard(PendingProgram& pending) {
+        releaseShaders(pending);
+        if (pending.program) glDeleteProgram(std::exchange(pending.program, 0));
+    }
+
+    // Next builds go to the driver, e.g. to time a cold start without deleting anything.
+    void setEnabled(bool enabled) { _enabled = enabled; }
+
+    // Drops every stored binary, the next run starts cold.
+    void clear() {
+        std::error_code error;
+        for (const auto& entry : std::filesystem::directory_iterator(_directory, error)) {
+            if (entry.path().extension() == ".bin") std::filesystem::remove(entry.path(), error);
+        }
+    }
+
+    bool supported() const { return _supported; }
+    const ProgramBinaryCacheStats& stats() const { return _stats; }
+
+private:
+    // FNV-1a, good enough to tell sources apart.
+    static uint64_t hash(std::initializer_list<std::string_view> parts) {
+        uint64_t value = 14695981039346656037ull;
+        for (const auto part : parts) {
+            for (const char c : part) {
+                value ^= static_cast<unsigned char>(c);
+                value *= 1099511628211ull;
+            }
+        }
+        return value;
+    }
+
+    std::filesystem::path pathFor(uint64_t key) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(key));
+        return _directory / name;
+    }
+
+    static unsigned int compile(GLenum type, const std::string& source) {
+        const unsigned int shader = glCreateShader(type);
+        const char* code = source.c_str();
+        glShaderSource(shader, 1, &code, NULL);
+        glCompileShader(shader);
+        return shader;
+    }
+
+    static void releaseShaders(PendingProgram& pending) {
+        for (auto* shader : { &pending.vertex, &pending.fragment }) {
+            if (!*shader) continue;
+            glDetachShader(pending.program, *shader);
+            glDeleteShader(std::exchange(*shader, 0));
+        }
+    }
+
+    unsigned int load(uint64_t key) {
+        const auto path = pathFor(key);
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) return 0;
+
+        char fileMagic[sizeof(magic)];
+        uint32_t fileVersion = 0, length = 0;
+        uint64_t fileKey = 0;
+        GLenum format = 0;
+        file.read(fileMagic, sizeof(fileMagic));
+        file.read(reinterpret_cast<char*>(&fileVersion), sizeof(fileVersion));
+        file.read(reinterpret_cast<char*>(&fileKey), sizeof(fileKey));
+        file.read(reinterpret_cast<char*>(&format), sizeof(format));
+        file.read(reinterpret_cast<char*>(&length), sizeof(length));
+        std::vector<char> binary(file ? length : 0);
+        file.read(binary.data(), binary.size());
+        if (!file || std::string_view(fileMagic, sizeof(fileMagic)) != std::string_view(magic, sizeof(magic))
+            || fileVersion != version || fileKey != key) {
+            invalidate(path);
+            return 0;
+        }
+
+        const unsigned int program = glCreateProgram();
+        glProgramBinary(program, format, binary.data(), static_cast<GLsizei>(binary.size()));
+        GLint linked = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (!linked) {
+            glDeleteProgram(program);
+            invalidate(path);
+            return 0;
+        }
+        return program;
+    }
+
+    void store(uint64_t key, unsigned int program) {
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) return;
+        std::vector<char> binary(length);
+        GLenum format = 0;
+        glGetProgramBinary(program, length, &length, &format, binary.data());
+
+        // Written aside and renamed, so a crash halfway never leaves a truncated binary behind.
+        const auto path = pathFor(key);
+        auto temporary = path;
+        temporary += ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            const uint32_t binaryLength = static_cast<uint32_t>(length);
+            file.write(magic, sizeof(magic));
+            file.write(reinterpret_cast<const char*>(&version), sizeof(version));
+            file.write(reinterpret_cast<const char*>(&key), sizeof(key));
+            file.write(reinterpret_cast<const char*>(&format), sizeof(format));
+            file.write(reinterpret_cast<const char*>(&binaryLength), sizeof(binaryLength));
+            file.write(binary.data(), length);
+            if (!file) return;
+        }
+        std::error_code error;
+        std::filesystem::rename(temporary, path, error);
+        if (!error) _stats.stores++;
+    }
+
+    void invalidate(const std::filesystem::path& path) {
+        std::error_code error;
+        std::filesystem::remove(path, error);
+        _stats.invalidations++;
+    }
+
+    static float elapsedMilliseconds(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+};
@@ -0,0 +1,163 @@
+#pragma once
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Nominal size, drivers are free to pad 3 channel formats to 4.
+inline unsigned int renderTargetFormatBytes(GLenum format) {
+    switch (format) {
+        case GL_R8: return 1;
+        case GL_RG8:
+        case GL_R16F:
+        case GL_DEPTH_COMPONENT16: return 2;
+        case GL_RGB8:
+        case GL_RGB8_SNORM:
+        case GL_DEPTH_COMPONENT24: return 3;
+        case GL_RGBA8:
+        case GL_RG16_SNORM:
+        case GL_RG16F:
+        case GL_R32F:
+        case GL_DEPTH24_STENCIL8:
+        case GL_DEPTH_COMPONENT32F: return 4;
+        case GL_RGB16F: return 6;
+        case GL_RGBA16F: return 8;
+        case GL_RGBA32F: return 16;
+        default: return 0;
+    }
+}
+
+inline bool isDepthFormat(GLenum format) {
+    return format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH_COMPONENT16 || format == GL_DEPTH_COMPONENT24 || format == GL_DEPTH_COMPONENT32F;
+}
+
+struct RenderTargetDesc {
+    unsigned int width;
+    unsigned int height;
+    GLenum format;
+
+    size_t bytes() const { return static_cast<size_t>(width) * height * renderTargetFormatBytes(format); }
+    bool operator==(const RenderTargetDesc& other) const = default;
+};
+
+struct RenderTargetPoolStats {
+    size_t textures = 0;
+    size_t texturesInUse = 0;
+    size_t bytes = 0;
+    size_t peakBytes = 0;
+    // Running totals, allocations - frees == textures or something leaked.
+    size_t allocations = 0;
+    size_t frees = 0;
+    // Acquires served from a released texture instead of a fresh allocation.
+    size_t reuses = 0;
+};
+
+// Hands out 2D textures by (size, format). Released textures go back to a free list and the next acquire with
+// the same descriptor gets the same memory, so passes whose lifetimes don't overlap within a frame alias each
+// other and per-frame transients cost nothing after the first frame. Whatever sits unused for a few frames
+// (e.g. everything at the old size after a resize) is deleted in endFrame().
+class RenderTargetPool {
+    struct Entry {
+        unsigned int texture;
+        RenderTargetDesc desc;
+        bool inUse;
+        uint64_t lastUsedFrame;
+    };
+
+    std::vector<Entry> _entries;
+    uint64_t _frame = 0;
+    unsigned int _retainFrames;
+    RenderTargetPoolStats _stats;
+public:
+    RenderTargetPool(unsigned int retainFrames = 3) : _retainFrames(retainFrames) {}
+
+    ~RenderTargetPool() {
+        for (const auto& entry : _entries) {
+            glDeleteTextures(1, &entry.texture);
+        }
+    }
+
+    RenderTargetPool(const RenderTargetPool& other) = delete;
+    RenderTargetPool& operator=(const RenderTargetPool& other) = delete;
+
+    unsigned int acquire(const RenderTargetDesc& desc) {
+        for (auto& entry : _entries) {
+            if (entry.inUse || !(entry.desc == desc)) continue;
+            entry.inUse = true;
+            entry.lastUsedFrame = _frame;
+            _stats.reuses++;
+            _stats.texturesInUse++;
+            return entry.texture;
+        }
+
+        unsigned int texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        // No data uploaded, format/type only have to be a legal pair for the internal format.
+        if (desc.format == GL_DEPTH24_STENCIL8) {
+            glTexImage2D(GL_TEXTURE_2D, 0, desc.format, desc.width, desc.height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
+        } else if (isDepthFormat(desc.format)) {
+            glTexImage2D(GL_TEXTURE_2D, 0, desc.format, desc.width, desc.height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+        } else {
+            glTexImage2D(GL_TEXTURE_2D, 0, desc.format, desc.width, desc.height, 0, GL_RGBA, GL_FLOAT, NULL);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        _entries.push_back(Entry { texture, desc, true, _frame });
+        _stats.allocations++;
+        _stats.textures++;
+        _stats.texturesInUse++;
+        _stats.bytes += desc.bytes();
+        _stats.peakBytes = std::max(_stats.peakBytes, _stats.bytes);
+        return texture;
+    }
+
+    // Back to the free list, the memory stays allocated for the next acquire.
+    void release(unsigned int texture) {
+        for (auto& entry : _entries) {
+            if (entry.texture != texture || !entry.inUse) continue;
+            entry.inUse = false;
+            entry.lastUsedFrame = _frame;
+            _stats.texturesInUse--;
+            return;
+        }
+    }
+
+    // Deletes free textures nobody asked for in the last few frames.
+    void endFrame() {
+        _frame++;
+        trim(_retainFrames);
+    }
+
+    // Zero frees every released texture right away.
+    void trim(unsigned int unusedFrames = 0) {
+        const auto stale = [&](const Entry& entry) {
+            return !entry.inUse && _frame - entry.lastUsedFrame >= unusedFrames;
+        };
+        for (const auto& entry : _entries) {
+            if (!stale(entry)) continue;
+            glDeleteTextures(1, &entry.texture);
+            _stats.frees++;
+            _stats.textures--;
+            _stats.bytes -= entry.desc.bytes();
+        }
+        _entries.erase(std::remove_if(_entries.begin(), _entries.end(), stale), _entries.end());
+    }
+
+    const RenderTargetPoolStats& stats() const { return _stats; }
+
+    // Holds a target for a single pass.
+    struct ScopedTarget {
+        RenderTargetPool& _pool;
+        unsigned int _texture;
+        ScopedTarget(RenderTargetPool& pool, const RenderTargetDesc& desc) : _pool(pool), _texture(pool.acquire(desc)) {}
+        ~ScopedTarget() { _pool.release(_texture); }
+        operator unsigned int() const { return _texture; }
+    };
+};
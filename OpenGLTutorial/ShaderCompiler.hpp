@@ -0,0 +1,283 @@
+#pragma once
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "ShaderProgram.hpp"
+#include "ProgramBinaryCache.hpp"
+#include "ShaderSource.hpp"
+
+// Files written under a directory tree, polled once a frame. inotify on Linux, elsewhere nothing ever changes.
+class ShaderWatcher {
+    int _fd = -1;
+    // Watch descriptor -> directory relative to the root, with a trailing slash.
+    std::unordered_map<int, std::string> _directories;
+public:
+    explicit ShaderWatcher(const std::filesystem::path& root) {
+#ifdef __linux__
+        _fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (_fd < 0) return;
+        add(root, "");
+        std::error_code error;
+        for (auto it = std::filesystem::recursive_directory_iterator(root, error); !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+            if (it->is_directory()) add(it->path(), std::filesystem::relative(it->path(), root).generic_string() + "/");
+        }
+#endif
+    }
+
+    ~ShaderWatcher() {
+#ifdef __linux__
+        if (_fd >= 0) close(_fd);
+#endif
+    }
+
+    ShaderWatcher(const ShaderWatcher& other) = delete;
+    ShaderWatcher& operator=(const ShaderWatcher& other) = delete;
+
+    // Paths relative to the root, same as ShaderSource::files. Never blocks.
+    std::vector<std::string> changedFiles() {
+        std::vector<std::string> files;
+#ifdef __linux__
+        if (_fd < 0) return files;
+        alignas(inotify_event) char buffer[4096];
+        ssize_t length;
+        while ((length = read(_fd, buffer, sizeof(buffer))) > 0) {
+            for (ssize_t offset = 0; offset < length; ) {
+                const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                offset += sizeof(inotify_event) + event->len;
+                if (event->len == 0 || (event->mask & IN_ISDIR)) continue;
+                const auto directory = _directories.find(event->wd);
+                if (directory == _directories.end()) continue;
+                auto file = directory->second + event->name;
+                if (std::find(files.begin(), files.end(), file) == files.end()) files.push_back(std::move(file));
+            }
+        }
+#endif
+        return files;
+    }
+
+private:
+#ifdef __linux__
+    void add(const std::filesystem::path& directory, std::string relative) {
+        // Editors that save through a temporary file and rename show up as IN_MOVED_TO rather than a write.
+        const int wd = inotify_add_watch(_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd >= 0) _directories[wd] = std::move(relative);
+    }
+#endif
+};
+
+struct ShaderCompileStats {
+    size_t submitted = 0;
+    size_t failed = 0;
+    size_t reloads = 0;
+    size_t inFlight = 0;
+    // From the first submit of a burst (startup, a save, recompileAll) until its last program is swapped in.
+    size_t lastBatchPrograms = 0;
+    float lastBatchMilliseconds = 0.f;
+    bool parallel = false;
+};
+
+// Owns every program build in flight. Owners hand over the ShaderProgram they draw with; it keeps whatever it held
+// (nothing at startup, the previous version on a reload) until the driver reports the new one linked, then it is
+// swapped in and onReady re-applies the constant uniforms. With KHR_parallel_shader_compile update() only polls
+// GL_COMPLETION_STATUS_KHR, so nothing in the frame waits on the compiler; without it, the first status query stalls
+// like a plain compile would. Targets must stay put (members of long-lived objects, map nodes) until they are ready.
+class ShaderCompiler {
+    struct Job {
+        ShaderProgram* target;
+        PendingProgram pending;
+        std::function<void(ShaderProgram&)> onReady;
+    };
+    struct Watch {
+        std::vector<std::string> files;
+        // Reloads the sources, resubmits and returns the files involved now (includes may have changed).
+        std::function<std::vector<std::string>()> rebuild;
+    };
+
+    ProgramBinaryCache& _cache;
+    ShaderWatcher _watcher;
+    std::vector<Job> _jobs;
+    std::vector<Watch> _watches;
+    bool _parallelSupported = false;
+    std::chrono::steady_clock::time_point _batchStart;
+    size_t _batchPrograms = 0;
+    ShaderCompileStats _stats;
+public:
+    ShaderCompiler(ProgramBinaryCache& cache, const std::filesystem::path& root = SHADERS_SOURCE_DIR)
+    : _cache(cache), _watcher(root)
+    {
+        _parallelSupported = GLAD_GL_KHR_parallel_shader_compile;
+        setParallel(true);
+    }
+
+    ShaderCompiler(const ShaderCompiler& other) = delete;
+    ShaderCompiler& operator=(const ShaderCompiler& other) = delete;
+
+    // Needs a current context the first time.
+    static ShaderCompiler& shared() {
+        static ShaderCompiler compiler(ProgramBinaryCache::shared());
+        return compiler;
+    }
+
+    // Zero compiler threads is the extension's way of saying compile on the calling thread, which is what the
+    // serial numbers are measured with.
+    void setParallel(bool parallel) {
+        _stats.parallel = parallel && _parallelSupported;
+        if (_parallelSupported) glMaxShaderCompilerThreadsKHR(_stats.parallel ? 0xFFFFFFFFu : 0u);
+    }
+
+    bool parallelSupported() const { return _parallelSupported; }
+
+    void submit(ShaderProgram& target, const std::string& vertexSource, const std::string& fragmentSource, std::function<void(ShaderProgram&)> onReady = {}) {
+        // A newer save wins over one still compiling, even if the older one would finish later.
+        cancel(target);
+        if (_jobs.empty()) {
+            _batchStart = std::chrono::steady_clock::now();
+            _batchPrograms = 0;
+        }
+        _jobs.push_back(Job { &target, _cache.begin(vertexSource, fragmentSource), std::move(onReady) });
+        _batchPrograms++;
+        _stats.submitted++;
+        _stats.inFlight = _jobs.size();
+    }
+
+    // Paths relative to the shaders root, #include resolved. Rebuilt whenever any file involved is saved. Returns the
+    // watch handle, owners that can go away unwatch() it and cancel() their target.
+    size_t compile(ShaderProgram& target, const std::string& vertexPath, const std::string& fragmentPath, std::function<void(ShaderProgram&)> onReady = {}) {
+        auto rebuild = [this, &target, vertexPath, fragmentPath, onReady]() {
+            const auto vertex = ShaderSource::load(vertexPath);
+            const auto fragment = ShaderSource::load(fragmentPath);
+            submit(target, vertex.text, fragment.text, onReady);
+            auto files = vertex.files;
+            files.insert(files.end(), fragment.files.begin(), fragment.files.end());
+            return files;
+        };
+        return watch(rebuild(), rebuild);
+    }
+
+    // Returns a handle for rewatch() and unwatch().
+    size_t watch(std::vector<std::string> files, std::function<std::vector<std::string>()> rebuild) {
+        _watches.push_back(Watch { std::move(files), std::move(rebuild) });
+        return _watches.size() - 1;
+    }
+
+    // For owners whose sources change without a save, e.g. generated shaders after a rebuild.
+    void rewatch(size_t watch, std::vector<std::string> files) {
+        _watches[watch].files = std::move(files);
+    }
+
+    // For owners that go away before the compiler does. The slot stays, handles don't shift.
+    void unwatch(size_t watch) {
+        _watches[watch] = Watch { {}, []() { return std::vector<std::string>(); } };
+    }
+
+    // Drops a build still in flight for a target about to go away, it would be swapped into freed memory otherwise.
+    void cancel(const ShaderProgram& target) {
+        for (auto it = _jobs.begin(); it != _jobs.end(); ++it) {
+            if (it->target != &target) continue;
+            _cache.discard(it->pending);
+            _jobs.erase(it);
+            break;
+        }
+        _stats.inFlight = _jobs.size();
+    }
+
+    // Once a frame: resubmits whatever was saved since and swaps in every program the driver is done with.
+    void update() {
+        const auto changed = _watcher.changedFiles();
+        if (!changed.empty()) {
+            for (auto& watch : _watches) {
+                const bool affected = std::any_of(changed.begin(), changed.end(), [&](const std::string& file) {
+                    return std::find(watch.files.begin(), watch.files.end(), file) != watch.files.end();
+                });
+                if (affected) rebuild(watch);
+            }
+        }
+
+        for (size_t i=0; i<_jobs.size(); ) {
+            if (!complete(_jobs[i].pending)) {
+                ++i;
+                continue;
+            }
+            retire(i);
+        }
+    }
+
+    // Startup: blocks until everything submitted so far is in place. Waiting in submission order is fine, the
+    // driver keeps working on the rest meanwhile.
+    void finishAll() {
+        while (!_jobs.empty()) retire(0);
+    }
+
+    // For a target needed right now, e.g. a permutation drawn before its warm-up finished.
+    void wait(const ShaderProgram& target) {
+        for (size_t i=0; i<_jobs.size(); ++i) {
+            if (_jobs[i].target == &target) {
+                retire(i);
+                return;
+            }
+        }
+    }
+
+    // Everything from source, bypassing the binary cache, to compare serial and parallel wall time in place.
+    void recompileAll() {
+        _cache.setEnabled(false);
+        for (auto& watch : _watches) rebuild(watch);
+        _cache.setEnabled(true);
+    }
+
+    const ShaderCompileStats& stats() const { return _stats; }
+
+private:
+    bool complete(const PendingProgram& pending) const {
+        if (!_stats.parallel) return true;
+        GLint done = GL_FALSE;
+        glGetProgramiv(pending.program, GL_COMPLETION_STATUS_KHR, &done);
+        return done == GL_TRUE;
+    }
+
+    void rebuild(Watch& watch) {
+        try {
+            watch.files = watch.rebuild();
+            _stats.reloads++;
+        } catch (const std::exception& exception) {
+            // Half-written file or a bad #include, the next save gets another go.
+            std::cout << "Shader reload failed: " << exception.what() << '\n';
+        }
+    }
+
+    void retire(size_t index) {
+        auto job = std::move(_jobs[index]);
+        _jobs.erase(_jobs.begin() + index);
+        auto program = _cache.finish(job.pending);
+        if (job.pending.linked) {
+            *job.target = std::move(program);
+            if (job.onReady) {
+                job.target->use();
+                job.onReady(*job.target);
+            }
+        } else {
+            _stats.failed++;
+        }
+
+        _stats.inFlight = _jobs.size();
+        if (_jobs.empty()) {
+            _stats.lastBatchPrograms = _batchPrograms;
+            _stats.lastBatchMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - _batchStart).count();
+        }
+    }
+};
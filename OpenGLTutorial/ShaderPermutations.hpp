@@ -0,0 +1,158 @@
+#pragma once
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ShaderProgram.hpp"
+#include "ProgramBinaryCache.hpp"
+#include "ShaderCompiler.hpp"
+#include "ShaderSource.hpp"
+
+struct ShaderPermutationStats {
+    size_t variants = 0;
+    size_t cacheHits = 0;
+    float compileMilliseconds = 0.f;
+};
+
+// A vertex/fragment pair compiled per feature set. Features are whatever the sources declare with
+// #pragma feature, bit i being the i-th one declared. Each mask is compiled once with the matching
+// #define NAME 1 lines and cached, so the shaders use #ifdef instead of uniform branches. Saving any of the files
+// recompiles every variant built so far in the background, see ShaderCompiler.
+class ShaderPermutations {
+    ShaderSource _vertex;
+    ShaderSource _fragment;
+    std::vector<std::string> _features;
+    // Constant per-program state, sampler units and the like, applied to every fresh variant.
+    std::function<void(ShaderProgram&)> _onCompile;
+    std::unordered_map<uint32_t, ShaderProgram> _variants;
+    size_t _watch;
+    ShaderPermutationStats _stats;
+public:
+    ShaderPermutations(const std::string& vertexPath, const std::string& fragmentPath, std::function<void(ShaderProgram&)> onCompile = {})
+    : _vertex(ShaderSource::load(vertexPath)),
+      _fragment(ShaderSource::load(fragmentPath)),
+      _onCompile(std::move(onCompile))
+    {
+        collectFeatures(fragmentPath);
+        _watch = ShaderCompiler::shared().watch(files(), [this, vertexPath, fragmentPath]() {
+            auto vertex = ShaderSource::load(vertexPath);
+            auto fragment = ShaderSource::load(fragmentPath);
+            _vertex = std::move(vertex);
+            _fragment = std::move(fragment);
+            collectFeatures(fragmentPath);
+            for (auto& [features, program] : _variants) submit(features, program);
+            return files();
+        });
+    }
+
+    ~ShaderPermutations() {
+        auto& compiler = ShaderCompiler::shared();
+        compiler.unwatch(_watch);
+        for (const auto& [features, program] : _variants) compiler.cancel(program);
+    }
+
+    ShaderPermutations(const ShaderPermutations& other) = delete;
+    ShaderPermutations& operator=(const ShaderPermutations& other) = delete;
+
+    // Bit of a declared feature, 0 if these sources don't have it so callers can OR it in regardless.
+    uint32_t feature(std::string_view name) const {
+        for (size_t i=0; i<_features.size(); ++i) {
+            if (_features[i] == name) return 1u << i;
+        }
+        return 0;
+    }
+
+    // Mask of several declared features. Bits only mean something to the set they came from, owners of several sets
+    // build each set's mask through that set.
+    uint32_t mask(std::initializer_list<std::string_view> names) const {
+        uint32_t result = 0;
+        for (const auto name : names) result |= feature(name);
+        return result;
+    }
+
+    ShaderProgram& get(uint32_t features) {
+        if (const auto it = _variants.find(features); it != _variants.end()) {
+            _stats.cacheHits++;
+            // Still compiling from warmAll(), only this one is waited for.
+            if (it->second == 0) ShaderCompiler::shared().wait(it->second);
+            return it->second;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        auto& program = _variants.emplace(features, ProgramBinaryCache::shared().build(
+            _vertex.withDefines(defines(features)),
+            _fragment.withDefines(defines(features))
+        )).first->second;
+        if (_onCompile) {
+            program.use();
+            _onCompile(program);
+        }
+        _stats.variants++;
+        _stats.compileMilliseconds += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return program;
+    }
+
+    // Submits every combination up front so the driver compiles them side by side instead of one per first draw.
+    // Fine for the few features these shaders have.
+    void warmAll() {
+        if (_features.size() > 8) return;
+        for (uint32_t features = 0; features < (1u << _features.size()); ++features) {
+            if (_variants.contains(features)) continue;
+            submit(features, _variants[features]);
+            _stats.variants++;
+        }
+    }
+
+    // Size of the driver's program binary, a rough stand-in for instruction count. 0 without ARB_get_program_binary.
+    int binaryLength(uint32_t features) {
+        if (!(GLAD_GL_VERSION_4_1 || GLAD_GL_ARB_get_program_binary)) return 0;
+        GLint length = 0;
+        glGetProgramiv(get(features), GL_PROGRAM_BINARY_LENGTH, &length);
+        return length;
+    }
+
+    const std::vector<std::string>& features() const { return _features; }
+    const ShaderPermutationStats& stats() const { return _stats; }
+
+private:
+    // New features from a reload go to the end, the bits callers already hold keep their meaning.
+    void collectFeatures(const std::string& fragmentPath) {
+        for (const auto* source : { &_vertex, &_fragment }) {
+            for (const auto& feature : source->features) {
+                if (std::find(_features.begin(), _features.end(), feature) == _features.end()) {
+                    _features.push_back(feature);
+                }
+            }
+        }
+        if (_features.size() > 32) {
+            throw std::runtime_error("Too many shader features in " + fragmentPath);
+        }
+    }
+
+    std::vector<std::string> defines(uint32_t features) const {
+        std::vector<std::string> result;
+        for (size_t i=0; i<_features.size(); ++i) {
+            if (features & (1u << i)) result.push_back(_features[i]);
+        }
+        return result;
+    }
+
+    std::vector<std::string> files() const {
+        auto result = _vertex.files;
+        result.insert(result.end(), _fragment.files.begin(), _fragment.files.end());
+        return result;
+    }
+
+    void submit(uint32_t features, ShaderProgram& program) {
+        const auto start = std::chrono::steady_clock::now();
+        ShaderCompiler::shared().submit(program, _vertex.withDefines(defines(features)), _fragment.withDefines(defines(features)), _onCompile);
+        _stats.compileMilliseconds += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+};
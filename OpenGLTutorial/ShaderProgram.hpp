@@ -5,7 +5,8 @@
 
 enum class ShaderType : uint8_t {
 	Vertex,
-	Fragment
+	Fragment,
+	Compute
 };
 
 template<ShaderType Type>
@@ -57,6 +58,8 @@ private:
 				return GL_VERTEX_SHADER;
 			case ShaderType::Fragment:
 				return GL_FRAGMENT_SHADER;
+			case ShaderType::Compute:
+				return GL_COMPUTE_SHADER;
 			default:
 				return -1;
 		}
@@ -75,6 +78,13 @@ public:
 
 	ShaderProgram() = default;
 
+	// Takes ownership of a program linked elsewhere (e.g. restored by ProgramBinaryCache).
+	static ShaderProgram adopt(unsigned int id) {
+		ShaderProgram program;
+		program._id = id;
+		return program;
+	}
+
 	ShaderProgram(ShaderProgram&& other) {
 		glDeleteProgram(_id);
 		_id = other._id;
@@ -155,4 +165,8 @@ void ShaderProgram::set<glm::mat4>(const std::string_view name, const glm::mat4
 template<>
 void ShaderProgram::set<glm::vec3>(const std::string_view name, const glm::vec3 value) {
 	glUniform3fv(glGetUniformLocation(_id, name.data()), 1, glm::value_ptr(value));
-}
\ No newline at end of file
+}
+template<>
+void ShaderProgram::set<glm::vec2>(const std::string_view name, const glm::vec2 value) {
+	glUniform2fv(glGetUniformLocation(_id, name.data()), 1, glm::value_ptr(value));
+}
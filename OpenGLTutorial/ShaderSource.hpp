@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Utils.hpp"
+
+#ifndef SHADERS_SOURCE_DIR
+#define SHADERS_SOURCE_DIR "INCORRECT SOURCE DIR"
+#endif
+
+// GLSL with two extra directives, both resolved before the driver sees the code:
+//   #include "Common/Octahedral.glsl"  - pasted in place, paths relative to the shaders root, each file once.
+//   #pragma feature NAME              - declares a compile-time switch, see ShaderPermutations.
+struct ShaderSource {
+    std::string text;
+    std::vector<std::string> features;
+    // Index is the source number in #line directives, so driver errors like "2(14)" can be traced back.
+    std::vector<std::string> files;
+
+    static ShaderSource load(const std::string& path, const std::string& root = SHADERS_SOURCE_DIR) {
+        ShaderSource source;
+        std::set<std::string> included;
+        source.append(root, path, Utils::readFile(root + "/" + path), included);
+        return source;
+    }
+
+    // Generated code, same directives as a file. The name only ends up as files[0], which nothing watches.
+    static ShaderSource parse(const std::string& name, const std::string& text, const std::string& root = SHADERS_SOURCE_DIR) {
+        ShaderSource source;
+        std::set<std::string> included;
+        source.append(root, name, text, included);
+        return source;
+    }
+
+    // Defines go right after #version, which has to stay the first line.
+    std::string withDefines(const std::vector<std::string>& defines) const {
+        if (defines.empty()) return text;
+        const auto versionEnd = text.rfind("#version", 0) == 0 ? text.find('\n') + 1 : 0;
+        std::string result = text.substr(0, versionEnd);
+        for (const auto& define : defines) {
+            result += "#define " + define + " 1\n";
+        }
+        result += "#line " + std::to_string(versionEnd ? 2 : 1) + " 0\n";
+        result += text.substr(versionEnd);
+        return result;
+    }
+
+private:
+    void append(const std::string& root, const std::string& path, const std::string& content, std::set<std::string>& included) {
+        if (!included.insert(path).second) return;
+        const int fileIndex = static_cast<int>(files.size());
+        files.push_back(path);
+
+        std::istringstream lines(content);
+        std::string line;
+        int lineNumber = 0;
+        while (std::getline(lines, line)) {
+            lineNumber++;
+            const auto start = line.find_first_not_of(" \t");
+            const auto directive = start == std::string::npos ? std::string_view() : std::string_view(line).substr(start);
+
+            if (directive.starts_with("#include")) {
+                const auto open = line.find('"');
+                const auto close = line.find('"', open + 1);
+                if (open == std::string::npos || close == std::string::npos) {
+                    throw std::runtime_error("Malformed #include in " + path + ": " + line);
+                }
+                const auto includePath = line.substr(open + 1, close - open - 1);
+                if (included.contains(includePath)) {
+                    text += "\n";
+                    continue;
+                }
+                text += "#line 1 " + std::to_string(static_cast<int>(files.size())) + "\n";
+                append(root, includePath, Utils::readFile(root + "/" + includePath), included);
+                text += "#line " + std::to_string(lineNumber + 1) + " " + std::to_string(fileIndex) + "\n";
+                continue;
+            }
+
+            if (directive.starts_with("#pragma feature")) {
+                std::istringstream words{std::string(directive.substr(15))};
+                std::string feature;
+                words >> feature;
+                if (std::find(features.begin(), features.end(), feature) == features.end()) {
+                    features.push_back(feature);
+                }
+                // Blank line keeps the numbering.
+                text += "\n";
+                continue;
+            }
+
+            text += line;
+            text += "\n";
+        }
+    }
+};
@@ -0,0 +1,18 @@
+// Vertex half of the G-buffer motion, see GBufferOutputs.glsl. objectMotion takes this frame's world position to last
+// frame's and stays identity for anything that didn't move. Camera motion isn't in here, TemporalReuse has both
+// frames' matrices and works it out from depth.
+uniform mat4 objectMotion = mat4(1.0);
+
+out vec4 MotionClipPos;
+out vec4 MotionPreviousClipPos;
+
+void WriteMotion(mat4 viewProjection, vec4 worldPos) {
+    MotionClipPos = viewProjection * worldPos;
+    MotionPreviousClipPos = viewProjection * (objectMotion * worldPos);
+}
+
+// Sky and the like, nothing moves on its own.
+void WriteStaticMotion() {
+    MotionClipPos = vec4(0.0, 0.0, 0.0, 1.0);
+    MotionPreviousClipPos = vec4(0.0, 0.0, 0.0, 1.0);
+}
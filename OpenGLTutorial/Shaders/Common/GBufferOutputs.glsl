@@ -0,0 +1,23 @@
+// Everything drawn into DeferredFramebuffer writes through here. A zero normal marks pixels the lighting leaves alone.
+#pragma feature OCTAHEDRAL_NORMALS
+#include "Common/Octahedral.glsl"
+
+layout (location = 0) out vec3 gPosition;
+layout (location = 1) out vec4 gAlbedo;
+layout (location = 2) out vec3 gNormal;
+// Object motion in UV units under this frame's camera, Common/GBufferMotion.glsl fills the inputs.
+layout (location = 3) out vec2 gMotion;
+
+in vec4 MotionClipPos;
+in vec4 MotionPreviousClipPos;
+
+void WriteGBuffer(vec3 position, vec4 albedo, vec3 normal) {
+    gPosition = position;
+    gAlbedo = albedo;
+#ifdef OCTAHEDRAL_NORMALS
+    gNormal = vec3(dot(normal, normal) > 0.0 ? OctahedralEncode(normal) : vec2(0.0), 0.0);
+#else
+    gNormal = normal;
+#endif
+    gMotion = MotionPreviousClipPos.w > 0.0 ? 0.5 * (MotionClipPos.xy / MotionClipPos.w - MotionPreviousClipPos.xy / MotionPreviousClipPos.w) : vec2(0.0);
+}
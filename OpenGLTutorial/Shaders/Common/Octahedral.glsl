@@ -0,0 +1,22 @@
+// Octahedral normal packing for the compact G-buffer, two snorm channels instead of three.
+
+vec2 SignNotZero(vec2 v) {
+    return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+// Unit normal onto the octahedron, folded into [-1, 1]^2.
+vec2 OctahedralEncode(vec3 n) {
+    vec2 p = n.xy / (abs(n.x) + abs(n.y) + abs(n.z));
+    if (n.z < 0.0) p = (1.0 - abs(p.yx)) * SignNotZero(p);
+    // Exact zero means "no normal" (sky, emissive). Straight up sits one snorm step off it instead.
+    if (all(lessThan(abs(p), vec2(0.5 / 32767.0)))) p.x = 1.0 / 32767.0;
+    return p;
+}
+
+// Exact zero stays a zero "no normal".
+vec3 OctahedralDecode(vec2 p) {
+    if (p == vec2(0.0)) return vec3(0.0);
+    vec3 n = vec3(p, 1.0 - abs(p.x) - abs(p.y));
+    if (n.z < 0.0) n.xy = (1.0 - abs(p.yx)) * SignNotZero(p);
+    return normalize(n);
+}
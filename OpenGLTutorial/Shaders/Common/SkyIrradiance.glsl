@@ -0,0 +1,13 @@
+// Skybox irradiance as order 2 spherical harmonics, filled once by Skybox. Coefficients come premultiplied
+// (cosine lobe, basis constants, 1/pi), so this is only the polynomial.
+layout (std140) uniform SkyIrradiance {
+    vec4 skyIrradiance[9];
+};
+
+vec3 SkyAmbient(vec3 n) {
+    return skyIrradiance[0].rgb
+        + skyIrradiance[1].rgb * n.y + skyIrradiance[2].rgb * n.z + skyIrradiance[3].rgb * n.x
+        + skyIrradiance[4].rgb * (n.x * n.y) + skyIrradiance[5].rgb * (n.y * n.z)
+        + skyIrradiance[6].rgb * (3.0 * n.z * n.z - 1.0)
+        + skyIrradiance[7].rgb * (n.x * n.z) + skyIrradiance[8].rgb * (n.x * n.x - n.y * n.y);
+}
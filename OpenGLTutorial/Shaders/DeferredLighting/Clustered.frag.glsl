@@ -0,0 +1,70 @@
+#version 330 core
+#include "DeferredLighting/GBufferInputs.glsl"
+
+// Has to match LightClusterGrid.
+const uint TILES_X = 16u;
+const uint TILES_Y = 9u;
+const uint SLICES = 24u;
+// Texels per light in the lights buffer, see DeferredLighting::packLights.
+const int LIGHT_STRIDE = 5;
+
+uniform samplerBuffer lights;
+uniform usamplerBuffer clusters;
+uniform usamplerBuffer lightIndices;
+
+uniform mat4 view;
+uniform vec3 viewPos;
+uniform float shininess;
+uniform float nearPlane;
+uniform float farPlane;
+uniform float screenWidth;
+uniform float screenHeight;
+
+out vec4 FragColor;
+
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    if (Reused(texel)) discard;
+    vec3 normal = FetchNormal(texel);
+    if (dot(normal, normal) < 0.25) discard;
+    normal = normalize(normal);
+
+    vec3 fragPos = FetchPosition(texel);
+    vec4 albedo = texelFetch(gAlbedo, texel, 0);
+    vec3 viewDir = normalize(viewPos - fragPos);
+
+    float depth = -(view * vec4(fragPos, 1.0)).z;
+    uint slice = uint(clamp(log(depth / nearPlane) / log(farPlane / nearPlane) * float(SLICES), 0.0, float(SLICES - 1u)));
+    uint tileX = min(uint(gl_FragCoord.x / screenWidth * float(TILES_X)), TILES_X - 1u);
+    uint tileY = min(uint(gl_FragCoord.y / screenHeight * float(TILES_Y)), TILES_Y - 1u);
+    uvec2 range = texelFetch(clusters, int((slice * TILES_Y + tileY) * TILES_X + tileX)).rg;
+
+    vec3 result = vec3(0);
+    for (uint i=0u; i<range.y; ++i) {
+        int base = int(texelFetch(lightIndices, int(range.x + i)).r) * LIGHT_STRIDE;
+        vec4 positionCutoffEnd = texelFetch(lights, base);
+        vec4 diffuseConstant = texelFetch(lights, base + 1);
+        vec4 specularLinear = texelFetch(lights, base + 2);
+        vec4 ambientQuadratic = texelFetch(lights, base + 3);
+        vec4 directionCutoffStart = texelFetch(lights, base + 4);
+
+        vec3 toLight = positionCutoffEnd.xyz - fragPos;
+        float dist = length(toLight);
+        vec3 lightDir = toLight / dist;
+        float attenuation = 1.0 / (diffuseConstant.w + specularLinear.w * dist + ambientQuadratic.w * dist * dist);
+
+        // Point lights have no direction and never cut off.
+        float cutoff = 1.0;
+        if (dot(directionCutoffStart.xyz, directionCutoffStart.xyz) > 0.0) {
+            float theta = dot(-lightDir, directionCutoffStart.xyz);
+            cutoff = clamp((theta - positionCutoffEnd.w) / (directionCutoffStart.w - positionCutoffEnd.w), 0.0, 1.0);
+        }
+
+        float diff = max(dot(normal, lightDir), 0.0);
+        float spec = pow(max(dot(viewDir, reflect(-lightDir, normal)), 0.0), shininess);
+        result += attenuation * (ambientQuadratic.rgb * albedo.rgb
+            + cutoff * (diffuseConstant.rgb * diff * albedo.rgb + specularLinear.rgb * spec * albedo.a));
+    }
+    FragColor = vec4(result, 1.0);
+}
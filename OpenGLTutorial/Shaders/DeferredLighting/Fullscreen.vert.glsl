@@ -6,4 +6,4 @@ out vec2 FragPos;
 void main() {
     gl_Position = vec4(aPos, 1);
     FragPos = aPos.xy;
-}
\ No newline at end of file
+}
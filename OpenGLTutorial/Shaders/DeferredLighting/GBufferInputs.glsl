@@ -0,0 +1,52 @@
+// G-buffer reads shared by the lighting passes. OCTAHEDRAL_NORMALS and POSITION_FROM_DEPTH follow the GBufferLayout,
+// TEMPORAL_REUSE is on when TemporalReuse has last frame's lighting for some of the pixels.
+#pragma feature OCTAHEDRAL_NORMALS
+#pragma feature POSITION_FROM_DEPTH
+#pragma feature TEMPORAL_REUSE
+#include "Common/Octahedral.glsl"
+
+uniform sampler2D gAlbedo;
+uniform sampler2D gNormal;
+#ifdef POSITION_FROM_DEPTH
+uniform sampler2D gDepth;
+uniform mat4 inverseProjection;
+uniform mat4 inverseView;
+// Rendered part of the G-buffer, its targets can be bigger (see FramebufferBase::setRenderSize).
+uniform vec2 viewportSize;
+#else
+uniform sampler2D gPosition;
+#endif
+
+vec3 FetchNormal(ivec2 texel) {
+#ifdef OCTAHEDRAL_NORMALS
+    return OctahedralDecode(texelFetch(gNormal, texel, 0).xy);
+#else
+    return texelFetch(gNormal, texel, 0).xyz;
+#endif
+}
+
+vec3 FetchPosition(ivec2 texel) {
+#ifdef POSITION_FROM_DEPTH
+    // No position target, back out of NDC through the inverse matrices instead.
+    float depth = texelFetch(gDepth, texel, 0).r;
+    vec2 ndc = (vec2(texel) + 0.5) / viewportSize * 2.0 - 1.0;
+    vec4 viewPosition = inverseProjection * vec4(ndc, depth * 2.0 - 1.0, 1.0);
+    return (inverseView * vec4(viewPosition.xyz / viewPosition.w, 1.0)).xyz;
+#else
+    return texelFetch(gPosition, texel, 0).xyz;
+#endif
+}
+
+#ifdef TEMPORAL_REUSE
+// Reprojected last frame, alpha set where it held up.
+uniform sampler2D temporalHistory;
+#endif
+
+// Pixels the lighting leaves alone because the resolve copies them over from last frame.
+bool Reused(ivec2 texel) {
+#ifdef TEMPORAL_REUSE
+    return texelFetch(temporalHistory, texel, 0).a > 0.5;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,96 @@
+#version 330 core
+#pragma feature SPOT_LIGHT
+#pragma feature SHADOW
+#include "DeferredLighting/GBufferInputs.glsl"
+
+// Spot and point lights share this, a point light is just a spot that never cuts off.
+struct Light {
+    vec3 position;
+    vec3 direction;
+    float cutoffStart;
+    float cutoffEnd;
+
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+
+    float constant;
+    float linear;
+    float quadratic;
+};
+
+uniform vec3 viewPos;
+uniform float shininess;
+uniform Light light;
+
+#ifdef SHADOW
+#ifdef SPOT_LIGHT
+uniform sampler2DShadow shadowMap;
+uniform mat4 lightSpace;
+#else
+uniform samplerCubeShadow shadowCube;
+// Cube maps store distance / shadowFar.
+uniform float shadowFar;
+#endif
+#endif
+
+out vec4 FragColor;
+
+float CalcAttenuation(vec3 fragPos) {
+    float dist = length(light.position - fragPos);
+    return 1.0f / (light.constant + light.linear * dist + light.quadratic * dist * dist);
+}
+
+float CalcCutoff(vec3 fragPos) {
+#ifndef SPOT_LIGHT
+    return 1.0;
+#else
+    float theta     = dot(normalize(fragPos - light.position), normalize(light.direction));
+    float epsilon   = light.cutoffStart - light.cutoffEnd;
+    return clamp((theta - light.cutoffEnd) / epsilon, 0.0, 1.0);
+#endif
+}
+
+// Fraction of the light reaching fragPos, hardware 2x2 PCF through the shadow samplers.
+float CalcShadow(vec3 fragPos, vec3 normal) {
+#ifndef SHADOW
+    return 1.0;
+#elif defined(SPOT_LIGHT)
+    // Pushed along the normal a bit, keeps surfaces facing away from the light from shadowing themselves.
+    vec4 lightClip = lightSpace * vec4(fragPos + 0.02 * normal, 1.0);
+    vec3 coord = lightClip.xyz / lightClip.w * 0.5 + 0.5;
+    return texture(shadowMap, coord);
+#else
+    vec3 toFragment = fragPos + 0.02 * normal - light.position;
+    return texture(shadowCube, vec4(toFragment, length(toFragment) / shadowFar - 0.002));
+#endif
+}
+
+void main()
+{
+    // Volumes are drawn at G-buffer resolution, so the fragment is the texel.
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    if (Reused(texel)) discard;
+    vec3 normal = FetchNormal(texel);
+    // Sky and emissive surfaces have no normal and aren't lit.
+    if (dot(normal, normal) < 0.25) discard;
+    normal = normalize(normal);
+
+    vec3 fragPos = FetchPosition(texel);
+    vec4 albedo = texelFetch(gAlbedo, texel, 0);
+
+    vec3 lightDir = normalize(light.position - fragPos);
+    vec3 viewDir = normalize(viewPos - fragPos);
+    vec3 reflectDir = reflect(-lightDir, normal);
+
+    float diff = max(dot(normal, lightDir), 0.0);
+    float spec = pow(max(dot(viewDir, reflectDir), 0.0), shininess);
+
+    float attenuation = CalcAttenuation(fragPos);
+    float visibility = CalcCutoff(fragPos) * CalcShadow(fragPos, normal);
+
+    vec3 ambient = light.ambient * albedo.rgb;
+    vec3 diffuse = visibility * light.diffuse * diff * albedo.rgb;
+    vec3 specular = visibility * light.specular * spec * albedo.a;
+    FragColor = vec4(attenuation * (ambient + diffuse + specular), 1.0);
+}
@@ -0,0 +1,13 @@
+#version 330 core
+in vec2 FragPos;
+
+out vec4 FragColor;
+
+uniform sampler2D imageTexture;
+// Rendered part of the texture.
+uniform vec2 viewportScale = vec2(1.f);
+
+void main() {
+    vec2 normalizedPos = (FragPos + vec2(1.f))/2.f * viewportScale;
+    FragColor = vec4(clamp(texture(imageTexture, normalizedPos).rgb, 0.0, 1.0), 1.f);
+}
@@ -0,0 +1,36 @@
+#version 330 core
+
+#include "DeferredLighting/GBufferInputs.glsl"
+#pragma feature SKY_AMBIENT
+
+uniform vec3 ambient;
+
+#ifdef SKY_AMBIENT
+#include "Common/SkyIrradiance.glsl"
+uniform float skyAmbientStrength;
+#endif
+
+out vec4 FragColor;
+
+// Starts the light buffer off: emissive/sky pixels as they are, the rest with a bit of ambient.
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+#ifdef TEMPORAL_REUSE
+    if (Reused(texel)) {
+        FragColor = vec4(texelFetch(temporalHistory, texel, 0).rgb, 1.0);
+        return;
+    }
+#endif
+    vec3 normal = FetchNormal(texel);
+    vec3 albedo = texelFetch(gAlbedo, texel, 0).rgb;
+    if (dot(normal, normal) < 0.25) {
+        FragColor = vec4(albedo, 1.0);
+        return;
+    }
+#ifdef SKY_AMBIENT
+    FragColor = vec4(max(SkyAmbient(normalize(normal)), vec3(0.0)) * skyAmbientStrength * albedo, 1.0);
+#else
+    FragColor = vec4(ambient * albedo, 1.0);
+#endif
+}
@@ -0,0 +1,18 @@
+#version 330 core
+#include "DeferredLighting/GBufferInputs.glsl"
+
+uniform sampler2D litTexture;
+uniform mat4 view;
+
+layout (location = 0) out vec4 HistoryColor;
+layout (location = 1) out vec4 HistoryGeometry;
+
+// What next frame's reprojection checks against: the lighting, plus facing and view depth of the surface it lit.
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    HistoryColor = texelFetch(litTexture, texel, 0);
+    vec3 normal = FetchNormal(texel);
+    float depth = -(view * vec4(FetchPosition(texel), 1.0)).z;
+    HistoryGeometry = vec4(dot(normal, normal) > 0.25 ? normalize(normal) : vec3(0.0), depth);
+}
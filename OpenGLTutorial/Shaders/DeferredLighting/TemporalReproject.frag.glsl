@@ -0,0 +1,47 @@
+#version 330 core
+#include "DeferredLighting/GBufferInputs.glsl"
+
+uniform sampler2D gMotion;
+uniform sampler2D historyColor;
+uniform sampler2D historyGeometry;
+uniform mat4 previousViewProjection;
+uniform mat4 previousView;
+uniform int refreshPeriod;
+uniform int refreshPhase;
+uniform float depthTolerance;
+uniform float normalTolerance;
+// What last frame rendered of the history targets.
+uniform vec2 previousViewportSize;
+
+out vec4 FragColor;
+
+// Last frame's lighting for this surface, or discard where it can't be trusted. The target starts out cleared, so
+// discarded pixels read back as not reused and the samples passed count the reused ones.
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    vec3 normal = FetchNormal(texel);
+    // Unlit anyway, the resolve copies them for free.
+    if (dot(normal, normal) < 0.25) discard;
+    normal = normalize(normal);
+
+    // Rotating subset of 8x8 tiles shades regardless, so nothing stays stale for more than refreshPeriod frames.
+    ivec2 tile = texel / 8;
+    if (refreshPeriod > 0 && (tile.x + 3 * tile.y) % refreshPeriod == refreshPhase) discard;
+
+    vec3 position = FetchPosition(texel);
+    vec4 previousClip = previousViewProjection * vec4(position, 1.0);
+    if (previousClip.w <= 0.0) discard;
+    // Camera motion from the matrices, whatever the object did on top from the G-buffer.
+    vec2 previousUv = previousClip.xy / previousClip.w * 0.5 + 0.5 - texelFetch(gMotion, texel, 0).xy;
+    if (any(lessThan(previousUv, vec2(0.0))) || any(greaterThanEqual(previousUv, vec2(1.0)))) discard;
+
+    // Disocclusion shows up as a different depth or facing at the spot we came from.
+    ivec2 previousTexel = ivec2(previousUv * previousViewportSize);
+    vec4 history = texelFetch(historyGeometry, previousTexel, 0);
+    float expectedDepth = -(previousView * vec4(position, 1.0)).z;
+    if (abs(history.w - expectedDepth) > depthTolerance * expectedDepth) discard;
+    if (dot(history.xyz, normal) < normalTolerance) discard;
+
+    FragColor = vec4(texelFetch(historyColor, previousTexel, 0).rgb, 1.0);
+}
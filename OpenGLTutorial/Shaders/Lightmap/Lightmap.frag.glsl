@@ -0,0 +1,20 @@
+#version 330 core
+
+in vec2 LightmapCoords;
+
+uniform sampler2D gAlbedo;
+uniform sampler2D lightmap;
+uniform float intensity;
+// TemporalReuse's reprojection, those pixels have their baked light already.
+uniform sampler2D temporalHistory;
+uniform bool temporalReuse = false;
+
+out vec4 FragColor;
+
+// Baked static lights added on top of the resolve. Albedo is whatever the G-buffer has under this fragment.
+void main()
+{
+    if (temporalReuse && texelFetch(temporalHistory, ivec2(gl_FragCoord.xy), 0).a > 0.5) discard;
+    vec3 albedo = texelFetch(gAlbedo, ivec2(gl_FragCoord.xy), 0).rgb;
+    FragColor = vec4(intensity * texture(lightmap, LightmapCoords).rgb * albedo, 1.0);
+}
@@ -0,0 +1,18 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec2 aLightmapCoords;
+
+out vec2 LightmapCoords;
+
+// Same expression as phong.vert, so the depth comes out identical to what the G-buffer holds.
+invariant gl_Position;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+void main()
+{
+    gl_Position = projection * view * model * vec4(aPos, 1.0);
+    LightmapCoords = aLightmapCoords;
+}
@@ -0,0 +1,28 @@
+// Per-pixel stage, see PostProcessGraph.hpp. Ordered dither of the luminance against a tiled Bayer matrix, or with
+// PALETTE of the color, onto whatever palette BayerMatrixDither::setPalette() baked into the lookup.
+#pragma feature PALETTE
+uniform sampler2D bayerMatrixTexture;
+uniform float matrixVerticalScale = 1.f;
+uniform float matrixHorizontalScale = 1.f;
+
+#ifdef PALETTE
+// Nearest palette color per RGB cell, cell i of an axis stands for i / (size - 1).
+uniform sampler3D paletteLut;
+uniform float paletteLutSize;
+// How far the matrix pushes a pixel, about the spacing between palette colors.
+uniform float paletteSpread;
+#endif
+
+vec4 Apply(vec4 imageColor, vec2 normalizedPos) {
+    vec2 scaledMatrixPos = vec2(matrixHorizontalScale, matrixVerticalScale) * normalizedPos;
+    vec3 matrixValue = texture(bayerMatrixTexture, scaledMatrixPos).xyz;
+
+#ifdef PALETTE
+    // Matrix values average 15/32, centered so the dither doesn't shift the picture's brightness.
+    vec3 dithered = clamp(imageColor.rgb + paletteSpread * (matrixValue - 0.46875), 0.0, 1.0);
+    return vec4(texture(paletteLut, (dithered * (paletteLutSize - 1.0) + 0.5) / paletteLutSize).rgb, 1.f);
+#else
+    vec3 grayscaleColor = vec3(0.21f * imageColor.r + 0.72 * imageColor.g + 0.07f * imageColor.b);
+    return vec4(round(grayscaleColor + .9f*(matrixValue - 0.45f)), 1.f);
+#endif
+}
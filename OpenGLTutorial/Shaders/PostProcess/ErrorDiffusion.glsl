@@ -0,0 +1,9 @@
+// Source stage, see PostProcessGraph.hpp. Shows the frame ErrorDiffusionDither dithered on the CPU, or the input
+// itself until the first one is back.
+uniform sampler2D diffusedTexture;
+uniform bool hasDiffused = false;
+
+vec4 Source(vec2 normalizedPos) {
+    if (!hasDiffused) return vec4(clamp(texture(imageTexture, normalizedPos).rgb, 0.0, 1.0), 1.f);
+    return vec4(vec3(texture(diffusedTexture, normalizedPos).r), 1.f);
+}
@@ -0,0 +1,11 @@
+#version 330 core
+
+out vec2 FragPos;
+
+// One triangle covering the screen, (-1,-1) (3,-1) (-1,3). Drawn from an empty VAO, no vertex buffer involved,
+// and no diagonal seam where two triangles' helper pixels would get shaded twice.
+void main() {
+    vec2 position = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2) * 2.f - vec2(1.f);
+    gl_Position = vec4(position, 0.f, 1.f);
+    FragPos = position;
+}
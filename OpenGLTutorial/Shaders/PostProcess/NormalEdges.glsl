@@ -1,14 +1,22 @@
-#version 330
-in vec2 FragPos;
+// Source stage, see PostProcessGraph.hpp. Edges where neighbouring normals disagree.
+#pragma feature OCTAHEDRAL_NORMALS
+#include "Common/Octahedral.glsl"
 
-out vec4 FragColor;
-
-uniform sampler2D imageTexture;
 uniform float imageVerticalScale = 1.f;
 uniform float imageHorizontalScale = 1.f;
 
-void main() {
-    vec2 normalizedPos = (FragPos + vec2(1.f))/2.f;
+// Same as the lighting shaders, zero stays zero so the sky still outlines everything. Clamped to the drawn part of
+// the image, past it is whatever the G-buffer was cleared to.
+vec3 normalEdgesFetch(vec2 coord, vec2 imageStep) {
+    coord = min(coord, viewportScale - 0.5 * imageStep);
+#ifdef OCTAHEDRAL_NORMALS
+    return OctahedralDecode(texture(imageTexture, coord).xy);
+#else
+    return vec3(texture(imageTexture, coord));
+#endif
+}
+
+vec4 Source(vec2 normalizedPos) {
     vec2 imageStep = vec2(1.f/imageHorizontalScale, 1.f/imageVerticalScale);
 
     vec2 top_left_coord = normalizedPos     + vec2(-imageStep.x, imageStep.y);
@@ -20,15 +28,14 @@ void main() {
     vec2 center_left_coord = normalizedPos  + vec2(-imageStep.x, 0.f);
     vec2 center_right_coord = normalizedPos + vec2(imageStep.x,  0.f);
 
-    
-    vec3 color_top_left     = vec3(texture(imageTexture, top_left_coord));
-    vec3 color_top_mid      = vec3(texture(imageTexture, top_mid_coord));
-    vec3 color_top_right    = vec3(texture(imageTexture, top_right_coord));
-    vec3 color_bottom_left  = vec3(texture(imageTexture, bottom_left_coord));
-    vec3 color_bottom_mid   = vec3(texture(imageTexture, bottom_mid_coord));
-    vec3 color_bottom_right = vec3(texture(imageTexture, bottom_right_coord));
-    vec3 color_center_left  = vec3(texture(imageTexture, center_left_coord));
-    vec3 color_center_right = vec3(texture(imageTexture, center_right_coord));
+    vec3 color_top_left     = normalEdgesFetch(top_left_coord, imageStep);
+    vec3 color_top_mid      = normalEdgesFetch(top_mid_coord, imageStep);
+    vec3 color_top_right    = normalEdgesFetch(top_right_coord, imageStep);
+    vec3 color_bottom_left  = normalEdgesFetch(bottom_left_coord, imageStep);
+    vec3 color_bottom_mid   = normalEdgesFetch(bottom_mid_coord, imageStep);
+    vec3 color_bottom_right = normalEdgesFetch(bottom_right_coord, imageStep);
+    vec3 color_center_left  = normalEdgesFetch(center_left_coord, imageStep);
+    vec3 color_center_right = normalEdgesFetch(center_right_coord, imageStep);
 
     // Horizontal
     float result_x = 0.f;
@@ -36,15 +43,13 @@ void main() {
     result_x += 1.f - abs(dot(color_center_left, color_center_right));
     result_x += 1.f - abs(dot(color_bottom_left, color_bottom_right));
 
-    // Horizontal
+    // Vertical
     float result_y = 0.f;
     result_y += 1.f - abs(dot(color_top_left, color_bottom_left));
     result_y += 1.f - abs(dot(color_top_mid, color_bottom_mid));
     result_y += 1.f - abs(dot(color_top_right, color_bottom_right));
-    
-    //vec3 outputColor = vec3(step(0.015, length(result_x)) + step(0.015, length(result_y)));
+
     vec3 outputColor = vec3(step(0.4, abs(result_x + result_y)));
 
-    FragColor = vec4(vec3(1.f) - outputColor, 1.f);
-    // FragColor = texture(imageTexture, normalizedPos);
-}
\ No newline at end of file
+    return vec4(vec3(1.f) - outputColor, 1.f);
+}
@@ -0,0 +1,6 @@
+// Per-pixel stage, see PostProcessGraph.hpp. Thresholds the gradient pair PrewittFilter convolves into red and green.
+vec4 Apply(vec4 gradients, vec2 normalizedPos) {
+    vec3 outputColor = vec3(step(0.015, length(vec3(gradients.r))) + step(0.015, length(vec3(gradients.g))));
+
+    return vec4(vec3(1.f) - outputColor, length(outputColor));
+}
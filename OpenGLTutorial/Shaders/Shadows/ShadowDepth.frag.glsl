@@ -0,0 +1,21 @@
+#version 330 core
+#pragma feature LINEAR_DEPTH
+
+in vec3 WorldPos;
+
+#ifdef LINEAR_DEPTH
+uniform vec3 lightPosition;
+uniform float farPlane;
+// Slope factor and units, like glPolygonOffset. Units are steps of the 24 bit map.
+uniform vec2 depthBias;
+#endif
+
+void main()
+{
+#ifdef LINEAR_DEPTH
+    // Cube maps are looked up by direction, distance compares the same whichever face it lands on.
+    float depth = length(WorldPos - lightPosition) / farPlane;
+    float slope = max(abs(dFdx(depth)), abs(dFdy(depth)));
+    gl_FragDepth = depth + depthBias.x * slope + depthBias.y / 16777215.0;
+#endif
+}
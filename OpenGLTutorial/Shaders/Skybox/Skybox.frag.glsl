@@ -1,15 +1,10 @@
 #version 330
-
-layout (location = 0) out vec3 gPosition;
-layout (location = 1) out vec4 gAlbedo;
-layout (location = 2) out vec3 gNormal;
+#include "Common/GBufferOutputs.glsl"
 
 in vec3 TexCoords; // direction vector representing a 3D texture coordinate
 uniform samplerCube cubemap; // cubemap texture sampler
 
 void main()
 {             
-    gPosition = vec3(0);
-    gAlbedo = texture(cubemap, TexCoords);
-    gNormal = vec3(0);
-}  
\ No newline at end of file
+    WriteGBuffer(vec3(0), texture(cubemap, TexCoords), vec3(0));
+}  
@@ -6,8 +6,11 @@ out vec3 TexCoords;
 uniform mat4 view;
 uniform mat4 projection;
 
+#include "Common/GBufferMotion.glsl"
+
 void main() {
     TexCoords = aPos;
     vec4 pos = projection * view * vec4(aPos, 1.0);
     gl_Position = pos.xyww;
+    WriteStaticMotion();
 }
\ No newline at end of file
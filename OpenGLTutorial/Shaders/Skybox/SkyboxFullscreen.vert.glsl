@@ -0,0 +1,19 @@
+#version 330
+
+out vec3 TexCoords;
+
+// Of the rotation-only view, same as the cube gets.
+uniform mat4 inverseViewProjection;
+
+#include "Common/GBufferMotion.glsl"
+
+// Same triangle as PostProcess/Fullscreen.vert.glsl, but at the far plane: with GL_LEQUAL it only survives where the
+// geometry left the cleared depth alone, and the early depth test takes care of the rest before shading.
+void main() {
+    vec2 position = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2) * 2.f - vec2(1.f);
+    gl_Position = vec4(position, 1.f, 1.f);
+    // w is the same everywhere on the far plane, so the direction still interpolates linearly after dividing.
+    vec4 direction = inverseViewProjection * vec4(position, 1.f, 1.f);
+    TexCoords = direction.xyz / direction.w;
+    WriteStaticMotion();
+}
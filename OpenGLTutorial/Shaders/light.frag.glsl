@@ -1,9 +1,10 @@
 #version 330 core
-out vec4 FragColor;
+#include "Common/GBufferOutputs.glsl"
 
 uniform vec3 lightColor;
 
+// No normal - the lighting pass passes it through unlit.
 void main()
 {
-    FragColor = vec4(lightColor, 1.0);
-}
\ No newline at end of file
+    WriteGBuffer(vec3(0), vec4(lightColor, 0.0), vec3(0));
+}
@@ -5,7 +5,10 @@ uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
 
+#include "Common/GBufferMotion.glsl"
+
 void main()
 {
     gl_Position = projection * view * model * vec4(aPos, 1.0);
+    WriteMotion(projection * view, model * vec4(aPos, 1.0));
 }
\ No newline at end of file
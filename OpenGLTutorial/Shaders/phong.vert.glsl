@@ -7,6 +7,10 @@ out vec3 FragPos;
 out vec3 Normal;
 out vec2 TexCoords;
 
+invariant gl_Position;
+
+#include "Common/GBufferMotion.glsl"
+
 uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
@@ -17,4 +21,5 @@ void main()
     FragPos = vec3(model * vec4(aPos, 1.0));
     TexCoords = aTexCoords;
     Normal = mat3(transpose(inverse(model))) * aNormal;
+    WriteMotion(projection * view, model * vec4(aPos, 1.0));
 }
\ No newline at end of file
@@ -0,0 +1,304 @@
+#pragma once
+
+#include "glad/glad.h"
+#include "glm/glm.hpp"
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <functional>
+#include <vector>
+
+#include "ShaderProgram.hpp"
+#include "ShaderPermutations.hpp"
+#include "GpuQuery.hpp"
+#include "Frustum.hpp"
+#include "Lights.hpp"
+
+enum class ShadowType : uint8_t {
+    // 2D map through the spot's cone.
+    Spot,
+    // Cube map of distances around the light.
+    Point
+};
+
+// Something drawn into the shadow maps. draw() gets the depth program with the light's matrices already set,
+// it only has to set "model" and draw. The sphere decides which lights it can reach.
+struct ShadowCaster {
+    glm::vec3 center;
+    float radius;
+    std::function<void(ShaderProgram&)> draw;
+};
+
+struct ShadowStats {
+    size_t lights = 0;
+    // Static map reused as is / re-rendered because the light or the static scene changed.
+    size_t cacheHits = 0;
+    size_t cacheMisses = 0;
+    // Lights with a dynamic caster in range, their static map copied and the casters drawn on top.
+    size_t composited = 0;
+    float milliseconds = 0.f;
+
+    float hitRate() const { return cacheHits + cacheMisses ? static_cast<float>(cacheHits) / (cacheHits + cacheMisses) : 0.f; }
+};
+
+// Shadow maps for a handful of spot and point lights. Static geometry only gets rendered into a light's map when
+// the light moved or the static scene was invalidated, everything else reuses last frame's map. Dynamic casters
+// can't be cached: lights they reach get a copy of the static map with them drawn on top, each frame.
+class ShadowMaps {
+    constexpr static auto lightSpaceName = std::string_view("lightSpace");
+    constexpr static auto lightPositionName = std::string_view("lightPosition");
+    constexpr static auto farPlaneName = std::string_view("farPlane");
+    constexpr static auto depthBiasName = std::string_view("depthBias");
+    // glPolygonOffset's factor and units, the cube pass adds the same in the shader.
+    constexpr static float slopeBias = 2.f;
+    constexpr static float constantBias = 4.f;
+    constexpr static float nearPlane = 0.05f;
+
+    struct Slot {
+        ShadowType type;
+        unsigned int size;
+        unsigned int staticMap = 0;
+        // Static + dynamic, only allocated once a dynamic caster shows up in range.
+        unsigned int compositeMap = 0;
+        bool composited = false;
+        bool valid = false;
+
+        // What staticMap was rendered with, a light that differs from it needs a new one.
+        glm::vec3 position;
+        glm::vec3 direction;
+        float cutoffEnd = 0.f;
+        float range = 0.f;
+        glm::mat4 lightSpace;
+    };
+
+    std::vector<Slot> _slots;
+    unsigned int _drawFramebuffer = 0;
+    unsigned int _readFramebuffer = 0;
+    ShaderPermutations _depthPermutations;
+    GpuTimer _timer;
+    ShadowStats _stats;
+public:
+    ShadowMaps()
+    : _depthPermutations("Shadows/ShadowDepth.vert.glsl", "Shadows/ShadowDepth.frag.glsl")
+    {
+        glGenFramebuffers(1, &_drawFramebuffer);
+        glGenFramebuffers(1, &_readFramebuffer);
+        // Depth only, no color buffer to draw to or read from.
+        for (const auto framebuffer : { _drawFramebuffer, _readFramebuffer }) {
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        _depthPermutations.warmAll();
+    }
+
+    ~ShadowMaps() {
+        for (const auto& slot : _slots) {
+            glDeleteTextures(1, &slot.staticMap);
+            if (slot.compositeMap) glDeleteTextures(1, &slot.compositeMap);
+        }
+        glDeleteFramebuffers(1, &_drawFramebuffer);
+        glDeleteFramebuffers(1, &_readFramebuffer);
+    }
+
+    ShadowMaps(const ShadowMaps& other) = delete;
+    ShadowMaps& operator=(const ShadowMaps& other) = delete;
+
+    // Goes into PointLight::shadowMap. A slot serves one light, the same one every frame.
+    int add(ShadowType type, unsigned int size) {
+        Slot slot { type, size };
+        slot.staticMap = createMap(type, size);
+        _slots.push_back(slot);
+        return static_cast<int>(_slots.size()) - 1;
+    }
+
+    void invalidate(int slot) { _slots[slot].valid = false; }
+
+    // Static geometry changed, every light has to see it again.
+    void invalidateStatic() {
+        for (auto& slot : _slots) slot.valid = false;
+    }
+
+    // Lights outside the view frustum are skipped and keep whatever they had.
+    void render(const Frustum& frustum, const std::vector<PointLight>& pointLights, const std::vector<SpotLight>& spotLights,
+                const std::function<void(ShaderProgram&)>& drawStatic, const std::vector<ShadowCaster>& dynamicCasters) {
+        _stats.lights = 0;
+        _stats.cacheHits = 0;
+        _stats.cacheMisses = 0;
+        _stats.composited = 0;
+
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        {
+            GpuTimer::ScopedQuery timer(_timer);
+            glEnable(GL_DEPTH_TEST);
+            glDepthFunc(GL_LESS);
+            glDepthMask(GL_TRUE);
+            // Slope scaled bias at render time, the shaders only add a small constant on top. Cube faces write
+            // gl_FragDepth, which the offset doesn't touch, ShadowDepth.frag adds the same bias itself.
+            glEnable(GL_POLYGON_OFFSET_FILL);
+            glPolygonOffset(slopeBias, constantBias);
+
+            for (const auto& light : pointLights) {
+                if (light.shadowMap >= 0) renderLight(frustum, light, glm::vec3(0.f), 1.f, drawStatic, dynamicCasters);
+            }
+            for (const auto& light : spotLights) {
+                if (light.shadowMap >= 0) renderLight(frustum, light, glm::normalize(light.direction), light.cutoffEnd, drawStatic, dynamicCasters);
+            }
+
+            glDisable(GL_POLYGON_OFFSET_FILL);
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        }
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        _stats.milliseconds = _timer.milliseconds();
+    }
+
+    // What the lighting pass samples, 0 if the light was never rendered.
+    unsigned int texture(int slot) const {
+        const auto& s = _slots[slot];
+        if (!s.valid) return 0;
+        return s.composited ? s.compositeMap : s.staticMap;
+    }
+
+    ShadowType type(int slot) const { return _slots[slot].type; }
+    const glm::mat4& lightSpace(int slot) const { return _slots[slot].lightSpace; }
+    // Point maps store distance / farPlane.
+    float farPlane(int slot) const { return _slots[slot].range; }
+
+    const ShadowStats& stats() const { return _stats; }
+    size_t slots() const { return _slots.size(); }
+
+private:
+    void renderLight(const Frustum& frustum, const PointLight& light, const glm::vec3& direction, float cutoffEnd,
+                     const std::function<void(ShaderProgram&)>& drawStatic, const std::vector<ShadowCaster>& dynamicCasters) {
+        auto& slot = _slots[light.shadowMap];
+        const float range = attenuationRange(light);
+        if (range <= 0.f || !frustum.intersectsSphere(light.position, range)) return;
+        _stats.lights++;
+
+        const bool moved = glm::length(light.position - slot.position) > 1e-4f
+            || glm::length(direction - slot.direction) > 1e-4f
+            || std::abs(cutoffEnd - slot.cutoffEnd) > 1e-4f
+            || std::abs(range - slot.range) > 1e-3f;
+        if (moved) slot.valid = false;
+
+        if (slot.valid) {
+            _stats.cacheHits++;
+        } else {
+            _stats.cacheMisses++;
+            slot.position = light.position;
+            slot.direction = direction;
+            slot.cutoffEnd = cutoffEnd;
+            slot.range = range;
+            if (slot.type == ShadowType::Spot) slot.lightSpace = spotMatrix(light.position, direction, cutoffEnd, range);
+            drawCasters(slot, slot.staticMap, [&](ShaderProgram& program) { drawStatic(program); });
+            slot.valid = true;
+        }
+
+        std::vector<const ShadowCaster*> inRange;
+        for (const auto& caster : dynamicCasters) {
+            if (glm::length(caster.center - light.position) < range + caster.radius) inRange.push_back(&caster);
+        }
+        slot.composited = !inRange.empty();
+        if (!slot.composited) return;
+
+        _stats.composited++;
+        if (!slot.compositeMap) slot.compositeMap = createMap(slot.type, slot.size);
+        copyMap(slot);
+        drawCasters(slot, slot.compositeMap, [&](ShaderProgram& program) {
+            for (const auto* caster : inRange) caster->draw(program);
+        }, false);
+    }
+
+    // Into every face of map, cleared first unless it's a composite going on top of the copied static depth.
+    void drawCasters(const Slot& slot, unsigned int map, const std::function<void(ShaderProgram&)>& draw, bool clear = true) {
+        const bool cube = slot.type == ShadowType::Point;
+        auto& program = _depthPermutations.get(cube ? _depthPermutations.feature("LINEAR_DEPTH") : 0);
+        program.use();
+        if (cube) {
+            program.set(lightPositionName, slot.position);
+            program.set(farPlaneName, slot.range);
+            program.set(depthBiasName, glm::vec2(slopeBias, constantBias));
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, _drawFramebuffer);
+        glViewport(0, 0, slot.size, slot.size);
+        for (int face=0; face<(cube ? 6 : 1); ++face) {
+            if (cube) {
+                glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, map, 0);
+                program.set(lightSpaceName, cubeFaceMatrix(slot.position, face, slot.range));
+            } else {
+                glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, map, 0);
+                program.set(lightSpaceName, slot.lightSpace);
+            }
+            if (clear) glClear(GL_DEPTH_BUFFER_BIT);
+            draw(program);
+        }
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, 0, 0);
+    }
+
+    void copyMap(const Slot& slot) {
+        const bool cube = slot.type == ShadowType::Point;
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, _readFramebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _drawFramebuffer);
+        for (int face=0; face<(cube ? 6 : 1); ++face) {
+            const GLenum target = cube ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : GL_TEXTURE_2D;
+            glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, target, slot.staticMap, 0);
+            glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, target, slot.compositeMap, 0);
+            glBlitFramebuffer(0, 0, slot.size, slot.size, 0, 0, slot.size, slot.size, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        }
+        glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, 0, 0);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    }
+
+    // Compare mode on, so the shaders get hardware 2x2 PCF out of a shadow sampler.
+    static unsigned int createMap(ShadowType type, unsigned int size) {
+        const GLenum target = type == ShadowType::Point ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+        unsigned int texture;
+        glGenTextures(1, &texture);
+        glBindTexture(target, texture);
+        if (type == ShadowType::Point) {
+            for (int face=0; face<6; ++face) {
+                glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+            }
+            glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(target, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        } else {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+            // Outside the cone counts as lit, the cutoff takes care of it anyway.
+            const float border[] = { 1.f, 1.f, 1.f, 1.f };
+            glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+            glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+            glTexParameterfv(target, GL_TEXTURE_BORDER_COLOR, border);
+        }
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(target, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(target, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        glBindTexture(target, 0);
+        return texture;
+    }
+
+    static glm::mat4 spotMatrix(const glm::vec3& position, const glm::vec3& direction, float cutoffEnd, float range) {
+        const glm::vec3 up = std::abs(direction.y) > 0.99f ? glm::vec3(1.f, 0.f, 0.f) : glm::vec3(0.f, 1.f, 0.f);
+        const float fov = 2.f * std::acos(std::clamp(cutoffEnd, 0.01f, 1.f));
+        return glm::perspective(std::min(fov + 0.05f, 3.f), 1.f, nearPlane, range) * glm::lookAt(position, position + direction, up);
+    }
+
+    // Face order and orientation as GL_TEXTURE_CUBE_MAP_POSITIVE_X + i expects them.
+    static glm::mat4 cubeFaceMatrix(const glm::vec3& position, int face, float range) {
+        static const std::array<glm::vec3, 6> forward = {
+            glm::vec3(1.f, 0.f, 0.f), glm::vec3(-1.f, 0.f, 0.f), glm::vec3(0.f, 1.f, 0.f),
+            glm::vec3(0.f, -1.f, 0.f), glm::vec3(0.f, 0.f, 1.f), glm::vec3(0.f, 0.f, -1.f)
+        };
+        static const std::array<glm::vec3, 6> up = {
+            glm::vec3(0.f, -1.f, 0.f), glm::vec3(0.f, -1.f, 0.f), glm::vec3(0.f, 0.f, 1.f),
+            glm::vec3(0.f, 0.f, -1.f), glm::vec3(0.f, -1.f, 0.f), glm::vec3(0.f, -1.f, 0.f)
+        };
+        return glm::perspective(glm::radians(90.f), 1.f, nearPlane, range) * glm::lookAt(position, position + forward[face], up[face]);
+    }
+};
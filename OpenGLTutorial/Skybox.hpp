@@ -2,26 +2,69 @@
 
 #include "Utils.hpp"
 #include "ShaderProgram.hpp"
+#include "ShaderCompiler.hpp"
+#include "SphericalHarmonics.hpp"
+#include "GpuQuery.hpp"
+#include "PostProcessGraph.hpp"
+#include "ThreadPool.hpp"
 #include "stb_image_proxy.hpp"
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 #include <array>
+#include <chrono>
+#include <cmath>
 
 #ifndef SHADERS_SOURCE_DIR
 #define SHADERS_SOURCE_DIR "INCORRECT SOURCE DIR"
 #endif
 
+enum class SkyboxDraw : uint8_t {
+    // Unit cube around the camera, pushed to the far plane in the vertex shader.
+    Cube,
+    // One triangle at the far plane, view direction from the inverse view-projection. Geometry is drawn first, so
+    // early depth rejects it everywhere but the sky.
+    FullscreenTriangle
+};
+
+struct SkyboxSettings {
+    // Faces decoded on the pool instead of one after the other.
+    bool parallelDecode = true;
+    // glTexStorage2D where there is one (4.2 or ARB_texture_storage), glTexImage2D per face otherwise.
+    bool immutableStorage = true;
+    // Mips down to 1x1. The pixelated framebuffer sees the sky far below the faces' size and shimmers without them.
+    bool mipmaps = true;
+};
+
+struct SkyboxLoadStats {
+    float decodeMilliseconds = 0.f;
+    // Upload plus mip generation, waited on so the driver's share counts too.
+    float uploadMilliseconds = 0.f;
+    int faceSize = 0;
+    int levels = 0;
+    bool immutable = false;
+
+    float totalMilliseconds() const { return decodeMilliseconds + uploadMilliseconds; }
+};
+
 class Skybox {
     constexpr static inline auto viewName = std::string_view("view");
     constexpr static inline auto projectionName = std::string_view("projection");
+    constexpr static inline auto inverseViewProjectionName = std::string_view("inverseViewProjection");
     constexpr static inline auto textureName = std::string_view("cubemap");
     unsigned int _texture;
     unsigned int _cubeVAO, _cubeVBO;
+    unsigned int _irradianceBuffer;
+    SphericalHarmonics9 _irradiance;
+    float _irradianceMilliseconds = 0.f;
+    SkyboxLoadStats _loadStats;
     ShaderProgram _program;
+    ShaderProgram _fullscreenProgram;
+    SkyboxDraw _drawMode = SkyboxDraw::FullscreenTriangle;
+    GpuTimer _drawTimer;
     glm::mat4 _view;
     glm::mat4 _projection;
 public:
-    Skybox(const std::vector<std::string>& textureFilepaths) {
+    Skybox(const std::vector<std::string>& textureFilepaths, const SkyboxSettings& settings = {}) {
 
         glGenVertexArrays(1, &_cubeVAO);
         glGenBuffers(1, &_cubeVBO);
@@ -34,66 +77,151 @@ public:
         glBindVertexArray(0);
         glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-        glGenTextures(1, &_texture);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, _texture);
+        // Decoded faces stay around until the SH projection below is done with them.
+        std::array<CubemapFace, 6> faces {};
+        _texture = load(textureFilepaths, settings, faces, _loadStats);
 
-        if (auto error = glGetError(); error != GL_NO_ERROR) {
-			std::cout << "Error: " << error << '\n';
-		}
-
-        int width, height, nrChannels, i = 0;
-        unsigned char* data;
-        for(const auto& filepath : textureFilepaths) {
-            data = stbi_load(filepath.c_str(), &width, &height, &nrChannels, 0);
-            if (!data) {
-                throw std::runtime_error("Failed to load texture file.");
-            }
-            glTexImage2D(
-                GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 
-                0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data
-            );
-            i++;
-            stbi_image_free(data);
+        const auto start = std::chrono::steady_clock::now();
+        _irradiance = SphericalHarmonicsProjector::project(faces);
+        _irradianceMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        for (const auto& face : faces) {
+            stbi_image_free(const_cast<unsigned char*>(face.data));
         }
 
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-
-        const std::string vertexShaderCode = Utils::readFile(SHADERS_SOURCE_DIR "/Skybox/" "Skybox.vert.glsl");
-        const std::string fragmentShaderCode = Utils::readFile(SHADERS_SOURCE_DIR "/Skybox/" "Skybox.frag.glsl");
+        // Stays bound to its binding point, any program declaring SkyIrradiance just has to point its block there.
+        const auto irradianceUniforms = _irradiance.irradianceUniforms();
+        glGenBuffers(1, &_irradianceBuffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, _irradianceBuffer);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(irradianceUniforms), irradianceUniforms.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        glBindBufferBase(GL_UNIFORM_BUFFER, skyIrradianceBinding, _irradianceBuffer);
 
         if (auto error = glGetError(); error != GL_NO_ERROR) {
 			std::cout << "Error: " << error << '\n';
 		}
 
-        _program = {
-            Shader<ShaderType::Vertex>(vertexShaderCode),
-            Shader<ShaderType::Fragment>(fragmentShaderCode),
-        };
+        ShaderCompiler::shared().compile(_program, "Skybox/Skybox.vert.glsl", "Skybox/Skybox.frag.glsl");
+        ShaderCompiler::shared().compile(_fullscreenProgram, "Skybox/SkyboxFullscreen.vert.glsl", "Skybox/Skybox.frag.glsl");
     }
 
+    // Order 2 SH of the faces, what SkyAmbient() in Common/SkyIrradiance.glsl evaluates.
+    const SphericalHarmonics9& irradiance() const { return _irradiance; }
+    float irradianceMilliseconds() const { return _irradianceMilliseconds; }
+    const SkyboxLoadStats& loadStats() const { return _loadStats; }
+
+    // Loads the faces the way the constructor would and throws the result away, to compare settings.
+    static SkyboxLoadStats measureLoad(const std::vector<std::string>& textureFilepaths, const SkyboxSettings& settings) {
+        std::array<CubemapFace, 6> faces {};
+        SkyboxLoadStats stats;
+        const auto texture = load(textureFilepaths, settings, faces, stats);
+        for (const auto& face : faces) {
+            stbi_image_free(const_cast<unsigned char*>(face.data));
+        }
+        glDeleteTextures(1, &texture);
+        return stats;
+    }
+
+    void setDrawMode(SkyboxDraw mode) { _drawMode = mode; }
+    SkyboxDraw drawMode() const { return _drawMode; }
+    float drawMilliseconds() const { return _drawTimer.milliseconds(); }
+
     void updateTransform(const glm::mat4& view, const glm::mat4& projection) {
         _view = glm::mat4(glm::mat3(view));
         _projection = projection;
     }
 
+    // After the opaque geometry, into the same depth buffer. Leaves depth writes alone, the sky is at the far plane
+    // the buffer was cleared to anyway.
     void draw() {
+        GpuTimer::ScopedQuery timer(_drawTimer);
         glDepthFunc(GL_LEQUAL);
-        _program.use();
-        _program.set(viewName, _view);
-        _program.set(projectionName, _projection);
-        glBindVertexArray(_cubeVAO);
+        glDepthMask(GL_FALSE);
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_CUBE_MAP, _texture);
-        glDrawArrays(GL_TRIANGLES, 0, 36);
-        glBindVertexArray(0);
+        if (_drawMode == SkyboxDraw::FullscreenTriangle) {
+            _fullscreenProgram.use();
+            _fullscreenProgram.set(inverseViewProjectionName, glm::inverse(_projection * _view));
+            FullscreenTriangle::shared().draw();
+        } else {
+            _program.use();
+            _program.set(viewName, _view);
+            _program.set(projectionName, _projection);
+            glBindVertexArray(_cubeVAO);
+            glDrawArrays(GL_TRIANGLES, 0, 36);
+            glBindVertexArray(0);
+        }
+        glDepthMask(GL_TRUE);
         glDepthFunc(GL_LESS);
     }
 
 private:
+    // Faces come back decoded as RGB, whoever called frees them.
+    static unsigned int load(const std::vector<std::string>& textureFilepaths, const SkyboxSettings& settings, std::array<CubemapFace, 6>& faces, SkyboxLoadStats& stats) {
+        if (textureFilepaths.size() != 6) {
+            throw std::runtime_error("Skybox needs six faces.");
+        }
+
+        const auto decodeStart = std::chrono::steady_clock::now();
+        // stbi_load is reentrant, only its flip and error state are global and neither is relied on here.
+        const auto decode = [&](size_t begin, size_t end) {
+            for (size_t i=begin; i<end; ++i) {
+                int width = 0, height = 0, channels = 0;
+                const auto* data = stbi_load(textureFilepaths[i].c_str(), &width, &height, &channels, 3);
+                faces[i] = CubemapFace { data, width, height, 3 };
+            }
+        };
+        if (settings.parallelDecode) ThreadPool::shared().parallelFor(0, 6, 1, decode);
+        else decode(0, 6);
+        stats.decodeMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - decodeStart).count();
+
+        const int size = faces[0].width;
+        for (const auto& face : faces) {
+            if (face.data && face.width == size && face.height == size) continue;
+            for (const auto& loaded : faces) {
+                if (loaded.data) stbi_image_free(const_cast<unsigned char*>(loaded.data));
+            }
+            throw std::runtime_error("Failed to load texture file.");
+        }
+
+        const auto uploadStart = std::chrono::steady_clock::now();
+        stats.faceSize = size;
+        stats.levels = settings.mipmaps ? static_cast<int>(std::floor(std::log2(static_cast<float>(size)))) + 1 : 1;
+        stats.immutable = settings.immutableStorage && (GLAD_GL_VERSION_4_2 || GLAD_GL_ARB_texture_storage);
+
+        unsigned int texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        if (stats.immutable) {
+            // One allocation for all faces and levels, the driver never has to check them for completeness.
+            glTexStorage2D(GL_TEXTURE_CUBE_MAP, stats.levels, GL_RGB8, size, size);
+        }
+        for (int i=0; i<6; ++i) {
+            if (stats.immutable) {
+                glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, 0, 0, size, size, GL_RGB, GL_UNSIGNED_BYTE, faces[i].data);
+            } else {
+                glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB8, size, size, 0, GL_RGB, GL_UNSIGNED_BYTE, faces[i].data);
+            }
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, stats.levels - 1);
+        if (settings.mipmaps) {
+            glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+            // Lower mips average across the face edges, seamless filtering keeps the seams from showing there.
+            glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+        }
+
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, settings.mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+        glFinish();
+        stats.uploadMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - uploadStart).count();
+        return texture;
+    }
+
     constexpr static float cubeVertices[] = {
         // positions          
         -1.0f,  1.0f, -1.0f,
@@ -0,0 +1,246 @@
+#pragma once
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SPHERICAL_HARMONICS_SSE 1
+#endif
+
+#include "ThreadPool.hpp"
+
+// Binding point of the SkyIrradiance uniform block, see Shaders/Common/SkyIrradiance.glsl.
+constexpr unsigned int skyIrradianceBinding = 0;
+
+// One face as stb_image decodes it: 8 bit, rows top to bottom, faces in GL_TEXTURE_CUBE_MAP_POSITIVE_X + i order.
+struct CubemapFace {
+    const unsigned char* data;
+    int width;
+    int height;
+    int channels;
+};
+
+// Order 2 (9 coefficients per channel) projection of an environment's radiance.
+struct SphericalHarmonics9 {
+    std::array<glm::vec3, 9> coefficients {};
+
+    // Convolved with the clamped cosine lobe and divided by pi, basis constants folded in, so the shader's
+    // evaluation is just the polynomial in the normal. vec4s for std140.
+    std::array<glm::vec4, 9> irradianceUniforms() const {
+        constexpr float pi = 3.14159265f;
+        constexpr float band[9] = { pi, 2.f * pi / 3.f, 2.f * pi / 3.f, 2.f * pi / 3.f, pi / 4.f, pi / 4.f, pi / 4.f, pi / 4.f, pi / 4.f };
+        std::array<glm::vec4, 9> uniforms;
+        for (int i=0; i<9; ++i) {
+            uniforms[i] = glm::vec4(coefficients[i] * (band[i] * basisConstants[i] / pi), 0.f);
+        }
+        return uniforms;
+    }
+
+    // Same polynomial as SkyAmbient() in the shader, for checking on the CPU.
+    glm::vec3 irradiance(const glm::vec3& n) const {
+        const auto u = irradianceUniforms();
+        return glm::vec3(u[0]) + glm::vec3(u[1]) * n.y + glm::vec3(u[2]) * n.z + glm::vec3(u[3]) * n.x
+            + glm::vec3(u[4]) * (n.x * n.y) + glm::vec3(u[5]) * (n.y * n.z) + glm::vec3(u[6]) * (3.f * n.z * n.z - 1.f)
+            + glm::vec3(u[7]) * (n.x * n.z) + glm::vec3(u[8]) * (n.x * n.x - n.y * n.y);
+    }
+
+    // Y00, Y1-1, Y10, Y11, Y2-2, Y2-1, Y20, Y21, Y22 without their polynomial part.
+    constexpr static float basisConstants[9] = { 0.282095f, 0.488603f, 0.488603f, 0.488603f, 1.092548f, 1.092548f, 0.315392f, 1.092548f, 0.546274f };
+};
+
+// Projects a cubemap onto SH9. Every texel counts with the solid angle it covers, 4 / (w*h) / (1 + s^2 + t^2)^1.5
+// for face coordinates s, t in [-1, 1], so the crowded corners don't outweigh the face centers. Rows are split
+// over the pool, four texels of a row go through SSE at a time.
+class SphericalHarmonicsProjector {
+    // Direction = s * sAxis + t * tAxis + major, unnormalized, per the GL cube map face selection table.
+    struct FaceAxes {
+        glm::vec3 sAxis, tAxis, major;
+    };
+    constexpr static int coefficientCount = 9 * 3;
+    struct Partial {
+        std::array<double, coefficientCount> sums {};
+        double weight = 0.0;
+    };
+public:
+    static SphericalHarmonics9 project(const std::array<CubemapFace, 6>& faces, ThreadPool& pool = ThreadPool::shared(), bool simd = true, bool threaded = true) {
+        Partial total;
+        for (int face=0; face<6; ++face) {
+            const auto& image = faces[face];
+            constexpr size_t rowsPerChunk = 16;
+            std::vector<Partial> partials((image.height + rowsPerChunk - 1) / rowsPerChunk);
+            const auto projectRows = [&](size_t begin, size_t end) {
+                auto& partial = partials[begin / rowsPerChunk];
+                for (size_t row=begin; row<end; ++row) {
+#ifdef SPHERICAL_HARMONICS_SSE
+                    if (simd) {
+                        projectRowSimd(image, faceAxes[face], static_cast<int>(row), partial);
+                        continue;
+                    }
+#endif
+                    projectRowScalar(image, faceAxes[face], static_cast<int>(row), 0, partial);
+                }
+            };
+            if (threaded) {
+                pool.parallelFor(0, image.height, rowsPerChunk, projectRows);
+            } else {
+                projectRows(0, image.height);
+            }
+            for (const auto& partial : partials) {
+                for (int i=0; i<coefficientCount; ++i) total.sums[i] += partial.sums[i];
+                total.weight += partial.weight;
+            }
+        }
+
+        // The per-texel solid angle is approximate, normalizing to the full sphere takes the error out.
+        SphericalHarmonics9 result;
+        const double scale = total.weight > 0.0 ? 4.0 * 3.14159265358979 / total.weight : 0.0;
+        for (int i=0; i<9; ++i) {
+            result.coefficients[i] = glm::vec3(total.sums[i * 3], total.sums[i * 3 + 1], total.sums[i * 3 + 2]) * static_cast<float>(scale);
+        }
+        return result;
+    }
+
+private:
+    inline static const std::array<FaceAxes, 6> faceAxes = {
+        FaceAxes { glm::vec3(0.f, 0.f, -1.f), glm::vec3(0.f, -1.f, 0.f), glm::vec3(1.f, 0.f, 0.f) },
+        FaceAxes { glm::vec3(0.f, 0.f, 1.f), glm::vec3(0.f, -1.f, 0.f), glm::vec3(-1.f, 0.f, 0.f) },
+        FaceAxes { glm::vec3(1.f, 0.f, 0.f), glm::vec3(0.f, 0.f, 1.f), glm::vec3(0.f, 1.f, 0.f) },
+        FaceAxes { glm::vec3(1.f, 0.f, 0.f), glm::vec3(0.f, 0.f, -1.f), glm::vec3(0.f, -1.f, 0.f) },
+        FaceAxes { glm::vec3(1.f, 0.f, 0.f), glm::vec3(0.f, -1.f, 0.f), glm::vec3(0.f, 0.f, 1.f) },
+        FaceAxes { glm::vec3(-1.f, 0.f, 0.f), glm::vec3(0.f, -1.f, 0.f), glm::vec3(0.f, 0.f, -1.f) },
+    };
+
+    static void projectRowScalar(const CubemapFace& image, const FaceAxes& axes, int row, int firstColumn, Partial& partial) {
+        const auto& c = SphericalHarmonics9::basisConstants;
+        const float t = 2.f * (row + 0.5f) / image.height - 1.f;
+        const float texelArea = 4.f / (static_cast<float>(image.width) * image.height);
+        const unsigned char* pixels = image.data + static_cast<size_t>(row) * image.width * image.channels;
+        for (int column=firstColumn; column<image.width; ++column) {
+            const float s = 2.f * (column + 0.5f) / image.width - 1.f;
+            const float lengthSquared = 1.f + s * s + t * t;
+            const float inverseLength = 1.f / std::sqrt(lengthSquared);
+            const glm::vec3 d = (s * axes.sAxis + t * axes.tAxis + axes.major) * inverseLength;
+            const float weight = texelArea * inverseLength * inverseLength * inverseLength;
+
+            const float basis[9] = {
+                c[0], c[1] * d.y, c[2] * d.z, c[3] * d.x, c[4] * d.x * d.y, c[5] * d.y * d.z,
+                c[6] * (3.f * d.z * d.z - 1.f), c[7] * d.x * d.z, c[8] * (d.x * d.x - d.y * d.y)
+            };
+            const unsigned char* pixel = pixels + column * image.channels;
+            const glm::vec3 color = glm::vec3(pixel[0], pixel[std::min(1, image.channels - 1)], pixel[std::min(2, image.channels - 1)]) * (weight / 255.f);
+            for (int i=0; i<9; ++i) {
+                partial.sums[i * 3] += color.r * basis[i];
+                partial.sums[i * 3 + 1] += color.g * basis[i];
+                partial.sums[i * 3 + 2] += color.b * basis[i];
+            }
+            partial.weight += weight;
+        }
+    }
+
+#ifdef SPHERICAL_HARMONICS_SSE
+    static void projectRowSimd(const CubemapFace& image, const FaceAxes& axes, int row, Partial& partial) {
+        const auto& c = SphericalHarmonics9::basisConstants;
+        const float t = 2.f * (row + 0.5f) / image.height - 1.f;
+        const float texelArea = 4.f / (static_cast<float>(image.width) * image.height);
+        const unsigned char* pixels = image.data + static_cast<size_t>(row) * image.width * image.channels;
+        const int g = std::min(1, image.channels - 1), b = std::min(2, image.channels - 1);
+
+        // t is fixed along the row, only s varies per lane.
+        const __m128 one = _mm_set1_ps(1.f);
+        const __m128 tTerm = _mm_set1_ps(t * t);
+        const __m128 baseX = _mm_set1_ps(t * axes.tAxis.x + axes.major.x), scaleX = _mm_set1_ps(axes.sAxis.x);
+        const __m128 baseY = _mm_set1_ps(t * axes.tAxis.y + axes.major.y), scaleY = _mm_set1_ps(axes.sAxis.y);
+        const __m128 baseZ = _mm_set1_ps(t * axes.tAxis.z + axes.major.z), scaleZ = _mm_set1_ps(axes.sAxis.z);
+        const __m128 colorScale = _mm_set1_ps(texelArea / 255.f);
+        const float sStep = 2.f / image.width;
+        __m128 s = _mm_setr_ps(0.5f * sStep - 1.f, 1.5f * sStep - 1.f, 2.5f * sStep - 1.f, 3.5f * sStep - 1.f);
+        const __m128 sAdvance = _mm_set1_ps(4.f * sStep);
+
+        __m128 sums[coefficientCount];
+        for (auto& sum : sums) sum = _mm_setzero_ps();
+        __m128 weights = _mm_setzero_ps();
+
+        int column = 0;
+        for (; column + 4 <= image.width; column += 4, s = _mm_add_ps(s, sAdvance)) {
+            // 1/sqrt through a real divide, _mm_rsqrt_ps's 12 bits would show up in the sums.
+            const __m128 inverseLength = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(one, _mm_mul_ps(s, s)), tTerm)));
+            const __m128 x = _mm_mul_ps(_mm_add_ps(baseX, _mm_mul_ps(scaleX, s)), inverseLength);
+            const __m128 y = _mm_mul_ps(_mm_add_ps(baseY, _mm_mul_ps(scaleY, s)), inverseLength);
+            const __m128 z = _mm_mul_ps(_mm_add_ps(baseZ, _mm_mul_ps(scaleZ, s)), inverseLength);
+            const __m128 solidAngle = _mm_mul_ps(_mm_mul_ps(inverseLength, inverseLength), inverseLength);
+            weights = _mm_add_ps(weights, solidAngle);
+
+            const unsigned char* p = pixels + column * image.channels;
+            const int stride = image.channels;
+            const __m128 weight = _mm_mul_ps(solidAngle, colorScale);
+            const __m128 red = _mm_mul_ps(weight, _mm_setr_ps(p[0], p[stride], p[2 * stride], p[3 * stride]));
+            const __m128 green = _mm_mul_ps(weight, _mm_setr_ps(p[g], p[stride + g], p[2 * stride + g], p[3 * stride + g]));
+            const __m128 blue = _mm_mul_ps(weight, _mm_setr_ps(p[b], p[stride + b], p[2 * stride + b], p[3 * stride + b]));
+
+            const __m128 basis[9] = {
+                _mm_set1_ps(c[0]),
+                _mm_mul_ps(_mm_set1_ps(c[1]), y),
+                _mm_mul_ps(_mm_set1_ps(c[2]), z),
+                _mm_mul_ps(_mm_set1_ps(c[3]), x),
+                _mm_mul_ps(_mm_set1_ps(c[4]), _mm_mul_ps(x, y)),
+                _mm_mul_ps(_mm_set1_ps(c[5]), _mm_mul_ps(y, z)),
+                _mm_mul_ps(_mm_set1_ps(c[6]), _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(3.f), _mm_mul_ps(z, z)), one)),
+                _mm_mul_ps(_mm_set1_ps(c[7]), _mm_mul_ps(x, z)),
+                _mm_mul_ps(_mm_set1_ps(c[8]), _mm_sub_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y))),
+            };
+            for (int i=0; i<9; ++i) {
+                sums[i * 3] = _mm_add_ps(sums[i * 3], _mm_mul_ps(red, basis[i]));
+                sums[i * 3 + 1] = _mm_add_ps(sums[i * 3 + 1], _mm_mul_ps(green, basis[i]));
+                sums[i * 3 + 2] = _mm_add_ps(sums[i * 3 + 2], _mm_mul_ps(blue, basis[i]));
+            }
+        }
+
+        // Lanes fold into doubles once per row, float only ever holds a row's worth.
+        alignas(16) float lanes[4];
+        for (int i=0; i<coefficientCount; ++i) {
+            _mm_store_ps(lanes, sums[i]);
+            partial.sums[i] += static_cast<double>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+        }
+        _mm_store_ps(lanes, weights);
+        partial.weight += (static_cast<double>(lanes[0]) + lanes[1] + lanes[2] + lanes[3]) * texelArea;
+
+        if (column < image.width) projectRowScalar(image, axes, row, column, partial);
+    }
+#endif
+};
+
+struct ShProjectionTiming {
+    int faceSize;
+    float scalarMilliseconds;
+    float simdMilliseconds;
+    float threadedMilliseconds;
+};
+
+// Six random faces of faceSize^2, projected scalar / SIMD on one thread / SIMD on the pool.
+inline ShProjectionTiming benchmarkShProjection(const int faceSize, ThreadPool& pool = ThreadPool::shared()) {
+    std::mt19937 random(7);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::vector<unsigned char> texels(static_cast<size_t>(faceSize) * faceSize * 3 * 6);
+    for (auto& texel : texels) texel = static_cast<unsigned char>(byte(random));
+    std::array<CubemapFace, 6> faces;
+    for (int i=0; i<6; ++i) {
+        faces[i] = CubemapFace { texels.data() + static_cast<size_t>(i) * faceSize * faceSize * 3, faceSize, faceSize, 3 };
+    }
+
+    constexpr int runs = 3;
+    const auto time = [&](bool simd, bool threaded) {
+        const auto start = std::chrono::steady_clock::now();
+        for (int run=0; run<runs; ++run) {
+            SphericalHarmonicsProjector::project(faces, pool, simd, threaded);
+        }
+        return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+    };
+    return ShProjectionTiming { faceSize, time(false, false), time(true, false), time(true, true) };
+}
@@ -0,0 +1,550 @@
+#pragma once
+
+#include <assimp/Importer.hpp>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <map>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "Bvh.hpp"
+#include "Frustum.hpp"
+#include "Mesh.hpp"
+#include "ShaderProgram.hpp"
+#include "ThreadPool.hpp"
+
+// Models too big for memory are cut into a grid of chunks offline, then streamed in around the camera.
+// Every chunk also carries a coarse proxy which is always resident and drawn until the real thing arrives.
+namespace StreamingFormat {
+
+constexpr char magic[8] = { 'L', 'O', 'G', 'L', 'C', 'H', 'N', 'K' };
+constexpr uint32_t version = 1;
+// pos3, normal3, uv2 - same as the cube in main.cpp
+constexpr size_t floatsPerVertex = 8;
+
+struct Submesh {
+    uint32_t material = 0;
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices;
+
+    size_t vertexCount() const { return vertices.size() / floatsPerVertex; }
+    size_t byteSize() const { return vertices.size() * sizeof(float) + indices.size() * sizeof(uint32_t); }
+};
+
+struct ChunkData {
+    std::vector<Submesh> submeshes;
+
+    size_t byteSize() const {
+        size_t bytes = 0;
+        for (const auto& submesh : submeshes) bytes += submesh.byteSize();
+        return bytes;
+    }
+};
+
+struct ChunkRecord {
+    glm::vec3 boundsMin, boundsMax;
+    uint64_t offset, size;
+    uint64_t proxyOffset, proxySize;
+};
+
+template<class T>
+void write(std::ostream& stream, const T& value) {
+    stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<class T>
+T read(std::istream& stream) {
+    T value {};
+    stream.read(reinterpret_cast<char*>(&value), sizeof(T));
+    return value;
+}
+
+inline void writeChunk(std::ostream& stream, const ChunkData& chunk) {
+    write<uint32_t>(stream, static_cast<uint32_t>(chunk.submeshes.size()));
+    for (const auto& submesh : chunk.submeshes) {
+        write<uint32_t>(stream, submesh.material);
+        write<uint32_t>(stream, static_cast<uint32_t>(submesh.vertices.size()));
+        write<uint32_t>(stream, static_cast<uint32_t>(submesh.indices.size()));
+        stream.write(reinterpret_cast<const char*>(submesh.vertices.data()), submesh.vertices.size() * sizeof(float));
+        stream.write(reinterpret_cast<const char*>(submesh.indices.data()), submesh.indices.size() * sizeof(uint32_t));
+    }
+}
+
+inline ChunkData readChunk(std::istream& stream) {
+    ChunkData chunk;
+    chunk.submeshes.resize(read<uint32_t>(stream));
+    for (auto& submesh : chunk.submeshes) {
+        submesh.material = read<uint32_t>(stream);
+        submesh.vertices.resize(read<uint32_t>(stream));
+        submesh.indices.resize(read<uint32_t>(stream));
+        stream.read(reinterpret_cast<char*>(submesh.vertices.data()), submesh.vertices.size() * sizeof(float));
+        stream.read(reinterpret_cast<char*>(submesh.indices.data()), submesh.indices.size() * sizeof(uint32_t));
+    }
+    if (!stream) {
+        throw std::runtime_error("Truncated chunk data");
+    }
+    return chunk;
+}
+
+}
+
+class StreamingModelBaker {
+    // Proxy vertices get welded on a grid this many times finer than a chunk.
+    constexpr static float proxyResolution = 8.f;
+public:
+    // Same import as Model, so the streamed version lines up with the regular one.
+    static void bake(std::string_view sourcePath, const std::string& outputPath, const float chunkSize) {
+        using namespace StreamingFormat;
+
+        Assimp::Importer importer;
+        const aiScene *scene = importer.ReadFile(std::string(sourcePath), aiProcess_Triangulate | aiProcess_FlipUVs);
+        if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
+            throw std::runtime_error("Failed to load Model");
+        }
+        const std::string directory(sourcePath.substr(0, sourcePath.find_last_of('/')));
+
+        using CellKey = std::tuple<int, int, int>;
+        struct SubmeshBuilder {
+            Submesh submesh;
+            std::unordered_map<uint64_t, uint32_t> remap;
+        };
+        std::map<CellKey, std::map<uint32_t, SubmeshBuilder>> cells;
+        std::map<CellKey, Aabb> cellBounds;
+
+        std::vector<const aiMesh*> meshes;
+        collectMeshes(scene->mRootNode, scene, meshes);
+        for (size_t meshIndex=0; meshIndex<meshes.size(); ++meshIndex) {
+            const aiMesh* mesh = meshes[meshIndex];
+            const auto position = [&](unsigned int v) { return glm::vec3(mesh->mVertices[v].x, mesh->mVertices[v].y, mesh->mVertices[v].z); };
+
+            for (unsigned int f=0; f<mesh->mNumFaces; ++f) {
+                const auto& face = mesh->mFaces[f];
+                if (face.mNumIndices != 3) continue;
+
+                const glm::vec3 centroid = (position(face.mIndices[0]) + position(face.mIndices[1]) + position(face.mIndices[2])) / 3.f;
+                const glm::ivec3 cell = glm::ivec3(glm::floor(centroid / chunkSize));
+                const CellKey key { cell.x, cell.y, cell.z };
+                auto& builder = cells[key][mesh->mMaterialIndex];
+                builder.submesh.material = mesh->mMaterialIndex;
+
+                for (int k=0; k<3; ++k) {
+                    const auto v = face.mIndices[k];
+                    cellBounds[key].grow(position(v));
+
+                    const uint64_t remapKey = (static_cast<uint64_t>(meshIndex) << 32) | v;
+                    auto [it, inserted] = builder.remap.try_emplace(remapKey, static_cast<uint32_t>(builder.submesh.vertexCount()));
+                    if (inserted) {
+                        const auto& normal = mesh->mNormals ? mesh->mNormals[v] : aiVector3D { 0.f, 1.f, 0.f };
+                        const auto uv = mesh->mTextureCoords[0] ? mesh->mTextureCoords[0][v] : aiVector3D { 0.f, 0.f, 0.f };
+                        builder.submesh.vertices.insert(builder.submesh.vertices.end(), {
+                            mesh->mVertices[v].x, mesh->mVertices[v].y, mesh->mVertices[v].z,
+                            normal.x, normal.y, normal.z,
+                            uv.x, uv.y
+                        });
+                    }
+                    builder.submesh.indices.push_back(it->second);
+                }
+            }
+        }
+
+        std::ofstream file(outputPath, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            throw std::runtime_error("Failed to open chunk file for writing");
+        }
+
+        write(file, magic);
+        write<uint32_t>(file, version);
+        write<float>(file, chunkSize);
+        writeMaterials(file, scene, directory);
+        write<uint32_t>(file, static_cast<uint32_t>(cells.size()));
+
+        // Table goes first, we come back and fill it in once the offsets are known.
+        const auto tableOffset = file.tellp();
+        std::vector<ChunkRecord> records(cells.size());
+        file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(ChunkRecord));
+
+        size_t chunkIndex = 0;
+        for (auto& [key, builders] : cells) {
+            ChunkData chunk;
+            ChunkData proxy;
+            for (auto& [material, builder] : builders) {
+                proxy.submeshes.push_back(simplify(builder.submesh, chunkSize / proxyResolution));
+                chunk.submeshes.push_back(std::move(builder.submesh));
+            }
+
+            auto& record = records[chunkIndex++];
+            record.boundsMin = cellBounds[key].min;
+            record.boundsMax = cellBounds[key].max;
+
+            record.offset = static_cast<uint64_t>(file.tellp());
+            writeChunk(file, chunk);
+            record.size = static_cast<uint64_t>(file.tellp()) - record.offset;
+
+            record.proxyOffset = static_cast<uint64_t>(file.tellp());
+            writeChunk(file, proxy);
+            record.proxySize = static_cast<uint64_t>(file.tellp()) - record.proxyOffset;
+        }
+
+        file.seekp(tableOffset);
+        file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(ChunkRecord));
+    }
+
+private:
+    static void collectMeshes(const aiNode* node, const aiScene* scene, std::vector<const aiMesh*>& meshes) {
+        for (unsigned int i=0; i<node->mNumMeshes; ++i) {
+            meshes.push_back(scene->mMeshes[node->mMeshes[i]]);
+        }
+        for (unsigned int i=0; i<node->mNumChildren; ++i) {
+            collectMeshes(node->mChildren[i], scene, meshes);
+        }
+    }
+
+    static void writeMaterials(std::ostream& stream, const aiScene* scene, const std::string& directory) {
+        using namespace StreamingFormat;
+        const std::pair<aiTextureType, TextureType> types[] = {
+            { aiTextureType_DIFFUSE, TextureType::Diffuse },
+            { aiTextureType_SPECULAR, TextureType::Specular },
+            { aiTextureType_NORMALS, TextureType::Normal },
+        };
+
+        write<uint32_t>(stream, scene->mNumMaterials);
+        for (unsigned int m=0; m<scene->mNumMaterials; ++m) {
+            const aiMaterial* material = scene->mMaterials[m];
+            std::vector<std::pair<TextureType, std::string>> textures;
+            for (const auto& [aiType, type] : types) {
+                for (unsigned int i=0; i<material->GetTextureCount(aiType); ++i) {
+                    aiString path;
+                    material->GetTexture(aiType, i, &path);
+                    textures.emplace_back(type, directory + '/' + path.C_Str());
+                }
+            }
+
+            write<uint32_t>(stream, static_cast<uint32_t>(textures.size()));
+            for (const auto& [type, path] : textures) {
+                write<uint8_t>(stream, static_cast<uint8_t>(type));
+                write<uint32_t>(stream, static_cast<uint32_t>(path.size()));
+                stream.write(path.data(), path.size());
+            }
+        }
+    }
+
+    // Vertex clustering - weld everything within a grid cell, drop triangles which collapsed.
+    static StreamingFormat::Submesh simplify(const StreamingFormat::Submesh& submesh, const float cellSize) {
+        using namespace StreamingFormat;
+        struct Cluster {
+            glm::vec3 position {}, normal {};
+            glm::vec2 uv {};
+            float count = 0.f;
+            uint32_t index = 0;
+        };
+        std::unordered_map<uint64_t, Cluster> clusters;
+        std::vector<uint64_t> vertexCluster(submesh.vertexCount());
+
+        for (size_t v=0; v<submesh.vertexCount(); ++v) {
+            const float* vertex = &submesh.vertices[v * floatsPerVertex];
+            const glm::ivec3 cell = glm::ivec3(glm::floor(glm::vec3(vertex[0], vertex[1], vertex[2]) / cellSize)) + glm::ivec3(1 << 20);
+            const uint64_t key = (static_cast<uint64_t>(cell.x & 0x1FFFFF) << 42) | (static_cast<uint64_t>(cell.y & 0x1FFFFF) << 21) | static_cast<uint64_t>(cell.z & 0x1FFFFF);
+            auto& cluster = clusters[key];
+            cluster.position += glm::vec3(vertex[0], vertex[1], vertex[2]);
+            cluster.normal += glm::vec3(vertex[3], vertex[4], vertex[5]);
+            cluster.uv += glm::vec2(vertex[6], vertex[7]);
+            cluster.count += 1.f;
+            vertexCluster[v] = key;
+        }
+
+        Submesh result;
+        result.material = submesh.material;
+        for (auto& [key, cluster] : clusters) {
+            cluster.index = static_cast<uint32_t>(result.vertexCount());
+            const glm::vec3 position = cluster.position / cluster.count;
+            const float normalLength = glm::length(cluster.normal);
+            const glm::vec3 normal = normalLength > 0.f ? cluster.normal / normalLength : glm::vec3(0.f, 1.f, 0.f);
+            const glm::vec2 uv = cluster.uv / cluster.count;
+            result.vertices.insert(result.vertices.end(), { position.x, position.y, position.z, normal.x, normal.y, normal.z, uv.x, uv.y });
+        }
+        for (size_t i=0; i+2<submesh.indices.size(); i+=3) {
+            const auto a = clusters[vertexCluster[submesh.indices[i + 0]]].index;
+            const auto b = clusters[vertexCluster[submesh.indices[i + 1]]].index;
+            const auto c = clusters[vertexCluster[submesh.indices[i + 2]]].index;
+            if (a == b || b == c || a == c) continue;
+            result.indices.insert(result.indices.end(), { a, b, c });
+        }
+        return result;
+    }
+};
+
+struct StreamingStats {
+    size_t residentBytes = 0;
+    size_t proxyBytes = 0;
+    size_t residentChunks = 0;
+    size_t loadingChunks = 0;
+    size_t totalChunks = 0;
+    size_t evictions = 0;
+    float bandwidthBytesPerSecond = 0.f;
+    float lastLoadMilliseconds = 0.f;
+    float averageLoadMilliseconds = 0.f;
+    float maxLoadMilliseconds = 0.f;
+    size_t loadedChunks = 0;
+};
+
+class StreamingModel {
+    using Clock = std::chrono::steady_clock;
+    constexpr static size_t maxLoadsInFlight = 4;
+    constexpr static size_t maxUploadsPerFrame = 2;
+
+    enum class ChunkState : uint8_t {
+        Unloaded,
+        Loading,
+        Resident
+    };
+
+    struct Chunk {
+        StreamingFormat::ChunkRecord record;
+        std::vector<Mesh> proxy;
+        std::vector<Mesh> meshes;
+        ChunkState state = ChunkState::Unloaded;
+        bool wanted = false;
+        size_t gpuBytes = 0;
+        float loadMilliseconds = 0.f;
+    };
+
+    struct PendingLoad {
+        size_t chunk;
+        std::future<StreamingFormat::ChunkData> data;
+        Clock::time_point requested;
+    };
+
+    std::string _path;
+    std::vector<std::vector<Texture>> _materials;
+    std::vector<Chunk> _chunks;
+    std::vector<PendingLoad> _pending;
+    std::deque<std::pair<Clock::time_point, size_t>> _recentLoads;
+    float _totalLoadMilliseconds = 0.f;
+    StreamingStats _stats;
+
+    size_t _memoryBudget;
+    float _streamingDistance;
+
+    // Declared last so the loaders are joined before anything they might touch goes away.
+    ThreadPool _loaders { 2 };
+public:
+    StreamingModel(const std::string& bakedPath, size_t memoryBudget, float streamingDistance = 50.f)
+    : _path(bakedPath),
+      _memoryBudget(memoryBudget),
+      _streamingDistance(streamingDistance)
+    {
+        using namespace StreamingFormat;
+        std::ifstream file(_path, std::ios::binary);
+        char fileMagic[8];
+        file.read(fileMagic, sizeof(fileMagic));
+        if (!file || !std::equal(std::begin(fileMagic), std::end(fileMagic), std::begin(magic)) || read<uint32_t>(file) != version) {
+            throw std::runtime_error("Not a chunk file or wrong version");
+        }
+        read<float>(file);
+
+        _materials.resize(read<uint32_t>(file));
+        for (auto& textures : _materials) {
+            const auto textureCount = read<uint32_t>(file);
+            for (uint32_t t=0; t<textureCount; ++t) {
+                const auto type = static_cast<TextureType>(read<uint8_t>(file));
+                std::string path(read<uint32_t>(file), '\0');
+                file.read(path.data(), path.size());
+                textures.emplace_back(path, type);
+            }
+        }
+
+        _chunks.resize(read<uint32_t>(file));
+        for (auto& chunk : _chunks) {
+            chunk.record = read<ChunkRecord>(file);
+        }
+        for (auto& chunk : _chunks) {
+            file.seekg(chunk.record.proxyOffset);
+            chunk.proxy = upload(readChunk(file), _stats.proxyBytes);
+        }
+        _stats.totalChunks = _chunks.size();
+    }
+
+    ~StreamingModel() {
+        for (auto& pending : _pending) {
+            pending.data.wait();
+        }
+        for (auto& chunk : _chunks) {
+            releaseMeshes(chunk.proxy);
+            releaseMeshes(chunk.meshes);
+        }
+    }
+
+    StreamingModel(const StreamingModel& other) = delete;
+    StreamingModel& operator=(const StreamingModel& other) = delete;
+
+    // Re-bakes when the baked file is missing or older than the source.
+    static bool isBakeUpToDate(const std::string& sourcePath, const std::string& bakedPath) {
+        std::error_code error;
+        const auto bakedTime = std::filesystem::last_write_time(bakedPath, error);
+        if (error) return false;
+        return bakedTime >= std::filesystem::last_write_time(sourcePath, error) && !error;
+    }
+
+    void setMemoryBudget(size_t bytes) { _memoryBudget = bytes; }
+    void setStreamingDistance(float distance) { _streamingDistance = distance; }
+    const StreamingStats& stats() const { return _stats; }
+
+    void update(const glm::vec3& cameraPosition, const glm::vec3& cameraFront) {
+        finishLoads();
+
+        // Closer first, and things in front count as closer than things behind.
+        std::vector<std::pair<float, size_t>> candidates;
+        for (size_t i=0; i<_chunks.size(); ++i) {
+            const auto& record = _chunks[i].record;
+            const glm::vec3 closest = glm::clamp(cameraPosition, record.boundsMin, record.boundsMax);
+            const float distance = glm::length(closest - cameraPosition);
+            if (distance > _streamingDistance) continue;
+
+            const glm::vec3 toCenter = 0.5f * (record.boundsMin + record.boundsMax) - cameraPosition;
+            const float centerDistance = glm::length(toCenter);
+            const float facing = centerDistance > 0.f ? glm::dot(cameraFront, toCenter / centerDistance) : 1.f;
+            candidates.emplace_back(distance * (1.5f - 0.5f * facing), i);
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        for (auto& chunk : _chunks) chunk.wanted = false;
+        size_t budget = _memoryBudget;
+        std::vector<size_t> toLoad;
+        for (const auto& [priority, index] : candidates) {
+            auto& chunk = _chunks[index];
+            const size_t bytes = chunk.state == ChunkState::Resident ? chunk.gpuBytes : chunk.record.size;
+            if (bytes > budget) break;
+            budget -= bytes;
+            chunk.wanted = true;
+            if (chunk.state == ChunkState::Unloaded) toLoad.push_back(index);
+        }
+
+        for (auto& chunk : _chunks) {
+            if (chunk.state == ChunkState::Resident && !chunk.wanted) {
+                releaseMeshes(chunk.meshes);
+                _stats.residentBytes -= chunk.gpuBytes;
+                chunk.gpuBytes = 0;
+                chunk.state = ChunkState::Unloaded;
+                _stats.evictions++;
+            }
+        }
+
+        for (const auto index : toLoad) {
+            if (_pending.size() >= maxLoadsInFlight) break;
+            _chunks[index].state = ChunkState::Loading;
+            const auto record = _chunks[index].record;
+            _pending.push_back(PendingLoad {
+                index,
+                _loaders.submit([path = _path, record] {
+                    std::ifstream file(path, std::ios::binary);
+                    file.seekg(record.offset);
+                    return StreamingFormat::readChunk(file);
+                }),
+                Clock::now()
+            });
+        }
+
+        updateStats();
+    }
+
+    void Draw(ShaderProgram& shader, const Frustum& frustum) {
+        forEachVisibleMesh(frustum, [&](Mesh& mesh) { mesh.Draw(shader); });
+    }
+
+    void Draw(MeshVariantDrawer& draw, const Frustum& frustum) {
+        forEachVisibleMesh(frustum, draw);
+    }
+
+    void DrawDepth(const Frustum& frustum) {
+        forEachVisibleMesh(frustum, [&](Mesh& mesh) { mesh.DrawDepth(); });
+    }
+
+private:
+    template<class Function>
+    void forEachVisibleMesh(const Frustum& frustum, Function&& function) {
+        for (auto& chunk : _chunks) {
+            if (!frustum.intersectsBox(chunk.record.boundsMin, chunk.record.boundsMax)) continue;
+            auto& meshes = chunk.state == ChunkState::Resident ? chunk.meshes : chunk.proxy;
+            for (auto& mesh : meshes) {
+                function(mesh);
+            }
+        }
+    }
+
+    void finishLoads() {
+        size_t uploads = 0;
+        for (auto it = _pending.begin(); it != _pending.end() && uploads < maxUploadsPerFrame;) {
+            if (it->data.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                ++it;
+                continue;
+            }
+
+            auto& chunk = _chunks[it->chunk];
+            const auto data = it->data.get();
+            if (chunk.wanted) {
+                chunk.meshes = upload(data, chunk.gpuBytes);
+                _stats.residentBytes += chunk.gpuBytes;
+                chunk.state = ChunkState::Resident;
+                chunk.loadMilliseconds = std::chrono::duration<float, std::milli>(Clock::now() - it->requested).count();
+
+                _stats.loadedChunks++;
+                _stats.lastLoadMilliseconds = chunk.loadMilliseconds;
+                _stats.maxLoadMilliseconds = std::max(_stats.maxLoadMilliseconds, chunk.loadMilliseconds);
+                _totalLoadMilliseconds += chunk.loadMilliseconds;
+                uploads++;
+            } else {
+                // Camera moved on while it was loading.
+                chunk.state = ChunkState::Unloaded;
+            }
+            _recentLoads.emplace_back(Clock::now(), chunk.record.size);
+            it = _pending.erase(it);
+        }
+    }
+
+    void updateStats() {
+        const auto now = Clock::now();
+        while (!_recentLoads.empty() && now - _recentLoads.front().first > std::chrono::seconds(1)) {
+            _recentLoads.pop_front();
+        }
+        size_t recentBytes = 0;
+        for (const auto& [time, bytes] : _recentLoads) recentBytes += bytes;
+
+        _stats.bandwidthBytesPerSecond = static_cast<float>(recentBytes);
+        _stats.loadingChunks = _pending.size();
+        _stats.residentChunks = std::count_if(_chunks.begin(), _chunks.end(), [](const Chunk& chunk) { return chunk.state == ChunkState::Resident; });
+        _stats.averageLoadMilliseconds = _stats.loadedChunks ? _totalLoadMilliseconds / _stats.loadedChunks : 0.f;
+    }
+
+    std::vector<Mesh> upload(const StreamingFormat::ChunkData& chunk, size_t& gpuBytes) {
+        std::vector<Mesh> meshes;
+        for (const auto& submesh : chunk.submeshes) {
+            if (submesh.indices.empty()) continue;
+            std::vector<unsigned int> indices(submesh.indices.begin(), submesh.indices.end());
+            VertexDataBase vertexData = VertexData<Layout::Interleaving, Vec3, Vec3, Vec2>(
+                indices, submesh.vertexCount(), reinterpret_cast<const std::byte*>(submesh.vertices.data()));
+            const auto& textures = submesh.material < _materials.size() ? _materials[submesh.material] : std::vector<Texture>{};
+            meshes.emplace_back(vertexData, textures);
+            gpuBytes += submesh.byteSize();
+        }
+        return meshes;
+    }
+
+    static void releaseMeshes(std::vector<Mesh>& meshes) {
+        for (auto& mesh : meshes) {
+            mesh.release();
+        }
+        meshes.clear();
+    }
+};
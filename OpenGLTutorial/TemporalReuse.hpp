@@ -0,0 +1,221 @@
+#pragma once
+
+#include "glad/glad.h"
+#include "glm/glm.hpp"
+
+#include <functional>
+
+#include "ShaderProgram.hpp"
+#include "ShaderPermutations.hpp"
+#include "GpuQuery.hpp"
+#include "DeferredFramebuffer.hpp"
+#include "RenderTargetPool.hpp"
+#include "PostProcessGraph.hpp"
+
+// Variant bits for a shader reading the G-buffer through DeferredLighting/GBufferInputs.glsl. Bits follow each
+// shader's own feature order, so every permutation set needs its own mask.
+inline uint32_t gBufferFeatures(const ShaderPermutations& permutations, const GBufferLayout& layout) {
+    uint32_t features = 0;
+    if (layout.octahedralNormals) features |= permutations.feature("OCTAHEDRAL_NORMALS");
+    if (!layout.storePosition) features |= permutations.feature("POSITION_FROM_DEPTH");
+    return features;
+}
+
+struct TemporalReuseStats {
+    // Of all the pixels, so sky and emissive count as shaded.
+    float reusedFraction = 0.f;
+    float reprojectMilliseconds = 0.f;
+    float historyMilliseconds = 0.f;
+};
+
+// Keeps last frame's lighting around and hands it back where the surface under a pixel is still the same one.
+// reproject() follows each pixel to where it was last frame (camera from the matrices, objects from the G-buffer
+// motion), rejects it on a depth or facing mismatch and leaves the survivors in a target the lighting shaders check
+// with TEMPORAL_REUSE. store() keeps this frame's result for the next one. Moving lights make reused pixels go stale,
+// a rotating subset of tiles gets shaded every frame to bound that.
+class TemporalReuse {
+    constexpr static auto gMotionName = std::string_view("gMotion");
+    constexpr static auto historyColorName = std::string_view("historyColor");
+    constexpr static auto historyGeometryName = std::string_view("historyGeometry");
+    constexpr static auto litTextureName = std::string_view("litTexture");
+    constexpr static auto previousViewProjectionName = std::string_view("previousViewProjection");
+    constexpr static auto previousViewName = std::string_view("previousView");
+    constexpr static auto inverseProjectionName = std::string_view("inverseProjection");
+    constexpr static auto inverseViewName = std::string_view("inverseView");
+    constexpr static auto viewName = std::string_view("view");
+    constexpr static auto refreshPeriodName = std::string_view("refreshPeriod");
+    constexpr static auto refreshPhaseName = std::string_view("refreshPhase");
+    constexpr static auto depthToleranceName = std::string_view("depthTolerance");
+    constexpr static auto normalToleranceName = std::string_view("normalTolerance");
+    constexpr static auto viewportSizeName = std::string_view("viewportSize");
+    constexpr static auto previousViewportSizeName = std::string_view("previousViewportSize");
+
+    RenderTargetPool& _pool;
+    ShaderPermutations _reprojectPermutations;
+    ShaderPermutations _historyPermutations;
+    unsigned int _framebuffer;
+    // Kept from one frame to the next, the reprojection only lives between reproject() and store().
+    unsigned int _historyColor = 0, _historyGeometry = 0;
+    unsigned int _reprojected = 0;
+    // Of the allocation, the history follows the G-buffer's. What got rendered into it can differ frame to frame.
+    unsigned int _width = 0, _height = 0;
+    glm::vec2 _previousViewportSize = glm::vec2(0.f);
+    bool _hasHistory = false;
+    glm::mat4 _previousView = glm::mat4(1.f);
+    glm::mat4 _previousViewProjection = glm::mat4(1.f);
+    int _refreshPeriod = 8;
+    int _frame = 0;
+    float _depthTolerance = 0.02f;
+    float _normalTolerance = 0.95f;
+
+    GpuTimer _reprojectTimer;
+    GpuTimer _historyTimer;
+    SamplesPassedCounter _reusedSamples;
+    TemporalReuseStats _stats;
+public:
+    constexpr static int historyUnit = 9;
+
+    TemporalReuse(RenderTargetPool& pool, const std::function<void(ShaderProgram&)>& bindGBufferUnits)
+    : _pool(pool),
+      _reprojectPermutations("PostProcess/Fullscreen.vert.glsl", "DeferredLighting/TemporalReproject.frag.glsl", [bindGBufferUnits](ShaderProgram& program) {
+          bindGBufferUnits(program);
+          program.set(gMotionName, 10);
+          program.set(historyColorName, 11);
+          program.set(historyGeometryName, 12);
+      }),
+      _historyPermutations("PostProcess/Fullscreen.vert.glsl", "DeferredLighting/TemporalHistory.frag.glsl", [bindGBufferUnits](ShaderProgram& program) {
+          bindGBufferUnits(program);
+          program.set(litTextureName, 11);
+      })
+    {
+        glGenFramebuffers(1, &_framebuffer);
+    }
+
+    ~TemporalReuse() {
+        releaseHistory();
+        glDeleteFramebuffers(1, &_framebuffer);
+    }
+
+    TemporalReuse(const TemporalReuse& other) = delete;
+    TemporalReuse& operator=(const TemporalReuse& other) = delete;
+
+    // Frames until every tile has been shaded fresh at least once, 0 reuses whatever passes the checks.
+    void setRefreshPeriod(int frames) { _refreshPeriod = std::max(frames, 0); }
+    int refreshPeriod() const { return _refreshPeriod; }
+    // Relative view depth difference and minimum normal dot product a reprojected pixel may have.
+    void setTolerances(float depth, float normal) {
+        _depthTolerance = depth;
+        _normalTolerance = normal;
+    }
+
+    // Drops the history, for when last frame has nothing to do with this one.
+    void reset() { _hasHistory = false; }
+
+    const TemporalReuseStats& stats() const { return _stats; }
+
+    // G-buffer units have to be bound already. Returns the reprojection (on historyUnit as well), 0 when there's
+    // nothing to reuse this frame and the lighting should run without TEMPORAL_REUSE.
+    unsigned int reproject(const DeferredFramebuffer& gBuffer, const glm::mat4& view, const glm::mat4& projection) {
+        _stats.reprojectMilliseconds = _reprojectTimer.milliseconds();
+        _stats.reusedFraction = static_cast<float>(_reusedSamples.result()) / (gBuffer._width * gBuffer._height);
+        if (!_hasHistory || gBuffer._allocatedWidth != _width || gBuffer._allocatedHeight != _height) return 0;
+
+        _reprojected = _pool.acquire(RenderTargetDesc { _width, _height, GL_RGBA16F });
+        glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _reprojected, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, 0, 0);
+        const unsigned int attachments[1] = { GL_COLOR_ATTACHMENT0 };
+        glDrawBuffers(1, attachments);
+        glViewport(0, 0, gBuffer._width, gBuffer._height);
+        glClearColor(0.f, 0.f, 0.f, 0.f);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        bind(10, gBuffer.getMotionTexture());
+        bind(11, _historyColor);
+        bind(12, _historyGeometry);
+        auto& program = _reprojectPermutations.get(gBufferFeatures(_reprojectPermutations, gBuffer.layout()));
+        program.use();
+        program.set(inverseProjectionName, glm::inverse(projection));
+        program.set(inverseViewName, glm::inverse(view));
+        program.set(previousViewProjectionName, _previousViewProjection);
+        program.set(previousViewName, _previousView);
+        program.set(refreshPeriodName, _refreshPeriod);
+        program.set(refreshPhaseName, _refreshPeriod > 0 ? _frame % _refreshPeriod : 0);
+        program.set(depthToleranceName, _depthTolerance);
+        program.set(normalToleranceName, _normalTolerance);
+        program.set(viewportSizeName, viewportSize(gBuffer));
+        // Last frame may have been rendered at another size, its uv maps to texels by that one.
+        program.set(previousViewportSizeName, _previousViewportSize);
+        {
+            GpuTimer::ScopedQuery timer(_reprojectTimer);
+            SamplesPassedCounter::ScopedQuery reused(_reusedSamples);
+            FullscreenTriangle::shared().draw();
+        }
+
+        bind(historyUnit, _reprojected);
+        return _reprojected;
+    }
+
+    // After the lighting, with the G-buffer units still bound. Leaves the framebuffer binding at 0.
+    void store(const DeferredFramebuffer& gBuffer, unsigned int lit, const glm::mat4& view, const glm::mat4& projection) {
+        if (gBuffer._allocatedWidth != _width || gBuffer._allocatedHeight != _height) {
+            releaseHistory();
+            _width = gBuffer._allocatedWidth;
+            _height = gBuffer._allocatedHeight;
+            _historyColor = _pool.acquire(RenderTargetDesc { _width, _height, GL_RGBA16F });
+            _historyGeometry = _pool.acquire(RenderTargetDesc { _width, _height, GL_RGBA16F });
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _historyColor, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, _historyGeometry, 0);
+        const unsigned int attachments[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+        glDrawBuffers(2, attachments);
+        glViewport(0, 0, gBuffer._width, gBuffer._height);
+
+        bind(historyUnit, 0);
+        bind(11, lit);
+        auto& program = _historyPermutations.get(gBufferFeatures(_historyPermutations, gBuffer.layout()));
+        program.use();
+        program.set(inverseProjectionName, glm::inverse(projection));
+        program.set(inverseViewName, glm::inverse(view));
+        program.set(viewName, view);
+        program.set(viewportSizeName, viewportSize(gBuffer));
+        {
+            GpuTimer::ScopedQuery timer(_historyTimer);
+            FullscreenTriangle::shared().draw();
+        }
+        _stats.historyMilliseconds = _historyTimer.milliseconds();
+        bind(11, 0);
+        bind(10, 0);
+        bind(12, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        if (_reprojected) _pool.release(_reprojected);
+        _reprojected = 0;
+        _previousView = view;
+        _previousViewProjection = projection * view;
+        _previousViewportSize = viewportSize(gBuffer);
+        _hasHistory = true;
+        _frame++;
+    }
+
+private:
+    static glm::vec2 viewportSize(const DeferredFramebuffer& gBuffer) {
+        return glm::vec2(gBuffer._width, gBuffer._height);
+    }
+
+    static void bind(int unit, unsigned int texture) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    void releaseHistory() {
+        if (_reprojected) _pool.release(_reprojected);
+        if (_historyColor) _pool.release(_historyColor);
+        if (_historyGeometry) _pool.release(_historyGeometry);
+        _reprojected = _historyColor = _historyGeometry = 0;
+        _hasHistory = false;
+    }
+};
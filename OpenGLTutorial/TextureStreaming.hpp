@@ -0,0 +1,324 @@
+#pragma once
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <limits>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "stb_image_proxy.hpp"
+#include "Frustum.hpp"
+#include "Mesh.hpp"
+#include "ThreadPool.hpp"
+
+// How much world a unit of UV covers, so we can guess which mip a mesh needs from how big it is on screen.
+struct TexelDensity {
+    glm::vec3 boundsMin { std::numeric_limits<float>::max() };
+    glm::vec3 boundsMax { std::numeric_limits<float>::lowest() };
+    float worldUnitsPerUv = 0.f;
+
+    static TexelDensity measure(const std::vector<glm::vec3>& positions, const std::vector<glm::vec2>& uvs, const std::vector<unsigned int>& indices) {
+        TexelDensity density;
+        for (const auto& position : positions) {
+            density.boundsMin = glm::min(density.boundsMin, position);
+            density.boundsMax = glm::max(density.boundsMax, position);
+        }
+
+        float worldArea = 0.f, uvArea = 0.f;
+        for (size_t i=0; i+2<indices.size(); i+=3) {
+            const auto a = indices[i], b = indices[i+1], c = indices[i+2];
+            worldArea += glm::length(glm::cross(positions[b] - positions[a], positions[c] - positions[a]));
+            const glm::vec2 uvB = uvs[b] - uvs[a], uvC = uvs[c] - uvs[a];
+            uvArea += std::abs(uvB.x * uvC.y - uvB.y * uvC.x);
+        }
+        if (uvArea > 0.f) {
+            density.worldUnitsPerUv = std::sqrt(worldArea / uvArea);
+        }
+        return density;
+    }
+};
+
+struct MipRequestContext {
+    Frustum frustum;
+    glm::vec3 cameraPosition;
+    // projection[1][1] * viewportHeight / 2 - how many pixels one world unit takes at distance 1.
+    float pixelsPerUnitAtUnitDistance;
+};
+
+// Finest level worth having for a texture of `textureSize` texels across, +inf when the mesh is off screen.
+inline float requiredMipLevel(const TexelDensity& density, const MipRequestContext& context, const int textureSize) {
+    if (density.worldUnitsPerUv <= 0.f) return 0.f;
+    if (!context.frustum.intersectsBox(density.boundsMin, density.boundsMax)) return std::numeric_limits<float>::infinity();
+
+    const glm::vec3 closest = glm::clamp(context.cameraPosition, density.boundsMin, density.boundsMax);
+    const float distance = std::max(glm::length(closest - context.cameraPosition), 0.1f);
+    const float pixelsPerUv = density.worldUnitsPerUv * context.pixelsPerUnitAtUnitDistance / distance;
+    return std::max(0.f, std::log2(textureSize / pixelsPerUv));
+}
+
+struct TextureStreamingStats {
+    size_t textures = 0;
+    size_t residentBytes = 0;
+    size_t fullChainBytes = 0;
+    size_t pendingLoads = 0;
+    size_t uploadedLevels = 0;
+    size_t evictedLevels = 0;
+    float lastLoadMilliseconds = 0.f;
+};
+
+// Textures start with only the small mips resident. Every frame whoever draws them says which mip they
+// need, finer ones get decoded on a worker and uploaded, unneeded ones get dropped again.
+// GL_TEXTURE_BASE_LEVEL keeps sampling off levels that aren't there, GL_TEXTURE_MIN_LOD eases new ones in.
+class TextureStreamer {
+    using Clock = std::chrono::steady_clock;
+    // Mips at most this big are loaded up front and never evicted.
+    constexpr static int residentSize = 64;
+    // Don't drop a level the moment it's not needed, the camera tends to come back.
+    constexpr static int evictionHysteresis = 1;
+    constexpr static float fadeLevelsPerUpdate = 0.25f;
+    constexpr static size_t maxUploadsPerUpdate = 2;
+    // GL_RGB is padded to 4 bytes by about every driver.
+    constexpr static size_t bytesPerTexel = 4;
+
+    struct DecodedMips {
+        int firstLevel = 0;
+        int channels = 0;
+        std::vector<std::vector<unsigned char>> levels;
+    };
+
+    struct Entry {
+        std::string path;
+        int width, height, levelCount;
+        int coarseBase;
+        int residentBase;
+        float requested = std::numeric_limits<float>::infinity();
+        float minLod = 0.f;
+        std::optional<std::future<DecodedMips>> pending;
+        Clock::time_point requestedAt;
+    };
+
+    std::unordered_map<std::string, unsigned int> _byPath;
+    std::unordered_map<unsigned int, Entry> _entries;
+    bool _enabled = true;
+    TextureStreamingStats _stats;
+
+    // Declared last so it's joined before the entries go away.
+    ThreadPool _loaders { 1 };
+public:
+    TextureStreamer() = default;
+
+    ~TextureStreamer() {
+        for (auto& [id, entry] : _entries) {
+            if (entry.pending) entry.pending->wait();
+            glDeleteTextures(1, &id);
+        }
+    }
+
+    TextureStreamer(const TextureStreamer& other) = delete;
+    TextureStreamer& operator=(const TextureStreamer& other) = delete;
+
+    // Same file twice gives the same GL texture.
+    Texture load(const std::string& path, TextureType type) {
+        if (const auto it = _byPath.find(path); it != _byPath.end()) {
+            const auto& entry = _entries.at(it->second);
+            return Texture(it->second, entry.width, entry.height, type);
+        }
+
+        int width = 0, height = 0, channels = 0;
+        if (!stbi_info(path.c_str(), &width, &height, &channels)) {
+            throw std::runtime_error("Failed to read texture " + path);
+        }
+        const int levelCount = levelCountFor(width, height);
+        int coarseBase = 0;
+        while (coarseBase + 1 < levelCount && std::max(levelSize(width, coarseBase), levelSize(height, coarseBase)) > residentSize) {
+            coarseBase++;
+        }
+
+        unsigned int id;
+        glGenTextures(1, &id);
+        glBindTexture(GL_TEXTURE_2D, id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        // Still nearest, but picking a mip - otherwise only the base level is ever sampled.
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        Entry entry { path, width, height, levelCount, coarseBase, levelCount };
+        uploadLevels(id, entry, decode(path, width, height, coarseBase, levelCount - 1));
+        _entries.emplace(id, std::move(entry));
+        _byPath.emplace(path, id);
+        return Texture(id, width, height, type);
+    }
+
+    // Call for every use of the texture each frame, the finest request wins.
+    void request(unsigned int id, float level) {
+        const auto it = _entries.find(id);
+        if (it == _entries.end()) return;
+        it->second.requested = std::min(it->second.requested, level);
+    }
+
+    // Off means everything asks for the full chain - handy to compare memory.
+    void setEnabled(bool enabled) { _enabled = enabled; }
+
+    const TextureStreamingStats& stats() const { return _stats; }
+
+    void update() {
+        collectLoads();
+
+        for (auto& [id, entry] : _entries) {
+            const float requested = _enabled ? entry.requested : 0.f;
+            const int wanted = std::isfinite(requested)
+                ? std::clamp(static_cast<int>(std::floor(requested)), 0, entry.coarseBase)
+                : entry.coarseBase;
+            entry.requested = std::numeric_limits<float>::infinity();
+
+            if (wanted < entry.residentBase && !entry.pending) {
+                const auto path = entry.path;
+                const int width = entry.width, height = entry.height, last = entry.residentBase - 1;
+                entry.pending = _loaders.submit([path, width, height, wanted, last] {
+                    return decode(path, width, height, wanted, last);
+                });
+                entry.requestedAt = Clock::now();
+            } else if (wanted > entry.residentBase + evictionHysteresis && !entry.pending) {
+                evictLevels(id, entry, wanted);
+            }
+
+            if (entry.minLod > 0.f) {
+                entry.minLod = std::max(0.f, entry.minLod - fadeLevelsPerUpdate);
+                glBindTexture(GL_TEXTURE_2D, id);
+                glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_LOD, entry.minLod);
+            }
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        _stats.textures = _entries.size();
+        _stats.residentBytes = 0;
+        _stats.fullChainBytes = 0;
+        _stats.pendingLoads = 0;
+        for (const auto& [id, entry] : _entries) {
+            _stats.residentBytes += levelBytes(entry, entry.residentBase, entry.levelCount);
+            _stats.fullChainBytes += levelBytes(entry, 0, entry.levelCount);
+            _stats.pendingLoads += entry.pending.has_value();
+        }
+    }
+
+private:
+    static int levelCountFor(int width, int height) {
+        return 1 + static_cast<int>(std::floor(std::log2(std::max(width, height))));
+    }
+
+    static int levelSize(int size, int level) {
+        return std::max(1, size >> level);
+    }
+
+    static size_t levelBytes(const Entry& entry, int first, int end) {
+        size_t bytes = 0;
+        for (int level=first; level<end; ++level) {
+            bytes += static_cast<size_t>(levelSize(entry.width, level)) * levelSize(entry.height, level) * bytesPerTexel;
+        }
+        return bytes;
+    }
+
+    // The formats we read can't be decoded partially, so it's always the full image boxed down to `lastLevel`.
+    static DecodedMips decode(const std::string& path, int width, int height, int firstLevel, int lastLevel) {
+        DecodedMips result;
+        result.firstLevel = firstLevel;
+        int decodedWidth, decodedHeight;
+        unsigned char* data = stbi_load(path.c_str(), &decodedWidth, &decodedHeight, &result.channels, 0);
+        if (!data) {
+            throw std::runtime_error("Failed to load texture " + path);
+        }
+        std::vector<unsigned char> level(data, data + static_cast<size_t>(width) * height * result.channels);
+        stbi_image_free(data);
+
+        for (int l=0; l<=lastLevel; ++l) {
+            if (l > 0) {
+                level = downsample(level, levelSize(width, l - 1), levelSize(height, l - 1), result.channels);
+            }
+            if (l >= firstLevel) {
+                result.levels.push_back(level);
+            }
+        }
+        return result;
+    }
+
+    static std::vector<unsigned char> downsample(const std::vector<unsigned char>& source, int width, int height, int channels) {
+        const int targetWidth = std::max(1, width / 2), targetHeight = std::max(1, height / 2);
+        std::vector<unsigned char> target(static_cast<size_t>(targetWidth) * targetHeight * channels);
+        for (int y=0; y<targetHeight; ++y) {
+            const int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+            for (int x=0; x<targetWidth; ++x) {
+                const int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+                for (int c=0; c<channels; ++c) {
+                    const int sum = source[(y0 * width + x0) * channels + c] + source[(y0 * width + x1) * channels + c]
+                                  + source[(y1 * width + x0) * channels + c] + source[(y1 * width + x1) * channels + c];
+                    target[(y * targetWidth + x) * channels + c] = static_cast<unsigned char>((sum + 2) / 4);
+                }
+            }
+        }
+        return target;
+    }
+
+    static GLenum formatFor(int channels) {
+        switch (channels) {
+            case 1: return GL_RED;
+            case 2: return GL_RG;
+            case 3: return GL_RGB;
+            default: return GL_RGBA;
+        }
+    }
+
+    void uploadLevels(unsigned int id, Entry& entry, const DecodedMips& mips) {
+        glBindTexture(GL_TEXTURE_2D, id);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // small RGB levels have odd row sizes
+        for (size_t i=0; i<mips.levels.size(); ++i) {
+            const int level = mips.firstLevel + static_cast<int>(i);
+            glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, levelSize(entry.width, level), levelSize(entry.height, level), 0,
+                formatFor(mips.channels), GL_UNSIGNED_BYTE, mips.levels[i].data());
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+        // Keep sampling as blurry as before and let update() sharpen it over a few frames.
+        entry.minLod = entry.residentBase < entry.levelCount ? static_cast<float>(entry.residentBase - mips.firstLevel) : 0.f;
+        entry.residentBase = mips.firstLevel;
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, entry.residentBase);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_LOD, entry.minLod);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        _stats.uploadedLevels += mips.levels.size();
+    }
+
+    void evictLevels(unsigned int id, Entry& entry, int newBase) {
+        glBindTexture(GL_TEXTURE_2D, id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, newBase);
+        entry.minLod = 0.f;
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_LOD, 0.f);
+        // A zero sized image frees the level's storage.
+        for (int level=entry.residentBase; level<newBase; ++level) {
+            glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, 0, 0, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+        }
+        _stats.evictedLevels += newBase - entry.residentBase;
+        entry.residentBase = newBase;
+    }
+
+    void collectLoads() {
+        size_t uploads = 0;
+        for (auto& [id, entry] : _entries) {
+            if (uploads >= maxUploadsPerUpdate) break;
+            if (!entry.pending || entry.pending->wait_for(std::chrono::seconds(0)) != std::future_status::ready) continue;
+
+            const auto mips = entry.pending->get();
+            entry.pending.reset();
+            uploadLevels(id, entry, mips);
+            _stats.lastLoadMilliseconds = std::chrono::duration<float, std::milli>(Clock::now() - entry.requestedAt).count();
+            uploads++;
+        }
+    }
+};
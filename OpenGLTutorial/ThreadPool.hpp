@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Plain fixed-size pool. parallelFor lets the calling thread chew through chunks as well,
+// so nesting it inside a task can't deadlock the pool.
+class ThreadPool {
+    std::vector<std::thread> _workers;
+    std::deque<std::function<void()>> _tasks;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    bool _stopping = false;
+public:
+    explicit ThreadPool(unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency())) {
+        for (unsigned int i=0; i<threadCount; ++i) {
+            _workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(_mutex);
+            _stopping = true;
+        }
+        _condition.notify_all();
+        for (auto& worker : _workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool& other) = delete;
+    ThreadPool& operator=(const ThreadPool& other) = delete;
+
+    size_t size() const {
+        return _workers.size();
+    }
+
+    template<class Function>
+    auto submit(Function&& function) -> std::future<std::invoke_result_t<Function>> {
+        using Result = std::invoke_result_t<Function>;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Function>(function));
+        auto future = task->get_future();
+        {
+            std::lock_guard lock(_mutex);
+            _tasks.emplace_back([task] { (*task)(); });
+        }
+        _condition.notify_one();
+        return future;
+    }
+
+    // Calls function(chunkBegin, chunkEnd) over [begin, end) split into chunks of `grain`, returns when all are done.
+    template<class Function>
+    void parallelFor(size_t begin, size_t end, size_t grain, Function&& function) {
+        if (end <= begin) return;
+        grain = std::max<size_t>(grain, 1);
+        const size_t chunkCount = (end - begin + grain - 1) / grain;
+        if (chunkCount == 1 || _workers.empty()) {
+            function(begin, end);
+            return;
+        }
+
+        struct SharedState {
+            std::atomic<size_t> nextChunk { 0 };
+            std::atomic<size_t> finishedChunks { 0 };
+            std::mutex mutex;
+            std::condition_variable done;
+        };
+        auto state = std::make_shared<SharedState>();
+
+        // Helpers may start after everything is finished - they only touch the shared state then.
+        auto runChunks = [state, begin, end, grain, chunkCount, &function] {
+            size_t chunk;
+            while ((chunk = state->nextChunk.fetch_add(1)) < chunkCount) {
+                const size_t chunkBegin = begin + chunk * grain;
+                function(chunkBegin, std::min(end, chunkBegin + grain));
+                if (state->finishedChunks.fetch_add(1) + 1 == chunkCount) {
+                    std::lock_guard lock(state->mutex);
+                    state->done.notify_all();
+                }
+            }
+        };
+
+        const size_t helpers = std::min(chunkCount - 1, _workers.size());
+        {
+            std::lock_guard lock(_mutex);
+            for (size_t i=0; i<helpers; ++i) {
+                _tasks.emplace_back(runChunks);
+            }
+        }
+        _condition.notify_all();
+
+        runChunks();
+        std::unique_lock lock(state->mutex);
+        state->done.wait(lock, [&] { return state->finishedChunks.load() == chunkCount; });
+    }
+
+    // One worker less than cores, parallelFor callers work too.
+    static ThreadPool& shared() {
+        static ThreadPool pool(std::max(2u, std::thread::hardware_concurrency()) - 1);
+        return pool;
+    }
+
+private:
+    void workerLoop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock lock(_mutex);
+                _condition.wait(lock, [this] { return _stopping || !_tasks.empty(); });
+                if (_stopping && _tasks.empty()) return;
+                task = std::move(_tasks.front());
+                _tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
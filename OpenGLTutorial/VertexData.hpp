@@ -33,6 +33,7 @@ using Float = VertexAttribute<1, float>;
 class VertexDataBase {   
 protected: 
     unsigned int _VAO{}, _VBO{}, _EBO{};
+    unsigned int _positionVAO{};
     size_t _size {}, _elementsCount{};
 public:
     constexpr VertexDataBase() {}
@@ -49,11 +50,50 @@ public:
         return _elementsCount;
     }
 
+    // Copies don't own anything, so whoever knows the data is going away calls this once.
+    void release() {
+        glDeleteVertexArrays(1, &_VAO);
+        glDeleteVertexArrays(1, &_positionVAO);
+        glDeleteBuffers(1, &_VBO);
+        glDeleteBuffers(1, &_EBO);
+        _VAO = _positionVAO = _VBO = _EBO = 0;
+        _elementsCount = 0;
+    }
+
+    // Replaces the index stream, e.g. with only the visible meshlets. Orphans the old storage.
+    void setIndices(const std::vector<unsigned int>& indices) {
+        _elementsCount = indices.size();
+        glBindVertexArray(0); // element buffer binding is VAO state, don't touch someone else's
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _EBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STREAM_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+
     struct ScopedBinding {
         unsigned int _id;
         ScopedBinding(const VertexDataBase& vertexData) : _id(vertexData._VAO) { glBindVertexArray(_id); }
         ~ScopedBinding() { glBindVertexArray(0); }
     };
+
+    // Only attribute 0 (position) enabled, for depth-only passes.
+    struct ScopedPositionBinding {
+        unsigned int _id;
+        ScopedPositionBinding(const VertexDataBase& vertexData) : _id(vertexData._positionVAO) { glBindVertexArray(_id); }
+        ~ScopedPositionBinding() { glBindVertexArray(0); }
+    };
+
+protected:
+    // Expects position to be the first attribute, as every shader here has it at location 0.
+    void layoutPositionOnlyArray(const int stride) {
+        glGenVertexArrays(1, &_positionVAO);
+        glBindVertexArray(_positionVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, _VBO);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _EBO);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
 };
 
 template <Layout, class ... >
@@ -80,6 +120,8 @@ public:
 
         glBindVertexArray(0);
         glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        layoutPositionOnlyArray((VertexAttributeDescription::byte_size::value + ...));
     }
 
 private:
@@ -126,6 +168,9 @@ public:
 
         glBindVertexArray(0);
         glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        // Positions are one tightly packed block here, so depth-only draws fetch nothing else.
+        layoutPositionOnlyArray(std::tuple_element_t<0, TupleOfDescriptions>::byte_size::value);
     }
 
     template<int Index>
@@ -0,0 +1,426 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VIDEO_CAPTURE_SSE 1
+#endif
+
+#include "AsyncReadback.hpp"
+#include "ThreadPool.hpp"
+
+// What happens to a frame when the encoder is as far behind as the queue allows.
+enum class CaptureBackPressure {
+    // Skipped and counted, the frame rate stays but the video has holes.
+    Drop,
+    // The render thread waits for room. Nothing gets lost, the frame rate follows the encoder.
+    Block
+};
+
+struct VideoCaptureSettings {
+    // Written into the file. Fixed timestep runs the scene at exactly this.
+    int framesPerSecond = 60;
+    CaptureBackPressure backPressure = CaptureBackPressure::Drop;
+    // Frames between the screen and the file at once: read back, waiting or being encoded.
+    size_t queueFrames = 8;
+    bool simd = true;
+};
+
+struct VideoCaptureStats {
+    uint64_t captured = 0;
+    uint64_t written = 0;
+    uint64_t dropped = 0;
+    // Readback failed or came back at the wrong size, or the file wouldn't take it.
+    uint64_t failed = 0;
+    size_t queued = 0;
+    // Render thread time capture took, the last frame, averaged over the recording and the worst one. Includes waiting
+    // for room with CaptureBackPressure::Block.
+    float overheadMilliseconds = 0.f;
+    float averageOverheadMilliseconds = 0.f;
+    float maxOverheadMilliseconds = 0.f;
+    float blockedMilliseconds = 0.f;
+    // Per frame on the encoder side.
+    float convertMilliseconds = 0.f;
+    float writeMilliseconds = 0.f;
+    uint64_t bytes = 0;
+};
+
+// Records what ends up on screen, every frame, as raw Y4M. Frames come off the GPU through an AsyncReadback of their
+// own (one slot per queued frame), wait in a queue and get converted to 4:2:0 YUV (across the pool) and written by an encoder thread, in order.
+// The queue is bounded by counting every frame from its readback request until it's on disk, so memory stays flat
+// however slow the disk is; what happens when it's full is up to CaptureBackPressure.
+class VideoCapture {
+    ThreadPool& _pool;
+    std::unique_ptr<AsyncReadback> _readback;
+    VideoCaptureSettings _settings;
+    std::filesystem::path _path;
+    std::ofstream _file;
+    int _width = 0, _height = 0;
+    bool _recording = false;
+    uint64_t _nextSequence = 0;
+    double _overheadTotal = 0.0;
+    VideoCaptureStats _stats;
+
+    std::thread _encoder;
+    std::mutex _mutex;
+    std::condition_variable _delivered;
+    std::condition_variable _consumed;
+    // Everything below under _mutex. Keyed by sequence, readbacks may finish out of order.
+    std::map<uint64_t, ReadbackImage> _queue;
+    size_t _reserved = 0;
+    bool _stopping = false;
+
+    // Written by the encoder.
+    std::atomic<uint64_t> _written { 0 };
+    std::atomic<uint64_t> _failed { 0 };
+    std::atomic<uint64_t> _bytes { 0 };
+    // The file stopped taking writes, frame() stops the capture on the render thread.
+    std::atomic<bool> _writeFailed { false };
+    std::atomic<float> _convertMilliseconds { 0.f };
+    std::atomic<float> _writeMilliseconds { 0.f };
+public:
+    explicit VideoCapture(ThreadPool& pool = ThreadPool::shared())
+    : _pool(pool)
+    {}
+
+    ~VideoCapture() {
+        stop();
+    }
+
+    VideoCapture(const VideoCapture& other) = delete;
+    VideoCapture& operator=(const VideoCapture& other) = delete;
+
+    // The size is the screen's and has to stay put until stop(), odd sizes lose their last row/column.
+    bool start(const std::filesystem::path& path, int width, int height, const VideoCaptureSettings& settings = {}) {
+        stop();
+        width &= ~1;
+        height &= ~1;
+        if (width <= 0 || height <= 0) return false;
+        _file.open(path, std::ios::binary | std::ios::trunc);
+        if (!_file) {
+            std::cout << "Couldn't open " << path.string() << " for capture\n";
+            return false;
+        }
+        // C420jpeg: chroma sited between the four pixels it covers, which is what averaging them gives.
+        _file << "YUV4MPEG2 W" << width << " H" << height << " F" << std::max(settings.framesPerSecond, 1) << ":1 Ip A1:1 C420jpeg\n";
+        if (!_file) {
+            std::cout << "Couldn't write " << path.string() << "\n";
+            _file.close();
+            return false;
+        }
+
+        _path = path;
+        _settings = settings;
+        _settings.queueFrames = std::max<size_t>(_settings.queueFrames, 1);
+        // Every queued frame may still be on the GPU, so as many slots as the queue is long.
+        _readback = std::make_unique<AsyncReadback>(_settings.queueFrames, _pool);
+        _width = width;
+        _height = height;
+        _nextSequence = 0;
+        _overheadTotal = 0.0;
+        _stats = {};
+        _written = _failed = _bytes = 0;
+        _writeFailed = false;
+        _convertMilliseconds = _writeMilliseconds = 0.f;
+        _queue.clear();
+        _reserved = 0;
+        _stopping = false;
+        _recording = true;
+        _encoder = std::thread([this]() { encode(); });
+        return true;
+    }
+
+    // Once per frame after everything that should be in the video got drawn, before the buffers swap.
+    void frame(int width, int height) {
+        if (!_recording) return;
+        if ((width & ~1) != _width || (height & ~1) != _height) {
+            std::cout << "Capture stopped, the window changed size\n";
+            stop();
+            return;
+        }
+        if (_writeFailed) {
+            std::cout << "Capture stopped, couldn't write " << _path.string() << "\n";
+            stop();
+            return;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        _readback->update();
+        bool take = true;
+        {
+            std::unique_lock lock(_mutex);
+            if (_reserved >= _settings.queueFrames) {
+                if (_settings.backPressure == CaptureBackPressure::Drop) {
+                    take = false;
+                } else {
+                    // Frames still on the GPU only reach the encoder through this thread, so those go first.
+                    const auto blockStart = std::chrono::steady_clock::now();
+                    lock.unlock();
+                    _readback->finish();
+                    lock.lock();
+                    _consumed.wait(lock, [this]() { return _reserved < _settings.queueFrames; });
+                    _stats.blockedMilliseconds += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - blockStart).count();
+                }
+            }
+            if (take) _reserved++;
+        }
+        if (take) {
+            const uint64_t sequence = _nextSequence;
+            const auto deliver = [this, sequence](ReadbackImage&& image) {
+                {
+                    std::lock_guard lock(_mutex);
+                    _queue.emplace(sequence, std::move(image));
+                }
+                _delivered.notify_one();
+            };
+            take = _readback->readScreen(_width, _height, ReadbackKind::Rgba, deliver);
+            if (!take && _settings.backPressure == CaptureBackPressure::Block) {
+                // Slots free up only once the workers hand them back, wait for that rather than lose the frame.
+                const auto blockStart = std::chrono::steady_clock::now();
+                _readback->finish();
+                take = _readback->readScreen(_width, _height, ReadbackKind::Rgba, deliver);
+                _stats.blockedMilliseconds += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - blockStart).count();
+            }
+            if (take) {
+                _nextSequence++;
+            } else {
+                std::lock_guard lock(_mutex);
+                _reserved--;
+            }
+        }
+        if (take) _stats.captured++;
+        else _stats.dropped++;
+
+        const float milliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        _overheadTotal += milliseconds;
+        _stats.overheadMilliseconds = milliseconds;
+        _stats.maxOverheadMilliseconds = std::max(_stats.maxOverheadMilliseconds, milliseconds);
+        _stats.averageOverheadMilliseconds = static_cast<float>(_overheadTotal / static_cast<double>(_stats.captured + _stats.dropped));
+    }
+
+    // Writes out whatever is still queued and closes the file.
+    void stop() {
+        if (!_recording) return;
+        _readback->finish();
+        {
+            std::lock_guard lock(_mutex);
+            _stopping = true;
+        }
+        _delivered.notify_all();
+        _encoder.join();
+        _file.close();
+        _readback.reset();
+        _recording = false;
+
+        const auto& finished = stats();
+        std::cout << "Capture " << _path.string() << ": " << finished.written << " frames, " << finished.dropped << " dropped, "
+            << finished.failed << " failed, " << finished.bytes / (1024.f * 1024.f) << " MB, render thread "
+            << finished.averageOverheadMilliseconds << " ms/frame (worst " << finished.maxOverheadMilliseconds << " ms)\n";
+    }
+
+    bool recording() const { return _recording; }
+    const std::filesystem::path& path() const { return _path; }
+
+    const VideoCaptureStats& stats() {
+        _stats.written = _written.load();
+        _stats.failed = _failed.load();
+        _stats.bytes = _bytes.load();
+        _stats.convertMilliseconds = _convertMilliseconds.load();
+        _stats.writeMilliseconds = _writeMilliseconds.load();
+        std::lock_guard lock(_mutex);
+        _stats.queued = _reserved;
+        return _stats;
+    }
+
+    // Top row first RGBA into the Y, U and V planes of one 4:2:0 frame back to back, the layout of a Y4M frame.
+    // BT.601 limited range in 8 bit fixed point; chroma is the average of each 2x2 block. Width and height even.
+    static void toI420(const unsigned char* rgba, int width, int height, unsigned char* planes, ThreadPool* pool = nullptr, bool simd = true) {
+        const auto rows = [&](size_t begin, size_t end) {
+            for (size_t pair=begin; pair<end; ++pair) {
+                int x = 0;
+#ifdef VIDEO_CAPTURE_SSE
+                if (simd) x = convertRowPairSse2(rgba, width, height, static_cast<int>(pair), planes);
+#endif
+                convertRowPairScalar(rgba, width, height, static_cast<int>(pair), planes, x);
+            }
+        };
+        if (pool) pool->parallelFor(0, height / 2, 16, rows);
+        else rows(0, height / 2);
+    }
+
+private:
+    void encode() {
+        std::vector<unsigned char> planes(static_cast<size_t>(_width) * _height * 3 / 2);
+        for (uint64_t next=0;; ++next) {
+            ReadbackImage image;
+            {
+                std::unique_lock lock(_mutex);
+                _delivered.wait(lock, [&]() { return (!_queue.empty() && _queue.begin()->first == next) || (_stopping && _queue.empty()); });
+                if (_queue.empty()) return;
+                image = std::move(_queue.begin()->second);
+                _queue.erase(_queue.begin());
+            }
+
+            if (_writeFailed || image.width != _width || image.height != _height || image.channels != 4) {
+                _failed++;
+            } else {
+                const auto start = std::chrono::steady_clock::now();
+                toI420(image.pixels.data(), _width, _height, planes.data(), &_pool, _settings.simd);
+                const auto converted = std::chrono::steady_clock::now();
+                _file << "FRAME\n";
+                _file.write(reinterpret_cast<const char*>(planes.data()), static_cast<std::streamsize>(planes.size()));
+                _convertMilliseconds = std::chrono::duration<float, std::milli>(converted - start).count();
+                _writeMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - converted).count();
+                if (_file) {
+                    _bytes += planes.size() + 6;
+                    _written++;
+                } else {
+                    // Disk full or gone. Whatever is still queued gets drained and counted as failed.
+                    _failed++;
+                    _writeFailed = true;
+                }
+            }
+            {
+                std::lock_guard lock(_mutex);
+                _reserved--;
+            }
+            _consumed.notify_one();
+        }
+    }
+
+    // Two image rows make one chroma row, so work goes by pairs of rows. Both return where they stopped.
+    static int convertRowPairScalar(const unsigned char* rgba, int width, int height, int pair, unsigned char* planes, int firstColumn = 0) {
+        const unsigned char* top = rgba + static_cast<size_t>(pair) * 2 * width * 4;
+        const unsigned char* bottom = top + static_cast<size_t>(width) * 4;
+        unsigned char* yTop = planes + static_cast<size_t>(pair) * 2 * width;
+        unsigned char* yBottom = yTop + width;
+        unsigned char* u = planes + static_cast<size_t>(width) * height + static_cast<size_t>(pair) * (width / 2);
+        unsigned char* v = u + static_cast<size_t>(width / 2) * (height / 2);
+        const auto luma = [](const unsigned char* p) {
+            return static_cast<unsigned char>(((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16);
+        };
+        for (int x=firstColumn; x<width; x+=2) {
+            const unsigned char* a = top + x * 4;
+            const unsigned char* b = bottom + x * 4;
+            yTop[x] = luma(a);
+            yTop[x + 1] = luma(a + 4);
+            yBottom[x] = luma(b);
+            yBottom[x + 1] = luma(b + 4);
+            const int r = a[0] + a[4] + b[0] + b[4];
+            const int g = a[1] + a[5] + b[1] + b[5];
+            const int bl = a[2] + a[6] + b[2] + b[6];
+            u[x / 2] = static_cast<unsigned char>(((-38 * r - 74 * g + 112 * bl + 512) >> 10) + 128);
+            v[x / 2] = static_cast<unsigned char>(((112 * r - 94 * g - 18 * bl + 512) >> 10) + 128);
+        }
+        return width;
+    }
+
+#ifdef VIDEO_CAPTURE_SSE
+    // Eight pixels of both rows at a time. Pixels widen to 16 bit RGBA and _mm_madd_epi16 does two channels of a pixel
+    // per lane, adding the lane pairs back up gives the same integers as the scalar path.
+    static int convertRowPairSse2(const unsigned char* rgba, int width, int height, int pair, unsigned char* planes) {
+        const unsigned char* top = rgba + static_cast<size_t>(pair) * 2 * width * 4;
+        const unsigned char* bottom = top + static_cast<size_t>(width) * 4;
+        unsigned char* yTop = planes + static_cast<size_t>(pair) * 2 * width;
+        unsigned char* yBottom = yTop + width;
+        unsigned char* u = planes + static_cast<size_t>(width) * height + static_cast<size_t>(pair) * (width / 2);
+        unsigned char* v = u + static_cast<size_t>(width / 2) * (height / 2);
+
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i yCoefficients = _mm_setr_epi16(66, 129, 25, 0, 66, 129, 25, 0);
+        const __m128i uCoefficients = _mm_setr_epi16(-38, -74, 112, 0, -38, -74, 112, 0);
+        const __m128i vCoefficients = _mm_setr_epi16(112, -94, -18, 0, 112, -94, -18, 0);
+        // Lane pairs of two madd results summed, four values.
+        const auto sumPairs = [](__m128i first, __m128i second) {
+            const __m128 a = _mm_castsi128_ps(first), b = _mm_castsi128_ps(second);
+            return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))), _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+        };
+        const auto luma = [&](__m128i pixels01, __m128i pixels23) {
+            const __m128i sum = sumPairs(_mm_madd_epi16(pixels01, yCoefficients), _mm_madd_epi16(pixels23, yCoefficients));
+            return _mm_add_epi32(_mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(128)), 8), _mm_set1_epi32(16));
+        };
+        const auto chroma = [&](__m128i blocks01, __m128i blocks23, __m128i coefficients) {
+            const __m128i sum = sumPairs(_mm_madd_epi16(blocks01, coefficients), _mm_madd_epi16(blocks23, coefficients));
+            return _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(512)), 10), _mm_set1_epi32(128));
+        };
+
+        int x = 0;
+        for (; x + 8 <= width; x += 8) {
+            __m128i rows[2][4];
+            for (int row=0; row<2; ++row) {
+                const unsigned char* source = (row == 0 ? top : bottom) + x * 4;
+                const __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source));
+                const __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 16));
+                rows[row][0] = _mm_unpacklo_epi8(first, zero);
+                rows[row][1] = _mm_unpackhi_epi8(first, zero);
+                rows[row][2] = _mm_unpacklo_epi8(second, zero);
+                rows[row][3] = _mm_unpackhi_epi8(second, zero);
+
+                const __m128i words = _mm_packs_epi32(luma(rows[row][0], rows[row][1]), luma(rows[row][2], rows[row][3]));
+                _mm_storel_epi64(reinterpret_cast<__m128i*>((row == 0 ? yTop : yBottom) + x), _mm_packus_epi16(words, words));
+            }
+
+            // Each register holds two horizontal neighbours, folding its halves together finishes a 2x2 block.
+            __m128i blocks[4];
+            for (int i=0; i<4; ++i) {
+                const __m128i vertical = _mm_add_epi16(rows[0][i], rows[1][i]);
+                blocks[i] = _mm_add_epi16(vertical, _mm_srli_si128(vertical, 8));
+            }
+            const __m128i blocks01 = _mm_unpacklo_epi64(blocks[0], blocks[1]);
+            const __m128i blocks23 = _mm_unpacklo_epi64(blocks[2], blocks[3]);
+            const __m128i words = _mm_packs_epi32(chroma(blocks01, blocks23, uCoefficients), chroma(blocks01, blocks23, vCoefficients));
+            const __m128i bytes = _mm_packus_epi16(words, words);
+            const int uBytes = _mm_cvtsi128_si32(bytes), vBytes = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 4));
+            std::memcpy(u + x / 2, &uBytes, 4);
+            std::memcpy(v + x / 2, &vBytes, 4);
+        }
+        return x;
+    }
+#endif
+};
+
+struct YuvConversionTiming {
+    int width, height;
+    float scalarMilliseconds;
+    float simdMilliseconds;
+    float threadedMilliseconds;
+    size_t threads;
+};
+
+// RGBA -> 4:2:0 of one random width x height frame, scalar / SIMD on one thread / SIMD on the pool.
+inline YuvConversionTiming benchmarkYuvConversion(int width, int height, ThreadPool& pool = ThreadPool::shared()) {
+    width &= ~1;
+    height &= ~1;
+    std::vector<unsigned char> rgba(static_cast<size_t>(width) * height * 4);
+    std::mt19937 random(7);
+    for (auto& value : rgba) value = static_cast<unsigned char>(random());
+    std::vector<unsigned char> planes(static_cast<size_t>(width) * height * 3 / 2);
+
+    const auto time = [&](ThreadPool* threads, bool simd) {
+        constexpr int runs = 8;
+        VideoCapture::toI420(rgba.data(), width, height, planes.data(), threads, simd);
+        const auto start = std::chrono::steady_clock::now();
+        for (int i=0; i<runs; ++i) VideoCapture::toI420(rgba.data(), width, height, planes.data(), threads, simd);
+        return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+    };
+    YuvConversionTiming timing { width, height, 0.f, 0.f, 0.f, pool.size() + 1 };
+    timing.scalarMilliseconds = time(nullptr, false);
+    timing.simdMilliseconds = time(nullptr, true);
+    timing.threadedMilliseconds = time(&pool, true);
+    return timing;
+}
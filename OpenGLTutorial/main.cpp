@@ -16,8 +16,17 @@
 #include <iostream>
 #include <fstream>
 #include <numeric>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <ctime>
+#include <filesystem>
+#include <optional>
 
 #include "ShaderProgram.hpp"
+#include "ProgramBinaryCache.hpp"
+#include "ShaderCompiler.hpp"
+#include "ShadowMaps.hpp"
 #include "Camera.hpp"
 #include "Mesh.hpp"
 #include "Model.hpp"
@@ -26,11 +35,25 @@
 #include "KeyControlSet.hpp"
 #include "CameraKeyboardControl.hpp"
 #include "WindowKeyboardControl.hpp"
+#include "PostProcessGraph.hpp"
 #include "BayerMatrixDither.hpp"
+#include "ErrorDiffusionDither.hpp"
+#include "PaletteLut.hpp"
+#include "Convolution.hpp"
 #include "PrewittFilter.hpp"
 #include "PrewittFilterNormals.hpp"
 #include "DeferredFramebuffer.hpp"
+#include "DynamicResolution.hpp"
+#include "AsyncReadback.hpp"
+#include "VideoCapture.hpp"
 #include "Skybox.hpp"
+#include "Frustum.hpp"
+#include "GpuQuery.hpp"
+#include "Bvh.hpp"
+#include "StreamingModel.hpp"
+#include "DeferredLighting.hpp"
+#include "Lightmap.hpp"
+#include "CpuImageFilters.hpp"
 
 #ifndef SHADERS_SOURCE_DIR
 #define SHADERS_SOURCE_DIR "INCORRECT SOURCE DIR"
@@ -44,16 +67,23 @@
 #define MODELS_SOURCE_DIR "INCORRECT SOURCE DIR"
 #endif
 
+#ifndef CAPTURE_DIR
+#define CAPTURE_DIR "INCORRECT CAPTURE DIR"
+#endif
+
 Camera camera;
 const float cameraSpeed = 1.5f;
 float deltaTime = 0.0f;
 float lastFrame = 0.0f;
 int windowWidth = 1024, windowHeight = 1024;
+// What the pixelated targets get allocated at. Dynamic resolution renders into a corner of them, never more.
 const int pixelHeight = 512;
 int pixelWidth = static_cast<float>(windowWidth)/static_cast<float>(windowHeight) * pixelHeight;
 
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
+	// Minimized, keep the old size around.
+	if (width == 0 || height == 0) return;
 	glViewport(0, 0, width, height);
 	camera.updateAspectRatio(static_cast<float>(width)/static_cast<float>(height));
 	windowWidth = width;
@@ -133,9 +163,162 @@ std::vector<float> vertices = {
 };
 std::vector<unsigned int> indices(36);
 
-int main() {
+// Lights that never move. The shadow cache keeps their maps around and the lightmap has them baked in.
+PointLight makeLantern() {
+	return PointLight { glm::vec3(2.f, 2.5f, 1.f), glm::vec3(0.01f), glm::vec3(1.f, 0.8f, 0.5f), glm::vec3(1.f, 0.8f, 0.5f) };
+}
+
+SpotLight makePorchLight() {
+	SpotLight porchLight;
+	porchLight.position = glm::vec3(-3.f, 3.5f, 3.f);
+	porchLight.ambient = glm::vec3(0.f);
+	porchLight.diffuse = glm::vec3(0.6f, 0.7f, 1.f);
+	porchLight.specular = glm::vec3(0.6f, 0.7f, 1.f);
+	porchLight.direction = glm::vec3(0.3f, -1.f, -0.4f);
+	porchLight.cutoffStart = glm::cos(glm::radians(25.f));
+	porchLight.cutoffEnd = glm::cos(glm::radians(30.f));
+	return porchLight;
+}
+
+void printLightmapBake(const LightmapBakeStats& stats) {
+	std::cout << "Lightmap bake: " << stats.totalMilliseconds << " ms (charts " << stats.chartMilliseconds << " ms, trace "
+		<< stats.traceMilliseconds << " ms, filter " << stats.filterMilliseconds << " ms), " << stats.rays << " rays at "
+		<< stats.raysPerSecond() / 1e6 << " Mrays/s on " << stats.threads << " threads\n";
+	std::cout << "  " << stats.meshes << " meshes, " << stats.triangles << " triangles, " << stats.charts << " charts, "
+		<< stats.texels << " texels (" << 100.f * stats.atlasCoverage << "% of the atlas) at " << stats.texelsPerUnit << " texels/unit, "
+		<< stats.tilesStolen << " of " << stats.tiles << " tiles stolen\n";
+}
+
+void printImageFilterThroughput(const std::vector<ImageFilterThroughput>& results) {
+	for (const auto& result : results) {
+		std::cout << result.filter << ", " << imageFilterIsaName(result.isa) << ", " << result.threads << " threads: "
+			<< result.megapixelsPerSecond << " MPix/s\n";
+	}
+}
+
+void printErrorDiffusionTimings(const std::vector<ErrorDiffusionTiming>& timings) {
+	for (const auto& timing : timings) {
+		std::cout << errorDiffusionKernelName(timing.kernel) << ", " << timing.threads << " threads: " << timing.milliseconds << " ms/frame\n";
+	}
+}
+
+void printSkyboxLoad(const char* label, const SkyboxLoadStats& stats) {
+	std::cout << "Skybox load (" << label << "): " << stats.totalMilliseconds() << " ms, decode " << stats.decodeMilliseconds
+		<< " ms, upload " << stats.uploadMilliseconds << " ms, " << stats.faceSize << "^2 faces, " << stats.levels << " levels"
+		<< (stats.immutable ? ", immutable" : "") << '\n';
+}
+
+void printPaletteLutTimings(const std::vector<PaletteLutTiming>& timings) {
+	for (const auto& timing : timings) {
+		std::cout << "Palette LUT, " << timing.palette << " (" << timing.colors << " colors), " << timing.lutSize << "^3 on "
+			<< timing.threads << " threads: " << timing.milliseconds << " ms\n";
+	}
+}
+
+// Local time for capture file names. localtime isn't one to call from several threads, so render thread only.
+std::string captureTimestamp() {
+	const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+	char time[32] {};
+	std::strftime(time, sizeof(time), "%Y%m%d-%H%M%S", std::localtime(&now));
+	return time;
+}
+
+// Saves a readback as CAPTURE_DIR/<time>-<frame>-<name>.png, from the pool thread it finishes on.
+std::function<void(ReadbackImage&&)> saveCapture(const std::string& name) {
+	return [prefix = captureTimestamp(), name](ReadbackImage&& image) {
+		const auto path = std::filesystem::path(CAPTURE_DIR) / (prefix + "-" + std::to_string(image.frame) + "-" + name + ".png");
+		if (!image.writePng(path)) std::cout << "Couldn't write " << path.string() << '\n';
+	};
+}
+
+struct ImageFilterComparison {
+	const char* filter;
+	// Against the GLSL output in an 8 bit target.
+	float maxDifference;
+	float mismatchFraction;
+};
+
+// Runs the GLSL stages on the current G-buffer into a texture of our own, and the CPU filters on its readback.
+std::vector<ImageFilterComparison> compareImageFiltersWithGpu(RenderTargetPool& pool, const DeferredFramebuffer& gBuffer, int width, int height,
+	const PrewittFilterNormals& normalEdges, const PrewittFilter& depthEdges, const BayerMatrixDither& ditherer) {
+	const auto texels = static_cast<size_t>(width) * height;
+	std::vector<float> normalTexels(texels * 3);
+	glBindTexture(GL_TEXTURE_2D, gBuffer.getNormalsTexture());
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, normalTexels.data());
+	ImagePlane depth(width, height);
+	glBindTexture(GL_TEXTURE_2D, gBuffer.getZBufferTexture());
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, GL_FLOAT, depth.values.data());
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	auto raw = NormalPlanes::fromInterleaved(normalTexels.data(), width, height);
+	const auto normals = gBuffer.layout().octahedralNormals ? NormalPlanes::fromOctahedral(normalTexels.data(), width, height, 3) : raw;
+	// The dither gets the raw normals texture as its color, same as what the GPU side samples.
+	const auto color = ColorPlanes { std::move(raw.x), std::move(raw.y), std::move(raw.z) };
+
+	RenderTargetPool::ScopedTarget reference(pool, RenderTargetDesc { static_cast<unsigned int>(width), static_cast<unsigned int>(height), GL_RGBA8 });
+	const auto compare = [&](const char* name, std::vector<PostProcessPass> passes, const ImagePlane& cpu) {
+		PostProcessGraph graph(pool, width, height);
+		graph.setInput("gNormal", gBuffer.getNormalsTexture());
+		graph.setInput("gDepth", gBuffer.getZBufferTexture());
+		graph.setInput("reference", reference);
+		for (auto& pass : passes) graph.addPass(std::move(pass));
+		graph.compile();
+		ShaderCompiler::shared().finishAll();
+		graph.execute(width, height);
+
+		std::vector<unsigned char> gpu(texels);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glBindTexture(GL_TEXTURE_2D, reference);
+		glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_UNSIGNED_BYTE, gpu.data());
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+		float maxDifference = 0.f;
+		size_t mismatches = 0;
+		for (size_t i=0; i<texels; ++i) {
+			const float difference = std::abs(gpu[i] / 255.f - std::clamp(cpu.values[i], 0.f, 1.f));
+			maxDifference = std::max(maxDifference, difference);
+			mismatches += difference > 1.f / 255.f;
+		}
+		return ImageFilterComparison { name, maxDifference, static_cast<float>(mismatches) / texels };
+	};
+
+	ImagePlane output;
+	std::vector<ImageFilterComparison> results;
+	CpuImageFilters::normalEdges(normals, output);
+	results.push_back(compare("Normal edges", { normalEdges.pass("gNormal", "reference") }, output));
+	CpuImageFilters::depthEdges(depth, output, depthEdges.nearPlane(), depthEdges.farPlane());
+	results.push_back(compare("Depth edges", depthEdges.passes("gDepth", "reference"), output));
+	CpuImageFilters::bayerDither(color, output);
+	results.push_back(compare("Bayer dither", { ditherer.pass("gNormal", "reference") }, output));
+	return results;
+}
+
+int main(int argc, char** argv) {
 	std::iota(indices.begin(), indices.end(), 0);
 
+	// --bake-lightmaps bakes the house's static lighting and exits, no window or GL context needed.
+	const std::string houseLightmapPath = MODELS_BAKE_DIR "/" "house.lightmap";
+	for (int i=1; i<argc; ++i) {
+		if (std::string_view(argv[i]) != "--bake-lightmaps") continue;
+		printLightmapBake(LightmapBaker::bake(MODELS_SOURCE_DIR "/" "house.fbx", houseLightmapPath, { makeLantern() }, { makePorchLight() }));
+		return 0;
+	}
+	// --image-filters-benchmark prints the CPU post filters' throughput at the pixelated resolution, error diffusion
+	// at 512p, palette LUT build times, and exits.
+	for (int i=1; i<argc; ++i) {
+		if (std::string_view(argv[i]) != "--image-filters-benchmark") continue;
+		printImageFilterThroughput(benchmarkCpuImageFilters(pixelWidth, pixelHeight, camera.getNearPlane(), camera.getFarPlane()));
+		printErrorDiffusionTimings(benchmarkErrorDiffusion(512 * pixelWidth / pixelHeight, 512));
+		printPaletteLutTimings(benchmarkPaletteLut());
+		return 0;
+	}
+	// --stream-house draws the house only from streamed chunks, the full model never gets loaded.
+	bool streamHouse = false;
+	for (int i=1; i<argc; ++i) {
+		streamHouse |= std::string_view(argv[i]) == "--stream-house";
+	}
+
 	IMGUI_CHECKVERSION();
 	ImGui::CreateContext();
 	ImGuiIO &io = ImGui::GetIO();
@@ -165,6 +348,12 @@ int main() {
 		return -1;
 	}
 	glViewport(0, 0, windowWidth, windowHeight);
+	// --cold-shader-cache compiles everything from source, for comparing startup against a warm cache.
+	// --serial-shader-compile turns KHR_parallel_shader_compile off, for comparing compile wall time.
+	for (int i=1; i<argc; ++i) {
+		if (std::string_view(argv[i]) == "--cold-shader-cache") ProgramBinaryCache::shared().setEnabled(false);
+		if (std::string_view(argv[i]) == "--serial-shader-compile") ShaderCompiler::shared().setParallel(false);
+	}
 	camera.updateAspectRatio(static_cast<float>(windowWidth)/static_cast<float>(windowHeight));
 
 	KeyControlSet keyboardControlls(window);
@@ -173,21 +362,16 @@ int main() {
 
 	VertexDataBase cubeVertexData = VertexData<Layout::Interleaving, Vec3, Vec3, Vec2>(indices, 36, reinterpret_cast<std::byte*>(vertices.data()));
 
-	const auto vertexShaderCode = Utils::readFile(SHADERS_SOURCE_DIR "/" "phong.vert.glsl");
-	const auto fragmentShaderCode = Utils::readFile(SHADERS_SOURCE_DIR "/" "phong.frag.glsl");
+	// Variant per mesh by which maps it has, and by G-buffer layout.
+	ShaderPermutations phongPermutations("phong.vert.glsl", "phong.frag.glsl");
+	phongPermutations.warmAll();
 
-	auto shaderProgram = ShaderProgram(
-		Shader<ShaderType::Vertex>(vertexShaderCode.c_str()),
-		Shader<ShaderType::Fragment>(fragmentShaderCode.c_str())
-	);
+	// Everything below only submits its programs, they compile side by side until finishAll() before the loop.
+	ShaderProgram lightProgram;
+	ShaderCompiler::shared().compile(lightProgram, "light.vert.glsl", "light.frag.glsl");
 
-	const auto lightVertexShaderCode = Utils::readFile(SHADERS_SOURCE_DIR "/" "light.vert.glsl");
-	const auto lightFragmentShaderCode = Utils::readFile(SHADERS_SOURCE_DIR "/" "light.frag.glsl");
-
-	auto lightProgram = ShaderProgram(
-		Shader<ShaderType::Vertex>(lightVertexShaderCode.c_str()),
-		Shader<ShaderType::Fragment>(lightFragmentShaderCode.c_str())
-	);
+	ShaderProgram depthProgram;
+	ShaderCompiler::shared().compile(depthProgram, "depth.vert.glsl", "depth.frag.glsl");
 
 	// Texture
 	std::vector<Texture> textures = { 
@@ -205,7 +389,60 @@ int main() {
 		{}
 	);
 
-	auto house = Model(MODELS_SOURCE_DIR "/" "house.fbx");
+	TextureStreamer textureStreamer;
+	bool textureStreaming = true;
+	// Either the whole house or its streamed chunks, never both - the budget has to bound what's actually resident.
+	std::optional<Model> house;
+	if (!streamHouse) {
+		house.emplace(MODELS_SOURCE_DIR "/" "house.fbx", &textureStreamer);
+	}
+
+	// What the phong permutations buy on the house: meshes without a specular map sample one texture instead of two.
+	size_t houseTriangles = 0, specularlessMeshes = 0, specularlessTriangles = 0;
+	const int phongFullBinary = phongPermutations.binaryLength(phongPermutations.feature("SPECULAR_MAP"));
+	const int phongDiffuseOnlyBinary = phongPermutations.binaryLength(0);
+	if (house) {
+		for (const auto& mesh : house->meshes()) {
+			houseTriangles += mesh.triangleCount();
+			if (mesh.hasTexture(TextureType::Specular)) continue;
+			specularlessMeshes++;
+			specularlessTriangles += mesh.triangleCount();
+		}
+		std::cout << "house.fbx: " << specularlessMeshes << " of " << house->meshes().size() << " meshes ("
+			<< specularlessTriangles << " of " << houseTriangles << " triangles) skip the specular fetch, "
+			<< "phong binary " << phongFullBinary << " -> " << phongDiffuseOnlyBinary << " bytes\n";
+	}
+
+	// Same house, cut into chunks and streamed around the camera. Baked once into the build dir.
+	int streamingBudgetMegabytes = 64;
+	float streamingDistance = 30.f;
+	std::optional<StreamingModel> streamedHouse;
+	if (streamHouse) {
+		const std::string houseChunksPath = MODELS_BAKE_DIR "/" "house.chunks";
+		if (!StreamingModel::isBakeUpToDate(MODELS_SOURCE_DIR "/" "house.fbx", houseChunksPath)) {
+			StreamingModelBaker::bake(MODELS_SOURCE_DIR "/" "house.fbx", houseChunksPath, 4.f);
+		}
+		streamedHouse.emplace(houseChunksPath, streamingBudgetMegabytes * 1024 * 1024, streamingDistance);
+	}
+
+	// Ray queries: one instance per house mesh plus the cube. Streamed chunks carry no trees, so only the cube then.
+	std::vector<glm::vec3> cubePositions;
+	for (size_t i=0; i<vertices.size(); i+=8) {
+		cubePositions.emplace_back(vertices[i], vertices[i+1], vertices[i+2]);
+	}
+	TriangleBvh cubeBvh(cubePositions, indices);
+	const auto cubeTransform = glm::translate(glm::mat4(1.0f), glm::vec3(0.f, 0.5f, -2.f));
+
+	std::vector<BvhInstance> bvhInstances;
+	for (size_t i=0; house && i<house->bvhs().size(); ++i) {
+		bvhInstances.push_back(BvhInstance { &house->bvhs()[i], glm::mat4(1.0f), static_cast<unsigned int>(i) });
+	}
+	const auto cubeInstanceId = static_cast<unsigned int>(bvhInstances.size());
+	bvhInstances.push_back(BvhInstance { &cubeBvh, cubeTransform, cubeInstanceId });
+	SceneBvh sceneBvh(bvhInstances);
+	RayHit crosshairHit;
+	float crosshairQueryMicroseconds = 0.f;
+	RayThroughput rayThroughput {};
 
 	Gizmo gizmo;
 	const glm::vec3 blue(0.f, 0.f, 1.f);
@@ -215,10 +452,23 @@ int main() {
 
 	BayerMatrixDither ditherer;
 	ditherer.setMatrixDensity(pixelWidth, pixelHeight);
+	const auto palettes = Palette::builtIn();
+	std::vector<const char*> paletteNames;
+	for (const auto& palette : palettes) paletteNames.push_back(palette.name.c_str());
+	int paletteIndex = 2;
+	int paletteLutSizeIndex = 0;
+	const int paletteLutSizes[] = { 32, 64 };
+	const char* paletteLutSizeNames[] = { "32^3", "64^3" };
+	float paletteStrength = 1.f;
+	ditherer.setPalette(palettes[paletteIndex].colors, paletteLutSizes[paletteLutSizeIndex]);
+	std::vector<PaletteLutTiming> paletteLutTimings;
 
 	Texture edgeTestText(TEXTURES_SOURCE_DIR "/" "edgeTest.png", TextureType::Diffuse);
 	PrewittFilterNormals filter{};
 	filter.setMatrixDensity(pixelWidth, pixelHeight);
+	PrewittFilter depthEdges;
+	depthEdges.setDepthRange(camera.getNearPlane(), camera.getFarPlane());
+	std::vector<ConvolutionTiming> convolutionTimings;
 
 	std::vector<std::string> skyboxTexturesList = {
 		TEXTURES_SOURCE_DIR "/skybox/right.jpg",
@@ -229,8 +479,153 @@ int main() {
 		TEXTURES_SOURCE_DIR "/skybox/back.jpg"
 	};
 	Skybox skybox(skyboxTexturesList);
+	std::cout << "Sky SH projection: " << skybox.irradianceMilliseconds() << " ms\n";
+	printSkyboxLoad("parallel decode, storage, mips", skybox.loadStats());
+	int skyboxDrawIndex = static_cast<int>(skybox.drawMode());
+	const char* skyboxDrawNames[] = { "Cube", "Fullscreen triangle" };
+	// Serial decode into mutable storage without mips, as it used to load, then the current settings.
+	std::vector<SkyboxLoadStats> skyboxLoadTimings;
+	bool skyAmbient = false;
+	float skyAmbientStrength = 1.f;
+	std::vector<ShProjectionTiming> shTimings;
+	std::vector<ImageFilterThroughput> imageFilterThroughput;
+	std::vector<ImageFilterComparison> imageFilterComparisons;
+
+	bool compactGBuffer = true;
+	RenderTargetPool renderTargets;
+	auto pixelatedFramebuffer = std::make_unique<DeferredFramebuffer>(renderTargets, pixelWidth, pixelHeight, GBufferLayout::compact());
+	filter.setOctahedralNormals(pixelatedFramebuffer->layout().octahedralNormals);
+	// Edges then dither, the dither is per-pixel so with fusion on it's one draw and "edges" never gets written.
+	PostProcessGraph postProcess(renderTargets, pixelWidth, pixelHeight);
+	bool postProcessFusion = postProcess.fusion();
+	int screenOutputIndex = 0;
+	const char* screenOutputNames[] = { "Normal edges", "Lit", "Depth edges", "Error diffusion", "Palette dither" };
+	ErrorDiffusionDither errorDiffusion(pixelWidth, pixelHeight);
+	int errorDiffusionKernelIndex = 0;
+	const char* errorDiffusionKernelNames[] = { "Floyd-Steinberg", "Atkinson", "Jarvis-Judice-Ninke" };
+	int errorDiffusionThreads = 0;
+	std::vector<ErrorDiffusionTiming> errorDiffusionTimings;
+	const auto buildPostProcess = [&]() {
+		postProcess.clear();
+		if (screenOutputIndex == 2) {
+			for (auto& pass : depthEdges.passes("gDepth", std::string(PostProcessGraph::screen))) postProcess.addPass(std::move(pass));
+		} else if (screenOutputIndex == 3) {
+			postProcess.addPass(errorDiffusion.pass("lit", std::string(PostProcessGraph::screen)));
+		} else if (screenOutputIndex == 4) {
+			postProcess.addPass(ditherer.palettePass("lit", std::string(PostProcessGraph::screen)));
+		} else {
+			postProcess.addPass(filter.pass("gNormal", "edges"));
+			postProcess.addPass(ditherer.pass("edges", std::string(PostProcessGraph::screen)));
+		}
+		postProcess.compile();
+	};
+	postProcess.setInput("gNormal", pixelatedFramebuffer->getNormalsTexture());
+	postProcess.setInput("gDepth", pixelatedFramebuffer->getZBufferTexture());
+	DeferredLighting deferredLighting(renderTargets, pixelWidth, pixelHeight);
+	postProcess.setInput("lit", deferredLighting.getLitTexture());
+	buildPostProcess();
+	bool stencilLightVolumes = true;
+	bool temporalReuse = false;
+	int temporalRefreshPeriod = deferredLighting.temporalReuse().refreshPeriod();
+	// The crate slides back and forth when asked, the lit object with motion of its own for the reprojection to follow.
+	bool crateMotion = false;
+	glm::mat4 previousCubeModel = cubeTransform;
+	int lightingTechniqueIndex = 0;
+	const char* lightingTechniqueNames[] = { "Light volumes", "Clustered" };
+	LightClusterGrid benchmarkGrid;
+	std::vector<ClusterAssignmentTiming> clusterTimings;
+
+	// A swarm of small point lights drifting around the house, on top of the flashlight and the police light.
+	struct DriftingLight {
+		glm::vec3 center;
+		float radius, speed, phase;
+		glm::vec3 color;
+	};
+	std::vector<DriftingLight> driftingLights;
+	{
+		std::mt19937 random(1337);
+		std::uniform_real_distribution<float> unit(0.f, 1.f);
+		for (int i=0; i<4096; ++i) {
+			driftingLights.push_back(DriftingLight {
+				glm::vec3(16.f * unit(random) - 8.f, 4.f * unit(random), 16.f * unit(random) - 8.f),
+				0.5f + 2.f * unit(random),
+				0.5f + unit(random),
+				6.2831853f * unit(random),
+				glm::vec3(unit(random), unit(random), unit(random))
+			});
+		}
+	}
+	int driftingLightCount = 256;
+	std::vector<PointLight> pointLights;
+	std::vector<SpotLight> spotLights;
+
+	// Flashlight and police light move all the time and miss the cache every frame, the lantern and the porch
+	// light never move and reuse theirs. The crate counts as the dynamic object composited on top.
+	bool shadows = true;
+	ShadowMaps shadowMaps;
+	const int flashlightShadow = shadowMaps.add(ShadowType::Spot, 1024);
+	const int policeShadow = shadowMaps.add(ShadowType::Point, 512);
+	PointLight lantern = makeLantern();
+	lantern.shadowMap = shadowMaps.add(ShadowType::Point, 512);
+	SpotLight porchLight = makePorchLight();
+	porchLight.shadowMap = shadowMaps.add(ShadowType::Spot, 1024);
+
+	// With the lightmap on, the lantern and the porch light come out of it instead of being shaded every frame.
+	if (!StreamingModel::isBakeUpToDate(MODELS_SOURCE_DIR "/" "house.fbx", houseLightmapPath)) {
+		printLightmapBake(LightmapBaker::bake(MODELS_SOURCE_DIR "/" "house.fbx", houseLightmapPath, { lantern }, { porchLight }));
+	}
+	auto houseLightmap = std::make_unique<Lightmap>(houseLightmapPath);
+	bool bakedLighting = true;
+	LightmapBakeStats lightmapRebake {};
+
+	MeshletCullingContext meshletCulling;
+	MeshletStats meshletStats;
+
+	// Depth pre-pass: lay down depth first so phong only runs once per pixel.
+	bool depthPrePass = false;
+	int prePassDepthFuncIndex = 0;
+	const GLenum prePassDepthFuncs[] = { GL_LEQUAL, GL_EQUAL };
+	const char* prePassDepthFuncNames[] = { "GL_LEQUAL", "GL_EQUAL" };
+	GpuTimer depthPrePassTimer;
+	GpuTimer geometryPassTimer;
+	SamplesPassedCounter geometryPassFragments;
 
-	DeferredFramebuffer pixelatedFramebuffer(pixelWidth, pixelHeight);
+	// Scales what gets rendered of the pixelated targets to keep the scene's GPU time on a target.
+	bool dynamicResolutionEnabled = false;
+	DynamicResolution dynamicResolution;
+	auto dynamicResolutionSettings = dynamicResolution.settings();
+	unsigned int renderWidth = pixelWidth, renderHeight = pixelHeight;
+
+	// F12 takes a screenshot, G-buffer dumps are a button away. Both get written off the render thread.
+	AsyncReadback readback;
+	bool screenshotRequested = false;
+	bool gBufferDumpRequested = false;
+	bool screenshotKeyDown = false;
+	{
+		std::error_code error;
+		std::filesystem::create_directories(CAPTURE_DIR, error);
+		if (error) std::cout << "Couldn't create " << CAPTURE_DIR << ": " << error.message() << '\n';
+	}
+	VideoCapture videoCapture;
+	VideoCaptureSettings captureSettings;
+	int captureBackPressureIndex = static_cast<int>(captureSettings.backPressure);
+	const char* captureBackPressureNames[] = { "Drop frames", "Block rendering" };
+	int captureQueueFrames = static_cast<int>(captureSettings.queueFrames);
+	// Steps the scene by exactly one video frame each frame, so a capture comes out the same however long frames took.
+	bool fixedTimestep = false;
+	float simulatedTime = 0.f;
+	std::vector<YuvConversionTiming> yuvTimings;
+
+	{
+		auto& compiler = ShaderCompiler::shared();
+		compiler.finishAll();
+		const auto& shaders = ProgramBinaryCache::shared().stats();
+		std::cout << "Shader setup: " << shaders.milliseconds << " ms for " << shaders.hits + shaders.misses << " programs, "
+			<< shaders.hits << " from the binary cache, " << shaders.misses << " compiled\n";
+		std::cout << "Shader compile wall time: " << compiler.stats().lastBatchMilliseconds << " ms for the last "
+			<< compiler.stats().lastBatchPrograms << " submitted, parallel compile "
+			<< (compiler.stats().parallel ? "on" : compiler.parallelSupported() ? "off" : "unsupported") << '\n';
+	}
 
 	glEnable(GL_DEPTH_TEST);
 	while(!glfwWindowShouldClose(window)) {
@@ -244,20 +639,86 @@ int main() {
 		ImGui::NewFrame();
 
 		// runtime stuff...
-		float currentFrame = static_cast<float>(glfwGetTime());
-		deltaTime = currentFrame - lastFrame;
-		lastFrame = currentFrame;  
+		const float wallClock = static_cast<float>(glfwGetTime());
+		deltaTime = fixedTimestep ? 1.f / captureSettings.framesPerSecond : wallClock - lastFrame;
+		lastFrame = wallClock;
+		simulatedTime += deltaTime;
+		float currentFrame = simulatedTime;
+
+		// Swaps in programs that finished compiling and picks up shader files saved since the last frame.
+		ShaderCompiler::shared().update();
+
+		// The callback only updates pixelWidth, targets follow here once per frame instead of on every resize event.
+		// Against the allocation, _width is the dynamic resolution's render size.
+		if (static_cast<int>(pixelatedFramebuffer->_allocatedWidth) != pixelWidth || static_cast<int>(pixelatedFramebuffer->_allocatedHeight) != pixelHeight) {
+			pixelatedFramebuffer->resize(pixelWidth, pixelHeight);
+			deferredLighting.resize(pixelWidth, pixelHeight);
+			ditherer.setMatrixDensity(pixelWidth, pixelHeight);
+			filter.setMatrixDensity(pixelWidth, pixelHeight);
+			postProcess.setSize(pixelWidth, pixelHeight);
+			errorDiffusion.setSize(pixelWidth, pixelHeight);
+		}
+
+		// Everything drawn at the pixelated resolution, as of the last frame the timers got back. The filters' matrix
+		// density stays with the allocation above: the post-process uv is in texels of the targets whatever the scale.
+		const float scaledMilliseconds = (depthPrePass ? depthPrePassTimer.milliseconds() : 0.f) + geometryPassTimer.milliseconds()
+			+ deferredLighting.stats().totalMilliseconds();
+		if (dynamicResolutionEnabled) dynamicResolution.update(scaledMilliseconds);
+		renderWidth = dynamicResolutionEnabled ? dynamicResolution.scaled(pixelWidth) : pixelWidth;
+		renderHeight = dynamicResolutionEnabled ? dynamicResolution.scaled(pixelHeight) : pixelHeight;
+		pixelatedFramebuffer->setRenderSize(renderWidth, renderHeight);
+		postProcess.setViewport(renderWidth, renderHeight);
 
 		cameraPosUpdater.update(deltaTime);
 		windowKeyboardControl.update();
+		{
+			const bool keyDown = keyboardControlls.keyState(GLFW_KEY_F12).isPressed();
+			screenshotRequested |= keyDown && !screenshotKeyDown;
+			screenshotKeyDown = keyDown;
+		}
 
 		policeColor = glm::mix(blue, red, glm::sin(currentFrame*5.f));
 
+		meshletCulling.frustum = Frustum(camera.getProjectionTransform() * camera.getViewTransform());
+		meshletCulling.cameraPosition = camera.getPosition();
+		meshletCulling.model = glm::mat4(1.0f);
+		if (house) {
+			meshletStats = house->updateVisibility(meshletCulling);
+
+			// Mips are picked for the pixelated framebuffer, that's the resolution the house gets drawn at.
+			textureStreamer.setEnabled(textureStreaming);
+			house->requestTextureMips(MipRequestContext {
+				meshletCulling.frustum,
+				camera.getPosition(),
+				camera.getProjectionTransform()[1][1] * renderHeight / 2.f
+			});
+		}
+		textureStreamer.update();
+
+		if (streamedHouse) {
+			streamedHouse->setMemoryBudget(static_cast<size_t>(streamingBudgetMegabytes) * 1024 * 1024);
+			streamedHouse->setStreamingDistance(streamingDistance);
+			streamedHouse->update(camera.getPosition(), camera.getFront());
+		}
+
+		const auto cubeModel = crateMotion ? glm::translate(cubeTransform, glm::vec3(glm::sin(currentFrame), 0.f, 0.f)) : cubeTransform;
+		if (cubeModel != bvhInstances.back().transform) {
+			// Only the top level gets rebuilt, the crate's own tree is in object space.
+			bvhInstances.back().transform = cubeModel;
+			sceneBvh = SceneBvh(bvhInstances);
+		}
+
+		{
+			const auto queryStart = std::chrono::steady_clock::now();
+			crosshairHit = sceneBvh.intersect(Ray { camera.getPosition(), camera.getFront(), 100.f });
+			crosshairQueryMicroseconds = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - queryStart).count();
+		}
+
 		{	
 			// Render to pixelated framebuffer!
-			FramebufferBase::ScopedBinding framebufferBinding(pixelatedFramebuffer);
+			FramebufferBase::ScopedBinding framebufferBinding(*pixelatedFramebuffer);
 			glClearColor(0.f, 0.f, 0.f, 1.f);
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
 			auto lightWorldTransform = glm::mat4(1.0f);
 			lightWorldTransform = glm::rotate(lightWorldTransform, currentFrame, glm::vec3(0.f, 1.f, 0.f));
@@ -296,57 +757,142 @@ int main() {
 				
 			}
 
-			{
-				shaderProgram.use();
-				shaderProgram.set("material.shininess", 32.0f);
-				shaderProgram.set("spotLight.ambient",  glm::vec3(0.2f, 0.2f, 0.2f));
-				shaderProgram.set("spotLight.diffuse",  glm::vec3(0.5f, 0.5f, 0.5f)); // darken diffuse light a bit
-				shaderProgram.set("spotLight.specular", glm::vec3(1.0f, 1.0f, 1.0f)); 
-				shaderProgram.set("spotLight.constant", 1.0f);
-				shaderProgram.set("spotLight.linear", 0.09f);
-				shaderProgram.set("spotLight.quadratic", 0.032f);
-				shaderProgram.set("spotLight.position", camera.getPosition());
-				shaderProgram.set("spotLight.direction", camera.getFront());
-				shaderProgram.set("spotLight.cutoffStart", glm::cos(glm::radians(10.f)));
-				shaderProgram.set("spotLight.cutoffEnd", glm::cos(glm::radians(11.f)));
-
-				shaderProgram.set("pointLight.position", glm::vec3(lightWorldTransform * glm::vec4(0.f, 0.f, 0.f, 1.f)));
-				shaderProgram.set("pointLight.ambient",  0.01f * policeColor);
-				shaderProgram.set("pointLight.diffuse",  0.5f * policeColor); // darken diffuse light a bit
-				shaderProgram.set("pointLight.specular", policeColor); 
-				shaderProgram.set("pointLight.constant", 1.0f);
-				shaderProgram.set("pointLight.linear", 0.09f);
-				shaderProgram.set("pointLight.quadratic", 0.032f);
-
-				shaderProgram.set("viewPos", camera.getPosition());
-				auto model = glm::mat4(1.0f);
-				// model = glm::scale(model, glm::vec3(0.01f));
-				shaderProgram.set("model", model);
-				shaderProgram.set("view", camera.getViewTransform());
-				shaderProgram.set("projection", camera.getProjectionTransform());
-
-				house.Draw(shaderProgram);
+			if (depthPrePass) {
+				GpuTimer::ScopedQuery timer(depthPrePassTimer);
+				glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+				depthProgram.use();
+				depthProgram.set("view", camera.getViewTransform());
+				depthProgram.set("projection", camera.getProjectionTransform());
+				depthProgram.set("model", glm::mat4(1.0f));
+				if (streamedHouse) streamedHouse->DrawDepth(meshletCulling.frustum);
+				else house->DrawDepth();
+				depthProgram.set("model", cubeModel);
+				cube.DrawDepth();
+				glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+				// Depth is final already - only the front-most fragment passes.
+				glDepthMask(GL_FALSE);
+				glDepthFunc(prePassDepthFuncs[prePassDepthFuncIndex]);
 			}
 
 			{
-				auto model = glm::mat4(1.0f);
-				model = glm::translate(model, glm::vec3(0.f, 0.5f, -2.f));
-				shaderProgram.set("model", model);
-				cube.Draw(shaderProgram);
+				GpuTimer::ScopedQuery timer(geometryPassTimer);
+				SamplesPassedCounter::ScopedQuery fragments(geometryPassFragments);
+				const uint32_t gBufferFeatures = pixelatedFramebuffer->layout().octahedralNormals ? phongPermutations.feature("OCTAHEDRAL_NORMALS") : 0;
+				{
+					auto model = glm::mat4(1.0f);
+					// model = glm::scale(model, glm::vec3(0.01f));
+					MeshVariantDrawer draw(phongPermutations, gBufferFeatures, [&](ShaderProgram& program) {
+						program.set("model", model);
+						// The crate shares these programs and leaves its motion behind.
+						program.set("objectMotion", glm::mat4(1.f));
+						program.set("view", camera.getViewTransform());
+						program.set("projection", camera.getProjectionTransform());
+					});
+
+					if (streamedHouse) streamedHouse->Draw(draw, meshletCulling.frustum);
+					else house->Draw(draw);
+				}
+
+				{
+					MeshVariantDrawer draw(phongPermutations, gBufferFeatures, [&](ShaderProgram& program) {
+						program.set("model", cubeModel);
+						program.set("objectMotion", previousCubeModel * glm::inverse(cubeModel));
+						program.set("view", camera.getViewTransform());
+						program.set("projection", camera.getProjectionTransform());
+					});
+					draw(cube);
+					previousCubeModel = cubeModel;
+				}
+			}
+
+			if (depthPrePass) {
+				glDepthMask(GL_TRUE);
+				glDepthFunc(GL_LESS);
 			}
 
 			skybox.updateTransform(camera.getViewTransform(), camera.getProjectionTransform());
 			skybox.draw();
+
+			pointLights.clear();
+			pointLights.push_back(PointLight {
+				glm::vec3(lightWorldTransform * glm::vec4(0.f, 0.f, 0.f, 1.f)),
+				skyAmbient ? glm::vec3(0.f) : 0.01f * policeColor,
+				0.5f * policeColor,
+				policeColor
+			});
+			pointLights.back().shadowMap = shadows ? policeShadow : -1;
+			for (int i=0; i<driftingLightCount; ++i) {
+				const auto& drifting = driftingLights[i];
+				const float angle = drifting.phase + drifting.speed * currentFrame;
+				pointLights.push_back(PointLight {
+					drifting.center + drifting.radius * glm::vec3(glm::cos(angle), 0.f, glm::sin(angle)),
+					glm::vec3(0.f),
+					drifting.color,
+					drifting.color,
+					1.f, 0.7f, 1.8f
+				});
+			}
+
+			spotLights.clear();
+			SpotLight flashlight;
+			flashlight.position = camera.getPosition();
+			// The sky term replaces the lights' own ambient hack rather than adding to it.
+			flashlight.ambient = skyAmbient ? glm::vec3(0.f) : glm::vec3(0.2f, 0.2f, 0.2f);
+			flashlight.diffuse = glm::vec3(0.5f, 0.5f, 0.5f); // darken diffuse light a bit
+			flashlight.specular = glm::vec3(1.0f, 1.0f, 1.0f);
+			flashlight.direction = camera.getFront();
+			flashlight.cutoffStart = glm::cos(glm::radians(10.f));
+			flashlight.cutoffEnd = glm::cos(glm::radians(11.f));
+			flashlight.shadowMap = shadows ? flashlightShadow : -1;
+			spotLights.push_back(flashlight);
+
+			if (shadows && !bakedLighting) {
+				pointLights.push_back(lantern);
+				spotLights.push_back(porchLight);
+			}
+		}
+
+		if (shadows) {
+			// Whole house regardless of what the camera sees, the cached maps have to hold up from any view.
+			const std::vector<ShadowCaster> dynamicCasters = {
+				ShadowCaster { glm::vec3(cubeModel * glm::vec4(0.f, 0.f, 0.f, 1.f)), 0.87f, [&](ShaderProgram& program) {
+					program.set("model", cubeModel);
+					cube.DrawDepth();
+				} }
+			};
+			shadowMaps.render(meshletCulling.frustum, pointLights, spotLights, [&](ShaderProgram& program) {
+				program.set("model", glm::mat4(1.0f));
+				// A default frustum lets every chunk through, proxies stand in for the ones that aren't resident.
+				if (streamedHouse) streamedHouse->DrawDepth(Frustum());
+				else house->DrawDepth();
+			}, dynamicCasters);
 		}
+
+		deferredLighting.setStencilCulling(stencilLightVolumes);
+		deferredLighting.setTemporalReuse(temporalReuse);
+		deferredLighting.setSkyAmbient(skyAmbient, skyAmbientStrength);
+		deferredLighting.setLightmap(bakedLighting ? houseLightmap.get() : nullptr);
+		deferredLighting.setTechnique(static_cast<LightingTechnique>(lightingTechniqueIndex));
+		deferredLighting.render(*pixelatedFramebuffer, camera.getViewTransform(), camera.getProjectionTransform(), camera.getPosition(), pointLights, spotLights,
+			shadows ? &shadowMaps : nullptr);
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		glViewport(0, 0, windowWidth, windowHeight);
 		//glClearColor(0.f, 0.f, 0.f, 1.f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		// ditherer.draw(pixelatedFramebuffer.getNormalsTexture());
+		// ditherer.draw(pixelatedFramebuffer->getNormalsTexture());
 		//ditherer.draw(pixelOutputDepthTexture);
 		// filter.draw(edgeTestText);
-		filter.draw(pixelatedFramebuffer.getNormalsTexture());
+		if (screenOutputIndex != 1) {
+			postProcess.setInput("gNormal", pixelatedFramebuffer->getNormalsTexture());
+			postProcess.setInput("gDepth", pixelatedFramebuffer->getZBufferTexture());
+			postProcess.setInput("lit", deferredLighting.getLitTexture());
+			if (screenOutputIndex == 3) errorDiffusion.update(deferredLighting.getLitTexture(), renderWidth, renderHeight);
+			postProcess.execute(windowWidth, windowHeight);
+		} else {
+			deferredLighting.present();
+		}
 
 		// Magic gizmo drawing.
 		glClear(GL_DEPTH_BUFFER_BIT);
@@ -354,15 +900,351 @@ int main() {
 		gizmo.setDirection(camera.getFront());
 		gizmo.draw();
 
+		// Before the UI goes on top. The G-buffer is what this frame's lighting read, at the size it got rendered.
+		if (screenshotRequested) readback.readScreen(windowWidth, windowHeight, ReadbackKind::Color, saveCapture("screen"));
+		if (gBufferDumpRequested) {
+			const auto& gBuffer = *pixelatedFramebuffer;
+			const int width = gBuffer._width, height = gBuffer._height;
+			readback.readTexture(gBuffer.getAlbedoTexture(), width, height, ReadbackKind::Color, saveCapture("albedo"));
+			readback.readTexture(gBuffer.getNormalsTexture(), width, height,
+				gBuffer.layout().octahedralNormals ? ReadbackKind::OctahedralNormals : ReadbackKind::Normals, saveCapture("normals"));
+			readback.readTexture(gBuffer.getZBufferTexture(), width, height, ReadbackKind::Depth, saveCapture("depth"));
+		}
+		screenshotRequested = gBufferDumpRequested = false;
+		readback.update();
+		videoCapture.frame(windowWidth, windowHeight);
+
 		// render your GUI
 		ImGui::Begin("Demo window");
 		ImGui::Button("Button");
 		ImGui::SliderFloat2("Gizmo Position", gizmoOffset, 0, 800);
+		ImGui::Checkbox("Meshlet frustum culling", &meshletCulling.frustumCulling);
+		ImGui::Checkbox("Meshlet cone culling", &meshletCulling.coneCulling);
+		ImGui::Text("Meshlets: %zu / %zu visible", meshletStats.visibleMeshlets, meshletStats.meshlets);
+		ImGui::Text("Triangles rejected: %.1f%% (frustum %zu, backface %zu of %zu)",
+			100.f * meshletStats.rejectedFraction(),
+			meshletStats.frustumRejectedTriangles,
+			meshletStats.coneRejectedTriangles,
+			meshletStats.triangles);
+		ImGui::Separator();
+		ImGui::Checkbox("Depth pre-pass", &depthPrePass);
+		ImGui::Combo("Main pass depth func", &prePassDepthFuncIndex, prePassDepthFuncNames, 2);
+		ImGui::Text("Depth pre-pass: %.3f ms", depthPrePass ? depthPrePassTimer.milliseconds() : 0.f);
+		ImGui::Text("Geometry pass:  %.3f ms", geometryPassTimer.milliseconds());
+		ImGui::Text("Shaded fragments per pixel: %.2f",
+			static_cast<float>(geometryPassFragments.result()) / static_cast<float>(renderWidth * renderHeight));
+		ImGui::Text("Phong variants: %zu, %zu of %zu house meshes (%.0f%% of triangles) skip the specular fetch",
+			phongPermutations.stats().variants, specularlessMeshes, house ? house->meshes().size() : size_t(0),
+			100.f * specularlessTriangles / std::max<size_t>(houseTriangles, 1));
+		ImGui::Text("Phong binary: %d B with specular map, %d B without", phongFullBinary, phongDiffuseOnlyBinary);
+		{
+			auto& programCache = ProgramBinaryCache::shared();
+			const auto& shaders = programCache.stats();
+			ImGui::Text("Program binaries: %zu hits, %zu compiled, %zu stored, %zu invalidated, %.1f ms total%s",
+				shaders.hits, shaders.misses, shaders.stores, shaders.invalidations, shaders.milliseconds,
+				programCache.supported() ? "" : " (unsupported)");
+			if (ImGui::Button("Clear program binary cache")) programCache.clear();
+
+			auto& compiler = ShaderCompiler::shared();
+			bool parallelCompile = compiler.stats().parallel;
+			if (compiler.parallelSupported() && ImGui::Checkbox("Parallel shader compile", &parallelCompile)) {
+				compiler.setParallel(parallelCompile);
+			}
+			if (compiler.parallelSupported()) ImGui::SameLine();
+			if (ImGui::Button("Recompile all shaders")) compiler.recompileAll();
+			ImGui::Text("Compile: last batch %zu programs in %.1f ms wall, %zu in flight, %zu reloads, %zu failed",
+				compiler.stats().lastBatchPrograms, compiler.stats().lastBatchMilliseconds, compiler.stats().inFlight,
+				compiler.stats().reloads, compiler.stats().failed);
+		}
+		ImGui::Separator();
+		if (ImGui::Combo("Screen output", &screenOutputIndex, screenOutputNames, 5)) buildPostProcess();
+		if (screenOutputIndex == 4) {
+			bool rebuild = ImGui::Combo("Palette", &paletteIndex, paletteNames.data(), static_cast<int>(paletteNames.size()));
+			rebuild |= ImGui::Combo("Palette LUT", &paletteLutSizeIndex, paletteLutSizeNames, 2);
+			if (rebuild) ditherer.setPalette(palettes[paletteIndex].colors, paletteLutSizes[paletteLutSizeIndex]);
+			if (ImGui::SliderFloat("Palette dither strength", &paletteStrength, 0.f, 2.f)) ditherer.setPaletteStrength(paletteStrength);
+			ImGui::Text("Palette LUT: %zu colors, %d^3 built in %.2f ms", palettes[paletteIndex].colors.size(), ditherer.paletteLutSize(),
+				ditherer.paletteLutMilliseconds());
+			if (ImGui::Button("Palette LUT benchmark")) {
+				paletteLutTimings = benchmarkPaletteLut();
+				printPaletteLutTimings(paletteLutTimings);
+			}
+			for (const auto& timing : paletteLutTimings) {
+				ImGui::Text("  %s, %zu colors, %d^3 on %zu threads: %.2f ms", timing.palette.c_str(), timing.colors, timing.lutSize,
+					timing.threads, timing.milliseconds);
+			}
+		}
+		if (screenOutputIndex == 3) {
+			if (ImGui::Combo("Error diffusion kernel", &errorDiffusionKernelIndex, errorDiffusionKernelNames, 3)) {
+				errorDiffusion.setKernel(static_cast<ErrorDiffusionKernel>(errorDiffusionKernelIndex));
+			}
+			if (ImGui::SliderInt("Error diffusion threads (0 = all)", &errorDiffusionThreads, 0, static_cast<int>(ThreadPool::shared().size()) + 1)) {
+				errorDiffusion.setThreads(errorDiffusionThreads);
+			}
+			const auto& diffusion = errorDiffusion.stats();
+			ImGui::Text("Error diffusion: %.2f ms on %zu threads, %llu frames behind, %zu readbacks skipped, %zu dropped",
+				diffusion.ditherMilliseconds, diffusion.threads, static_cast<unsigned long long>(diffusion.latencyFrames),
+				diffusion.skippedReadbacks, diffusion.droppedReadbacks);
+		}
+		if (ImGui::Checkbox("Compact G-buffer", &compactGBuffer)) {
+			// Old one goes first so its albedo and depth go back to the pool for the new one to pick up.
+			pixelatedFramebuffer.reset();
+			pixelatedFramebuffer = std::make_unique<DeferredFramebuffer>(renderTargets, pixelWidth, pixelHeight, compactGBuffer ? GBufferLayout::compact() : GBufferLayout::wide());
+			filter.setOctahedralNormals(pixelatedFramebuffer->layout().octahedralNormals);
+			buildPostProcess();
+		}
+		if (ImGui::Checkbox("Fuse per-pixel post passes", &postProcessFusion)) postProcess.setFusion(postProcessFusion);
+		{
+			const auto& post = postProcess.stats();
+			ImGui::Text("Post-process: %zu passes in %zu draws, %zu intermediates in %zu targets, fusion saves %.2f MB/frame",
+				post.passes, post.draws, post.intermediates, post.targets, post.fusedBytes / (1024.f * 1024.f));
+			for (const auto& timing : post.timings) {
+				ImGui::Text("  %s: %.3f ms", timing.name.c_str(), timing.milliseconds);
+			}
+		}
+		{
+			const size_t pixels = static_cast<size_t>(renderWidth) * renderHeight;
+			const auto wide = GBufferLayout::wide();
+			const auto compact = GBufferLayout::compact();
+			ImGui::Text("G-buffer: wide %u B/px, %.2f MB/frame | compact %u B/px, %.2f MB/frame",
+				wide.bytesPerPixel(), wide.frameTrafficBytes(pixels) / (1024.f * 1024.f),
+				compact.bytesPerPixel(), compact.frameTrafficBytes(pixels) / (1024.f * 1024.f));
+		}
+		ImGui::Separator();
+		if (ImGui::Checkbox("Dynamic resolution", &dynamicResolutionEnabled)) dynamicResolution.reset();
+		if (dynamicResolutionEnabled) {
+			auto& settings = dynamicResolutionSettings;
+			bool changed = ImGui::SliderFloat("Target GPU ms", &settings.targetMilliseconds, 1.f, 33.f);
+			changed |= ImGui::SliderFloat("Min scale", &settings.minScale, 0.25f, 1.f);
+			changed |= ImGui::SliderFloat("Max scale", &settings.maxScale, 0.25f, 1.f);
+			changed |= ImGui::SliderFloat("Deadband", &settings.deadband, 0.f, 0.5f);
+			changed |= ImGui::SliderInt("Settle frames", &settings.settleFrames, 1, 60);
+			if (changed) {
+				dynamicResolution.setSettings(settings);
+				settings = dynamicResolution.settings();
+			}
+			ImGui::Text("Rendering %ux%u of %dx%d (%.1f%%), scaled passes %.3f ms GPU, average %.3f ms",
+				renderWidth, renderHeight, pixelWidth, pixelHeight, 100.f * dynamicResolution.scale(), scaledMilliseconds,
+				dynamicResolution.averageMilliseconds());
+			const auto& decisions = dynamicResolution.log();
+			for (auto it = decisions.rbegin(); it != decisions.rend() && it - decisions.rbegin() < 5; ++it) {
+				ImGui::Text("  frame %llu: %.1f%% -> %.1f%% at %.2f ms, %s", static_cast<unsigned long long>(it->frame),
+					100.f * it->fromScale, 100.f * it->toScale, it->milliseconds, it->reason);
+			}
+		}
+		ImGui::SliderInt("Point lights", &driftingLightCount, 0, static_cast<int>(driftingLights.size()));
+		ImGui::Combo("Lighting", &lightingTechniqueIndex, lightingTechniqueNames, 2);
+		ImGui::Checkbox("Stencil light volumes", &stencilLightVolumes);
+		ImGui::Checkbox("Temporal reuse", &temporalReuse);
+		ImGui::SameLine();
+		ImGui::Checkbox("Move crate", &crateMotion);
+		if (temporalReuse && ImGui::SliderInt("Refresh every N frames (0 = never)", &temporalRefreshPeriod, 0, 32)) {
+			deferredLighting.temporalReuse().setRefreshPeriod(temporalRefreshPeriod);
+		}
+		{
+			const auto& lighting = deferredLighting.stats();
+			ImGui::Text("Lighting resolve: %.3f ms (%zu shader variants)", lighting.resolveMilliseconds, deferredLighting.shaderVariants());
+			ImGui::Text("Lighting total: %.3f ms GPU", lighting.totalMilliseconds());
+			if (temporalReuse) {
+				ImGui::Text("Temporal reuse: %.1f%% of pixels reused, reproject %.3f ms, history %.3f ms",
+					100.f * lighting.temporal.reusedFraction, lighting.temporal.reprojectMilliseconds, lighting.temporal.historyMilliseconds);
+			}
+			if (lightingTechniqueIndex == 0) {
+				ImGui::Text("Lights: %zu drawn, %zu culled", lighting.lightsDrawn, lighting.lightsCulled);
+				ImGui::Text("Light volumes:    %.3f ms", lighting.lightVolumesMilliseconds);
+			} else {
+				ImGui::Text("Cluster assignment (CPU): %.3f ms", lighting.clusterAssignMilliseconds);
+				ImGui::Text("Clustered shading:        %.3f ms", lighting.clusteredShadingMilliseconds);
+				ImGui::Text("Clusters: %zu occupied, max %zu lights, %zu indices",
+					lighting.clusters.occupiedClusters, lighting.clusters.maxLightsPerCluster, lighting.clusters.indices);
+			}
+		}
+		ImGui::Checkbox("Shadows", &shadows);
+		if (shadows) {
+			const auto& shadowStats = shadowMaps.stats();
+			ImGui::SameLine();
+			if (ImGui::Button("Invalidate static shadows")) shadowMaps.invalidateStatic();
+			ImGui::Text("Shadows: %.3f ms, %zu lights (%zu shaded), cache hit rate %.0f%% (%zu reused, %zu re-rendered), %zu composited",
+				shadowStats.milliseconds, shadowStats.lights, deferredLighting.stats().lightsShadowed, 100.f * shadowStats.hitRate(),
+				shadowStats.cacheHits, shadowStats.cacheMisses, shadowStats.composited);
+		}
+		ImGui::Checkbox("Baked static lights", &bakedLighting);
+		if (bakedLighting) {
+			ImGui::SameLine();
+			if (ImGui::Button("Rebake lightmap")) {
+				lightmapRebake = LightmapBaker::bake(MODELS_SOURCE_DIR "/" "house.fbx", houseLightmapPath, { lantern }, { porchLight });
+				printLightmapBake(lightmapRebake);
+				houseLightmap = std::make_unique<Lightmap>(houseLightmapPath);
+			}
+			ImGui::Text("Baked lighting: %.3f ms, %ux%u atlas", deferredLighting.stats().bakedLightingMilliseconds, houseLightmap->width(), houseLightmap->height());
+			if (lightmapRebake.rays > 0) {
+				ImGui::Text("Last bake: %.0f ms, %.2f Mrays/s on %u threads", lightmapRebake.totalMilliseconds, lightmapRebake.raysPerSecond() / 1e6, lightmapRebake.threads);
+			}
+		}
+		ImGui::Checkbox("Sky ambient (SH)", &skyAmbient);
+		if (skyAmbient) {
+			ImGui::SameLine();
+			ImGui::SliderFloat("Strength", &skyAmbientStrength, 0.f, 2.f);
+		}
+		if (ImGui::Combo("Skybox draw", &skyboxDrawIndex, skyboxDrawNames, 2)) skybox.setDrawMode(static_cast<SkyboxDraw>(skyboxDrawIndex));
+		ImGui::SameLine();
+		ImGui::Text("%.3f ms GPU", skybox.drawMilliseconds());
+		if (ImGui::Button("Skybox load benchmark")) {
+			skyboxLoadTimings = {
+				Skybox::measureLoad(skyboxTexturesList, SkyboxSettings { false, false, false }),
+				Skybox::measureLoad(skyboxTexturesList, SkyboxSettings {})
+			};
+			printSkyboxLoad("serial, mutable, no mips", skyboxLoadTimings[0]);
+			printSkyboxLoad("parallel decode, storage, mips", skyboxLoadTimings[1]);
+		}
+		for (size_t i=0; i<skyboxLoadTimings.size(); ++i) {
+			const auto& timing = skyboxLoadTimings[i];
+			ImGui::Text("%s: decode %.1f ms, upload %.1f ms, %d levels%s", i == 0 ? "Serial, mutable" : "Parallel, storage",
+				timing.decodeMilliseconds, timing.uploadMilliseconds, timing.levels, timing.immutable ? ", immutable" : "");
+		}
+		if (ImGui::Button("SH projection benchmark")) {
+			shTimings.clear();
+			for (const int faceSize : { 64, 128, 256, 512, 1024 }) {
+				shTimings.push_back(benchmarkShProjection(faceSize));
+			}
+		}
+		for (const auto& timing : shTimings) {
+			ImGui::Text("%4d^2 faces: scalar %.2f ms, SIMD %.2f ms, SIMD + threads %.2f ms",
+				timing.faceSize, timing.scalarMilliseconds, timing.simdMilliseconds, timing.threadedMilliseconds);
+		}
+		if (ImGui::Button("Convolution benchmark")) {
+			convolutionTimings.clear();
+			for (const int size : { 3, 5, 9, 15, 21, 31 }) {
+				convolutionTimings.push_back(benchmarkConvolution(size, pixelWidth, pixelHeight, renderTargets));
+			}
+		}
+		for (const auto& timing : convolutionTimings) {
+			ImGui::Text("%2dx%-2d Gaussian: 2D %.3f ms (%zu taps), separable %.3f ms (%zu), shared taps %.3f ms (%zu), compute %s",
+				timing.size, timing.size, timing.directMilliseconds, timing.directTaps, timing.separableMilliseconds, timing.separableTaps,
+				timing.sharedMilliseconds, timing.sharedTaps,
+				timing.computeMilliseconds < 0.f ? "n/a" : (std::to_string(timing.computeMilliseconds) + " ms").c_str());
+		}
+		if (ImGui::Button("CPU image filter benchmark")) imageFilterThroughput = benchmarkCpuImageFilters(pixelWidth, pixelHeight, camera.getNearPlane(), camera.getFarPlane());
+		for (const auto& result : imageFilterThroughput) {
+			ImGui::Text("%s, %s, %zu threads: %.1f MPix/s", result.filter, imageFilterIsaName(result.isa), result.threads, result.megapixelsPerSecond);
+		}
+		if (ImGui::Button("Error diffusion benchmark (512p)")) errorDiffusionTimings = benchmarkErrorDiffusion(512 * pixelWidth / pixelHeight, 512);
+		for (const auto& timing : errorDiffusionTimings) {
+			ImGui::Text("%s, %zu threads: %.2f ms/frame", errorDiffusionKernelName(timing.kernel), timing.threads, timing.milliseconds);
+		}
+		if (ImGui::Button("Check CPU image filters against GLSL")) {
+			imageFilterComparisons = compareImageFiltersWithGpu(renderTargets, *pixelatedFramebuffer, pixelWidth, pixelHeight, filter, depthEdges, ditherer);
+		}
+		for (const auto& comparison : imageFilterComparisons) {
+			ImGui::Text("%s: max difference %.3f, %.2f%% of pixels off", comparison.filter, comparison.maxDifference, 100.f * comparison.mismatchFraction);
+		}
+		if (ImGui::Button("Cluster assignment benchmark")) {
+			benchmarkGrid.setProjection(camera.getProjectionTransform(), camera.getNearPlane(), camera.getFarPlane());
+			clusterTimings.clear();
+			for (const size_t lightCount : { 16, 256, 4096 }) {
+				clusterTimings.push_back(benchmarkClusterAssignment(benchmarkGrid, lightCount, camera.getFarPlane()));
+			}
+		}
+		for (const auto& timing : clusterTimings) {
+			ImGui::Text("%4zu lights, one core: scalar %.3f ms, SIMD %.3f ms, %.1f lights/cluster",
+				timing.lights, timing.scalarMilliseconds, timing.simdMilliseconds, timing.averageLightsPerOccupiedCluster);
+		}
+		{
+			const auto& targets = renderTargets.stats();
+			ImGui::Text("Render targets: %.2f MB (peak %.2f MB), %zu textures, %zu in use",
+				targets.bytes / (1024.f * 1024.f), targets.peakBytes / (1024.f * 1024.f), targets.textures, targets.texturesInUse);
+			ImGui::Text("Allocations %zu, frees %zu, reuses %zu", targets.allocations, targets.frees, targets.reuses);
+		}
+		ImGui::Separator();
+		if (crosshairHit.hit()) {
+			ImGui::Text("Crosshair: %s %u, triangle %u at %.2f (%.1f us)",
+				crosshairHit.mesh == cubeInstanceId ? "cube" : "house mesh",
+				crosshairHit.mesh, crosshairHit.triangle, crosshairHit.distance, crosshairQueryMicroseconds);
+		} else {
+			ImGui::Text("Crosshair: nothing (%.1f us)", crosshairQueryMicroseconds);
+		}
+		ImGui::Separator();
+		ImGui::Checkbox("Texture mip streaming", &textureStreaming);
+		{
+			const auto& mips = textureStreamer.stats();
+			ImGui::Text("Texture memory: %.2f MB of %.2f MB full chains (%zu textures, %zu loading)",
+				mips.residentBytes / (1024.f * 1024.f), mips.fullChainBytes / (1024.f * 1024.f), mips.textures, mips.pendingLoads);
+			ImGui::Text("Mip levels: %zu uploaded, %zu evicted, last load %.1f ms",
+				mips.uploadedLevels, mips.evictedLevels, mips.lastLoadMilliseconds);
+		}
+		ImGui::Separator();
+		if (!streamedHouse) {
+			ImGui::Text("House fully loaded, run with --stream-house to stream it in chunks");
+		} else {
+			ImGui::SliderInt("Streaming budget (MB)", &streamingBudgetMegabytes, 1, 512);
+			ImGui::SliderFloat("Streaming distance", &streamingDistance, 1.f, 200.f);
+			const auto& streaming = streamedHouse->stats();
+			ImGui::Text("Chunks: %zu resident, %zu loading of %zu (%zu evicted)",
+				streaming.residentChunks, streaming.loadingChunks, streaming.totalChunks, streaming.evictions);
+			ImGui::Text("Resident: %.2f MB + %.2f MB proxies",
+				streaming.residentBytes / (1024.f * 1024.f), streaming.proxyBytes / (1024.f * 1024.f));
+			ImGui::Text("Bandwidth: %.2f MB/s", streaming.bandwidthBytesPerSecond / (1024.f * 1024.f));
+			ImGui::Text("Chunk latency: last %.1f ms, avg %.1f ms, max %.1f ms",
+				streaming.lastLoadMilliseconds, streaming.averageLoadMilliseconds, streaming.maxLoadMilliseconds);
+		}
+		ImGui::Separator();
+		screenshotRequested |= ImGui::Button("Screenshot (F12)");
+		ImGui::SameLine();
+		gBufferDumpRequested |= ImGui::Button("Dump G-buffer");
+		{
+			const auto& captures = readback.stats();
+			ImGui::Text("Readback: %zu done, %zu pending, %zu rejected, %zu failed, %llu frames behind",
+				captures.completed, captures.pending, captures.rejected, captures.failed, static_cast<unsigned long long>(captures.latencyFrames));
+			ImGui::Text("Render thread %.3f ms (worst %.3f ms), last encode %.1f ms on the pool",
+				captures.renderThreadMilliseconds, captures.maxRenderThreadMilliseconds, captures.workerMilliseconds);
+		}
+		ImGui::Separator();
+		ImGui::Checkbox("Fixed timestep", &fixedTimestep);
+		if (!videoCapture.recording()) {
+			ImGui::SliderInt("Capture FPS", &captureSettings.framesPerSecond, 10, 120);
+			ImGui::Combo("Capture back pressure", &captureBackPressureIndex, captureBackPressureNames, 2);
+			ImGui::SliderInt("Capture queue frames", &captureQueueFrames, 1, 32);
+			ImGui::Checkbox("SIMD YUV conversion", &captureSettings.simd);
+			if (ImGui::Button("Start capture")) {
+				captureSettings.backPressure = static_cast<CaptureBackPressure>(captureBackPressureIndex);
+				captureSettings.queueFrames = static_cast<size_t>(captureQueueFrames);
+				videoCapture.start(std::filesystem::path(CAPTURE_DIR) / (captureTimestamp() + "-capture.y4m"), windowWidth, windowHeight, captureSettings);
+			}
+		} else if (ImGui::Button("Stop capture")) {
+			videoCapture.stop();
+		}
+		{
+			const auto& video = videoCapture.stats();
+			ImGui::Text("Capture: %llu written, %llu dropped, %llu failed, %zu queued, %.1f MB",
+				static_cast<unsigned long long>(video.written), static_cast<unsigned long long>(video.dropped),
+				static_cast<unsigned long long>(video.failed), video.queued, video.bytes / (1024.f * 1024.f));
+			ImGui::Text("Capture overhead %.3f ms (avg %.3f, worst %.3f, blocked %.1f ms total), convert %.2f ms, write %.2f ms",
+				video.overheadMilliseconds, video.averageOverheadMilliseconds, video.maxOverheadMilliseconds, video.blockedMilliseconds,
+				video.convertMilliseconds, video.writeMilliseconds);
+		}
+		if (ImGui::Button("YUV conversion benchmark")) {
+			yuvTimings = { benchmarkYuvConversion(windowWidth, windowHeight), benchmarkYuvConversion(1920, 1080) };
+		}
+		for (const auto& timing : yuvTimings) {
+			ImGui::Text("%dx%d to 4:2:0: scalar %.2f ms, SIMD %.2f ms, SIMD on %zu threads %.2f ms",
+				timing.width, timing.height, timing.scalarMilliseconds, timing.simdMilliseconds, timing.threads, timing.threadedMilliseconds);
+		}
+		ImGui::Separator();
+		if (ImGui::Button("Ray benchmark")) {
+			rayThroughput = benchmarkRayThroughput(sceneBvh, camera.getPosition(), 1'000'000);
+			std::cout << "Rays/s single thread: " << rayThroughput.singleThreadRaysPerSecond
+				<< ", per core on " << rayThroughput.threads << " threads: " << rayThroughput.raysPerSecondPerCore << '\n';
+		}
+		ImGui::SameLine();
+		ImGui::Text("%.2f Mrays/s/core (%u threads), %.2f Mrays/s single",
+			rayThroughput.raysPerSecondPerCore / 1e6, rayThroughput.threads, rayThroughput.singleThreadRaysPerSecond / 1e6);
 		ImGui::End();
 		// Render dear imgui into screen
 		ImGui::Render();
 		ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
+		renderTargets.endFrame();
+
 		// check and call events and swap the buffers
 		glfwSwapBuffers(window);
 		glfwPollEvents();
@@ -372,6 +1254,9 @@ int main() {
 		}
 	}
 
+	// Their files get finished while there's still a context to read back with.
+	videoCapture.stop();
+	readback.finish();
 	glfwTerminate();
 	return 0;
 }
\ No newline at end of file